@@ -0,0 +1,93 @@
+#!/usr/bin/ruby
+
+#
+# Benchmarks for the MusicBrainz::Client hot path.
+#
+# Responses are loaded from bench/fixtures with Client#rdf=, so no
+# server is needed and the numbers only reflect the native paths (RDF
+# parsing, context selection, and result extraction):
+#
+#   artist.rdf      ~1kB   GetArtistById, depth 1
+#   album.rdf       ~8kB   GetAlbumById, 11 tracks
+#   findalbum.rdf   ~230kB FindAlbumByName, 25 albums with track lists
+#
+# See bench/helper.rb for the command-line options.
+#
+
+require File.expand_path('helper', File.dirname(__FILE__))
+
+Q = MusicBrainz::Query
+
+FIXTURES = %w{artist album findalbum}.map { |name|
+  [name, Bench.fixture(name + '.rdf')]
+}
+
+mb = MusicBrainz::Client.new
+
+# query: parse responses of increasing size
+FIXTURES.each do |name, rdf|
+  Bench.measure("rdf=/#{name}") { |n| n.times { mb.rdf = rdf } }
+end
+
+# everything below runs against the album search results
+mb.rdf = FIXTURES.assoc('findalbum')[1]
+num_albums = mb.result_int(Q::GetNumAlbums)
+abort "findalbum.rdf: no albums (is the extension linked against libmusicbrainz?)" unless num_albums > 0
+
+Bench.measure('select') { |n|
+  n.times { |i|
+    mb.select Q::Rewind
+    mb.select Q::SelectAlbum, i % num_albums + 1
+  }
+}
+
+mb.select Q::Rewind
+mb.select Q::SelectAlbum, 1
+url = mb.result(Q::AlbumGetAlbumId)
+list = mb.result(Q::AlbumGetTrackList)
+num_tracks = mb.result_int(Q::AlbumGetNumTracks)
+last_track = mb.result(Q::AlbumGetTrackId, num_tracks)
+
+Bench.measure('result') { |n| n.times { mb.result Q::AlbumGetAlbumName } }
+Bench.measure('result/ordinal_arg') { |n|
+  n.times { |i| mb.result Q::AlbumGetTrackName, i % num_tracks + 1 }
+}
+Bench.measure('result_int') { |n| n.times { mb.result_int Q::AlbumGetNumTracks } }
+Bench.measure('exists?/hit') { |n| n.times { mb.exists? Q::AlbumGetAlbumName } }
+Bench.measure('exists?/miss') { |n| n.times { mb.exists? Q::TrackGetTrackDuration } }
+Bench.measure('id_from_url') { |n| n.times { mb.id_from_url url } }
+Bench.measure('id_from_url/mbid') { |n| n.times { mb.id_from_url url, true } }
+Bench.measure('ordinal') { |n| n.times { mb.ordinal list, last_track } }
+
+# macro: load the search results and walk them the way findalbum.rb does
+rdf = FIXTURES.assoc('findalbum')[1]
+Bench.measure('macro/findalbum') { |n|
+  n.times {
+    mb.rdf = rdf
+    mb.result_int(Q::GetNumAlbums).times { |i|
+      mb.select Q::Rewind
+      mb.select Q::SelectAlbum, i + 1
+      mb.result Q::AlbumGetAlbumName
+      mb.id_from_url mb.result(Q::AlbumGetAlbumId)
+      mb.id_from_url mb.result(Q::AlbumGetAlbumArtistId)
+    }
+  }
+}
+
+# macro: load an album and walk its track list the way getalbum.rb does
+rdf = FIXTURES.assoc('album')[1]
+Bench.measure('macro/getalbum') { |n|
+  n.times {
+    mb.rdf = rdf
+    mb.select Q::SelectAlbum, 1
+    list = mb.result(Q::AlbumGetTrackList)
+    1.upto(mb.result_int(Q::AlbumGetNumTracks)) { |i|
+      mb.result Q::AlbumGetTrackName, i
+      id = mb.result(Q::AlbumGetTrackId, i)
+      mb.ordinal list, id
+      mb.id_from_url id
+    }
+  }
+}
+
+Bench.report
@@ -0,0 +1,247 @@
+#
+# Shared benchmark harness for the scripts in bench/.
+#
+# Each benchmark is run for a fixed amount of wall-clock (or CPU) time
+# after a short warmup, and reports operations per second, allocated
+# Ruby objects per operation, and the resident set size of the process
+# afterwards.  Results can be printed as text, TSV, or JSON, saved as a
+# baseline, and compared against a saved baseline (exiting non-zero on
+# regressions, so the benchmarks can gate a release).  Stored baselines
+# live in bench/baselines/<script>.tsv.
+#
+# Command-line options (shared by every bench/*.rb script):
+#
+#   -t, --time SECS        seconds to run each benchmark (default 1.0)
+#   -f, --format FMT       output format: text, tsv, or json
+#   -o, --only REGEX       only run benchmarks whose name matches REGEX
+#   -s, --save FILE        save results as a baseline (TSV)
+#   -c, --compare FILE     compare results against a saved baseline
+#   -b, --baseline         compare against the stored baseline
+#   -u, --update-baseline  save results as the stored baseline
+#   -T, --tolerance PCT    allowed slowdown against the baseline (default 20)
+#
+
+# load the extension from the source tree if it has been built there
+$LOAD_PATH.unshift(File.expand_path('..', File.dirname(__FILE__)))
+
+require 'optparse'
+require 'musicbrainz'
+
+module Bench
+  Result = Struct.new(:name, :ops, :secs, :rate, :allocs, :rss, :unit, :cpu)
+
+  FIXTURE_DIR = File.join(File.dirname(__FILE__), 'fixtures')
+  BASELINE_DIR = File.join(File.dirname(__FILE__), 'baselines')
+
+  #
+  # Parse the shared command-line options.
+  #
+  def self.options
+    @options ||= begin
+      opts = {
+        :time       => (ENV['BENCH_TIME'] || 1.0).to_f,
+        :format     => 'text',
+        :only       => nil,
+        :save       => nil,
+        :compare    => nil,
+        :tolerance  => 20.0,
+      }
+
+      OptionParser.new do |o|
+        o.banner = "Usage: #$0 [options]"
+        o.on('-t', '--time SECS', Float, 'seconds per benchmark') { |v| opts[:time] = v }
+        o.on('-f', '--format FMT', %w{text tsv json}, 'text, tsv, or json') { |v| opts[:format] = v }
+        o.on('-o', '--only REGEX', 'only run matching benchmarks') { |v| opts[:only] = Regexp.new(v) }
+        o.on('-s', '--save FILE', 'save results as a baseline') { |v| opts[:save] = v }
+        o.on('-c', '--compare FILE', 'compare against a baseline') { |v| opts[:compare] = v }
+        o.on('-b', '--baseline', 'compare against the stored baseline') { opts[:compare] = baseline }
+        o.on('-u', '--update-baseline', 'save as the stored baseline') { opts[:save] = baseline }
+        o.on('-T', '--tolerance PCT', Float, 'allowed slowdown in percent') { |v| opts[:tolerance] = v }
+      end.parse!(ARGV)
+
+      opts
+    end
+  end
+
+  #
+  # Path of the stored baseline for the running script.
+  #
+  def self.baseline
+    File.join(BASELINE_DIR, File.basename($0, '.rb') + '.tsv')
+  end
+
+  #
+  # Read a fixture from bench/fixtures.
+  #
+  def self.fixture(name)
+    File.open(File.join(FIXTURE_DIR, name), 'rb') { |fh| fh.read }
+  end
+
+  #
+  # Total objects allocated by this process so far, or nil if the
+  # interpreter can't tell us.
+  #
+  def self.allocated
+    if GC.respond_to?(:stat) && (stat = GC.stat).key?(:total_allocated_objects)
+      stat[:total_allocated_objects]
+    end
+  end
+
+  #
+  # Resident set size of this process, in kilobytes.
+  #
+  def self.rss
+    if File.readable?('/proc/self/status')
+      File.read('/proc/self/status')[/^VmRSS:\s+(\d+)/, 1].to_i
+    else
+      `ps -o rss= -p #$$`.to_i
+    end
+  end
+
+  #
+  # Current time in seconds, either wall-clock or (if cpu is true) CPU
+  # time used by this process.
+  #
+  def self.now(cpu = false)
+    if cpu
+      if defined?(Process::CLOCK_PROCESS_CPUTIME_ID)
+        Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+      else
+        t = Process.times
+        t.utime + t.stime
+      end
+    elsif defined?(Process::CLOCK_MONOTONIC)
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    else
+      Time.now.to_f
+    end
+  end
+
+  #
+  # Was the named benchmark selected with --only?
+  #
+  def self.selected?(name)
+    !options[:only] || name =~ options[:only]
+  end
+
+  #
+  # Time a block.  The block is called with an iteration count and
+  # should perform that many operations; batching keeps the harness
+  # overhead out of the numbers for sub-microsecond operations.
+  #
+  # Options:
+  #   :unit    name of the thing counted by the rate (default 'ops')
+  #   :scale   amount of :unit per operation (default 1)
+  #   :cpu     rate is per CPU-second instead of per wall-clock second
+  #
+  def self.measure(name, opts = {}, &block)
+    return nil unless selected?(name)
+    cpu = opts[:cpu]
+
+    # warm up and size the batches to roughly 1/20th of the run time
+    n = 1
+    loop do
+      t = now(cpu)
+      block.call(n)
+      break if now(cpu) - t > options[:time] / 20 || n >= (1 << 30)
+      n *= 2
+    end
+
+    GC.start
+    ops, a0, t0 = 0, allocated, now(cpu)
+    begin
+      block.call(n)
+      ops += n
+    end while now(cpu) - t0 < options[:time]
+    secs, a1 = now(cpu) - t0, allocated
+
+    results << Result.new(name, ops, secs,
+      ops * (opts[:scale] || 1) / secs,
+      a0 && a1 ? (a1 - a0).to_f / ops : nil,
+      rss, opts[:unit] || 'ops', cpu ? true : false)
+    results.last
+  end
+
+  def self.results
+    @results ||= []
+  end
+
+  #
+  # Print results in the selected format, then save and/or compare
+  # against a baseline.  Exits with status 1 if any result regressed.
+  #
+  def self.report(io = $stdout)
+    case options[:format]
+    when 'text'
+      io.puts '%-40s %14s %-14s %10s %10s' % %w{name rate unit allocs/op rss(kB)}
+      results.each do |r|
+        io.puts '%-40s %14.1f %-14s %10s %10d' % [
+          r.name, r.rate, r.unit + (r.cpu ? '/cpu-s' : '/s'),
+          r.allocs ? '%.1f' % r.allocs : '-', r.rss
+        ]
+      end
+    when 'tsv'
+      io.puts tsv
+    when 'json'
+      io.puts '[' << results.map { |r| json(r) }.join(",\n ") << ']'
+    end
+
+    if options[:save]
+      dir = File.dirname(options[:save])
+      Dir.mkdir(dir) unless File.directory?(dir)
+      File.open(options[:save], 'w') { |fh| fh.puts tsv }
+    end
+
+    exit 1 if options[:compare] && !compare(options[:compare])
+  end
+
+  def self.tsv
+    results.map { |r|
+      [r.name, '%.3f' % r.rate, r.unit, r.allocs ? '%.2f' % r.allocs : '-', r.rss].join("\t")
+    }.join("\n")
+  end
+
+  #
+  # Minimal JSON encoder, so the harness has no dependencies.
+  #
+  def self.json(r)
+    '{' << [
+      ['name', r.name.inspect],
+      ['ops', r.ops],
+      ['secs', '%.6f' % r.secs],
+      ['rate', '%.3f' % r.rate],
+      ['unit', r.unit.inspect],
+      ['clock', r.cpu ? '"cpu"' : '"wall"'],
+      ['allocs_per_op', r.allocs ? '%.2f' % r.allocs : 'null'],
+      ['rss_kb', r.rss],
+    ].map { |k, v| "\"#{k}\": #{v}" }.join(', ') << '}'
+  end
+
+  #
+  # Compare results against a baseline saved with --save.  A result
+  # regresses if its rate drops by more than the tolerance, or if it
+  # allocates more objects per operation than the baseline did.
+  #
+  def self.compare(path)
+    abort "#{path}: no baseline (run with --update-baseline first)" unless File.exist?(path)
+
+    base = {}
+    File.readlines(path).each do |line|
+      name, rate, unit, allocs = line.chomp.split("\t")
+      base[name] = [rate.to_f, allocs == '-' ? nil : allocs.to_f] if name
+    end
+
+    ok = true
+    results.each do |r|
+      next unless b = base[r.name]
+      delta = (r.rate - b[0]) * 100 / b[0]
+      msgs = []
+      msgs << 'slower' if delta < -options[:tolerance]
+      msgs << 'more allocations' if b[1] && r.allocs && r.allocs > b[1] + 0.5
+      ok = false unless msgs.empty?
+      $stderr.puts '%-40s %+7.1f%% %s' % [r.name, delta, msgs.empty? ? 'ok' : 'REGRESSED: ' + msgs.join(', ')]
+    end
+
+    ok
+  end
+end
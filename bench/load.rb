@@ -0,0 +1,167 @@
+#!/usr/bin/ruby
+
+#
+# Load generator: drives a number of MusicBrainz::Client objects
+# against a server and reports throughput and latency percentiles.
+#
+# Unless --server is given, a stand-in server (bench/server.rb) is
+# started on a free local port for the duration of the run, and the
+# latency, jitter, error, and drop options are passed through to it.
+#
+# Each client runs in its own process: the default (network) transport
+# holds the interpreter lock while it waits for the server, so threads
+# wouldn't run concurrently.
+#
+# Options:
+#
+#   -c, --clients N        number of concurrent clients (default 4)
+#   -t, --time SECS        length of the run (default 10)
+#   -n, --requests N       stop after N requests per client instead
+#   -s, --server HOST:PORT use an existing server
+#   -q, --query NAME       query to send; may be repeated (default
+#                          GetArtistById, GetAlbumById, FindAlbumByName)
+#   -f, --format FMT       output format: text (default) or json
+#   -l, --latency MS       \
+#   -j, --jitter MS         | passed to bench/server.rb
+#   -e, --errors RATE       |
+#   -D, --drops RATE       /
+#
+
+require File.expand_path('helper', File.dirname(__FILE__))
+require 'rbconfig'
+
+QUERIES = {
+  'GetArtistById'   => ['d7bb728b-6e04-44cb-902c-fda6cd7affe7'],
+  'GetAlbumById'    => ['7f72293a-8438-470a-9d4c-3a273beb322d'],
+  'GetTrackById'    => ['21fe2cd7-1648-444e-a373-0b4a35b7381d'],
+  'FindArtistByName'=> ['Portishead'],
+  'FindAlbumByName' => ['Electric Garden'],
+  'FindTrackByName' => ['Sour Times'],
+}
+
+opts = {
+  :clients  => 4,
+  :time     => 10.0,
+  :requests => nil,
+  :server   => nil,
+  :queries  => [],
+  :format   => 'text',
+  :args     => [],
+}
+
+OptionParser.new do |o|
+  o.banner = "Usage: #$0 [options]"
+  o.on('-c', '--clients N', Integer, 'concurrent clients') { |v| opts[:clients] = v }
+  o.on('-t', '--time SECS', Float, 'length of the run') { |v| opts[:time] = v }
+  o.on('-n', '--requests N', Integer, 'requests per client') { |v| opts[:requests] = v }
+  o.on('-s', '--server HOST:PORT', 'use an existing server') { |v| opts[:server] = v }
+  o.on('-q', '--query NAME', QUERIES.keys, 'query to send') { |v| opts[:queries] << v }
+  o.on('-f', '--format FMT', %w{text json}, 'text or json') { |v| opts[:format] = v }
+  %w{latency jitter errors drops}.each do |name|
+    o.on("-#{name == 'drops' ? 'D' : name[0, 1]}", "--#{name} VAL", Float, 'see bench/server.rb') { |v|
+      opts[:args] << "--#{name}" << v.to_s
+    }
+  end
+end.parse!(ARGV)
+
+opts[:queries] = %w{GetArtistById GetAlbumById FindAlbumByName} if opts[:queries].empty?
+
+#
+# Start the stand-in server, and return its pid and address.
+#
+def start_server(args)
+  rd, wr = IO.pipe
+  pid = fork do
+    rd.close
+    $stdout.reopen(wr)
+    exec(RbConfig.ruby, File.join(File.dirname(__FILE__), 'server.rb'), '-p', '0', *args)
+  end
+
+  wr.close
+  addr = rd.gets or abort 'server failed to start'
+  rd.close
+  [pid, addr.chomp]
+end
+
+#
+# Run one client until the deadline (or request limit).  Returns the
+# number of failed queries and a list of latencies, in seconds.
+#
+def run_client(server, queries, deadline, limit)
+  mb = MusicBrainz::Client.new
+  mb.server = server
+
+  lat, errors = [], 0
+  while Bench.now < deadline && (!limit || lat.size < limit)
+    name = queries[lat.size % queries.size]
+    t = Bench.now
+    ok = mb.query(MusicBrainz::Query.const_get(name), *QUERIES[name])
+    lat << Bench.now - t
+    errors += 1 unless ok
+  end
+
+  [errors, lat]
+end
+
+def percentile(sorted, pct)
+  return 0.0 if sorted.empty?
+  sorted[[(sorted.size * pct / 100.0).ceil - 1, 0].max]
+end
+
+pid, server = opts[:server] ? [nil, opts[:server]] : start_server(opts[:args])
+
+begin
+  start = Bench.now
+  deadline = start + (opts[:requests] ? 1e9 : opts[:time])
+
+  pids, pipes = [], []
+  opts[:clients].times do
+    rd, wr = IO.pipe
+    pids << fork do
+      rd.close
+      wr.write Marshal.dump(run_client(server, opts[:queries], deadline, opts[:requests]))
+      wr.close
+      exit! 0
+    end
+    wr.close
+    pipes << rd
+  end
+
+  # clients only write their results once they're done
+  lat, errors = [], 0
+  pipes.each do |rd|
+    n, l = Marshal.load(rd.read)
+    errors += n
+    lat.concat(l)
+    rd.close
+  end
+  pids.each { |p| Process.wait(p) }
+  elapsed = Bench.now - start
+ensure
+  if pid
+    Process.kill('TERM', pid)
+    Process.wait(pid)
+  end
+end
+
+lat.sort!
+res = [
+  ['server', server],
+  ['clients', opts[:clients]],
+  ['requests', lat.size],
+  ['errors', errors],
+  ['secs', elapsed],
+  ['throughput', lat.size / elapsed],
+  ['p50_ms', percentile(lat, 50) * 1000],
+  ['p99_ms', percentile(lat, 99) * 1000],
+  ['p999_ms', percentile(lat, 99.9) * 1000],
+  ['max_ms', (lat.last || 0.0) * 1000],
+]
+
+if opts[:format] == 'json'
+  puts '{' << res.map { |k, v|
+    "\"#{k}\": " << (v.is_a?(String) ? v.inspect : v.is_a?(Float) ? '%.3f' % v : v.to_s)
+  }.join(', ') << '}'
+else
+  res.each { |k, v| puts '%-12s %s' % [k, v.is_a?(Float) ? '%.3f' % v : v] }
+end
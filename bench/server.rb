@@ -0,0 +1,268 @@
+#!/usr/bin/ruby
+
+#
+# Stand-in MusicBrainz server for end-to-end benchmarks.
+#
+# Answers the two kinds of requests libmusicbrainz makes from a
+# directory of recorded RDF responses (bench/fixtures by default):
+#
+#   GET /mm-2.1/<type>/<id>[/<depth>]
+#     (GetArtistById, GetAlbumById, GetTrackById, GetTrackByTRMId)
+#     serves <dir>/<type>/<id>.rdf, or <dir>/<type>.rdf
+#
+#   POST /cgi-bin/mq_2_1.pl
+#     (FindArtist, FindAlbum, GetCDInfo, TrackInfoFromTRMId, ...)
+#     serves <dir>/<query>.rdf, where <query> is the downcased name of
+#     the query element (eg "findalbum"), or <dir>/<type>.rdf with the
+#     "find"/"get" prefix removed (eg "album")
+#
+# Anything else gets a 404.  Point a client at the server with
+# mb.server = 'localhost:<port>'.  Responses carry an ETag, and
+# requests with a matching If-None-Match get a 304.
+#
+# Options:
+#
+#   -p, --port PORT        port to listen on (default 8080, 0 picks one)
+#   -b, --bind ADDR        address to listen on (default 127.0.0.1)
+#   -d, --dir DIR          directory of RDF responses
+#   -l, --latency MS       delay before each response
+#   -j, --jitter MS        extra random delay, 0 to MS
+#   -e, --errors RATE      fraction of requests answered with a 500
+#   -D, --drops RATE       fraction of connections closed without a response
+#   -z, --gzip             compress responses for clients that accept gzip
+#                          or deflate
+#   -B, --bandwidth KBPS   limit each response to KBPS kilobytes/second
+#   -v, --verbose          log each request to standard error
+#
+# The listening address is printed on standard output once the server
+# is ready.  The server exits on SIGINT or SIGTERM, printing a count of
+# requests by status to standard error.
+#
+
+require 'optparse'
+require 'socket'
+require 'stringio'
+require 'zlib'
+
+module Bench
+  class Server
+    DEFAULTS = {
+      :port     => 8080,
+      :bind     => '127.0.0.1',
+      :dir      => File.join(File.dirname(__FILE__), 'fixtures'),
+      :latency  => 0.0,
+      :jitter   => 0.0,
+      :errors   => 0.0,
+      :drops    => 0.0,
+      :gzip     => false,
+      :bandwidth => 0.0,
+      :verbose  => false,
+    }
+
+    STATUS = {
+      200 => 'OK',
+      304 => 'Not Modified',
+      400 => 'Bad Request',
+      404 => 'Not Found',
+      500 => 'Internal Server Error',
+    }
+
+    attr_reader :counts
+
+    def initialize(opts = {})
+      @opts = DEFAULTS.merge(opts)
+      @cache = {}
+      @counts = Hash.new(0)
+      @lock = Mutex.new
+      @server = TCPServer.new(@opts[:bind], @opts[:port])
+    end
+
+    def port
+      @server.addr[1]
+    end
+
+    def address
+      "#{@opts[:bind]}:#{port}"
+    end
+
+    #
+    # Accept connections until the server socket is closed.  Each
+    # connection gets its own thread, so injected latency doesn't
+    # serialize requests.
+    #
+    def run
+      loop do
+        begin
+          sock = @server.accept
+        rescue IOError, Errno::EBADF
+          break
+        end
+
+        Thread.new(sock) do |s|
+          begin
+            handle(s)
+          rescue StandardError => e
+            $stderr.puts "#{e.class}: #{e.message}" if @opts[:verbose]
+          ensure
+            s.close unless s.closed?
+          end
+        end
+      end
+    end
+
+    def stop
+      @server.close unless @server.closed?
+    end
+
+    private
+
+    def count(key)
+      @lock.synchronize { @counts[key] += 1 }
+    end
+
+    def handle(sock)
+      return unless line = sock.gets
+      meth, path = line.split(' ')
+
+      # read headers, then the body (if any)
+      len, accept, match = 0, '', nil
+      while (hdr = sock.gets) && hdr !~ /\A\r?\n\z/
+        len = $1.to_i if hdr =~ /\Acontent-length:\s*(\d+)/i
+        accept = $1 if hdr =~ /\Aaccept-encoding:(.*)/i
+        match = $1 if hdr =~ /\Aif-none-match:\s*(.*?)\s*\z/i
+      end
+      body = (len > 0) ? sock.read(len) : ''
+
+      delay = @opts[:latency] + rand * @opts[:jitter]
+      sleep(delay / 1000.0) if delay > 0
+
+      if rand < @opts[:drops]
+        count('drop')
+        log(meth, path, 'drop')
+        return
+      end
+
+      status, rdf = (rand < @opts[:errors]) ? [500, ''] : lookup(meth, path, body)
+      etag = (status == 200) ? etag(rdf) : nil
+      status, rdf = 304, '' if etag && etag == match
+      count(status)
+      log(meth, path, status)
+
+      enc = @opts[:gzip] && status == 200 && %w{gzip deflate}.find { |e| accept =~ /\b#{e}\b/i }
+      rdf = encode(rdf, enc) if enc
+
+      write(sock, "HTTP/1.0 #{status} #{STATUS[status]}\r\n" <<
+                  "Content-Type: text/plain\r\n" <<
+                  (etag ? "ETag: #{etag}\r\n" : '') <<
+                  (enc ? "Content-Encoding: #{enc}\r\n" : '') <<
+                  "Content-Length: #{rdf.size}\r\n" <<
+                  "Connection: close\r\n\r\n" << rdf)
+    end
+
+    #
+    # Write a response, at no more than the --bandwidth limit.
+    #
+    def write(sock, data)
+      return sock.write(data) unless @opts[:bandwidth] > 0
+
+      # send a twentieth of a second's worth at a time
+      size = [(@opts[:bandwidth] * 1024 / 20).to_i, 1].max
+      (0...data.size).step(size) do |ofs|
+        sock.write data[ofs, size]
+        sleep 0.05
+      end
+    end
+
+    #
+    # Entity tag for a response body.
+    #
+    def etag(rdf)
+      '"%08x"' % Zlib.crc32(rdf)
+    end
+
+    #
+    # Compress (and cache) a response body.
+    #
+    def encode(rdf, enc)
+      @lock.synchronize do
+        @encoded ||= {}
+        @encoded[[rdf.object_id, enc]] ||= if enc == 'gzip'
+          io = StringIO.new
+          gz = Zlib::GzipWriter.new(io)
+          gz.write rdf
+          gz.close
+          io.string
+        else
+          Zlib::Deflate.deflate(rdf)
+        end
+      end
+    end
+
+    def log(meth, path, status)
+      $stderr.puts "#{meth} #{path} #{status}" if @opts[:verbose]
+    end
+
+    #
+    # Map a request to a response file.  Returns [status, body].
+    #
+    def lookup(meth, path, body)
+      names = case "#{meth} #{path}"
+      when %r{\AGET /mm-2\.1/(\w+)/([\w-]+)}
+        ["#$1/#$2", $1]
+      when %r{\APOST /cgi-bin/mq_2_1\.pl}
+        return [400, ''] unless body =~ /<mq:(\w+)>/
+        query = $1.downcase
+        [query, query.sub(/\A(find|get)/, '')]
+      else
+        return [404, '']
+      end
+
+      names.each do |name|
+        rdf = read(name)
+        return [200, rdf] if rdf
+      end
+
+      [404, '']
+    end
+
+    #
+    # Read (and cache) a response file, or return nil if it doesn't
+    # exist.
+    #
+    def read(name)
+      @lock.synchronize do
+        return @cache[name] if @cache.key?(name)
+      end
+
+      path = File.join(@opts[:dir], name + '.rdf')
+      rdf = File.exist?(path) ? File.open(path, 'rb') { |fh| fh.read } : nil
+      @lock.synchronize { @cache[name] = rdf }
+    end
+  end
+end
+
+if __FILE__ == $0
+  opts = {}
+  OptionParser.new do |o|
+    o.banner = "Usage: #$0 [options]"
+    o.on('-p', '--port PORT', Integer, 'port to listen on') { |v| opts[:port] = v }
+    o.on('-b', '--bind ADDR', 'address to listen on') { |v| opts[:bind] = v }
+    o.on('-d', '--dir DIR', 'directory of RDF responses') { |v| opts[:dir] = v }
+    o.on('-l', '--latency MS', Float, 'delay before each response') { |v| opts[:latency] = v }
+    o.on('-j', '--jitter MS', Float, 'extra random delay') { |v| opts[:jitter] = v }
+    o.on('-e', '--errors RATE', Float, 'fraction of 500 responses') { |v| opts[:errors] = v }
+    o.on('-D', '--drops RATE', Float, 'fraction of dropped connections') { |v| opts[:drops] = v }
+    o.on('-z', '--gzip', 'compress responses') { opts[:gzip] = true }
+    o.on('-B', '--bandwidth KBPS', Float, 'limit response bandwidth') { |v| opts[:bandwidth] = v }
+    o.on('-v', '--verbose', 'log requests') { opts[:verbose] = true }
+  end.parse!(ARGV)
+
+  server = Bench::Server.new(opts)
+  %w{INT TERM}.each { |sig| trap(sig) { server.stop } }
+
+  $stdout.puts server.address
+  $stdout.flush
+
+  server.run
+  $stderr.puts server.counts.map { |k, v| "#{k}: #{v}" }.sort.join(', ') unless server.counts.empty?
+end
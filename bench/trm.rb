@@ -0,0 +1,127 @@
+#!/usr/bin/ruby
+
+#
+# Throughput benchmarks for MusicBrainz::TRM.
+#
+# Generates synthetic PCM audio (a few tones plus noise) in each
+# combination of channels (mono/stereo), sample size (8/16-bit) and
+# sample rate (11025/22050/44100 Hz), then times complete signatures:
+# a fresh generator, pcm_data, and generate_signature on chunks of the
+# audio until the generator has enough.  Rates are in seconds of audio
+# signatured per CPU-second, so they can be used to size a
+# fingerprinting host.
+#
+# finalize_signature sends the signature to the TRM server, so it is
+# only benchmarked when BENCH_FINALIZE is set.
+#
+# See bench/helper.rb for the command-line options; use --baseline to
+# check the results against bench/baselines/trm.tsv.
+#
+
+require File.expand_path('helper', File.dirname(__FILE__))
+
+RATES     = [11025, 22050, 44100]
+CHANNELS  = [1, 2]
+BITS      = [8, 16]
+CHUNKS    = [1024, 4096, 16384, 65536, 262144]
+
+# default chunk size, same as MusicBrainz::TRM#feed
+CHUNK     = 65536
+
+# seconds of audio to generate; the generator needs at most 30
+SECONDS   = 35
+
+#
+# Generate one second of synthetic audio and repeat it.
+#
+def pcm(rate, channels, bits)
+  seed = 1
+  frames = (0...rate).map do |i|
+    t = i.to_f / rate
+    (0...channels).map do |c|
+      seed = (seed * 1103515245 + 12345) & 0x7fffffff
+      v = 0.4 * Math.sin(2 * Math::PI * 220 * t + c) +
+          0.3 * Math.sin(2 * Math::PI * 554.37 * t) +
+          0.2 * Math.sin(2 * Math::PI * 1318.5 * t * (1 + c * 0.01)) +
+          0.1 * (seed.to_f / 0x3fffffff - 1)
+      (bits == 8) ? (128 + v * 127).round : (v * 32767).round & 0xffff
+    end
+  end
+
+  frames.flatten.pack((bits == 8) ? 'C*' : 'v*') * SECONDS
+end
+
+#
+# Split a string into chunks of the given size.
+#
+def chunks(data, size)
+  (0...data.size).step(size).map { |ofs| data[ofs, size] }
+end
+
+#
+# Generate a complete signature from a list of chunks.  Returns the
+# number of bytes the generator needed, or nil if it ran out of data.
+#
+def signature(bufs, rate, channels, bits)
+  trm = MusicBrainz::TRM.new
+  trm.pcm_data rate, channels, bits
+
+  bytes = 0
+  bufs.each do |buf|
+    bytes += buf.size
+    return bytes if trm.generate_signature(buf)
+  end
+
+  nil
+end
+
+#
+# Benchmark signatures of one format at one chunk size.
+#
+def bench_signature(name, data, rate, channels, bits, size)
+  return unless Bench.selected?(name)
+
+  bufs = chunks(data, size)
+  bytes = signature(bufs, rate, channels, bits)
+  abort "#{name}: no signature after #{SECONDS} seconds of audio" unless bytes
+
+  Bench.measure(name, :unit => 'audio-s', :cpu => true,
+                :scale => bytes.to_f / (rate * channels * bits / 8)) { |n|
+    n.times { signature(bufs, rate, channels, bits) }
+  }
+end
+
+RATES.each do |rate|
+  CHANNELS.each do |channels|
+    BITS.each do |bits|
+      fmt = "#{rate}/#{channels == 1 ? 'mono' : 'stereo'}/#{bits}"
+      names = ["signature/#{fmt}"]
+      names += CHUNKS.map { |size| "signature/#{fmt}/chunk=#{size}" } if rate == 44100 && channels == 2 && bits == 16
+      next unless names.any? { |name| Bench.selected?(name) }
+
+      data = pcm(rate, channels, bits)
+      bench_signature(names.shift, data, rate, channels, bits, CHUNK)
+      names.zip(CHUNKS) do |name, size|
+        bench_signature(name, data, rate, channels, bits, size)
+      end
+    end
+  end
+end
+
+trm = MusicBrainz::TRM.new
+sig = (0...16).map { |i| (i * 37 + 11) & 0xff }.pack('C*')
+Bench.measure('convert_sig') { |n| n.times { trm.convert_sig sig } }
+
+if ENV['BENCH_FINALIZE']
+  data = chunks(pcm(44100, 2, 16), CHUNK)
+  Bench.measure('signature+finalize/44100/stereo/16') { |n|
+    n.times {
+      trm = MusicBrainz::TRM.new
+      trm.pcm_data 44100, 2, 16
+      data.each { |buf| break if trm.generate_signature(buf) }
+      trm.finalize_signature
+    }
+  }
+end
+
+Bench.report
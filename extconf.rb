@@ -2,6 +2,25 @@ require 'mkmf'
 
 $LD_FLAGS = "-lstdc++ -lm"
 
+# optional: release the interpreter lock during file scans
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h') or
+have_func('rb_thread_blocking_region')
+
+# optional: native threads for batch methods
+have_header('pthread.h') and have_library('pthread', 'pthread_create')
+
+# optional: io_uring for bulk file reads (linux only)
+have_header('linux/io_uring.h')
+# optional: x86-64 SHA extensions for file hashes
+have_header('cpuid.h') and have_header('immintrin.h')
+
+# optional: USDT probes for bpftrace/perf/systemtap
+have_header('sys/sdt.h')
+
+# optional: compressed responses for the http transport
+have_header('zlib.h') and have_library('z', 'inflate')
+
 have_func('pow', 'math.h') and
 # note, this causes problems in cygwin.  any suggestions?
 have_library('stdc++', '__cxa_rethrow') and
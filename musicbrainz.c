@@ -25,6 +25,45 @@
 /************************************************************************/
 
 #include <ruby.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif /* HAVE_RUBY_THREAD_H */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__GNUC__)
+#define MB_HAVE_IO_URING 1
+#endif
+#endif /* HAVE_LINUX_IO_URING_H */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif /* HAVE_SYS_SDT_H */
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif /* HAVE_ZLIB_H */
 #include <musicbrainz/mb_c.h>
 #include <musicbrainz/queries.h>
 #include <musicbrainz/browser.h>
@@ -32,6 +71,50 @@
 #define MB_VERSION "0.3.0"
 #define UNUSED(a) ((void) (a))
 
+/*
+ * Static tracepoints (USDT probes in the "musicbrainz" provider, for
+ * bpftrace, perf, SystemTap, etc).  Disabled probes are a single nop,
+ * and without sys/sdt.h they compile to nothing.  String arguments are
+ * pointers to NUL-terminated strings.
+ *
+ *   query__start(query, argc, arg1)  Client#query entry
+ *   query__done(query, ok, rdf_len, local)
+ *   server__start(query, argc)       request (connect, send, receive,
+ *   server__done(query, ok, rdf_len)   and parse) by libmusicbrainz
+ *   rdf__parse__start(len)           result loaded (mb_SetResultRDF)
+ *   rdf__parse__done(len, ok)
+ *   index__lookup(query, arg1, found)
+ *   trm__chunk__start(len, fed)      one trm_GenerateSignature() call
+ *   trm__chunk__done(len, done)
+ *
+ * Example:
+ *   bpftrace -e 'usdt:./musicbrainz.so:musicbrainz:query__start
+ *                { @start[tid] = nsecs }
+ *                usdt:./musicbrainz.so:musicbrainz:query__done
+ *                /@start[tid]/
+ *                { @us = hist((nsecs - @start[tid]) / 1000);
+ *                  delete(@start[tid]) }'
+ */
+#ifdef HAVE_SYS_SDT_H
+#define MB_PROBE1(name, a)              DTRACE_PROBE1(musicbrainz, name, a)
+#define MB_PROBE2(name, a, b)           DTRACE_PROBE2(musicbrainz, name, a, b)
+#define MB_PROBE3(name, a, b, c)        DTRACE_PROBE3(musicbrainz, name, a, b, c)
+#define MB_PROBE4(name, a, b, c, d)     DTRACE_PROBE4(musicbrainz, name, a, b, c, d)
+#else /* !HAVE_SYS_SDT_H */
+#define MB_PROBE1(name, a)              do { } while (0)
+#define MB_PROBE2(name, a, b)           do { } while (0)
+#define MB_PROBE3(name, a, b, c)        do { } while (0)
+#define MB_PROBE4(name, a, b, c, d)     do { } while (0)
+#endif /* HAVE_SYS_SDT_H */
+
+/* ruby 1.8.5 and earlier don't have these */
+#ifndef RSTRING_PTR
+#define RSTRING_PTR(s) (RSTRING(s)->ptr)
+#endif /* !RSTRING_PTR */
+#ifndef RSTRING_LEN
+#define RSTRING_LEN(s) (RSTRING(s)->len)
+#endif /* !RSTRING_LEN */
+
 /**********************************************************************/
 /* Buffer Type                                                        */
 /*                                                                    */
@@ -58,19 +141,52 @@
 #define MB_VERSION_BUFSIZ   32
 #define MB_ID_BUFSIZ        128
 #define MB_FRAG_BUFSIZ      256
+#define MB_TRM_BUFSIZ       65536
+#define MB_MP3_BUFSIZ       16384
+
+/**********************************************************************/
+/* Amount of audio (in seconds) the TRM generator consumes before     */
+/* trm_GenerateSignature() reports that it has enough data.  Used to  */
+/* tell callers how much PCM data they actually need to read.         */
+/**********************************************************************/
+#define MB_TRM_SECONDS      30
+
+/**********************************************************************/
+/* Default number of worker threads for batch methods (eg             */
+/* MusicBrainz.mp3_info_batch).  Ignored if pthreads aren't           */
+/* available.                                                         */
+/**********************************************************************/
+#define MB_BATCH_THREADS    4
+
+/**********************************************************************/
+/* Number of reads kept in flight by bulk file readers (eg            */
+/* MusicBrainz.mp3_info_batch and MusicBrainz.scan_files), and the    */
+/* size of each read.                                                 */
+/**********************************************************************/
+#define MB_BULK_DEPTH       32
+#define MB_BULK_BUFSIZ      65536
 
 #define MB_QUERY(a,b,c)                  \
   do {                                   \
     VALUE v = rb_str_new2(c);            \
     rb_define_const(mQuery, (b), v);     \
     rb_define_const(mQuery, a "_" b, v); \
+    stats_query_type(a, b, c);           \
   } while (0)
 
-static VALUE mMB,     /* MusicBrainz          */
-             eErr,    /* MusicBrainz::Error   */
-             cClient, /* MusicBrainz::Client  */
-             cTRM,    /* MusicBrainz::TRM     */
-             mQuery;  /* MusicBrainz::Query   */
+static VALUE mMB,       /* MusicBrainz          */
+             eErr,      /* MusicBrainz::Error   */
+             eTimeout,  /* MusicBrainz::TimeoutError */
+             cClient,   /* MusicBrainz::Client  */
+             cTRM,      /* MusicBrainz::TRM     */
+             cMP3Info,  /* MusicBrainz::MP3Info */
+             cMBID,     /* MusicBrainz::MBID    */
+             cDiscID,   /* MusicBrainz::DiscID  */
+             cIDSet,    /* MusicBrainz::IDSet   */
+             cIDMap,    /* MusicBrainz::IDMap   */
+             cIndex,    /* MusicBrainz::Index   */
+             cEvent,    /* MusicBrainz::Event   */
+             mQuery;    /* MusicBrainz::Query   */
 
 /* 
  * Document-module: MusicBrainz
@@ -78,1124 +194,11914 @@ static VALUE mMB,     /* MusicBrainz          */
  * See MusicBrainz::Client and MusicBrainz::TRM for API documentation.
  */
 
-/* 
- * parse host specification and (optionally) extract the port name.
+/*
+ * Run func(data) without holding the global interpreter lock, so other
+ * Ruby threads can run during long file scans.  ubf is called (from
+ * another thread) to interrupt func; if it's NULL, the blocking system
+ * call func is sitting in is interrupted instead.  On rubies without
+ * native threads, this just calls func(data).
  */
-static void parse_hostspec(const int argc, 
-                           const VALUE *argv, 
-                           char *ret_host, 
-                           size_t ret_host_len, 
-                           int *ret_port) {
-  VALUE host, port;
-  char *ptr;
-
-  /* grab host and port from argument list */
-  host = port = Qnil;
-  rb_scan_args(argc, argv, "11", &host, &port);
+typedef void *(*mb_blocking_func_t)(void *);
+typedef void (*mb_unblock_func_t)(void *);
+
+#if !defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) && defined(HAVE_RB_THREAD_BLOCKING_REGION)
+typedef struct {
+  mb_blocking_func_t func;
+  void *data, *ret;
+} mb_blocking_call_t;
+
+static VALUE mb_blocking_call(void *ptr) {
+  mb_blocking_call_t *call = ptr;
+  call->ret = call->func(call->data);
+  return Qnil;
+}
+#endif
+
+static void *mb_without_gvl(mb_blocking_func_t func, void *data, 
+                            mb_unblock_func_t ubf, void *ubf_data) {
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+  return rb_thread_call_without_gvl(func, data, ubf ? ubf : RUBY_UBF_IO, ubf_data);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+  mb_blocking_call_t call;
+
+  call.func = func;
+  call.data = data;
+  call.ret = NULL;
+  rb_thread_blocking_region(mb_blocking_call, &call, ubf ? ubf : RUBY_UBF_IO, ubf_data);
+
+  return call.ret;
+#else
+  UNUSED(ubf);
+  UNUSED(ubf_data);
+  return func(data);
+#endif
+}
 
-  /* clear buffer, copy hostspec, and make sure buffer is null-terminated */
-  memset(ret_host, 0, ret_host_len);
-  strncpy(ret_host, StringValueCStr(host), ret_host_len);
-  ret_host[ret_host_len - 1] = '\0';
+/*
+ * Handle the interrupt that woke a blocking call: raise its exception
+ * (Thread#raise, Thread#kill, Timeout), or run signal handlers and
+ * return.  On rubies without native threads, this does nothing.
+ */
+static void mb_check_ints(void) {
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) || defined(HAVE_RB_THREAD_BLOCKING_REGION)
+  rb_thread_check_ints();
+#endif
+}
 
-  /* if we only got one argument, then scan it for a port suffix */
-  if (argc == 1) {
-    if ((ptr = strchr(ret_host, ':')) != NULL) {
-      *ptr = '\0';
-      *ret_port = atoi(ptr + 1);
-    }
-  } else {
-    *ret_port = NUM2INT(port);
+/*
+ * Batch job: calls func(batch, i) for each i in [0, num), spread
+ * across several native threads, without the global interpreter lock.
+ * func must not touch any Ruby objects.
+ */
+typedef struct mb_batch_t {
+  long num, next;
+  int threads;
+  volatile int cancel;
+  void (*func)(struct mb_batch_t *, long);
+  void *data;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+#endif /* HAVE_PTHREAD_H */
+} mb_batch_t;
+
+static void *batch_worker(void *ptr) {
+  mb_batch_t *b = ptr;
+  long i;
+
+  for (;;) {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&(b->lock));
+#endif /* HAVE_PTHREAD_H */
+    i = b->cancel ? b->num : b->next++;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&(b->lock));
+#endif /* HAVE_PTHREAD_H */
+
+    if (i >= b->num)
+      break;
+    b->func(b, i);
   }
 
-  /* make sure specified port is in range */
-  if (*ret_port < 0 || *ret_port > 0xffff)
-    rb_raise(eErr, "invalid port: %d", *ret_port);
+  return NULL;
 }
 
+static void *batch_run_blocking(void *ptr) {
+#ifdef HAVE_PTHREAD_H
+  mb_batch_t *b = ptr;
+  pthread_t *tids;
+  int i, num_tids = 0;
+
+  /* the calling thread is one of the workers */
+  if (b->threads > 1 && (tids = malloc(sizeof(pthread_t) * (b->threads - 1))) != NULL) {
+    for (i = 0; i < b->threads - 1; i++)
+      if (!pthread_create(tids + num_tids, NULL, batch_worker, b))
+        num_tids++;
+
+    batch_worker(b);
+
+    for (i = 0; i < num_tids; i++)
+      pthread_join(tids[i], NULL);
+    free(tids);
+
+    return NULL;
+  }
+#endif /* HAVE_PTHREAD_H */
+
+  return batch_worker(ptr);
+}
 
 /*
- * Document-class: MusicBrainz::Client
- *
- * Client query interface to the MusicBrainz music library.  The
- * easiest way to explain the code is probably with a simple example.
- *
- *   # load the musicbrainz library
- *   require 'musicbrainz'
- *
- *   # create a musicbrainz client handle
- *   mb = MusicBrainz::Client.new
- *
- *   # create a musicbrainz client handle
- *   mb = MusicBrainz::Client.new
- *
- *   # search for albums named "mirror conspiracy"
- *   album_name = 'Mirror Conspiracy'
- *   query_ok = mb.query(MusicBrainz::Query::FindAlbumByName, album_name)
- *
- *   # if there weren't any errors, then print the number of matching albums
- *   if query_ok
- *     num_albums = mb.result(MusicBrainz::Query::GetNumAlbums).to_i
- *     puts "Number of Results: #{num_albums}"
- *   end
- *
+ * Run a batch job in the current thread (which must not be holding the
+ * global interpreter lock).
  */
+static void *batch_run_nogvl(void *ptr) {
+  mb_batch_t *b = ptr;
 
-/*******************************/
-/* MusicBrainz::Client methods */
-/*******************************/
-static void client_free(void *mb) {
-  mb_Delete(* (musicbrainz_t*) mb);
-  free(mb);
-}
+  if (b->threads > b->num)
+    b->threads = (int) b->num;
 
-static VALUE mb_client_alloc(VALUE klass) {
-  musicbrainz_t *mb;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&(b->lock), NULL);
+#endif /* HAVE_PTHREAD_H */
 
-  if ((mb = malloc(sizeof(musicbrainz_t))) == NULL)
-    rb_raise(eErr, "couldn't allocate memory for Client structure");
+  batch_run_blocking(b);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_destroy(&(b->lock));
+#endif /* HAVE_PTHREAD_H */
 
-  return Data_Wrap_Struct(klass, 0, client_free, mb);
+  return NULL;
+}
+
+static void batch_cancel(void *ptr) {
+  ((mb_batch_t*) ptr)->cancel = 1;
 }
 
-#ifndef HAVE_RB_DEFINE_ALLOC_FUNC
 /*
- * Allocate and initialize a new MusicBrainz::Client object.
- *
- * Example:
- *   mb = MusicBrainz::Client.new
+ * Run a batch job without the global interpreter lock.  An interrupt
+ * stops it once the items in progress are done; if handling the
+ * interrupt doesn't raise (a trapped signal, say), the items that
+ * weren't started yet are run.
  */
-VALUE mb_client_new(VALUE klass) {
-  VALUE self;
-  musicbrainz_t *mb;
+static void batch_run(mb_batch_t *b) {
+  b->next = 0;
+  while (b->next < b->num) {
+    b->cancel = 0;
+    mb_without_gvl(batch_run_nogvl, b, batch_cancel, b);
+    if (!b->cancel)
+      break;
+    mb_check_ints();
+  }
+}
 
-  self = mb_client_alloc(klass);
-  rb_obj_call_init(self, 0, NULL);
+/*
+ * Get a boolean option from an option hash.
+ */
+static int scan_opt(VALUE opts, const char *key, int def) {
+  VALUE val;
 
-  return self;
+  if (NIL_P(opts))
+    return def;
+
+  val = rb_hash_aref(opts, ID2SYM(rb_intern(key)));
+  return NIL_P(val) ? def : RTEST(val);
 }
-#endif /* HAVE_RB_DEFINE_ALLOC_FUNC */
 
 /*
- * :nodoc:
- *
- * Constructor for MusicBrainz::Client object.
+ * Get the number of worker threads from the threads: entry of an
+ * option hash.
  */
-static VALUE mb_client_init(VALUE self) {
-  musicbrainz_t *mb;
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  *mb = mb_New();
-  return self;
+static int batch_threads(VALUE opts) {
+  VALUE val;
+  int ret;
+
+  val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("threads")));
+  ret = NIL_P(val) ? MB_BATCH_THREADS : NUM2INT(val);
+  if (ret < 1)
+    rb_raise(eErr, "invalid thread count: %d", ret);
+
+  return ret;
 }
 
 /*
- * Get the version of a MusicBrainz::Client object.
- *
- * Note: this actually returns the version of the MusicBrainz library.
- *
- * Example:
- *   puts 'MusicBrainz version: ' << mb.version
- *   
+ * Copy an array of paths to a C string array, so it can be used
+ * without the global interpreter lock.  Free the result with
+ * batch_free_paths().
  */
-static VALUE mb_client_version(VALUE self) {
-  musicbrainz_t *mb;
-  MB_BUFFER buf[MB_VERSION_BUFSIZ];
-  int ver[3];
+static char **batch_paths(VALUE ary, long *num) {
+  VALUE strs;
+  char **ret;
+  long i;
+
+  Check_Type(ary, T_ARRAY);
+
+  /* convert every path first, since that can raise */
+  strs = rb_ary_new2(RARRAY_LEN(ary));
+  for (i = 0; i < RARRAY_LEN(ary); i++) {
+    VALUE path = rb_ary_entry(ary, i);
+    StringValueCStr(path);
+    rb_ary_push(strs, path);
+  }
+  *num = RARRAY_LEN(strs);
+
+  if ((ret = malloc(sizeof(char*) * (*num + 1))) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for path list");
+  memset(ret, 0, sizeof(char*) * (*num + 1));
+
+  for (i = 0; i < *num; i++) {
+    if ((ret[i] = strdup(RSTRING_PTR(rb_ary_entry(strs, i)))) == NULL) {
+      while (i-- > 0)
+        free(ret[i]);
+      free(ret);
+      rb_raise(eErr, "couldn't allocate memory for path list");
+    }
+  }
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
+  return ret;
+}
 
-  mb_GetVersion(*mb, &(ver[0]), &(ver[1]), &(ver[2]));
-  snprintf(buf, sizeof(buf), "%d.%d.%d", ver[0], ver[1], ver[2]);
+static void batch_free_paths(char **paths, long num) {
+  long i;
 
-  return rb_str_new2(buf);
+  for (i = 0; i < num; i++)
+    free(paths[i]);
+  free(paths);
 }
 
 /*
- * Set the server name and port for the MusicBrainz::Client object.
- *
- * Returns false if MusicBrainz could not connect to the server. If this
- * method is not called, the default server is 'www.musicbrainz.org',
- * port 80.
- *
- * Aliases:
- *   MusicBrainz::Client#set_server
- *
- * Examples:
- *   # connect to www.musicbrainz.org, port 80
- *   mb.server = 'www.musicbrainz.org'
- *
- *   # connect to www.example.com, port 31337
- *   mb.server = 'www.example.com:31337'
- *
- *   # connect to www.musicbrainz.org, port 80
- *   mb.set_server 'www.musicbrainz.org'
- *
- *   # connect to www.example.com, port 31337
- *   mb.set_server 'www.example.com', 31337
- *
+ * Bulk file reader.  Reads many files at once, keeping up to depth
+ * reads in flight, which matters a lot on high-latency (eg network)
+ * storage.  On Linux this uses an io_uring submission queue (opens
+ * and reads are both asynchronous); elsewhere, or if io_uring isn't
+ * available (old kernel, blocked by a sandbox, etc), it falls back to
+ * a pool of depth threads doing blocking open() and pread() calls.
+ *
+ * Reads for each file are issued one at a time, at offsets chosen by
+ * the consumer:
+ *
+ * - start(b, i, fd) is called after path i is opened, and returns the
+ *   offset of the first read, or -1 to skip the file.
+ * - consume(b, i, buf, len) is called with the result of each read
+ *   (len <= 0 at end of file or on error), and returns the offset of
+ *   the next read, or -1 once it's done with the file.
+ *
+ * Callbacks for different files may run in parallel, and must not
+ * touch any Ruby objects.  Files that can't be opened are silently
+ * skipped.
  */
-static VALUE mb_client_set_server(int argc, VALUE *argv, VALUE self) {
-  musicbrainz_t *mb;
-  MB_BUFFER host[MB_HOST_BUFSIZ];
-  int port;
+typedef struct mb_bulk_t {
+  char **paths;
+  long num;
+  int depth;
+  volatile int cancel;
+  long long (*start)(struct mb_bulk_t *, long, int);
+  long long (*consume)(struct mb_bulk_t *, long, const unsigned char *, long);
+  void *data;
+
+  /* files are started in order: started is the next one, and base the
+   * first one given to the thread pool fallback */
+  long started, base;
+  mb_batch_t pool;
+} mb_bulk_t;
 
-  /* grab mb handle */
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  
-  /* clear host buffer and set default port */
-  memset(host, 0, sizeof(host));
-  port = 80;
+/*
+ * Finish reading a file with blocking calls, from offset ofs.
+ */
+static void bulk_finish_file(mb_bulk_t *b, long i, int fd, long long ofs) {
+  unsigned char buf[MB_BULK_BUFSIZ];
+  ssize_t len;
+
+  for (; ofs >= 0; ofs = b->consume(b, i, buf, len)) {
+    do {
+      len = pread(fd, buf, sizeof(buf), ofs);
+    } while (len < 0 && errno == EINTR);
+  }
+}
 
-  parse_hostspec(argc, argv, host, sizeof(host), &port);
-  
-  return mb_SetServer(*mb, host, port) ? Qtrue : Qfalse;
+/*
+ * Read a file with blocking calls, from the start.
+ */
+static void bulk_read_file(mb_bulk_t *b, long i) {
+  int fd;
+
+  if ((fd = open(b->paths[i], O_RDONLY)) < 0)
+    return;
+
+  bulk_finish_file(b, i, fd, b->start(b, i, fd));
+  close(fd);
 }
 
+#ifdef MB_HAVE_IO_URING
 /*
- * Enable debugging output for this MusicBrainz::Client object.
- * 
- * Note: Debugging output is sent to standard output, not standard
- * error.
- * 
- * Example:
- *   mb.debug = true
- *
+ * Minimal io_uring wrapper (raw system calls, so there's no dependency
+ * on liburing).
  */
-static VALUE mb_client_set_debug(VALUE self, VALUE debug) {
-  musicbrainz_t *mb;
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  mb_SetDebug(*mb, (debug == Qtrue));
-  return debug;
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_pending;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+} mb_uring_t;
+
+static void uring_free(mb_uring_t *r) {
+  if (r->sqes)
+    munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+    munmap(r->cq_ptr, r->cq_len);
+  if (r->sq_ptr)
+    munmap(r->sq_ptr, r->sq_len);
+  close(r->fd);
+}
+
+static int uring_init(mb_uring_t *r, unsigned entries) {
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(r, 0, sizeof(mb_uring_t));
+  memset(&p, 0, sizeof(p));
+
+  if ((r->fd = (int) syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return -1;
+
+  /* need single mmap and fast poll (5.7+), which also means openat
+   * and read ops are supported */
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_FAST_POLL)) {
+    close(r->fd);
+    return -1;
+  }
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (r->cq_len > r->sq_len)
+    r->sq_len = r->cq_len;
+  r->cq_len = r->sq_len;
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                   r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    r->sq_ptr = NULL;
+    uring_free(r);
+    return -1;
+  }
+  r->cq_ptr = r->sq_ptr;
+
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    uring_free(r);
+    return -1;
+  }
+
+  sq = r->sq_ptr;
+  r->sq_head = (unsigned*) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned*) (sq + p.sq_off.array);
+
+  cq = r->cq_ptr;
+  r->cq_head = (unsigned*) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+  return 0;
 }
 
 /*
- * Set the proxy name and port for the MusicBrainz::Client object.
- *
- * Returns false if MusicBrainz could not connect to the proxy.
- *
- * Aliases:
- *   MusicBrainz::Client#set_proxy
- *
- * Examples:
- *   # connect to 'proxy.localdomain', port 8080
- *   mb.proxy = 'proxy.localdomain'
- *
- *   # connect to proxy.example.com, port 31337
- *   mb.proxy = 'proxy.example.com:31337'
- *
- *   # connect to www.musicbrainz.org, port 8080
- *   mb.set_proxy 'www.musicbrainz.org'
- *
- *   # connect to proxy.example.com, port 31337
- *   mb.set_proxy 'proxy.example.com', 31337
- *
+ * Get the next free submission queue entry.  The caller must make
+ * sure there's room (we never have more than depth entries queued).
  */
-static VALUE mb_client_set_proxy(int argc, VALUE *argv, VALUE self) {
-  musicbrainz_t *mb;
-  MB_BUFFER host[MB_HOST_BUFSIZ];
-  int port;
+static struct io_uring_sqe *uring_sqe(mb_uring_t *r) {
+  unsigned tail = *(r->sq_tail) + r->sq_pending, idx = tail & *(r->sq_mask);
+  struct io_uring_sqe *sqe = r->sqes + idx;
 
-  /* get musicbrainz handle */
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  
-  /* clear host buffer and set default port */
-  memset(host, 0, sizeof(host));
-  port = 8080;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  r->sq_array[idx] = idx;
+  r->sq_pending++;
 
-  parse_hostspec(argc, argv, host, sizeof(host), &port);
-  
-  return mb_SetProxy(*mb, host, port) ? Qtrue : Qfalse;
+  return sqe;
 }
 
 /*
- * Set user authentication for a MusicBrainz::Client object.
- *
- * This method is optional.  It only needs to be called if you want to
- * submit data to the server and give the user credit for the
- * submission.  If you want to submit data anonymously, don't call this
- * method.  Returns true if the authentication was successful.
- *
- * Aliases:
- *   MusicBrainz::Client#authenticate
- *
- * Examples:
- *   # connect as user "MrMusic", password "s3kr3tp455w0rd"
- *   mb.auth 'MrMusic', 's3kr3tp455w0rd'
- *
- *   # connect as user "MBrox", password "hithere!"
- *   mb.authenticate 'MBrox', 'hithere!'
- *
+ * Submit pending entries and wait for at least one completion.
  */
-static VALUE mb_client_auth(VALUE self, VALUE user, VALUE pass) {
-  musicbrainz_t *mb;
-  char *u, *p;
+static int uring_submit_and_wait(mb_uring_t *r) {
+  unsigned n = r->sq_pending;
+  int ret;
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  u = StringValueCStr(user); 
-  p = StringValueCStr(pass);
+  __atomic_store_n(r->sq_tail, *(r->sq_tail) + n, __ATOMIC_RELEASE);
+  r->sq_pending = 0;
+
+  do {
+    ret = (int) syscall(__NR_io_uring_enter, r->fd, n, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
 
-  return mb_Authenticate(*mb, u, p) ? Qtrue : Qfalse;
+  return ret;
 }
 
 /*
- * Set CD-ROM device for a MusicBrainz::Client object.
- *
- * On Unix systems, this is a path (eg "/dev/scd0") and defaults to
- * "/dev/cdrom". On Win32 systems, it's a drive letter (eg "E:").  This
- * method always returns true.
+ * Wait for at least one completion, without submitting anything.
+ */
+static int uring_wait(mb_uring_t *r) {
+  int ret;
+
+  do {
+    ret = (int) syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+/*
+ * A file being read through the ring: its open (ofs < 0) or its read
+ * at ofs is in the kernel's hands while pending is set.  If the ring
+ * fails, reaped is set for operations that finished anyway, with their
+ * result in res.
+ */
+typedef struct {
+  long file;
+  int fd, pending, reaped, res;
+  long long ofs;
+  unsigned char *buf;
+} bulk_slot_t;
+
+static void bulk_uring_open(mb_uring_t *r, mb_bulk_t *b, bulk_slot_t *s) {
+  struct io_uring_sqe *sqe = uring_sqe(r);
+
+  s->fd = -1;
+  s->ofs = -1;
+  s->pending = 1;
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (unsigned long) b->paths[s->file];
+  sqe->open_flags = O_RDONLY;
+  sqe->user_data = (unsigned long) s;
+}
+
+static void bulk_uring_read(mb_uring_t *r, bulk_slot_t *s, long long ofs) {
+  struct io_uring_sqe *sqe = uring_sqe(r);
+
+  s->ofs = ofs;
+  s->pending = 1;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = s->fd;
+  sqe->addr = (unsigned long) s->buf;
+  sqe->len = MB_BULK_BUFSIZ;
+  sqe->off = ofs;
+  sqe->user_data = (unsigned long) s;
+}
+
+/*
+ * The ring failed: get the kernel to let go of every slot, then finish
+ * the slots' files with blocking calls.  Entries it never took from
+ * the submission queue are redone here, and ones it did are waited
+ * for, so files it opened get closed and nothing writes to the buffers
+ * once they're freed.  Returns 0 if the ring can't even be waited on,
+ * in which case the buffers have to be leaked.
+ */
+static int bulk_uring_abort(mb_uring_t *r, mb_bulk_t *b, bulk_slot_t *slots) {
+  struct io_uring_cqe *cqe;
+  bulk_slot_t *s;
+  unsigned head, tail;
+  int i, pending, quiet = 1;
+  long long ofs;
+
+  /* entries the kernel hasn't taken never will be, since nothing is
+   * submitted from here on */
+  tail = *(r->sq_tail);
+  for (head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE); head != tail; head++)
+    ((bulk_slot_t*) (unsigned long) r->sqes[r->sq_array[head & *(r->sq_mask)]].user_data)->pending = 0;
+
+  for (;;) {
+    head = *(r->cq_head);
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = r->cqes + (head & *(r->cq_mask));
+      s = (bulk_slot_t*) (unsigned long) cqe->user_data;
+      s->pending = 0;
+      s->reaped = 1;
+      s->res = cqe->res;
+      head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    for (i = 0, pending = 0; i < b->depth; i++)
+      pending += (slots[i].file >= 0 && slots[i].pending);
+    if (!pending)
+      break;
+    if (uring_wait(r) < 0) {
+      quiet = 0;
+      break;
+    }
+  }
+
+  for (i = 0; i < b->depth; i++) {
+    s = slots + i;
+    if (s->file < 0)
+      continue;
+
+    if (s->ofs < 0) {
+      /* opening: redo it unless the kernel finished it (if it's lost,
+       * so is the descriptor) */
+      if (!s->reaped) {
+        bulk_read_file(b, s->file);
+        continue;
+      } else if (s->res < 0) {
+        continue;
+      }
+      s->fd = s->res;
+      ofs = b->start(b, s->file, s->fd);
+    } else {
+      ofs = s->reaped ? b->consume(b, s->file, s->buf, s->res) : s->ofs;
+    }
+
+    bulk_finish_file(b, s->file, s->fd, ofs);
+    close(s->fd);
+  }
+
+  return quiet;
+}
+
+/*
+ * Run a bulk read with io_uring, from file b->started on.  Returns 0
+ * if io_uring isn't available, or if the ring fails part of the way
+ * through; in that case, the files that were being read have been
+ * finished with blocking reads, and the rest are left for the thread
+ * pool.
+ */
+static int bulk_run_uring(mb_bulk_t *b) {
+  bulk_slot_t *slots, *s;
+  struct io_uring_cqe *cqe;
+  unsigned char *bufs;
+  unsigned head;
+  long long ofs;
+  int i, busy = 0;
+  mb_uring_t r;
+
+  if (uring_init(&r, b->depth))
+    return 0;
+
+  slots = calloc(b->depth, sizeof(bulk_slot_t));
+  bufs = malloc((size_t) MB_BULK_BUFSIZ * b->depth);
+  if (!slots || !bufs) {
+    free(slots);
+    free(bufs);
+    uring_free(&r);
+    return 0;
+  }
+
+  /* start opening the first depth files */
+  for (i = 0; i < b->depth; i++) {
+    slots[i].file = -1;
+    slots[i].buf = bufs + (size_t) MB_BULK_BUFSIZ * i;
+    if (b->started < b->num && !b->cancel) {
+      slots[i].file = b->started++;
+      bulk_uring_open(&r, b, slots + i);
+      busy++;
+    }
+  }
+
+  while (busy > 0) {
+    if (uring_submit_and_wait(&r) < 0) {
+      if (!bulk_uring_abort(&r, b, slots))
+        bufs = NULL;
+      break;
+    }
+
+    head = *(r.cq_head);
+    while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = r.cqes + (head & *(r.cq_mask));
+      s = (bulk_slot_t*) (unsigned long) cqe->user_data;
+      s->pending = 0;
+      head++;
+
+      if (s->fd < 0) {
+        /* open finished */
+        if (cqe->res >= 0) {
+          s->fd = cqe->res;
+          ofs = b->start(b, s->file, s->fd);
+        } else {
+          ofs = -1;
+        }
+      } else {
+        /* read finished */
+        ofs = b->consume(b, s->file, s->buf, cqe->res);
+      }
+
+      if (ofs >= 0) {
+        bulk_uring_read(&r, s, ofs);
+        continue;
+      }
+
+      /* done with this file, move on to the next one */
+      if (s->fd >= 0)
+        close(s->fd);
+      s->fd = -1;
+      if (b->started < b->num && !b->cancel) {
+        s->file = b->started++;
+        bulk_uring_open(&r, b, s);
+      } else {
+        s->file = -1;
+        busy--;
+      }
+    }
+    __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  free(bufs);
+  free(slots);
+  uring_free(&r);
+
+  return busy == 0;
+}
+#endif /* MB_HAVE_IO_URING */
+
+/*
+ * Thread pool fallback: read file base + i with blocking calls.
+ */
+static void bulk_pool_file(mb_batch_t *pool, long i) {
+  mb_bulk_t *b = pool->data;
+  bulk_read_file(b, b->base + i);
+}
+
+static void *bulk_run_blocking(void *ptr) {
+  mb_bulk_t *b = ptr;
+
+#ifdef MB_HAVE_IO_URING
+  if (bulk_run_uring(b))
+    return NULL;
+#endif /* MB_HAVE_IO_URING */
+
+  /* no io_uring (or it failed); one blocking reader thread per read
+   * in flight */
+  b->base = b->started;
+  b->pool.num = b->num - b->base;
+  b->pool.next = 0;
+  b->pool.threads = (b->depth < b->pool.num) ? b->depth : (int) b->pool.num;
+  b->pool.func = bulk_pool_file;
+  b->pool.data = b;
+  if (b->pool.num > 0 && !b->cancel)
+    batch_run_nogvl(&(b->pool));
+
+  /* the pool hands files out in order, and finishes the ones it has */
+  b->started = b->base + ((b->pool.next < b->pool.num) ? b->pool.next : b->pool.num);
+
+  return NULL;
+}
+
+static void bulk_cancel(void *ptr) {
+  mb_bulk_t *b = ptr;
+  b->cancel = 1;
+  b->pool.cancel = 1;
+}
+
+/*
+ * Run a bulk read without the global interpreter lock.  An interrupt
+ * stops it once the files being read are done; if handling the
+ * interrupt doesn't raise (a trapped signal, say), the rest are read.
+ */
+static void bulk_run(mb_bulk_t *b) {
+  b->started = 0;
+  while (b->started < b->num) {
+    b->cancel = b->pool.cancel = 0;
+    mb_without_gvl(bulk_run_blocking, b, bulk_cancel, b);
+    if (!b->cancel)
+      break;
+    mb_check_ints();
+  }
+}
+
+/* 
+ * parse host specification and (optionally) extract the port name.
+ */
+static void parse_hostspec(const int argc, 
+                           const VALUE *argv, 
+                           char *ret_host, 
+                           size_t ret_host_len, 
+                           int *ret_port) {
+  VALUE host, port;
+  char *ptr;
+
+  /* grab host and port from argument list */
+  host = port = Qnil;
+  rb_scan_args(argc, argv, "11", &host, &port);
+
+  /* clear buffer, copy hostspec, and make sure buffer is null-terminated */
+  memset(ret_host, 0, ret_host_len);
+  strncpy(ret_host, StringValueCStr(host), ret_host_len);
+  ret_host[ret_host_len - 1] = '\0';
+
+  /* if we only got one argument, then scan it for a port suffix */
+  if (argc == 1) {
+    if ((ptr = strchr(ret_host, ':')) != NULL) {
+      *ptr = '\0';
+      *ret_port = atoi(ptr + 1);
+    }
+  } else {
+    *ret_port = NUM2INT(port);
+  }
+
+  /* make sure specified port is in range */
+  if (*ret_port < 0 || *ret_port > 0xffff)
+    rb_raise(eErr, "invalid port: %d", *ret_port);
+}
+
+
+/*******************/
+/* Message digests */
+/*******************/
+
+/*
+ * Incremental SHA-1 and SHA-256 contexts (FIPS 180-2).  These are used
+ * instead of mb_CalculateSha1() so files can be hashed in the same pass
+ * as other scans, and without the global interpreter lock.  Both
+ * hashes share the same Merkle-Damgard framing; only the compression
+ * function (blocks) and the size of the state differ.
+ */
+typedef void (*mb_blocks_func_t)(uint32_t *, const unsigned char *, size_t);
+
+typedef struct {
+  uint32_t h[8];
+  uint64_t len;
+  unsigned char buf[64];
+  int buf_len, words;
+  mb_blocks_func_t blocks;
+} mb_hash_t;
+
+#define MB_HASH_SHA1    0
+#define MB_HASH_SHA256  1
+
+#define MB_SHA1_LEN     20
+#define MB_SHA256_LEN   32
+#define MB_HASH_MAXLEN  MB_SHA256_LEN
+
+#define MB_ROL32(v, n)  (((v) << (n)) | ((v) >> (32 - (n))))
+#define MB_ROR32(v, n)  (((v) >> (n)) | ((v) << (32 - (n))))
+
+/*
+ * SHA-NI (x86-64 SHA extensions) versions of the compression
+ * functions.  These are compiled with a target attribute, so the rest
+ * of the file doesn't need -msha, and are only used if cpuid says the
+ * processor supports them (see hash_init_cpu()).
+ */
+#if defined(__x86_64__) && defined(HAVE_CPUID_H) && defined(HAVE_IMMINTRIN_H) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define MB_HAVE_SHA_NI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/*
+ * Run the SHA-1 compression function over num 64-byte blocks.
+ */
+static void sha1_blocks_c(uint32_t *h, const unsigned char *p, size_t num) {
+  uint32_t w[80], a, b, c, d, e, t;
+  int i;
+
+  for (; num > 0; num--, p += 64) {
+    for (i = 0; i < 16; i++)
+      w[i] = ((uint32_t) p[4 * i] << 24) | ((uint32_t) p[4 * i + 1] << 16) |
+             ((uint32_t) p[4 * i + 2] << 8) | p[4 * i + 3];
+    for (i = 16; i < 80; i++)
+      w[i] = MB_ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+    for (i = 0; i < 80; i++) {
+      if (i < 20)
+        t = ((b & c) | (~b & d)) + 0x5a827999;
+      else if (i < 40)
+        t = (b ^ c ^ d) + 0x6ed9eba1;
+      else if (i < 60)
+        t = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+      else
+        t = (b ^ c ^ d) + 0xca62c1d6;
+
+      t += MB_ROL32(a, 5) + e + w[i];
+      e = d; d = c; c = MB_ROL32(b, 30); b = a; a = t;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+  }
+}
+
+/*
+ * Run the SHA-256 compression function over num 64-byte blocks.
+ */
+static void sha256_blocks_c(uint32_t *h, const unsigned char *p, size_t num) {
+  uint32_t w[64], s[8], t1, t2;
+  int i;
+
+  for (; num > 0; num--, p += 64) {
+    for (i = 0; i < 16; i++)
+      w[i] = ((uint32_t) p[4 * i] << 24) | ((uint32_t) p[4 * i + 1] << 16) |
+             ((uint32_t) p[4 * i + 2] << 8) | p[4 * i + 3];
+    for (i = 16; i < 64; i++)
+      w[i] = w[i - 16] + w[i - 7] +
+             (MB_ROR32(w[i - 15], 7) ^ MB_ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+             (MB_ROR32(w[i - 2], 17) ^ MB_ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    memcpy(s, h, sizeof(s));
+
+    for (i = 0; i < 64; i++) {
+      t1 = s[7] + (MB_ROR32(s[4], 6) ^ MB_ROR32(s[4], 11) ^ MB_ROR32(s[4], 25)) +
+           ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+      t2 = (MB_ROR32(s[0], 2) ^ MB_ROR32(s[0], 13) ^ MB_ROR32(s[0], 22)) +
+           ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+      memmove(s + 1, s, sizeof(uint32_t) * 7);
+      s[4] += t1;
+      s[0] = t1 + t2;
+    }
+
+    for (i = 0; i < 8; i++)
+      h[i] += s[i];
+  }
+}
+
+#ifdef MB_HAVE_SHA_NI
+#define MB_SHA_NI __attribute__((target("sha,sse4.1,ssse3")))
+
+/*
+ * SHA-1 using the SHA extensions.  Each pass of the inner loop does
+ * four rounds; w[] is a ring of the last four message schedule
+ * vectors.
+ */
+static MB_SHA_NI void sha1_blocks_ni(uint32_t *h, const unsigned char *p, size_t num) {
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e, e_save, prev, w[4];
+  int i;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) h), 0x1b);
+  e = _mm_set_epi32((int) h[4], 0, 0, 0);
+
+  for (; num > 0; num--, p += 64) {
+    abcd_save = abcd;
+    e_save = e;
+
+    for (i = 0; i < 4; i++)
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 16 * i)), mask);
+
+    /* rounds 0-3 */
+    e = _mm_add_epi32(e, w[0]);
+    prev = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+
+    /* rounds 4-79 */
+    for (i = 1; i < 20; i++) {
+      if (i >= 4)
+        w[i & 3] = _mm_sha1msg2_epu32(_mm_xor_si128(
+          _mm_sha1msg1_epu32(w[i & 3], w[(i + 1) & 3]), w[(i + 2) & 3]
+        ), w[(i + 3) & 3]);
+
+      e = _mm_sha1nexte_epu32(prev, w[i & 3]);
+      prev = abcd;
+
+      switch (i / 5) {
+      case 0:  abcd = _mm_sha1rnds4_epu32(abcd, e, 0); break;
+      case 1:  abcd = _mm_sha1rnds4_epu32(abcd, e, 1); break;
+      case 2:  abcd = _mm_sha1rnds4_epu32(abcd, e, 2); break;
+      default: abcd = _mm_sha1rnds4_epu32(abcd, e, 3); break;
+      }
+    }
+
+    e = _mm_sha1nexte_epu32(prev, e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i*) h, _mm_shuffle_epi32(abcd, 0x1b));
+  h[4] = (uint32_t) _mm_extract_epi32(e, 3);
+}
+
+/*
+ * SHA-256 using the SHA extensions.  The state is kept as ABEF/CDGH
+ * pairs, which is what sha256rnds2 wants.
+ */
+static MB_SHA_NI void sha256_blocks_ni(uint32_t *h, const unsigned char *p, size_t num) {
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i s0, s1, s0_save, s1_save, tmp, msg, w[4];
+  int i;
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) h), 0xb1);
+  s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) (h + 4)), 0x1b);
+  s0 = _mm_alignr_epi8(tmp, s1, 8);
+  s1 = _mm_blend_epi16(s1, tmp, 0xf0);
+
+  for (; num > 0; num--, p += 64) {
+    s0_save = s0;
+    s1_save = s1;
+
+    for (i = 0; i < 16; i++) {
+      if (i < 4)
+        w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 16 * i)), mask);
+      else
+        w[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(
+          _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+          _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4)
+        ), w[(i + 3) & 3]);
+
+      msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i*) (sha256_k + 4 * i)));
+      s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+      s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+    }
+
+    s0 = _mm_add_epi32(s0, s0_save);
+    s1 = _mm_add_epi32(s1, s1_save);
+  }
+
+  tmp = _mm_shuffle_epi32(s0, 0x1b);
+  s1 = _mm_shuffle_epi32(s1, 0xb1);
+  _mm_storeu_si128((__m128i*) h, _mm_blend_epi16(tmp, s1, 0xf0));
+  _mm_storeu_si128((__m128i*) (h + 4), _mm_alignr_epi8(s1, tmp, 8));
+}
+#endif /* MB_HAVE_SHA_NI */
+
+static mb_blocks_func_t sha1_blocks = sha1_blocks_c,
+                        sha256_blocks = sha256_blocks_c;
+
+/*
+ * Pick the fastest compression functions this processor supports.
+ * Called once, from Init_musicbrainz().
+ */
+static void hash_init_cpu(void) {
+#ifdef MB_HAVE_SHA_NI
+  unsigned int a, b, c, d;
+
+  if (__get_cpuid_max(0, NULL) < 7)
+    return;
+  __cpuid(1, a, b, c, d);
+  if (!(c & bit_SSSE3) || !(c & bit_SSE4_1))
+    return;
+  __cpuid_count(7, 0, a, b, c, d);
+  if (!(b & (1 << 29)))
+    return;
+
+  sha1_blocks = sha1_blocks_ni;
+  sha256_blocks = sha256_blocks_ni;
+#endif /* MB_HAVE_SHA_NI */
+}
+
+static void hash_init(mb_hash_t *c, int algo) {
+  static const uint32_t sha1_h[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+  };
+  static const uint32_t sha256_h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  if (algo == MB_HASH_SHA256) {
+    memcpy(c->h, sha256_h, sizeof(sha256_h));
+    c->words = 8;
+    c->blocks = sha256_blocks;
+  } else {
+    memcpy(c->h, sha1_h, sizeof(sha1_h));
+    c->words = 5;
+    c->blocks = sha1_blocks;
+  }
+
+  c->len = 0;
+  c->buf_len = 0;
+}
+
+static void hash_update(mb_hash_t *c, const unsigned char *p, size_t len) {
+  size_t n;
+
+  c->len += len;
+
+  /* top off partial block */
+  if (c->buf_len > 0) {
+    n = 64 - c->buf_len;
+    if (n > len)
+      n = len;
+    memcpy(c->buf + c->buf_len, p, n);
+    c->buf_len += n;
+    p += n;
+    len -= n;
+
+    if (c->buf_len < 64)
+      return;
+    c->blocks(c->h, c->buf, 1);
+    c->buf_len = 0;
+  }
+
+  /* hash full blocks directly from the input */
+  if (len >= 64) {
+    c->blocks(c->h, p, len / 64);
+    p += len & ~((size_t) 63);
+    len &= 63;
+  }
+
+  /* save remainder */
+  if (len > 0) {
+    memcpy(c->buf, p, len);
+    c->buf_len = len;
+  }
+}
+
+/*
+ * Finish a hash.  Writes 4 * c->words (20 or 32) bytes to out.
+ */
+static void hash_final(mb_hash_t *c, unsigned char *out) {
+  uint64_t bits = c->len * 8;
+  unsigned char pad[72];
+  size_t pad_len;
+  int i;
+
+  /* 0x80, zero-pad to 56 mod 64, then 64-bit big-endian bit length */
+  pad_len = ((c->buf_len < 56) ? 56 : 120) - c->buf_len;
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for (i = 0; i < 8; i++)
+    pad[pad_len + i] = (unsigned char) (bits >> (56 - 8 * i));
+  hash_update(c, pad, pad_len + 8);
+
+  for (i = 0; i < c->words; i++) {
+    out[4 * i] = (unsigned char) (c->h[i] >> 24);
+    out[4 * i + 1] = (unsigned char) (c->h[i] >> 16);
+    out[4 * i + 2] = (unsigned char) (c->h[i] >> 8);
+    out[4 * i + 3] = (unsigned char) c->h[i];
+  }
+}
+
+/*
+ * Hash an entire file.  The file is mapped into memory and hashed in
+ * one pass (falling back to read() for files that can't be mapped,
+ * like pipes).  Doesn't touch any Ruby objects, so it's safe to call
+ * without the global interpreter lock.  Returns 0 on success, or an
+ * errno value.
+ */
+static int hash_path(const char *path, int algo, unsigned char *out) {
+  unsigned char buf[MB_BULK_BUFSIZ];
+  struct stat st;
+  mb_hash_t c;
+  ssize_t len;
+  void *map;
+  int fd, err = 0;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return errno;
+  if (fstat(fd, &st)) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+
+  hash_init(&c, algo);
+
+  map = MAP_FAILED;
+  if (S_ISREG(st.st_mode) && st.st_size > 0)
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif /* MADV_SEQUENTIAL */
+    hash_update(&c, map, st.st_size);
+    munmap(map, st.st_size);
+  } else {
+    while ((len = read(fd, buf, sizeof(buf))) != 0) {
+      if (len < 0) {
+        if (errno == EINTR)
+          continue;
+        err = errno;
+        break;
+      }
+      hash_update(&c, buf, len);
+    }
+  }
+
+  close(fd);
+  if (!err)
+    hash_final(&c, out);
+
+  return err;
+}
+
+/*
+ * Convert a raw digest to a lower-case hex string.  The output buffer
+ * must hold at least (2 * len + 1) bytes.
+ */
+static void digest_to_hex(const unsigned char *digest, int len, char *out) {
+  static const char hex[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0; i < len; i++) {
+    out[2 * i] = hex[digest[i] >> 4];
+    out[2 * i + 1] = hex[digest[i] & 0xf];
+  }
+  out[2 * len] = '\0';
+}
+
+/*
+ * Hash job, for running hash_path() without the global interpreter
+ * lock.
+ */
+typedef struct {
+  char *path;
+  int algo, err;
+  unsigned char digest[MB_HASH_MAXLEN];
+} hash_job_t;
+
+static void *hash_path_blocking(void *ptr) {
+  hash_job_t *job = ptr;
+  job->err = hash_path(job->path, job->algo, job->digest);
+  return NULL;
+}
+
+/*
+ * Convert a raw digest to a Ruby string: either the raw bytes, or a
+ * lower-case hex string.
+ */
+static VALUE hash_str(const unsigned char *digest, int algo, int hex) {
+  char buf[2 * MB_HASH_MAXLEN + 1];
+  int len = (algo == MB_HASH_SHA256) ? MB_SHA256_LEN : MB_SHA1_LEN;
+
+  if (!hex)
+    return rb_str_new((const char*) digest, len);
+
+  digest_to_hex(digest, len, buf);
+  return rb_str_new2(buf);
+}
+
+static VALUE hash_path_call(VALUE ptr) {
+  mb_without_gvl(hash_path_blocking, (void*) ptr, NULL, NULL);
+  return Qnil;
+}
+
+/*
+ * Free the path, even if the thread was interrupted while hashing.
+ */
+static VALUE hash_path_free(VALUE ptr) {
+  free(((hash_job_t*) ptr)->path);
+  return Qnil;
+}
+
+/*
+ * Hash the file at path (without the global interpreter lock), and
+ * return the digest as a string.  Raises MusicBrainz::Error if the
+ * file can't be read.
+ */
+static VALUE hash_file(VALUE path, int algo, int hex) {
+  hash_job_t job;
+
+  memset(&job, 0, sizeof(job));
+  job.algo = algo;
+  if ((job.path = strdup(StringValueCStr(path))) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for path");
+
+  rb_ensure(hash_path_call, (VALUE) &job, hash_path_free, (VALUE) &job);
+
+  if (job.err)
+    rb_raise(eErr, "couldn't hash \"%s\": %s", RSTRING_PTR(path), strerror(job.err));
+
+  return hash_str(job.digest, algo, hex);
+}
+
+/*********************/
+/* MPEG audio frames */
+/*********************/
+
+/* 
+ * bitrates (kbps), indexed by [MPEG 1 ? 0 : 1][layer - 1][index] 
+ */
+static const int mp3_bitrates[2][3][16] = {
+  { { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0 },
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0 },
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 } },
+  { { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 } },
+};
+
+/* 
+ * sample rates (Hz), indexed by version bits (MPEG 2.5, reserved,
+ * MPEG 2, MPEG 1) 
+ */
+static const int mp3_samplerates[4][3] = {
+  { 11025, 12000, 8000 },
+  { 0, 0, 0 },
+  { 22050, 24000, 16000 },
+  { 44100, 48000, 32000 },
+};
+
+/*
+ * Decoded MPEG audio frame header.
+ */
+typedef struct {
+  int version,    /* version bits: 3 = MPEG 1, 2 = MPEG 2, 0 = MPEG 2.5 */
+      layer,      /* 1, 2, or 3 */
+      bitrate,    /* kbps */
+      samplerate, /* Hz */
+      samples,    /* samples per frame */
+      mono,       /* channel mode == single channel */
+      size;       /* frame size, including header */
+} mp3_frame_t;
+
+/*
+ * Decode a 4-byte MPEG audio frame header.  Returns 0 if the bytes
+ * aren't a valid header (or are a free-format header, which can't be
+ * walked).
+ */
+static int mp3_parse_frame(const unsigned char *p, mp3_frame_t *f) {
+  int v, l, b, s;
+
+  if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0)
+    return 0;
+
+  v = (p[1] >> 3) & 3;
+  l = 4 - ((p[1] >> 1) & 3);
+  b = (p[2] >> 4) & 0xf;
+  s = (p[2] >> 2) & 3;
+
+  /* reserved version or layer, free or bad bitrate, bad samplerate */
+  if (v == 1 || l == 4 || b == 0 || b == 15 || s == 3)
+    return 0;
+
+  f->version = v;
+  f->layer = l;
+  f->bitrate = mp3_bitrates[(v == 3) ? 0 : 1][l - 1][b];
+  f->samplerate = mp3_samplerates[v][s];
+  f->mono = ((p[3] >> 6) & 3) == 3;
+
+  if (l == 1) {
+    f->samples = 384;
+    f->size = (12000 * f->bitrate / f->samplerate + ((p[2] >> 1) & 1)) * 4;
+  } else {
+    f->samples = (l == 3 && v != 3) ? 576 : 1152;
+    f->size = (f->samples / 8) * 1000 * f->bitrate / f->samplerate + ((p[2] >> 1) & 1);
+  }
+
+  return 1;
+}
+
+/* streaming MPEG audio scanner states */
+#define MP3_STATE_START 0  /* at start of file, checking for ID3v2 tag */
+#define MP3_STATE_SYNC  1  /* looking for the next frame header */
+#define MP3_STATE_TAG   2  /* reading first frame, checking for VBR tag */
+
+/* 
+ * number of bytes of the first frame to check for a Xing/Info/VBRI
+ * header (and LAME extension)
+ */
+#define MP3_TAG_BUFSIZ  192
+
+/* 
+ * number of identical-bitrate frames needed to decide that a file
+ * without a VBR header is CBR
+ */
+#define MP3_CBR_FRAMES  8
+
+/* 
+ * minimum number of consecutive frames needed for a run of frames to
+ * count (shorter runs are almost always junk that happens to look
+ * like a frame header)
+ */
+#define MP3_MIN_RUN     3
+
+/*
+ * Streaming MPEG audio scanner.  Feed it consecutive chunks of a file
+ * with mp3_feed(); it skips ID3v2 tags and junk, checks the first frame
+ * for a Xing/Info/VBRI header, and walks the frame headers, keeping
+ * enough totals to compute the duration and average bitrate no matter
+ * how the chunks line up with the frames.
+ *
+ * Unless full is set, the scanner stops (and sets done) as soon as it
+ * has found a VBR header, or has seen enough identical frames to treat
+ * the file as CBR.  Callers should stop reading at that point, and
+ * set file_size (and id3v1) before calling mp3_result().  Callers may
+ * also seek past skip bytes rather than feeding them.
+ */
+typedef struct {
+  int state, full, done;
+  unsigned char hdr[MP3_TAG_BUFSIZ];
+  int hdr_len, tag_len;
+  long long skip, offset;
+
+  /* format and offset of first frame (subsequent frames must match) */
+  mp3_frame_t first;
+  long long first_offset;
+
+  /* totals */
+  long frames, stereo;
+  long long samples, bytes;
+  int vbr, cbr;
+
+  /* totals for the current run of consecutive frames */
+  long run, run_stereo;
+  long long run_samples, run_bytes;
+
+  /* VBR header of first frame (tag_type is 0 if there isn't one) */
+  int tag_type, delay, padding;
+  long tag_frames;
+  long long tag_bytes;
+
+  /* set by caller */
+  long long file_size;
+  int id3v1;
+} mb_mp3_t;
+
+/* VBR header types */
+#define MP3_TAG_XING    1
+#define MP3_TAG_INFO    2
+#define MP3_TAG_VBRI    3
+
+/*
+ * Summary of a scanned MPEG audio stream.
+ */
+typedef struct {
+  int duration,   /* ms */
+      bitrate,    /* kbps (average for VBR files) */
+      stereo,
+      samplerate, /* Hz */
+      vbr;
+  long frames;
+} mb_mp3_info_t;
+
+static void mp3_init(mb_mp3_t *m) {
+  memset(m, 0, sizeof(mb_mp3_t));
+  m->state = MP3_STATE_START;
+}
+
+#define MP3_BE32(p) (((uint32_t) (p)[0] << 24) | ((uint32_t) (p)[1] << 16) | \
+                     ((uint32_t) (p)[2] << 8) | (uint32_t) (p)[3])
+
+/*
+ * Check the start of the first frame (in m->hdr) for a Xing/Info,
+ * LAME, or VBRI header.
+ */
+static void mp3_parse_tag(mb_mp3_t *m) {
+  const unsigned char *p = m->hdr;
+  int ofs, xing, flags;
+
+  /* Xing/Info header follows the side information */
+  if (m->first.version == 3)
+    ofs = 4 + (m->first.mono ? 17 : 32);
+  else
+    ofs = 4 + (m->first.mono ? 9 : 17);
+
+  if (ofs + 8 <= m->tag_len && 
+      (!memcmp(p + ofs, "Xing", 4) || !memcmp(p + ofs, "Info", 4))) {
+    m->tag_type = (p[ofs] == 'X') ? MP3_TAG_XING : MP3_TAG_INFO;
+    flags = MP3_BE32(p + ofs + 4);
+    xing = ofs;
+    ofs += 8;
+
+    if ((flags & 1) && ofs + 4 <= m->tag_len) {
+      m->tag_frames = MP3_BE32(p + ofs);
+      ofs += 4;
+    }
+    if ((flags & 2) && ofs + 4 <= m->tag_len)
+      m->tag_bytes = MP3_BE32(p + ofs);
+
+    /* LAME extension (always at a fixed offset) has encoder delay and
+     * padding, in samples */
+    ofs = xing + 120;
+    if (ofs + 24 <= m->tag_len && !memcmp(p + ofs, "LAME", 4)) {
+      m->delay = (p[ofs + 21] << 4) | (p[ofs + 22] >> 4);
+      m->padding = ((p[ofs + 22] & 0xf) << 8) | p[ofs + 23];
+    }
+  } else if (36 + 18 <= m->tag_len && !memcmp(p + 36, "VBRI", 4)) {
+    /* Fraunhofer VBRI header is always 32 bytes after the header */
+    m->tag_type = MP3_TAG_VBRI;
+    m->tag_bytes = MP3_BE32(p + 36 + 10);
+    m->tag_frames = MP3_BE32(p + 36 + 14);
+  }
+
+  if (m->tag_type && m->tag_frames > 0 && !m->full)
+    m->done = 1;
+}
+
+/*
+ * Handle a complete frame header sitting in m->hdr.
+ */
+static void mp3_frame(mb_mp3_t *m) {
+  mp3_frame_t f;
+  unsigned char *p;
+  int ok;
+
+  ok = mp3_parse_frame(m->hdr, &f);
+
+  /* all frames in a stream share version, layer, and samplerate */
+  if (ok && m->frames > 0)
+    ok = f.version == m->first.version && f.layer == m->first.layer &&
+         f.samplerate == m->first.samplerate;
+
+  if (!ok) {
+    /* lost sync; throw away the previous run if it was too short */
+    if (m->run > 0 && m->run < MP3_MIN_RUN) {
+      m->frames -= m->run;
+      m->stereo -= m->run_stereo;
+      m->samples -= m->run_samples;
+      m->bytes -= m->run_bytes;
+      if (!m->frames)
+        m->tag_type = m->vbr = 0;
+    }
+    m->run = m->run_stereo = 0;
+    m->run_samples = m->run_bytes = 0;
+
+    /* not a frame; resync on the next 0xff in the header buffer */
+    p = memchr(m->hdr + 1, 0xff, m->hdr_len - 1);
+    m->hdr_len = p ? (m->hdr_len - (p - m->hdr)) : 0;
+    if (p)
+      memmove(m->hdr, p, m->hdr_len);
+    return;
+  }
+
+  if (!m->frames) {
+    m->first = f;
+    m->first_offset = m->offset - 4;
+  } else if (f.bitrate != m->first.bitrate) {
+    m->vbr = 1;
+  }
+
+  m->frames++;
+  m->samples += f.samples;
+  m->bytes += f.size;
+  m->stereo += !f.mono;
+
+  m->run++;
+  m->run_samples += f.samples;
+  m->run_bytes += f.size;
+  m->run_stereo += !f.mono;
+
+  if (m->frames == 1) {
+    /* read the rest of the first frame header to check for a VBR tag */
+    m->tag_type = 0;
+    m->tag_len = (f.size < MP3_TAG_BUFSIZ) ? f.size : MP3_TAG_BUFSIZ;
+    m->state = MP3_STATE_TAG;
+    return;
+  }
+
+  /* enough identical frames without a VBR header, assume CBR */
+  if (!m->tag_type && !m->vbr && !m->full && m->frames >= MP3_CBR_FRAMES) {
+    m->cbr = 1;
+    m->done = 1;
+  }
+
+  m->skip = f.size - 4;
+  m->hdr_len = 0;
+}
+
+static void mp3_feed(mb_mp3_t *m, const unsigned char *buf, long len) {
+  const unsigned char *p;
+  long n;
+  int need;
+
+  while (len > 0 && !m->done) {
+    /* skip over frame data and tags */
+    if (m->skip > 0) {
+      n = (m->skip < len) ? m->skip : len;
+      m->skip -= n;
+      m->offset += n;
+      buf += n;
+      len -= n;
+      continue;
+    }
+
+    /* jump straight to the next possible sync byte */
+    if (m->state == MP3_STATE_SYNC && !m->hdr_len) {
+      if ((p = memchr(buf, 0xff, len)) == NULL) {
+        m->offset += len;
+        return;
+      }
+      m->offset += p - buf;
+      len -= p - buf;
+      buf = p;
+    }
+
+    /* accumulate header bytes (these may span several chunks) */
+    switch (m->state) {
+      case MP3_STATE_START: need = 10; break;
+      case MP3_STATE_TAG:   need = m->tag_len; break;
+      default:              need = 4;
+    }
+
+    n = need - m->hdr_len;
+    if (n > len)
+      n = len;
+    memcpy(m->hdr + m->hdr_len, buf, n);
+    m->hdr_len += n;
+    m->offset += n;
+    buf += n;
+    len -= n;
+    if (m->hdr_len < need)
+      return;
+
+    if (m->state == MP3_STATE_START) {
+      m->state = MP3_STATE_SYNC;
+
+      if (!memcmp(m->hdr, "ID3", 3)) {
+        /* skip ID3v2 tag (size is a 28-bit syncsafe integer) */
+        m->skip = ((m->hdr[6] & 0x7f) << 21) | ((m->hdr[7] & 0x7f) << 14) |
+                  ((m->hdr[8] & 0x7f) << 7) | (m->hdr[9] & 0x7f);
+        if (m->hdr[5] & 0x10)
+          m->skip += 10;
+        m->hdr_len = 0;
+      } else {
+        /* no tag; rescan these bytes as audio data */
+        unsigned char tmp[10];
+        memcpy(tmp, m->hdr, 10);
+        m->hdr_len = 0;
+        m->offset -= 10;
+        mp3_feed(m, tmp, 10);
+      }
+    } else if (m->state == MP3_STATE_TAG) {
+      mp3_parse_tag(m);
+      m->state = MP3_STATE_SYNC;
+      m->skip = m->first.size - m->tag_len;
+      m->hdr_len = 0;
+    } else {
+      mp3_frame(m);
+    }
+  }
+}
+
+/*
+ * Summarize the stream fed so far.  Uses the VBR header or CBR
+ * estimate if the scanner stopped early, and the frame totals
+ * otherwise.  Returns 0 if no frames were found.
+ */
+static int mp3_result(mb_mp3_t *m, mb_mp3_info_t *info) {
+  long long samples, bytes, end;
+
+  if (!m->frames)
+    return 0;
+
+  end = m->file_size - (m->id3v1 ? 128 : 0);
+
+  if (m->tag_type && m->tag_frames > 0 && !m->full) {
+    /* VBR header */
+    samples = (long long) m->tag_frames * m->first.samples - m->delay - m->padding;
+    bytes = m->tag_bytes ? m->tag_bytes : (end - m->first_offset);
+    info->frames = m->tag_frames;
+    info->vbr = (m->tag_type != MP3_TAG_INFO);
+  } else if (m->cbr && end > m->first_offset) {
+    /* constant bitrate; estimate from the file size */
+    bytes = end - m->first_offset;
+    samples = bytes * 8 * m->first.samplerate / (m->first.bitrate * 1000);
+    info->frames = (long) (bytes / m->first.size);
+    info->vbr = 0;
+  } else {
+    /* frame totals (not counting the VBR header frame, if any) */
+    samples = m->samples;
+    bytes = m->bytes;
+    info->frames = m->frames;
+    if (m->tag_type) {
+      samples -= m->first.samples;
+      bytes -= m->first.size;
+      info->frames--;
+    }
+    info->vbr = m->vbr;
+  }
+
+  if (samples < 0)
+    samples = 0;
+
+  info->duration = (int) (samples * 1000 / m->first.samplerate);
+  info->bitrate = info->duration ? (int) ((bytes * 8 + info->duration / 2) / info->duration) : m->first.bitrate;
+  info->stereo = m->stereo > 0;
+  info->samplerate = m->first.samplerate;
+
+  return 1;
+}
+
+/*
+ * Build the hash returned by MusicBrainz::Client#mp3_info.
+ */
+static VALUE mp3_info_hash(int dr, int br, int st, int sr) {
+  VALUE ret = rb_hash_new();
+
+  rb_hash_aset(ret, rb_str_new2("duration"), INT2FIX(dr));
+  rb_hash_aset(ret, rb_str_new2("bitrate"), INT2FIX(br));
+  rb_hash_aset(ret, rb_str_new2("stereo"), st ? Qtrue : Qfalse);
+  rb_hash_aset(ret, rb_str_new2("samplerate"), INT2FIX(sr));
+
+  return ret;
+}
+
+/*******************/
+/* MusicBrainz IDs */
+/*******************/
+
+/*
+ * MusicBrainz IDs are UUIDs, so they're kept as 16 raw bytes rather
+ * than 36 character strings (see MusicBrainz::MBID).
+ */
+#define MB_MBID_LEN     16
+#define MB_MBID_STRLEN  36
+
+typedef struct {
+  unsigned char id[MB_MBID_LEN];
+} mb_mbid_t;
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/*
+ * Decode 32 hex digits (either case) to 16 bytes, 16 digits at a time.
+ * Returns 0 if any of the characters isn't a hex digit.
+ */
+static int mbid_decode_hex(const char *s, unsigned char *out) {
+  __m128i c, lc, dig, alpha, nib, v[2];
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    c = _mm_loadu_si128((const __m128i*) (s + 16 * i));
+    lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+
+    /* signed compares, so bytes >= 0x80 fail both tests */
+    dig = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), 
+                        _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    alpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)), 
+                          _mm_cmplt_epi8(lc, _mm_set1_epi8('f' + 1)));
+    if (_mm_movemask_epi8(_mm_or_si128(dig, alpha)) != 0xffff)
+      return 0;
+
+    nib = _mm_or_si128(_mm_and_si128(dig, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                       _mm_andnot_si128(dig, _mm_sub_epi8(lc, _mm_set1_epi8('a' - 10))));
+
+    /* merge each (high, low) pair of nibbles within a 16-bit lane */
+    v[i] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nib, _mm_set1_epi16(0xff)), 4),
+                        _mm_srli_epi16(nib, 8));
+  }
+
+  _mm_storeu_si128((__m128i*) out, _mm_packus_epi16(v[0], v[1]));
+  return 1;
+}
+#else /* !__SSE2__ */
+static int mbid_decode_hex(const char *s, unsigned char *out) {
+  int i, n, v = 0;
+
+  for (i = 0; i < 32; i++) {
+    if (s[i] >= '0' && s[i] <= '9')
+      n = s[i] - '0';
+    else if ((s[i] | 0x20) >= 'a' && (s[i] | 0x20) <= 'f')
+      n = (s[i] | 0x20) - 'a' + 10;
+    else
+      return 0;
+
+    v = (v << 4) | n;
+    if (i & 1)
+      out[i / 2] = (unsigned char) v;
+  }
+
+  return 1;
+}
+#endif /* __SSE2__ */
+
+/*
+ * Find the last occurrence of c in the first len bytes of s, or -1 if
+ * there isn't one.  Scans backwards 16 bytes at a time where SSE2 is
+ * available, since the interesting part of a URL is usually at the
+ * end.
+ */
+static long url_rfind(const char *s, long len, int c) {
+#ifdef __SSE2__
+  __m128i needle = _mm_set1_epi8((char) c);
+  int mask, bit;
+
+  for (; len >= 16; len -= 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (s + len - 16)), needle));
+    if (mask) {
+#ifdef __GNUC__
+      bit = 31 - __builtin_clz(mask);
+#else /* !__GNUC__ */
+      for (bit = 15; !(mask & (1 << bit)); bit--)
+        ;
+#endif /* __GNUC__ */
+      return len - 16 + bit;
+    }
+  }
+#endif /* __SSE2__ */
+
+  while (len-- > 0)
+    if (s[len] == c)
+      return len;
+
+  return -1;
+}
+
+/*
+ * Parse an ID from a hyphenated UUID, 32 hex digits, or a URL ending
+ * in either (eg the result of a MBE_GetxxxxxId query).  Returns 0 if
+ * the string doesn't contain a valid ID.
+ */
+static int mbid_parse(const char *s, long len, unsigned char *out) {
+  char hex[32];
+  long i;
+
+  /* use the last path component, ignoring trailing slashes */
+  while (len > 0 && s[len - 1] == '/')
+    len--;
+  i = url_rfind(s, len, '/') + 1;
+  s += i;
+  len -= i;
+
+  if (len == 32)
+    return mbid_decode_hex(s, out);
+  if (len != MB_MBID_STRLEN || s[8] != '-' || s[13] != '-' || s[18] != '-' || s[23] != '-')
+    return 0;
+
+  memcpy(hex, s, 8);
+  memcpy(hex + 8, s + 9, 4);
+  memcpy(hex + 12, s + 14, 4);
+  memcpy(hex + 16, s + 19, 4);
+  memcpy(hex + 20, s + 24, 12);
+
+  return mbid_decode_hex(hex, out);
+}
+
+/*
+ * Format an ID as a lower-case hyphenated UUID.  The output buffer
+ * must hold at least (MB_MBID_STRLEN + 1) bytes.
+ */
+static void mbid_format(const unsigned char *id, char *out) {
+  static const char hex[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0; i < MB_MBID_LEN; i++) {
+    if (i == 4 || i == 6 || i == 8 || i == 10)
+      *(out++) = '-';
+    *(out++) = hex[id[i] >> 4];
+    *(out++) = hex[id[i] & 0xf];
+  }
+  *out = '\0';
+}
+
+static VALUE mbid_wrap(VALUE klass, const unsigned char *id) {
+  mb_mbid_t *m;
+
+  if ((m = malloc(sizeof(mb_mbid_t))) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for MBID structure");
+  if (id)
+    memcpy(m->id, id, MB_MBID_LEN);
+  else
+    memset(m->id, 0, MB_MBID_LEN);
+
+  return Data_Wrap_Struct(klass, 0, free, m);
+}
+
+/*
+ * Create a MusicBrainz::MBID from 16 raw bytes.
+ */
+static VALUE mbid_new(const unsigned char *id) {
+  return mbid_wrap(cMBID, id);
+}
+
+/**********************/
+/* Local mirror index */
+/**********************/
+
+/*
+ * Read-only index of (a subset of) the MusicBrainz database, built
+ * from a tab-separated export by MusicBrainz::Index.build and mapped
+ * into memory by MusicBrainz::Index.new.  A client with an index (see
+ * MusicBrainz::Client#index=) answers supported queries by synthesizing
+ * the same mm-2.1 RDF the server would return, and falls back to the
+ * server for everything else.
+ *
+ * The file is a header followed by fixed-size tables, each aligned to
+ * 8 bytes.  Records refer to each other by table position, and to
+ * names by offset into a string table of NUL-terminated UTF-8.  The
+ * artist, album, track, and TRM tables are sorted by ID, so lookups
+ * are binary searches.
+ *
+ * Artist, album, and track names are also indexed by trigram (see
+ * index_grams()): each kind of record has a sorted table of trigrams,
+ * each with a list of the records whose name contains it, and the
+ * number of distinct trigrams in each name.  Searches count shared
+ * trigrams and rank names by Dice coefficient, so misspellings,
+ * missing words, and differences in case still match.
+ */
+#define MB_INDEX_MAGIC    "MBINDEX1"
+#define MB_INDEX_BOM      0x01020304
+#define MB_INDEX_VERSION  2
+#define MB_INDEX_NONE     0xffffffff
+
+/* kinds of named records, for name searches */
+#define MB_INDEX_ARTIST   0
+#define MB_INDEX_ALBUM    1
+#define MB_INDEX_TRACK    2
+#define MB_INDEX_KINDS    3
+
+/* names are cut off after this many (non-distinct) trigrams */
+#define MB_INDEX_GRAMS_MAX  256
+
+/* most results returned from a single name search */
+#define MB_INDEX_HITS_MAX   128
+
+/* least relevance of a name search result answered from the index;
+ * searches with nothing better go to the server */
+#define MB_INDEX_MIN_RELEVANCE  50
+
+/* resource URLs used in synthesized RDF */
+#define MB_INDEX_URL      "http://musicbrainz.org/mm-2.1/"
+#define MB_INDEX_NS       "http://musicbrainz.org/mm/mm-2.1#"
+
+typedef struct {
+  char magic[8];
+  uint32_t bom, version;
+  uint32_t num_artists, num_albums, num_tracks, num_trms;
+
+  /* table offsets (in bytes, from the start of the file) */
+  uint64_t artists, albums, tracks, trms;
+  uint64_t artist_albums, album_tracks;
+  uint64_t strings, strings_len;
+
+  /* trigram tables, one set for each kind of record */
+  struct {
+    uint64_t keys, starts, postings, lens;
+    uint64_t num_keys, num_postings;
+  } grams[MB_INDEX_KINDS];
+} mb_index_hdr_t;
+
+typedef struct {
+  unsigned char id[MB_MBID_LEN];
+  uint32_t name, sort_name;
+
+  /* albums[0 .. num_albums - 1] in the artist_albums table */
+  uint32_t albums, num_albums;
+} mb_index_artist_t;
+
+typedef struct {
+  unsigned char id[MB_MBID_LEN];
+  uint32_t artist, name, type, status;
+
+  /* tracks[0 .. num_tracks - 1] in the album_tracks table */
+  uint32_t tracks, num_tracks;
+} mb_index_album_t;
+
+typedef struct {
+  unsigned char id[MB_MBID_LEN];
+  uint32_t artist, album, name, num, duration;
+} mb_index_track_t;
+
+typedef struct {
+  unsigned char id[MB_MBID_LEN];
+  uint32_t track;
+} mb_index_trm_t;
+
+typedef struct {
+  void *map;
+  size_t map_len;
+
+  const mb_index_hdr_t *hdr;
+  const mb_index_artist_t *artists;
+  const mb_index_album_t *albums;
+  const mb_index_track_t *tracks;
+  const mb_index_trm_t *trms;
+  const uint32_t *artist_albums, *album_tracks;
+  const char *strings;
+
+  struct {
+    const uint64_t *keys;
+    const uint32_t *starts, *postings;
+    const uint16_t *lens;
+    uint32_t num_keys, num_postings, num_recs;
+  } grams[MB_INDEX_KINDS];
+} mb_index_t;
+
+typedef struct {
+  uint32_t rec, relevance;
+} mb_index_hit_t;
+
+static const char *index_str(const mb_index_t *ix, uint32_t ofs) {
+  return (ofs < ix->hdr->strings_len) ? ix->strings + ofs : "";
+}
+
+/*
+ * Binary search a table of records which start with a 16 byte ID.
+ * Returns the position of the first match, or MB_INDEX_NONE.
+ */
+static uint32_t index_find(const void *table, size_t size, uint32_t num, const unsigned char *id) {
+  const unsigned char *base = table;
+  uint32_t lo = 0, hi = num, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (memcmp(base + size * mid, id, MB_MBID_LEN) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return (lo < num && !memcmp(base + size * lo, id, MB_MBID_LEN)) ? lo : MB_INDEX_NONE;
+}
+
+/*
+ * Check that a table of num records of the given size fits in the
+ * mapped file.
+ */
+static int index_table_ok(const mb_index_t *ix, uint64_t ofs, uint64_t num, size_t size) {
+  return ofs >= sizeof(mb_index_hdr_t) && ofs % 8 == 0 && ofs <= ix->map_len && 
+         num <= (ix->map_len - ofs) / size;
+}
+
+/*
+ * Check the trigram tables for one kind of record.  Postings are
+ * checked as they're read.
+ */
+static int index_grams_ok(const mb_index_t *ix, int kind, uint64_t num_recs) {
+  const mb_index_hdr_t *h = ix->hdr;
+
+  return h->grams[kind].num_keys < UINT32_MAX && h->grams[kind].num_postings <= UINT32_MAX &&
+         index_table_ok(ix, h->grams[kind].keys, h->grams[kind].num_keys, sizeof(uint64_t)) &&
+         index_table_ok(ix, h->grams[kind].starts, h->grams[kind].num_keys + 1, sizeof(uint32_t)) &&
+         index_table_ok(ix, h->grams[kind].postings, h->grams[kind].num_postings, sizeof(uint32_t)) &&
+         index_table_ok(ix, h->grams[kind].lens, num_recs, sizeof(uint16_t));
+}
+
+/*
+ * Map an index file into memory and check its tables.  Returns 0 on
+ * success, or an errno value (EINVAL if the file isn't a valid index).
+ */
+static int index_open(mb_index_t *ix, const char *path) {
+  const mb_index_hdr_t *h;
+  struct stat st;
+  int fd, err, k;
+
+  memset(ix, 0, sizeof(mb_index_t));
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return errno;
+  if (fstat(fd, &st)) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+  if (st.st_size < (off_t) sizeof(mb_index_hdr_t)) {
+    close(fd);
+    return EINVAL;
+  }
+
+  ix->map_len = st.st_size;
+  ix->map = mmap(NULL, ix->map_len, PROT_READ, MAP_SHARED, fd, 0);
+  err = errno;
+  close(fd);
+  if (ix->map == MAP_FAILED) {
+    ix->map = NULL;
+    return err;
+  }
+
+  h = ix->hdr = ix->map;
+  if (memcmp(h->magic, MB_INDEX_MAGIC, 8) || h->bom != MB_INDEX_BOM || h->version != MB_INDEX_VERSION ||
+      !index_table_ok(ix, h->artists, h->num_artists, sizeof(mb_index_artist_t)) ||
+      !index_table_ok(ix, h->albums, h->num_albums, sizeof(mb_index_album_t)) ||
+      !index_table_ok(ix, h->tracks, h->num_tracks, sizeof(mb_index_track_t)) ||
+      !index_table_ok(ix, h->trms, h->num_trms, sizeof(mb_index_trm_t)) ||
+      !index_table_ok(ix, h->artist_albums, h->num_albums, sizeof(uint32_t)) ||
+      !index_table_ok(ix, h->album_tracks, h->num_tracks, sizeof(uint32_t)) ||
+      !index_table_ok(ix, h->strings, h->strings_len, 1) || 
+      h->strings_len < 1 || ((const char*) ix->map)[h->strings + h->strings_len - 1] ||
+      !index_grams_ok(ix, MB_INDEX_ARTIST, h->num_artists) ||
+      !index_grams_ok(ix, MB_INDEX_ALBUM, h->num_albums) ||
+      !index_grams_ok(ix, MB_INDEX_TRACK, h->num_tracks)) {
+    munmap(ix->map, ix->map_len);
+    ix->map = NULL;
+    return EINVAL;
+  }
+
+  ix->artists = (const void*) ((const char*) ix->map + h->artists);
+  ix->albums = (const void*) ((const char*) ix->map + h->albums);
+  ix->tracks = (const void*) ((const char*) ix->map + h->tracks);
+  ix->trms = (const void*) ((const char*) ix->map + h->trms);
+  ix->artist_albums = (const void*) ((const char*) ix->map + h->artist_albums);
+  ix->album_tracks = (const void*) ((const char*) ix->map + h->album_tracks);
+  ix->strings = (const char*) ix->map + h->strings;
+
+  for (k = 0; k < MB_INDEX_KINDS; k++) {
+    ix->grams[k].keys = (const void*) ((const char*) ix->map + h->grams[k].keys);
+    ix->grams[k].starts = (const void*) ((const char*) ix->map + h->grams[k].starts);
+    ix->grams[k].postings = (const void*) ((const char*) ix->map + h->grams[k].postings);
+    ix->grams[k].lens = (const void*) ((const char*) ix->map + h->grams[k].lens);
+    ix->grams[k].num_keys = h->grams[k].num_keys;
+    ix->grams[k].num_postings = h->grams[k].num_postings;
+  }
+  ix->grams[MB_INDEX_ARTIST].num_recs = h->num_artists;
+  ix->grams[MB_INDEX_ALBUM].num_recs = h->num_albums;
+  ix->grams[MB_INDEX_TRACK].num_recs = h->num_tracks;
+
+  return 0;
+}
+
+static void index_close(mb_index_t *ix) {
+  if (ix->map)
+    munmap(ix->map, ix->map_len);
+  ix->map = NULL;
+}
+
+/*
+ * Decode one UTF-8 character and advance *sp past it.  Bytes that
+ * aren't part of a valid sequence are treated as Latin-1.
+ */
+static uint32_t utf8_next(const unsigned char **sp) {
+  const unsigned char *s = *sp;
+  uint32_t c = *s;
+  int i, n;
+
+  if (c < 0x80) {
+    n = 0;
+  } else if (c >= 0xc2 && c < 0xe0) {
+    n = 1;
+    c &= 0x1f;
+  } else if (c >= 0xe0 && c < 0xf0) {
+    n = 2;
+    c &= 0x0f;
+  } else if (c >= 0xf0 && c < 0xf5) {
+    n = 3;
+    c &= 0x07;
+  } else {
+    *sp = s + 1;
+    return c;
+  }
+
+  for (i = 1; i <= n; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      *sp = s + 1;
+      return *s;
+    }
+    c = (c << 6) | (s[i] & 0x3f);
+  }
+
+  *sp = s + n + 1;
+  return c;
+}
+
+/*
+ * Case fold a character for name searches (simple Unicode case folding
+ * for Latin, Greek, Cyrillic, Armenian, and fullwidth forms).  Returns
+ * 0 for punctuation, spaces, and symbols, which separate words.
+ */
+static uint32_t fold_char(uint32_t c) {
+  if (c < 0x80) {
+    if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+      return c;
+    return (c >= 'A' && c <= 'Z') ? c + 32 : 0;
+  }
+
+  /* Latin-1 */
+  if (c < 0xc0)
+    return (c == 0xb5) ? 0x3bc : (c == 0xaa || c == 0xba) ? c : 0;
+  if (c < 0xdf)
+    return (c == 0xd7) ? 0 : c + 32;
+  if (c < 0x100)
+    return (c == 0xf7) ? 0 : c;
+
+  /* Latin Extended-A */
+  if (c < 0x180) {
+    if (c == 0x130)
+      return 'i';
+    if (c == 0x131 || c == 0x138 || c == 0x149)
+      return c;
+    if (c == 0x178)
+      return 0xff;
+    if (c == 0x17f)
+      return 's';
+    if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e))
+      return (c & 1) ? c + 1 : c;
+    return c | 1;
+  }
+
+  /* Greek */
+  if (c >= 0x370 && c < 0x400) {
+    if (c == 0x386)
+      return 0x3ac;
+    if (c >= 0x388 && c <= 0x38a)
+      return c + 37;
+    if (c == 0x38c)
+      return 0x3cc;
+    if (c == 0x38e || c == 0x38f)
+      return c + 63;
+    if (c >= 0x391 && c <= 0x3ab && c != 0x3a2)
+      return c + 32;
+    return (c == 0x3c2) ? 0x3c3 : c;
+  }
+
+  /* Cyrillic and Armenian */
+  if (c >= 0x400 && c < 0x410)
+    return c + 80;
+  if (c >= 0x410 && c < 0x430)
+    return c + 32;
+  if ((c >= 0x460 && c < 0x482) || (c >= 0x48a && c < 0x4c0) || (c >= 0x4d0 && c < 0x530))
+    return c | 1;
+  if (c >= 0x4c1 && c <= 0x4ce)
+    return (c & 1) ? c + 1 : c;
+  if (c >= 0x531 && c <= 0x556)
+    return c + 48;
+
+  /* Latin Extended Additional */
+  if ((c >= 0x1e00 && c < 0x1e96) || (c >= 0x1ea0 && c < 0x1f00))
+    return c | 1;
+  if (c == 0x1e9e)
+    return 0xdf;
+
+  /* punctuation */
+  if ((c >= 0x2000 && c < 0x2070) || (c >= 0x2e00 && c < 0x2e80) || 
+      (c >= 0x3000 && c < 0x3040 && (c < 0x3005 || c > 0x3007)))
+    return 0;
+
+  /* fullwidth forms */
+  if (c >= 0xff01 && c < 0xff66) {
+    if (c >= 0xff21 && c <= 0xff3a)
+      return c + 32;
+    if ((c >= 0xff10 && c <= 0xff19) || (c >= 0xff41 && c <= 0xff5a))
+      return c;
+    return 0;
+  }
+
+  return c;
+}
+
+#define MB_GRAM(a, b, c) (((uint64_t) (a) << 42) | ((uint64_t) (b) << 21) | (uint64_t) (c))
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *((const uint64_t*) a), y = *((const uint64_t*) b);
+  return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * Get the distinct trigrams of a name, in order.  Each word is case
+ * folded and padded with two spaces in front and one behind, so
+ * "Air" becomes "  a", " ai", "air", and "ir ".  Each trigram packs
+ * three 21-bit code points into a 64-bit key.  out must have room for
+ * MB_INDEX_GRAMS_MAX keys.  Returns the number of trigrams.
+ */
+static size_t index_grams(const char *name, uint64_t *out) {
+  const unsigned char *s = (const unsigned char*) name;
+  uint32_t a = ' ', b = ' ', c;
+  size_t i, j, n = 0;
+  int in_word = 0;
+
+  while (n < MB_INDEX_GRAMS_MAX) {
+    c = *s ? fold_char(utf8_next(&s)) : 0;
+
+    if (c) {
+      if (!in_word)
+        a = b = ' ';
+      in_word = 1;
+      out[n++] = MB_GRAM(a, b, c);
+      a = b;
+      b = c;
+    } else {
+      if (in_word)
+        out[n++] = MB_GRAM(a, b, ' ');
+      in_word = 0;
+      if (!*s)
+        break;
+    }
+  }
+
+  /* sort, then drop duplicates */
+  qsort(out, n, sizeof(uint64_t), cmp_u64);
+  for (i = j = 0; i < n; i++)
+    if (!j || out[i] != out[j - 1])
+      out[j++] = out[i];
+
+  return j;
+}
+
+/*
+ * Is hit a a better match than hit b?
+ */
+static int index_hit_better(const mb_index_hit_t *a, const mb_index_hit_t *b) {
+  return a->relevance > b->relevance || (a->relevance == b->relevance && a->rec < b->rec);
+}
+
+static int index_hit_cmp(const void *a, const void *b) {
+  return index_hit_better(a, b) ? -1 : index_hit_better(b, a) ? 1 : 0;
+}
+
+/*
+ * Add a hit to a heap of the best max hits so far, with the worst of
+ * them at the root.
+ */
+static void index_hits_push(mb_index_hit_t *hits, int *num, int max, const mb_index_hit_t *hit) {
+  mb_index_hit_t tmp;
+  int i, j;
+
+  if (*num < max) {
+    /* add to the end, then sift up */
+    for (i = (*num)++; i > 0 && index_hit_better(hits + (i - 1) / 2, hit); i = (i - 1) / 2)
+      hits[i] = hits[(i - 1) / 2];
+    hits[i] = *hit;
+    return;
+  }
+
+  if (!index_hit_better(hit, hits))
+    return;
+
+  /* replace the root, then sift down */
+  for (i = 0, tmp = *hit; (j = 2 * i + 1) < max; i = j) {
+    if (j + 1 < max && index_hit_better(hits + j, hits + j + 1))
+      j++;
+    if (!index_hit_better(&tmp, hits + j))
+      break;
+    hits[i] = hits[j];
+  }
+  hits[i] = tmp;
+}
+
+/*
+ * Find the names of the given kind of record which share the most
+ * trigrams with name.  Relevance is the Dice coefficient of the two
+ * sets of trigrams, scaled to 0-100.  Fills hits with up to max_hits
+ * results, best first, and returns the number of results.
+ */
+static int index_search(const mb_index_t *ix, int kind, const char *name, mb_index_hit_t *hits, int max_hits) {
+  uint64_t grams[MB_INDEX_GRAMS_MAX];
+  uint32_t lo, hi, mid, starts[MB_INDEX_GRAMS_MAX], ends[MB_INDEX_GRAMS_MAX];
+  uint32_t j, rec, *touched = NULL;
+  uint16_t *counts = NULL;
+  size_t i, q, num_touched = 0, total = 0;
+  mb_index_hit_t hit;
+  int num = 0;
+
+  if ((q = index_grams(name, grams)) == 0 || !ix->grams[kind].num_recs)
+    return 0;
+
+  /* find the postings list for each trigram */
+  for (i = 0; i < q; i++) {
+    lo = 0;
+    hi = ix->grams[kind].num_keys;
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (ix->grams[kind].keys[mid] < grams[i])
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    starts[i] = ends[i] = 0;
+    if (lo < ix->grams[kind].num_keys && ix->grams[kind].keys[lo] == grams[i]) {
+      starts[i] = ix->grams[kind].starts[lo];
+      ends[i] = ix->grams[kind].starts[lo + 1];
+      if (ends[i] < starts[i] || ends[i] > ix->grams[kind].num_postings)
+        starts[i] = ends[i] = 0;
+    }
+    total += ends[i] - starts[i];
+  }
+  if (!total)
+    return 0;
+
+  /* count shared trigrams for each name */
+  counts = calloc(ix->grams[kind].num_recs, sizeof(uint16_t));
+  touched = malloc(sizeof(uint32_t) * ((total < ix->grams[kind].num_recs) ? total : ix->grams[kind].num_recs));
+  if (!counts || !touched)
+    goto done;
+
+  for (i = 0; i < q; i++) {
+    for (j = starts[i]; j < ends[i]; j++) {
+      if ((rec = ix->grams[kind].postings[j]) >= ix->grams[kind].num_recs)
+        continue;
+      if (!counts[rec]++)
+        touched[num_touched++] = rec;
+    }
+  }
+
+  /* keep the best max_hits names */
+  for (i = 0; i < num_touched; i++) {
+    hit.rec = touched[i];
+    hit.relevance = 200 * counts[hit.rec] / (q + ix->grams[kind].lens[hit.rec]);
+    if (hit.relevance > 100)
+      hit.relevance = 100;
+    index_hits_push(hits, &num, max_hits, &hit);
+  }
+  qsort(hits, num, sizeof(mb_index_hit_t), index_hit_cmp);
+
+done:
+  free(counts);
+  free(touched);
+
+  return num;
+}
+
+/*
+ * Growable string buffer, used to build RDF.  Sets err instead of
+ * failing, so callers only need to check once at the end.
+ */
+typedef struct {
+  char *ptr;
+  size_t len, capa;
+  int err;
+} mb_strbuf_t;
+
+/*
+ * Make room for len more bytes (plus a terminating NUL).  Returns 0 on
+ * error.
+ */
+static int sb_reserve(mb_strbuf_t *b, size_t len) {
+  char *p;
+  size_t capa;
+
+  if (b->err)
+    return 0;
+
+  if (b->len + len + 1 > b->capa) {
+    for (capa = b->capa ? b->capa : 4096; capa < b->len + len + 1; capa *= 2)
+      ;
+    if ((p = realloc(b->ptr, capa)) == NULL) {
+      b->err = 1;
+      return 0;
+    }
+    b->ptr = p;
+    b->capa = capa;
+  }
+
+  return 1;
+}
+
+static void sb_cat(mb_strbuf_t *b, const char *s, size_t len) {
+  if (!sb_reserve(b, len))
+    return;
+
+  memcpy(b->ptr + b->len, s, len);
+  b->len += len;
+  b->ptr[b->len] = '\0';
+}
+
+static void sb_str(mb_strbuf_t *b, const char *s) {
+  sb_cat(b, s, strlen(s));
+}
+
+/*
+ * Append a string with XML special characters escaped.
+ */
+static void sb_xml(mb_strbuf_t *b, const char *s) {
+  const char *p;
+
+  for (p = s; *p; p++) {
+    const char *ent = NULL;
+
+    switch (*p) {
+    case '&': ent = "&amp;"; break;
+    case '<': ent = "&lt;"; break;
+    case '>': ent = "&gt;"; break;
+    case '"': ent = "&quot;"; break;
+    }
+
+    if (ent) {
+      sb_cat(b, s, p - s);
+      sb_str(b, ent);
+      s = p + 1;
+    }
+  }
+
+  sb_cat(b, s, p - s);
+}
+
+static void sb_int(mb_strbuf_t *b, long v) {
+  char buf[32];
+  sb_cat(b, buf, snprintf(buf, sizeof(buf), "%ld", v));
+}
+
+/*
+ * Append "host", or "host:port" if the port isn't 80.
+ */
+static void sb_hostport(mb_strbuf_t *b, const char *host, int port) {
+  sb_str(b, host);
+  if (port != 80) {
+    sb_cat(b, ":", 1);
+    sb_int(b, port);
+  }
+}
+
+/*
+ * Append the resource URL of an ID (eg "http://.../artist/<id>").
+ */
+static void sb_url(mb_strbuf_t *b, const char *type, const unsigned char *id) {
+  char buf[MB_MBID_STRLEN + 1];
+
+  mbid_format(id, buf);
+  sb_str(b, MB_INDEX_URL);
+  sb_str(b, type);
+  sb_str(b, "/");
+  sb_cat(b, buf, MB_MBID_STRLEN);
+}
+
+static void sb_resource(mb_strbuf_t *b, const char *tag, const char *type, const unsigned char *id) {
+  sb_str(b, "  <");
+  sb_str(b, tag);
+  sb_str(b, " rdf:resource=\"");
+  sb_url(b, type, id);
+  sb_str(b, "\"/>\n");
+}
+
+/*
+ * Start a synthesized query result, with a list of the given type
+ * (eg "artist" for an mm:artistList).  Follow with rdf_list_item()
+ * for each item, then rdf_list_end().
+ */
+static void rdf_begin(mb_strbuf_t *b, const char *type) {
+  sb_str(b, 
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\"\n"
+    "         xmlns:dc=\"http://purl.org/dc/elements/1.1/\"\n"
+    "         xmlns:mq=\"http://musicbrainz.org/mm/mq-1.1#\"\n"
+    "         xmlns:mm=\"http://musicbrainz.org/mm/mm-2.1#\">\n"
+    "<mq:Result>\n"
+    "  <mq:status>OK</mq:status>\n"
+    "  <mm:");
+  sb_str(b, type);
+  sb_str(b, "List>\n  <rdf:Bag>\n");
+}
+
+static void rdf_list_item(mb_strbuf_t *b, const char *type, const unsigned char *id) {
+  sb_str(b, "  ");
+  sb_resource(b, "rdf:li", type, id);
+}
+
+static void rdf_list_end(mb_strbuf_t *b, const char *type) {
+  sb_str(b, "  </rdf:Bag>\n  </mm:");
+  sb_str(b, type);
+  sb_str(b, "List>\n</mq:Result>\n");
+}
+
+static void rdf_end(mb_strbuf_t *b) {
+  sb_str(b, "</rdf:RDF>\n");
+}
+
+static void rdf_relevance(mb_strbuf_t *b, int relevance) {
+  if (relevance >= 0) {
+    sb_str(b, "  <mq:relevance>");
+    sb_int(b, relevance);
+    sb_str(b, "</mq:relevance>\n");
+  }
+}
+
+static void rdf_artist(mb_strbuf_t *b, const mb_index_t *ix, uint32_t i, int with_albums, int relevance) {
+  const mb_index_artist_t *a = ix->artists + i;
+  uint32_t j, k;
+
+  sb_str(b, "<mm:Artist rdf:about=\"");
+  sb_url(b, "artist", a->id);
+  sb_str(b, "\">\n  <dc:title>");
+  sb_xml(b, index_str(ix, a->name));
+  sb_str(b, "</dc:title>\n  <mm:sortName>");
+  sb_xml(b, index_str(ix, a->sort_name));
+  sb_str(b, "</mm:sortName>\n");
+  rdf_relevance(b, relevance);
+
+  if (with_albums) {
+    sb_str(b, "  <mm:albumList>\n  <rdf:Bag>\n");
+    for (j = 0; j < a->num_albums && a->albums + j < ix->hdr->num_albums; j++)
+      if ((k = ix->artist_albums[a->albums + j]) < ix->hdr->num_albums)
+        rdf_list_item(b, "album", ix->albums[k].id);
+    sb_str(b, "  </rdf:Bag>\n  </mm:albumList>\n");
+  }
+
+  sb_str(b, "</mm:Artist>\n");
+}
+
+static void rdf_album(mb_strbuf_t *b, const mb_index_t *ix, uint32_t i, int relevance) {
+  const mb_index_album_t *l = ix->albums + i;
+  uint32_t j, k;
+
+  sb_str(b, "<mm:Album rdf:about=\"");
+  sb_url(b, "album", l->id);
+  sb_str(b, "\">\n  <dc:title>");
+  sb_xml(b, index_str(ix, l->name));
+  sb_str(b, "</dc:title>\n");
+  if (l->artist < ix->hdr->num_artists)
+    sb_resource(b, "dc:creator", "artist", ix->artists[l->artist].id);
+
+  if (*index_str(ix, l->type)) {
+    sb_str(b, "  <mm:releaseType rdf:resource=\"" MB_INDEX_NS "Type");
+    sb_xml(b, index_str(ix, l->type));
+    sb_str(b, "\"/>\n");
+  }
+  if (*index_str(ix, l->status)) {
+    sb_str(b, "  <mm:releaseStatus rdf:resource=\"" MB_INDEX_NS "Status");
+    sb_xml(b, index_str(ix, l->status));
+    sb_str(b, "\"/>\n");
+  }
+  rdf_relevance(b, relevance);
+
+  sb_str(b, "  <mm:trackList>\n  <rdf:Seq>\n");
+  for (j = 0; j < l->num_tracks && l->tracks + j < ix->hdr->num_tracks; j++)
+    if ((k = ix->album_tracks[l->tracks + j]) < ix->hdr->num_tracks)
+      rdf_list_item(b, "track", ix->tracks[k].id);
+  sb_str(b, "  </rdf:Seq>\n  </mm:trackList>\n</mm:Album>\n");
+}
+
+static void rdf_track(mb_strbuf_t *b, const mb_index_t *ix, uint32_t i, int relevance) {
+  const mb_index_track_t *t = ix->tracks + i;
+
+  sb_str(b, "<mm:Track rdf:about=\"");
+  sb_url(b, "track", t->id);
+  sb_str(b, "\">\n  <dc:title>");
+  sb_xml(b, index_str(ix, t->name));
+  sb_str(b, "</dc:title>\n");
+  if (t->artist < ix->hdr->num_artists)
+    sb_resource(b, "dc:creator", "artist", ix->artists[t->artist].id);
+  if (t->duration) {
+    sb_str(b, "  <mm:duration>");
+    sb_int(b, t->duration);
+    sb_str(b, "</mm:duration>\n");
+  }
+  rdf_relevance(b, relevance);
+  sb_str(b, "</mm:Track>\n");
+}
+
+/*
+ * Small set of table positions, so related artists and albums are only
+ * described once per result.
+ */
+typedef struct {
+  uint32_t items[128];
+  int num;
+} mb_index_seen_t;
+
+static int index_seen(mb_index_seen_t *s, uint32_t i) {
+  int j;
+
+  for (j = 0; j < s->num; j++)
+    if (s->items[j] == i)
+      return 1;
+  if (s->num < (int) (sizeof(s->items) / sizeof(s->items[0])))
+    s->items[s->num++] = i;
+
+  return 0;
+}
+
+/*
+ * Describe the artists and albums of a list of tracks.
+ */
+static void rdf_track_context(mb_strbuf_t *b, const mb_index_t *ix, const uint32_t *tracks, int num) {
+  mb_index_seen_t artists, albums;
+  uint32_t a;
+  int i;
+
+  artists.num = albums.num = 0;
+
+  for (i = 0; i < num; i++) {
+    a = ix->tracks[tracks[i]].album;
+    if (a < ix->hdr->num_albums && !index_seen(&albums, a))
+      rdf_album(b, ix, a, -1);
+  }
+
+  for (i = 0; i < num; i++) {
+    a = ix->tracks[tracks[i]].artist;
+    if (a < ix->hdr->num_artists && !index_seen(&artists, a))
+      rdf_artist(b, ix, a, 0, -1);
+  }
+}
+
+static int index_get_artist(const mb_index_t *ix, const unsigned char *id, int depth, mb_strbuf_t *b) {
+  const mb_index_artist_t *a;
+  uint32_t i, j, k;
+
+  if ((i = index_find(ix->artists, sizeof(mb_index_artist_t), ix->hdr->num_artists, id)) == MB_INDEX_NONE)
+    return 0;
+  a = ix->artists + i;
+
+  rdf_begin(b, "artist");
+  rdf_list_item(b, "artist", id);
+  rdf_list_end(b, "artist");
+  rdf_artist(b, ix, i, depth >= 2, -1);
+
+  if (depth >= 2)
+    for (j = 0; j < a->num_albums && a->albums + j < ix->hdr->num_albums; j++)
+      if ((k = ix->artist_albums[a->albums + j]) < ix->hdr->num_albums)
+        rdf_album(b, ix, k, -1);
+
+  rdf_end(b);
+  return 1;
+}
+
+static int index_get_album(const mb_index_t *ix, const unsigned char *id, mb_strbuf_t *b) {
+  const mb_index_album_t *l;
+  mb_index_seen_t artists;
+  uint32_t i, j, k;
+
+  if ((i = index_find(ix->albums, sizeof(mb_index_album_t), ix->hdr->num_albums, id)) == MB_INDEX_NONE)
+    return 0;
+  l = ix->albums + i;
+
+  rdf_begin(b, "album");
+  rdf_list_item(b, "album", id);
+  rdf_list_end(b, "album");
+  rdf_album(b, ix, i, -1);
+
+  artists.num = 0;
+  if (l->artist < ix->hdr->num_artists && !index_seen(&artists, l->artist))
+    rdf_artist(b, ix, l->artist, 0, -1);
+
+  for (j = 0; j < l->num_tracks && l->tracks + j < ix->hdr->num_tracks; j++) {
+    if ((k = ix->album_tracks[l->tracks + j]) >= ix->hdr->num_tracks)
+      continue;
+    rdf_track(b, ix, k, -1);
+    if (ix->tracks[k].artist < ix->hdr->num_artists && !index_seen(&artists, ix->tracks[k].artist))
+      rdf_artist(b, ix, ix->tracks[k].artist, 0, -1);
+  }
+
+  rdf_end(b);
+  return 1;
+}
+
+static int index_get_track(const mb_index_t *ix, const unsigned char *id, mb_strbuf_t *b) {
+  uint32_t i;
+
+  if ((i = index_find(ix->tracks, sizeof(mb_index_track_t), ix->hdr->num_tracks, id)) == MB_INDEX_NONE)
+    return 0;
+
+  rdf_begin(b, "track");
+  rdf_list_item(b, "track", id);
+  rdf_list_end(b, "track");
+  rdf_track(b, ix, i, -1);
+  rdf_track_context(b, ix, &i, 1);
+  rdf_end(b);
+
+  return 1;
+}
+
+static int index_trm_tracks(const mb_index_t *ix, const unsigned char *id, int max_items, mb_strbuf_t *b) {
+  uint32_t i, j, tracks[128];
+  int num = 0;
+
+  if ((i = index_find(ix->trms, sizeof(mb_index_trm_t), ix->hdr->num_trms, id)) == MB_INDEX_NONE)
+    return 0;
+
+  if (max_items < 1 || max_items > (int) (sizeof(tracks) / sizeof(tracks[0])))
+    max_items = sizeof(tracks) / sizeof(tracks[0]);
+  for (j = i; j < ix->hdr->num_trms && num < max_items && !memcmp(ix->trms[j].id, id, MB_MBID_LEN); j++)
+    if (ix->trms[j].track < ix->hdr->num_tracks)
+      tracks[num++] = ix->trms[j].track;
+  if (!num)
+    return 0;
+
+  rdf_begin(b, "track");
+  for (j = 0; j < (uint32_t) num; j++)
+    rdf_list_item(b, "track", ix->tracks[tracks[j]].id);
+  rdf_list_end(b, "track");
+  for (j = 0; j < (uint32_t) num; j++)
+    rdf_track(b, ix, tracks[j], -1);
+  rdf_track_context(b, ix, tracks, num);
+  rdf_end(b);
+
+  return 1;
+}
+
+/*
+ * Find artists, albums, or tracks by name, ranked by relevance (see
+ * index_search()).  Albums and tracks are followed by descriptions of
+ * their artists (and albums), like the server's results.  Returns 0
+ * if there are no results at least MB_INDEX_MIN_RELEVANCE relevant.
+ */
+static int index_find_names(const mb_index_t *ix, int kind, const char *name, int max_items, mb_strbuf_t *b) {
+  static const char *types[MB_INDEX_KINDS] = { "artist", "album", "track" };
+  mb_index_hit_t hits[MB_INDEX_HITS_MAX];
+  mb_index_seen_t artists;
+  uint32_t tracks[MB_INDEX_HITS_MAX], a;
+  int i, num;
+
+  if (max_items < 1 || max_items > MB_INDEX_HITS_MAX)
+    max_items = MB_INDEX_HITS_MAX;
+  num = index_search(ix, kind, name, hits, max_items);
+
+  /* a few shared trigrams isn't a match */
+  while (num > 0 && hits[num - 1].relevance < MB_INDEX_MIN_RELEVANCE)
+    num--;
+  if (!num)
+    return 0;
+
+  rdf_begin(b, types[kind]);
+  for (i = 0; i < num; i++)
+    rdf_list_item(b, types[kind], (kind == MB_INDEX_ARTIST) ? ix->artists[hits[i].rec].id :
+                                  (kind == MB_INDEX_ALBUM) ? ix->albums[hits[i].rec].id :
+                                  ix->tracks[hits[i].rec].id);
+  rdf_list_end(b, types[kind]);
+
+  switch (kind) {
+    case MB_INDEX_ARTIST:
+      for (i = 0; i < num; i++)
+        rdf_artist(b, ix, hits[i].rec, 0, hits[i].relevance);
+      break;
+    case MB_INDEX_ALBUM:
+      artists.num = 0;
+      for (i = 0; i < num; i++)
+        rdf_album(b, ix, hits[i].rec, hits[i].relevance);
+      for (i = 0; i < num; i++)
+        if ((a = ix->albums[hits[i].rec].artist) < ix->hdr->num_artists && !index_seen(&artists, a))
+          rdf_artist(b, ix, a, 0, -1);
+      break;
+    default:
+      for (i = 0; i < num; i++) {
+        rdf_track(b, ix, hits[i].rec, hits[i].relevance);
+        tracks[i] = hits[i].rec;
+      }
+      rdf_track_context(b, ix, tracks, num);
+  }
+
+  rdf_end(b);
+  return 1;
+}
+
+/*
+ * Answer a query from the index, if possible, by building the RDF
+ * result the server would have returned.  Returns 1 and fills b on
+ * success, or 0 if the query isn't supported or the index doesn't
+ * have the answer.
+ */
+static int index_query(const mb_index_t *ix, const char *query, int argc, char **argv, 
+                       int depth, int max_items, mb_strbuf_t *b) {
+  unsigned char id[MB_MBID_LEN];
+
+  if (argc < 1)
+    return 0;
+
+  if (!strcmp(query, MBQ_FindArtistByName))
+    return index_find_names(ix, MB_INDEX_ARTIST, argv[0], max_items, b);
+  if (!strcmp(query, MBQ_FindAlbumByName))
+    return index_find_names(ix, MB_INDEX_ALBUM, argv[0], max_items, b);
+  if (!strcmp(query, MBQ_FindTrackByName))
+    return index_find_names(ix, MB_INDEX_TRACK, argv[0], max_items, b);
+
+  if (!mbid_parse(argv[0], strlen(argv[0]), id))
+    return 0;
+
+  if (!strcmp(query, MBQ_GetArtistById))
+    return index_get_artist(ix, id, depth, b);
+  if (!strcmp(query, MBQ_GetAlbumById))
+    return index_get_album(ix, id, b);
+  if (!strcmp(query, MBQ_GetTrackById))
+    return index_get_track(ix, id, b);
+  if (!strcmp(query, MBQ_TrackInfoFromTRMId))
+    return index_trm_tracks(ix, id, max_items, b);
+
+  return 0;
+}
+
+/**************/
+/* Statistics */
+/**************/
+
+/*
+ * Call counters and latency histograms for native calls, kept for each
+ * MusicBrainz::Client and for the whole process (see
+ * MusicBrainz::Client#stats and MusicBrainz.stats).  Counters are
+ * updated with relaxed atomic adds, since TRM generation and MP3 scans
+ * also run on worker threads; reads are unsynchronized snapshots.
+ *
+ * Histograms use power-of-two buckets: bucket i counts values below
+ * 2**i (and at least 2**(i - 1)), and the last bucket also counts
+ * everything larger.  Latencies are in microseconds, RDF lengths in
+ * bytes.
+ */
+#define MB_STATS_BUCKETS  28
+
+/* most distinct query types counted (see MB_QUERY()) */
+#define MB_STATS_QUERIES  64
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define MB_STATS_ADD(v, n) __atomic_fetch_add(&(v), (n), __ATOMIC_RELAXED)
+#elif defined(__GNUC__)
+#define MB_STATS_ADD(v, n) __sync_fetch_and_add(&(v), (n))
+#else
+#define MB_STATS_ADD(v, n) ((v) += (n))
+#endif
+
+/* add to a counter in the process-wide and (if any) client stats */
+#define MB_STATS_COUNT(s, field, n) do {  \
+  MB_STATS_ADD(mb_stats.field, (n));      \
+  if (s)                                  \
+    MB_STATS_ADD((s)->field, (n));        \
+} while (0)
+
+/* timed operations */
+#define MB_STATS_QUERY    0
+#define MB_STATS_SELECT   1
+#define MB_STATS_RESULT   2
+#define MB_STATS_AUTH     3
+#define MB_STATS_TRM      4
+#define MB_STATS_MP3_INFO 5
+#define MB_STATS_OPS      6
+
+static const char *mb_stats_ops[MB_STATS_OPS] = {
+  "query", "select", "result", "auth", "trm", "mp3_info"
+};
+
+typedef struct {
+  uint64_t calls, errors, usecs;
+  uint64_t latency[MB_STATS_BUCKETS];
+} mb_stats_op_t;
+
+typedef struct {
+  mb_stats_op_t ops[MB_STATS_OPS];
+
+  /* query calls by type; the last entry counts unknown queries */
+  uint64_t queries[MB_STATS_QUERIES + 1];
+
+  /* queries answered from a local index */
+  uint64_t local_queries;
+
+  /* RDF received from the server, and result sizes (local or not) */
+  uint64_t bytes_received, rdf_bytes;
+  uint64_t rdf_len[MB_STATS_BUCKETS];
+
+  /* results cut off by the result buffer (see MB_RESULT_BUFSIZ) */
+  uint64_t result_truncated;
+
+  /* retried requests, and retries refused by a server's budget */
+  uint64_t retries, retries_denied;
+
+  /* DNS cache lookups (see server_addrs()): answered from the cache,
+   * sent to the resolver, resolver errors, expired addresses used
+   * because of an error, and background refreshes */
+  uint64_t dns_hits, dns_misses, dns_errors, dns_stale, dns_refreshes;
+
+  /* compressed responses received by the http transport, and their
+   * size once inflated */
+  uint64_t compressed_bytes, uncompressed_bytes;
+
+  /* conditional requests for cached responses, and how many of them
+   * the server said were current */
+  uint64_t revalidations, revalidation_hits;
+
+  /* PCM data passed to trm_GenerateSignature() */
+  uint64_t trm_bytes;
+} mb_stats_t;
+
+static mb_stats_t mb_stats;
+
+/* known query types, in definition order (filled in by MB_QUERY()) */
+static struct {
+  const char *name, *query;
+} mb_query_types[MB_STATS_QUERIES];
+static int mb_num_query_types;
+
+/*
+ * Current time, in nanoseconds, from a monotonic clock (if available).
+ */
+static uint64_t mb_now_ns(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif /* CLOCK_MONOTONIC */
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000000 + (uint64_t) tv.tv_usec * 1000;
+  }
+}
+
+static int stats_bucket(uint64_t v) {
+  int i;
+
+#ifdef __GNUC__
+  i = v ? 64 - __builtin_clzll(v) : 0;
+#else
+  for (i = 0; v; i++)
+    v >>= 1;
+#endif /* __GNUC__ */
+
+  return (i < MB_STATS_BUCKETS) ? i : MB_STATS_BUCKETS - 1;
+}
+
+/*
+ * Remember a query type, so query calls can be counted by name.
+ */
+static void stats_query_type(const char *prefix, const char *name, const char *query) {
+  if (strcmp(prefix, "MBQ") || mb_num_query_types >= MB_STATS_QUERIES)
+    return;
+
+  mb_query_types[mb_num_query_types].name = name;
+  mb_query_types[mb_num_query_types].query = query;
+  mb_num_query_types++;
+}
+
+/*
+ * Count a query call by type.
+ */
+static void stats_query(mb_stats_t *s, const char *query) {
+  int i;
+
+  for (i = 0; i < mb_num_query_types; i++)
+    if (!strcmp(mb_query_types[i].query, query))
+      break;
+  if (i == mb_num_query_types)
+    i = MB_STATS_QUERIES;
+
+  MB_STATS_COUNT(s, queries[i], 1);
+}
+
+/*
+ * Record a call to a timed operation which started at start (see
+ * mb_now_ns()).  Returns the finish time.
+ */
+static uint64_t stats_time(mb_stats_t *s, int op, uint64_t start, int ok) {
+  uint64_t finish = mb_now_ns(), usecs = (finish - start) / 1000;
+  int b = stats_bucket(usecs);
+
+  MB_STATS_COUNT(s, ops[op].calls, 1);
+  MB_STATS_COUNT(s, ops[op].usecs, usecs);
+  MB_STATS_COUNT(s, ops[op].latency[b], 1);
+  if (!ok)
+    MB_STATS_COUNT(s, ops[op].errors, 1);
+
+  return finish;
+}
+
+static VALUE stats_histogram(const uint64_t *counts) {
+  VALUE ret = rb_ary_new();
+  int i;
+
+  for (i = 0; i < MB_STATS_BUCKETS; i++)
+    rb_ary_push(ret, ULL2NUM(counts[i]));
+
+  return ret;
+}
+
+/*
+ * Convert statistics to a Ruby hash.
+ */
+static VALUE stats_hash(const mb_stats_t *s) {
+  VALUE ret, op, queries;
+  int i;
+
+  ret = rb_hash_new();
+  for (i = 0; i < MB_STATS_OPS; i++) {
+    op = rb_hash_new();
+    rb_hash_aset(op, rb_str_new2("calls"), ULL2NUM(s->ops[i].calls));
+    rb_hash_aset(op, rb_str_new2("errors"), ULL2NUM(s->ops[i].errors));
+    rb_hash_aset(op, rb_str_new2("seconds"), rb_float_new(s->ops[i].usecs / 1000000.0));
+    rb_hash_aset(op, rb_str_new2("latency"), stats_histogram(s->ops[i].latency));
+    rb_hash_aset(ret, rb_str_new2(mb_stats_ops[i]), op);
+  }
+
+  queries = rb_hash_new();
+  for (i = 0; i < mb_num_query_types; i++)
+    if (s->queries[i])
+      rb_hash_aset(queries, rb_str_new2(mb_query_types[i].name), ULL2NUM(s->queries[i]));
+  if (s->queries[MB_STATS_QUERIES])
+    rb_hash_aset(queries, rb_str_new2("other"), ULL2NUM(s->queries[MB_STATS_QUERIES]));
+  rb_hash_aset(ret, rb_str_new2("queries"), queries);
+
+  rb_hash_aset(ret, rb_str_new2("local_queries"), ULL2NUM(s->local_queries));
+  rb_hash_aset(ret, rb_str_new2("bytes_received"), ULL2NUM(s->bytes_received));
+  rb_hash_aset(ret, rb_str_new2("rdf_len"), stats_histogram(s->rdf_len));
+  rb_hash_aset(ret, rb_str_new2("result_truncated"), ULL2NUM(s->result_truncated));
+  rb_hash_aset(ret, rb_str_new2("retries"), ULL2NUM(s->retries));
+  rb_hash_aset(ret, rb_str_new2("retries_denied"), ULL2NUM(s->retries_denied));
+  rb_hash_aset(ret, rb_str_new2("dns_hits"), ULL2NUM(s->dns_hits));
+  rb_hash_aset(ret, rb_str_new2("dns_misses"), ULL2NUM(s->dns_misses));
+  rb_hash_aset(ret, rb_str_new2("dns_errors"), ULL2NUM(s->dns_errors));
+  rb_hash_aset(ret, rb_str_new2("dns_stale"), ULL2NUM(s->dns_stale));
+  rb_hash_aset(ret, rb_str_new2("dns_refreshes"), ULL2NUM(s->dns_refreshes));
+  rb_hash_aset(ret, rb_str_new2("compressed_bytes"), ULL2NUM(s->compressed_bytes));
+  rb_hash_aset(ret, rb_str_new2("uncompressed_bytes"), ULL2NUM(s->uncompressed_bytes));
+  rb_hash_aset(ret, rb_str_new2("revalidations"), ULL2NUM(s->revalidations));
+  rb_hash_aset(ret, rb_str_new2("revalidation_hits"), ULL2NUM(s->revalidation_hits));
+  rb_hash_aset(ret, rb_str_new2("trm_bytes"), ULL2NUM(s->trm_bytes));
+
+  return ret;
+}
+
+#ifdef __GNUC__
+static void sb_printf(mb_strbuf_t *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+#endif /* __GNUC__ */
+
+static void sb_printf(mb_strbuf_t *b, const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  if (len > 0)
+    sb_cat(b, buf, (len < (int) sizeof(buf)) ? (size_t) len : sizeof(buf) - 1);
+}
+
+/*
+ * Write a Prometheus histogram.  Bucket bounds are scaled by scale
+ * (eg microseconds to seconds).
+ */
+static void stats_prom_histogram(mb_strbuf_t *b, const char *name, const char *labels,
+                                 const uint64_t *counts, double scale, double sum) {
+  uint64_t total = 0;
+  int i;
+
+  for (i = 0; i < MB_STATS_BUCKETS - 1; i++) {
+    total += counts[i];
+    sb_printf(b, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, *labels ? "," : "",
+              (double) ((uint64_t) 1 << i) * scale, (unsigned long long) total);
+  }
+  total += counts[MB_STATS_BUCKETS - 1];
+  sb_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, *labels ? "," : "", (unsigned long long) total);
+  sb_printf(b, "%s_sum%s%s%s %.6f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", sum);
+  sb_printf(b, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", 
+            (unsigned long long) total);
+}
+
+/*
+ * Convert statistics to the Prometheus text exposition format.
+ */
+static VALUE stats_prometheus(const mb_stats_t *s) {
+  mb_strbuf_t b;
+  char labels[64];
+  VALUE ret;
+  int i;
+
+  memset(&b, 0, sizeof(b));
+
+  sb_str(&b, "# HELP musicbrainz_calls_total Native calls, by operation.\n"
+             "# TYPE musicbrainz_calls_total counter\n");
+  for (i = 0; i < MB_STATS_OPS; i++)
+    sb_printf(&b, "musicbrainz_calls_total{op=\"%s\"} %llu\n", mb_stats_ops[i], (unsigned long long) s->ops[i].calls);
+
+  sb_str(&b, "# HELP musicbrainz_errors_total Failed native calls, by operation.\n"
+             "# TYPE musicbrainz_errors_total counter\n");
+  for (i = 0; i < MB_STATS_OPS; i++)
+    sb_printf(&b, "musicbrainz_errors_total{op=\"%s\"} %llu\n", mb_stats_ops[i], (unsigned long long) s->ops[i].errors);
+
+  sb_str(&b, "# HELP musicbrainz_latency_seconds Native call latency, by operation.\n"
+             "# TYPE musicbrainz_latency_seconds histogram\n");
+  for (i = 0; i < MB_STATS_OPS; i++) {
+    snprintf(labels, sizeof(labels), "op=\"%s\"", mb_stats_ops[i]);
+    stats_prom_histogram(&b, "musicbrainz_latency_seconds", labels, s->ops[i].latency, 
+                         1e-6, s->ops[i].usecs / 1000000.0);
+  }
+
+  sb_str(&b, "# HELP musicbrainz_queries_total Queries, by type.\n"
+             "# TYPE musicbrainz_queries_total counter\n");
+  for (i = 0; i < mb_num_query_types; i++)
+    if (s->queries[i])
+      sb_printf(&b, "musicbrainz_queries_total{query=\"%s\"} %llu\n", mb_query_types[i].name, (unsigned long long) s->queries[i]);
+  if (s->queries[MB_STATS_QUERIES])
+    sb_printf(&b, "musicbrainz_queries_total{query=\"other\"} %llu\n", (unsigned long long) s->queries[MB_STATS_QUERIES]);
+
+  sb_printf(&b, "# HELP musicbrainz_local_queries_total Queries answered from a local index.\n"
+                "# TYPE musicbrainz_local_queries_total counter\n"
+                "musicbrainz_local_queries_total %llu\n", (unsigned long long) s->local_queries);
+  sb_printf(&b, "# HELP musicbrainz_received_bytes_total RDF received from the server.\n"
+                "# TYPE musicbrainz_received_bytes_total counter\n"
+                "musicbrainz_received_bytes_total %llu\n", (unsigned long long) s->bytes_received);
+  sb_printf(&b, "# HELP musicbrainz_result_truncated_total Results cut off by the result buffer.\n"
+                "# TYPE musicbrainz_result_truncated_total counter\n"
+                "musicbrainz_result_truncated_total %llu\n", (unsigned long long) s->result_truncated);
+  sb_printf(&b, "# HELP musicbrainz_retries_total Retried query requests.\n"
+                "# TYPE musicbrainz_retries_total counter\n"
+                "musicbrainz_retries_total %llu\n", (unsigned long long) s->retries);
+  sb_printf(&b, "# HELP musicbrainz_retries_denied_total Retries refused by a server's retry budget.\n"
+                "# TYPE musicbrainz_retries_denied_total counter\n"
+                "musicbrainz_retries_denied_total %llu\n", (unsigned long long) s->retries_denied);
+  sb_printf(&b, "# HELP musicbrainz_dns_lookups_total Host lookups by the http transport.\n"
+                "# TYPE musicbrainz_dns_lookups_total counter\n"
+                "musicbrainz_dns_lookups_total{result=\"hit\"} %llu\n"
+                "musicbrainz_dns_lookups_total{result=\"miss\"} %llu\n",
+                (unsigned long long) s->dns_hits, (unsigned long long) s->dns_misses);
+  sb_printf(&b, "# HELP musicbrainz_dns_errors_total Failed host lookups.\n"
+                "# TYPE musicbrainz_dns_errors_total counter\n"
+                "musicbrainz_dns_errors_total %llu\n", (unsigned long long) s->dns_errors);
+  sb_printf(&b, "# HELP musicbrainz_dns_stale_total Expired addresses used because a lookup failed.\n"
+                "# TYPE musicbrainz_dns_stale_total counter\n"
+                "musicbrainz_dns_stale_total %llu\n", (unsigned long long) s->dns_stale);
+  sb_printf(&b, "# HELP musicbrainz_dns_refreshes_total Background refreshes of cached addresses.\n"
+                "# TYPE musicbrainz_dns_refreshes_total counter\n"
+                "musicbrainz_dns_refreshes_total %llu\n", (unsigned long long) s->dns_refreshes);
+  sb_printf(&b, "# HELP musicbrainz_compressed_bytes_total Compressed responses received.\n"
+                "# TYPE musicbrainz_compressed_bytes_total counter\n"
+                "musicbrainz_compressed_bytes_total %llu\n", (unsigned long long) s->compressed_bytes);
+  sb_printf(&b, "# HELP musicbrainz_uncompressed_bytes_total Size of compressed responses once inflated.\n"
+                "# TYPE musicbrainz_uncompressed_bytes_total counter\n"
+                "musicbrainz_uncompressed_bytes_total %llu\n", (unsigned long long) s->uncompressed_bytes);
+  sb_printf(&b, "# HELP musicbrainz_revalidations_total Conditional requests for cached responses.\n"
+                "# TYPE musicbrainz_revalidations_total counter\n"
+                "musicbrainz_revalidations_total %llu\n", (unsigned long long) s->revalidations);
+  sb_printf(&b, "# HELP musicbrainz_revalidation_hits_total Cached responses the server said were current.\n"
+                "# TYPE musicbrainz_revalidation_hits_total counter\n"
+                "musicbrainz_revalidation_hits_total %llu\n", (unsigned long long) s->revalidation_hits);
+  sb_printf(&b, "# HELP musicbrainz_trm_bytes_total PCM data used for TRM signatures.\n"
+                "# TYPE musicbrainz_trm_bytes_total counter\n"
+                "musicbrainz_trm_bytes_total %llu\n", (unsigned long long) s->trm_bytes);
+
+  sb_str(&b, "# HELP musicbrainz_rdf_bytes Size of query results.\n"
+             "# TYPE musicbrainz_rdf_bytes histogram\n");
+  stats_prom_histogram(&b, "musicbrainz_rdf_bytes", "", s->rdf_len, 1, s->rdf_bytes);
+
+  if (b.err) {
+    free(b.ptr);
+    rb_raise(eErr, "couldn't allocate memory for statistics");
+  }
+
+  ret = rb_str_new(b.ptr, b.len);
+  free(b.ptr);
+
+  return ret;
+}
+
+/*
+ * Convert statistics to the requested format (a hash by default).
+ */
+static VALUE stats_format(const mb_stats_t *s, int argc, VALUE *argv) {
+  VALUE format;
+
+  rb_scan_args(argc, argv, "01", &format);
+  if (NIL_P(format))
+    return stats_hash(s);
+
+  format = rb_funcall(format, rb_intern("to_s"), 0);
+  if (!strcmp(RSTRING_PTR(format), "hash"))
+    return stats_hash(s);
+  if (!strcmp(RSTRING_PTR(format), "prometheus"))
+    return stats_prometheus(s);
+
+  rb_raise(eErr, "unknown statistics format: %s", RSTRING_PTR(format));
+  return Qnil;
+}
+
+/*
+ * Get process-wide statistics for native calls (all clients, plus TRM
+ * generation and MusicBrainz.mp3_info).  See MusicBrainz::Client#stats
+ * for the format.
+ *
+ * Examples:
+ *   # serve from a metrics endpoint
+ *   body = MusicBrainz.stats(:prometheus)
+ *
+ */
+static VALUE mb_stats_get(int argc, VALUE *argv, VALUE self) {
+  UNUSED(self);
+  return stats_format(&mb_stats, argc, argv);
+}
+
+/*
+ * Reset process-wide statistics.
+ */
+static VALUE mb_stats_reset(VALUE self) {
+  memset(&mb_stats, 0, sizeof(mb_stats));
+  return self;
+}
+
+/*******************/
+/* Instrumentation */
+/*******************/
+
+/*
+ * Subscribers (see MusicBrainz.subscribe) for each timed operation
+ * (MB_STATS_QUERY, etc).  mb_subscribed has a bit set for each
+ * operation with at least one subscriber, so call sites only pay for a
+ * single (predicted) branch when nobody is listening.
+ */
+#ifdef __GNUC__
+#define MB_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define MB_UNLIKELY(x) (x)
+#endif /* __GNUC__ */
+
+#define MB_EVENT_ON(op) MB_UNLIKELY(mb_subscribed & (1 << (op)))
+
+static VALUE mb_subscribers[MB_STATS_OPS];
+static unsigned int mb_subscribed;
+
+/*
+ * Send an event to the subscribers of an operation.  start and finish
+ * are from mb_now_ns().  bytes is the size of the result or input (or
+ * -1 if there isn't one).
+ */
+static void event_fire(int op, uint64_t start, uint64_t finish, VALUE query, VALUE args, long bytes, int ok) {
+  VALUE subs, ev;
+  long i;
+
+  ev = rb_struct_new(cEvent, ID2SYM(rb_intern(mb_stats_ops[op])), ULL2NUM(start),
+                     ULL2NUM(finish), query, NIL_P(args) ? rb_ary_new() : args,
+                     (bytes < 0) ? Qnil : LONG2NUM(bytes), ok ? Qtrue : Qfalse);
+
+  /* copy, in case a subscriber unsubscribes */
+  subs = rb_ary_dup(mb_subscribers[op]);
+  for (i = 0; i < RARRAY_LEN(subs); i++)
+    rb_funcall(rb_ary_entry(subs, i), rb_intern("call"), 1, ev);
+}
+
+/*
+ * Get the operation bit for an event name, or raise an exception.
+ */
+static unsigned int event_bit(VALUE name) {
+  int i;
+
+  name = rb_funcall(name, rb_intern("to_s"), 0);
+  for (i = 0; i < MB_STATS_OPS; i++)
+    if (!strcmp(RSTRING_PTR(name), mb_stats_ops[i]))
+      return 1 << i;
+
+  rb_raise(eErr, "unknown event: %s", RSTRING_PTR(name));
+  return 0;
+}
+
+static void event_update_mask(void) {
+  int i;
+
+  mb_subscribed = 0;
+  for (i = 0; i < MB_STATS_OPS; i++)
+    if (RARRAY_LEN(mb_subscribers[i]) > 0)
+      mb_subscribed |= 1 << i;
+}
+
+/*
+ * Call a block after every native call of the given kinds (:query,
+ * :select, :result, :auth, :trm, and :mp3_info; all of them if none
+ * are given).  The block is passed a MusicBrainz::Event.  Exceptions
+ * raised by the block propagate to the caller of the native method.
+ *
+ * Returns the block, which can be passed to MusicBrainz.unsubscribe.
+ * Without subscribers, the only cost is one branch per call.
+ *
+ * Examples:
+ *   sub = MusicBrainz.subscribe(:query, :result) do |ev|
+ *     puts "#{ev.name}: #{ev.duration * 1000} ms, #{ev.bytes} bytes"
+ *   end
+ *
+ *   MusicBrainz.unsubscribe(sub)
+ *
+ */
+static VALUE mb_subscribe(int argc, VALUE *argv, VALUE self) {
+  unsigned int mask = 0;
+  VALUE block;
+  int i;
+
+  UNUSED(self);
+  if (!rb_block_given_p())
+    rb_raise(eErr, "no block given");
+  block = rb_block_proc();
+
+  for (i = 0; i < argc; i++)
+    mask |= event_bit(argv[i]);
+  if (!argc)
+    mask = (1 << MB_STATS_OPS) - 1;
+
+  for (i = 0; i < MB_STATS_OPS; i++)
+    if (mask & (1 << i))
+      rb_ary_push(mb_subscribers[i], block);
+  event_update_mask();
+
+  return block;
+}
+
+/*
+ * Remove a subscriber added by MusicBrainz.subscribe.  Returns true if
+ * the subscriber was found.
+ *
+ * Examples:
+ *   MusicBrainz.unsubscribe(sub)
+ *
+ */
+static VALUE mb_unsubscribe(VALUE self, VALUE block) {
+  VALUE ret = Qfalse;
+  int i;
+
+  UNUSED(self);
+  for (i = 0; i < MB_STATS_OPS; i++)
+    if (!NIL_P(rb_ary_delete(mb_subscribers[i], block)))
+      ret = Qtrue;
+  event_update_mask();
+
+  return ret;
+}
+
+/*
+ * Time between the start and finish of the call, in seconds.
+ */
+static VALUE mb_event_duration(VALUE self) {
+  uint64_t start = NUM2ULL(rb_struct_aref(self, INT2FIX(1))),
+           finish = NUM2ULL(rb_struct_aref(self, INT2FIX(2)));
+  return rb_float_new((finish - start) / 1e9);
+}
+
+/*
+ * Document-class: MusicBrainz::Client
+ *
+ * Client query interface to the MusicBrainz music library.  The
+ * easiest way to explain the code is probably with a simple example.
+ *
+ *   # load the musicbrainz library
+ *   require 'musicbrainz'
+ *
+ *   # create a musicbrainz client handle
+ *   mb = MusicBrainz::Client.new
+ *
+ *   # create a musicbrainz client handle
+ *   mb = MusicBrainz::Client.new
+ *
+ *   # search for albums named "mirror conspiracy"
+ *   album_name = 'Mirror Conspiracy'
+ *   query_ok = mb.query(MusicBrainz::Query::FindAlbumByName, album_name)
+ *
+ *   # if there weren't any errors, then print the number of matching albums
+ *   if query_ok
+ *     num_albums = mb.result(MusicBrainz::Query::GetNumAlbums).to_i
+ *     puts "Number of Results: #{num_albums}"
+ *   end
+ *
+ */
+
+/*******************************/
+/* MusicBrainz::Client methods */
+/*******************************/
+struct mb_transport_vt;
+
+/*
+ * Servers (see MusicBrainz::Client#servers=).  Servers are shared by
+ * every client in the process that uses them, so latency and health
+ * learned by one client benefit the rest; clients hold references, and
+ * a server is freed with the last one.  Requests update servers
+ * without the interpreter lock, so everything but the host and port is
+ * guarded by mb_servers_lock.
+ *
+ * Each server keeps its recent latencies in nanoseconds: an
+ * exponentially weighted moving average (0 until the first response),
+ * and a ring of the last MB_SERVER_SAMPLES responses, for percentiles.
+ *
+ * Health is tracked passively, from the outcome of requests.  After
+ * MB_BREAKER_FAILURES consecutive failures, or once the error rate
+ * (another moving average) reaches MB_BREAKER_ERROR_RATE, the
+ * server's circuit breaker opens and it gets no requests for
+ * MB_BREAKER_OPEN ns, doubling each time it trips again (up to
+ * MB_BREAKER_OPEN_MAX).  Then it's half open: a single probe request
+ * is let through, and closes the breaker if it succeeds or reopens it
+ * if it fails.
+ */
+#define MB_MAX_SERVERS        16
+#define MB_SERVER_SAMPLES     64
+
+/* EWMA weight of each new sample: 1/8, as in TCP's smoothed RTT */
+#define MB_SERVER_EWMA_SHIFT  3
+
+/* latency charged for a failed request, unless it took longer */
+#define MB_SERVER_PENALTY     1000000000ULL
+
+/* samples needed before hedging on a server's percentile */
+#define MB_HEDGE_MIN_SAMPLES  8
+
+/* default hedging percentile */
+#define MB_HEDGE_PERCENTILE   95
+
+/* circuit breaker settings (see above) */
+#define MB_BREAKER_FAILURES   5
+#define MB_BREAKER_ERROR_RATE 0.5
+#define MB_BREAKER_MIN_REQS   20
+#define MB_BREAKER_RATE_ALPHA 0.1
+#define MB_BREAKER_OPEN       2000000000ULL
+#define MB_BREAKER_OPEN_MAX   60000000000ULL
+
+/* circuit breaker states */
+#define MB_BREAKER_CLOSED     0
+#define MB_BREAKER_OPEN_STATE 1
+#define MB_BREAKER_HALF_OPEN  2
+
+/* request outcomes (see server_release()) */
+#define MB_OUTCOME_OK         0
+#define MB_OUTCOME_ERROR      1
+#define MB_OUTCOME_TIMEOUT    2
+#define MB_OUTCOME_ABANDONED  3
+
+/* most retries a server's budget can save up */
+#define MB_RETRY_TOKENS       10
+
+/* default retry policy (see MusicBrainz::Client#retries=) */
+#define MB_RETRY_BACKOFF      50000000ULL
+#define MB_RETRY_MAX_BACKOFF  2000000000ULL
+#define MB_RETRY_BUDGET       0.1
+
+/* balancing policies (see MusicBrainz::Client#balance=) */
+#define MB_BALANCE_LATENCY      0
+#define MB_BALANCE_ROUND_ROBIN  1
+#define MB_BALANCE_LEAST_OUTSTANDING 2
+
+/* default DNS cache TTL (see MusicBrainz.dns_ttl=) */
+#define MB_DNS_TTL            60000000000ULL
+
+/* longest DNS cache TTL, in seconds (see MusicBrainz.dns_ttl=) */
+#define MB_DNS_MAX_TTL        31536000
+
+/* how often a request waiting on the resolver checks on it, in ns */
+#define MB_DNS_POLL           5000000ULL
+
+/* most addresses pinned for a host (see MusicBrainz.resolve) */
+#define MB_DNS_MAX_ADDRS      16
+
+/* most background refreshes running before prefetches are skipped
+ * (see server_prefetch()) */
+#define MB_DNS_MAX_PREFETCH   8
+
+/*
+ * Resolved addresses of a server or proxy.  Shared by the server's
+ * DNS cache entry and the connections using them, so a refresh can
+ * replace the entry while a connection is still working through the
+ * old one; references are guarded by mb_servers_lock.
+ */
+typedef struct {
+  int family, socktype, protocol;
+  socklen_t len;
+  struct sockaddr_storage addr;
+} mb_addr_t;
+
+typedef struct {
+  long refs;
+  int num;
+  mb_addr_t addrs[1];
+} mb_addrs_t;
+
+typedef struct mb_server_t {
+  struct mb_server_t *next;
+  long refs;
+
+  char host[MB_HOST_BUFSIZ];
+  int port;
+
+  /* latency */
+  uint64_t ewma, samples[MB_SERVER_SAMPLES];
+  int num_samples, next_sample;
+
+  /* health and circuit breaker */
+  int outstanding, failures, state, probing, trips;
+  double error_rate;
+  uint64_t open_until;
+
+  /* retry budget (see server_budget()) */
+  double retry_tokens;
+
+  /* DNS cache (see server_addrs()): the addresses (NULL until
+   * resolved) and when they expire, whether a background refresh is
+   * running, and whether the addresses were pinned with
+   * MusicBrainz.resolve; how many refreshes have finished, and the
+   * error from the last one (0 if it worked) */
+  mb_addrs_t *addrs;
+  uint64_t expires;
+  int resolving, pinned;
+  unsigned resolved;
+  int resolve_err;
+
+  uint64_t requests, errors, timeouts, hedges, wins, opened;
+} mb_server_t;
+
+static mb_server_t *mb_servers = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t mb_servers_lock = PTHREAD_MUTEX_INITIALIZER;
+#define MB_SERVERS_LOCK() pthread_mutex_lock(&mb_servers_lock)
+#define MB_SERVERS_UNLOCK() pthread_mutex_unlock(&mb_servers_lock)
+#else /* !HAVE_PTHREAD_H */
+#define MB_SERVERS_LOCK()
+#define MB_SERVERS_UNLOCK()
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ * Get a reference to a server, creating it if necessary.  Returns NULL
+ * if out of memory.
+ */
+static mb_server_t *server_get(const char *host, int port) {
+  mb_server_t *s;
+
+  MB_SERVERS_LOCK();
+  for (s = mb_servers; s; s = s->next)
+    if (s->port == port && !strcmp(s->host, host))
+      break;
+
+  if (!s && (s = calloc(1, sizeof(mb_server_t))) != NULL) {
+    snprintf(s->host, sizeof(s->host), "%s", host);
+    s->port = port;
+    s->retry_tokens = MB_RETRY_TOKENS;
+    s->next = mb_servers;
+    mb_servers = s;
+  }
+
+  if (s)
+    s->refs++;
+  MB_SERVERS_UNLOCK();
+
+  return s;
+}
+
+/*
+ * Drop a reference to a set of addresses.  Called with the lock held.
+ */
+static void addrs_unref(mb_addrs_t *a) {
+  if (a && --a->refs == 0)
+    free(a);
+}
+
+/*
+ * Drop a reference to a set of addresses.
+ */
+static void addrs_put(mb_addrs_t *a) {
+  MB_SERVERS_LOCK();
+  addrs_unref(a);
+  MB_SERVERS_UNLOCK();
+}
+
+/*
+ * Drop a reference to a server.
+ */
+static void server_put(mb_server_t *s) {
+  mb_server_t **p;
+
+  MB_SERVERS_LOCK();
+  if (--s->refs == 0) {
+    for (p = &mb_servers; *p != s; p = &((*p)->next))
+      ;
+    *p = s->next;
+    addrs_unref(s->addrs);
+    free(s);
+  }
+  MB_SERVERS_UNLOCK();
+}
+
+/*
+ * DNS cache.  Each server (or proxy) keeps the addresses its host
+ * last resolved to for mb_dns_ttl ns, so requests don't wait for the
+ * resolver.  Once three quarters of the TTL have passed, the next
+ * request starts a background refresh (if threads are available) and
+ * carries on with the cached addresses; if they expire anyway, the
+ * request starts a refresh (or joins the one running) and waits for
+ * it (see server_resolved()).  If the resolver fails, the expired
+ * addresses are used until it recovers.  Pinned addresses (see
+ * MusicBrainz.resolve) never expire.
+ */
+static uint64_t mb_dns_ttl = MB_DNS_TTL;
+
+/* background refreshes running (guarded by mb_servers_lock) */
+static int mb_dns_refreshing = 0;
+
+/*
+ * Resolve a host, without the lock.  Returns a new reference, or NULL
+ * (with a getaddrinfo() error code in err).
+ */
+static mb_addrs_t *addrs_resolve(const char *host, int port, int *err) {
+  struct addrinfo hints, *res, *ai;
+  mb_addrs_t *a;
+  mb_addr_t *e;
+  char buf[16];
+  int num;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(buf, sizeof(buf), "%d", port);
+
+  if ((*err = getaddrinfo(host, buf, &hints, &res)) != 0)
+    return NULL;
+
+  for (num = 0, ai = res; ai; ai = ai->ai_next)
+    num++;
+  if ((a = malloc(sizeof(mb_addrs_t) + num * sizeof(mb_addr_t))) == NULL) {
+    freeaddrinfo(res);
+    *err = EAI_MEMORY;
+    return NULL;
+  }
+
+  a->refs = 1;
+  a->num = 0;
+  for (ai = res; ai; ai = ai->ai_next) {
+    if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+      continue;
+    e = a->addrs + a->num++;
+    e->family = ai->ai_family;
+    e->socktype = ai->ai_socktype;
+    e->protocol = ai->ai_protocol;
+    e->len = ai->ai_addrlen;
+    memcpy(&(e->addr), ai->ai_addr, ai->ai_addrlen);
+  }
+  freeaddrinfo(res);
+
+  return a;
+}
+
+/*
+ * Replace a server's cached addresses with a new reference (which it
+ * takes over).  Called with the lock held.
+ */
+static void server_set_addrs(mb_server_t *s, mb_addrs_t *a, uint64_t now) {
+  addrs_unref(s->addrs);
+  s->addrs = a;
+  s->expires = now + mb_dns_ttl;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *server_refresh_run(void *ptr) {
+  mb_server_t *s = ptr;
+  mb_addrs_t *a;
+  int err;
+
+  a = addrs_resolve(s->host, s->port, &err);
+
+  MB_SERVERS_LOCK();
+  if (a && !s->pinned)
+    server_set_addrs(s, a, mb_now_ns());
+  else
+    addrs_unref(a);
+  s->resolve_err = a ? 0 : err;
+  s->resolved++;
+  s->resolving = 0;
+  mb_dns_refreshing--;
+  MB_SERVERS_UNLOCK();
+
+  MB_STATS_ADD(mb_stats.dns_refreshes, 1);
+  if (!a)
+    MB_STATS_ADD(mb_stats.dns_errors, 1);
+
+  server_put(s);
+  return NULL;
+}
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ * Resolve a server's host in a background thread (holding a reference
+ * to the server), unless that's already happening or the addresses
+ * are pinned; if max is set, also unless max refreshes are already
+ * running.  Returns 1 if a refresh is running, or 0 if not (always
+ * without threads).  Called without the lock.
+ */
+static int server_refresh(mb_server_t *s, int max) {
+#ifdef HAVE_PTHREAD_H
+  pthread_attr_t attr;
+  pthread_t tid;
+  int start, running;
+
+  MB_SERVERS_LOCK();
+  running = !s->pinned && (s->resolving || !max || mb_dns_refreshing < max);
+  if ((start = running && !s->resolving) != 0) {
+    s->resolving = 1;
+    s->refs++;
+    mb_dns_refreshing++;
+  }
+  MB_SERVERS_UNLOCK();
+  if (!start)
+    return running;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, server_refresh_run, s)) {
+    MB_SERVERS_LOCK();
+    s->resolving = 0;
+    mb_dns_refreshing--;
+    MB_SERVERS_UNLOCK();
+    server_put(s);
+    running = 0;
+  }
+  pthread_attr_destroy(&attr);
+
+  return running;
+#else /* !HAVE_PTHREAD_H */
+  UNUSED(s);
+  UNUSED(max);
+  return 0;
+#endif /* HAVE_PTHREAD_H */
+}
+
+/*
+ * Start resolving a server that hasn't been resolved yet, so its
+ * first request doesn't have to wait.  Skipped if too many refreshes
+ * are already running; the first request resolves it instead.
+ */
+static void server_prefetch(mb_server_t *s) {
+  int empty;
+
+  MB_SERVERS_LOCK();
+  empty = (s->addrs == NULL);
+  MB_SERVERS_UNLOCK();
+
+  if (empty)
+    server_refresh(s, MB_DNS_MAX_PREFETCH);
+}
+
+/*
+ * Get a reference to a server's addresses once the refresh that
+ * server_addrs() was waiting on (the gen-th) has finished.  Returns
+ * NULL with err set to 0 until then, or with a getaddrinfo() error
+ * code if the host couldn't be resolved and nothing is cached.  If
+ * the resolver failed, the expired addresses are used.
+ */
+static mb_addrs_t *server_resolved(mb_server_t *s, mb_stats_t *stats, unsigned gen, int *err) {
+  mb_addrs_t *a;
+  int failed;
+
+  MB_SERVERS_LOCK();
+  if (s->resolved == gen) {
+    MB_SERVERS_UNLOCK();
+    *err = 0;
+    return NULL;
+  }
+
+  failed = s->resolve_err && !s->pinned;
+  if ((a = s->addrs) != NULL)
+    a->refs++;
+  else
+    *err = s->resolve_err ? s->resolve_err : EAI_FAIL;
+  MB_SERVERS_UNLOCK();
+
+  /* the refresh counted the error in the process-wide stats */
+  if (failed) {
+    if (stats)
+      MB_STATS_ADD(stats->dns_errors, 1);
+    if (a)
+      MB_STATS_COUNT(stats, dns_stale, 1);
+  }
+
+  return a;
+}
+
+/*
+ * Get a reference to a server's addresses, from the cache if
+ * possible.  If they have to be resolved, starts a background refresh
+ * (or joins the one running) and returns NULL with err set to 0; pass
+ * gen to server_resolved() until it's done, so the caller can keep
+ * polling for cancellation and timeouts meanwhile.  Without threads,
+ * it resolves them itself, so it's called without the interpreter
+ * lock (and without the servers lock).  Returns NULL (with a
+ * getaddrinfo() error code in err) if the host couldn't be resolved
+ * and nothing is cached.
+ */
+static mb_addrs_t *server_addrs(mb_server_t *s, mb_stats_t *stats, int *err, unsigned *gen) {
+  mb_addrs_t *a, *fresh;
+  uint64_t now = mb_now_ns();
+  int refresh = 0;
+
+  *err = 0;
+  MB_SERVERS_LOCK();
+  if ((a = s->addrs) != NULL && (s->pinned || now < s->expires)) {
+    a->refs++;
+    refresh = !s->pinned && !s->resolving && now + mb_dns_ttl / 4 >= s->expires;
+    MB_SERVERS_UNLOCK();
+
+    MB_STATS_COUNT(stats, dns_hits, 1);
+    if (refresh)
+      server_refresh(s, 0);
+    return a;
+  }
+  *gen = s->resolved;
+  MB_SERVERS_UNLOCK();
+
+  MB_STATS_COUNT(stats, dns_misses, 1);
+  if (server_refresh(s, 0))
+    return NULL;
+
+  /* no threads: resolve it here */
+  fresh = addrs_resolve(s->host, s->port, err);
+  if (!fresh)
+    MB_STATS_ADD(mb_stats.dns_errors, 1);
+
+  MB_SERVERS_LOCK();
+  if (fresh && !s->pinned)
+    server_set_addrs(s, fresh, mb_now_ns());
+  else
+    addrs_unref(fresh);
+  s->resolve_err = fresh ? 0 : *err;
+  s->resolved++;
+  MB_SERVERS_UNLOCK();
+
+  return server_resolved(s, stats, *gen, err);
+}
+
+/*
+ * Expire a server's cached addresses, if they're still the ones given,
+ * so the next request resolves the host again.
+ */
+static void server_expire(mb_server_t *s, mb_addrs_t *a) {
+  MB_SERVERS_LOCK();
+  if (s->addrs == a && !s->pinned)
+    s->expires = 0;
+  MB_SERVERS_UNLOCK();
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Keep the servers lock usable in a child process forked while a
+ * refresh thread held it; refreshes in flight don't survive the fork.
+ */
+static void servers_atfork_prepare(void) {
+  MB_SERVERS_LOCK();
+}
+
+static void servers_atfork_parent(void) {
+  MB_SERVERS_UNLOCK();
+}
+
+static void servers_atfork_child(void) {
+  mb_server_t *s;
+
+  for (s = mb_servers; s; s = s->next)
+    s->resolving = 0;
+  MB_SERVERS_UNLOCK();
+}
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ * Record a server's latency for a request.  Called with the lock held.
+ */
+static void server_sample(mb_server_t *s, uint64_t ns) {
+  s->samples[s->next_sample] = ns;
+  s->next_sample = (s->next_sample + 1) % MB_SERVER_SAMPLES;
+  if (s->num_samples < MB_SERVER_SAMPLES)
+    s->num_samples++;
+
+  if (s->ewma)
+    s->ewma += ((int64_t) ns - (int64_t) s->ewma) / (1 << MB_SERVER_EWMA_SHIFT);
+  else
+    s->ewma = ns;
+}
+
+/*
+ * Get the given percentile of a server's recent latencies, or 0 if
+ * there aren't enough samples to tell.
+ */
+static uint64_t server_percentile(mb_server_t *s, int pct) {
+  uint64_t v[MB_SERVER_SAMPLES];
+  int i, n;
+
+  MB_SERVERS_LOCK();
+  n = s->num_samples;
+  memcpy(v, s->samples, n * sizeof(uint64_t));
+  MB_SERVERS_UNLOCK();
+
+  if (n < MB_HEDGE_MIN_SAMPLES)
+    return 0;
+
+  qsort(v, n, sizeof(uint64_t), cmp_u64);
+  i = (n * pct + 99) / 100 - 1;
+
+  return v[(i < 0) ? 0 : i];
+}
+
+/*
+ * Can a server take a request?  Called with the lock held.
+ */
+static int server_available(const mb_server_t *s, uint64_t now) {
+  switch (s->state) {
+  case MB_BREAKER_OPEN_STATE:
+    return now >= s->open_until;
+  case MB_BREAKER_HALF_OPEN:
+    return !s->probing;
+  default:
+    return 1;
+  }
+}
+
+/*
+ * Should server b be tried before server a?  Servers without samples
+ * come first, then the lowest average latency.  Called with the lock
+ * held.
+ */
+static int server_slower(const mb_server_t *a, const mb_server_t *b) {
+  if (!a->num_samples || !b->num_samples)
+    return !b->num_samples && a->num_samples;
+  return b->ewma < a->ewma;
+}
+
+/*
+ * Start a request to a server.  Returns 0 if the server's circuit
+ * breaker is open (or it's half open, and already being probed).  Sets
+ * probe if the request is the one probing a half open breaker; only
+ * its outcome closes or reopens the breaker (see server_release()).
+ */
+static int server_acquire(mb_server_t *s, int hedge, int *probe) {
+  uint64_t now = mb_now_ns();
+  int ok;
+
+  *probe = 0;
+
+  MB_SERVERS_LOCK();
+  if ((ok = server_available(s, now)) != 0) {
+    if (s->state == MB_BREAKER_OPEN_STATE)
+      s->state = MB_BREAKER_HALF_OPEN;
+    if (s->state == MB_BREAKER_HALF_OPEN)
+      s->probing = *probe = 1;
+
+    s->outstanding++;
+    s->requests++;
+    if (hedge)
+      s->hedges++;
+  }
+  MB_SERVERS_UNLOCK();
+
+  return ok;
+}
+
+/*
+ * Open a server's circuit breaker.  Called with the lock held.
+ */
+static void server_trip(mb_server_t *s, uint64_t now) {
+  uint64_t open = MB_BREAKER_OPEN << ((s->trips < 5) ? s->trips : 5);
+
+  s->state = MB_BREAKER_OPEN_STATE;
+  s->open_until = now + ((open < MB_BREAKER_OPEN_MAX) ? open : MB_BREAKER_OPEN_MAX);
+  s->trips++;
+  s->opened++;
+}
+
+/*
+ * Finish a request to a server: track its latency, and its health.
+ * Abandoned requests (the query was answered by another server,
+ * cancelled, or ran out of time) don't count against the server, but
+ * did take at least elapsed ns.  won is set if the request was a hedge
+ * and answered first, and probe if it was probing a half open breaker
+ * (see server_acquire()); requests started before the breaker opened
+ * can still finish while it's open or half open, but don't move it.
+ */
+static void server_release(mb_server_t *s, int outcome, uint64_t elapsed, int won, int probe) {
+  uint64_t now = mb_now_ns();
+
+  MB_SERVERS_LOCK();
+  s->outstanding--;
+  if (probe)
+    s->probing = 0;
+
+  switch (outcome) {
+  case MB_OUTCOME_OK:
+    server_sample(s, elapsed);
+    s->wins += won;
+    s->failures = 0;
+    s->error_rate -= MB_BREAKER_RATE_ALPHA * s->error_rate;
+    if (probe) {
+      /* start over, so the old errors don't trip it again */
+      s->state = MB_BREAKER_CLOSED;
+      s->trips = 0;
+      s->error_rate = 0;
+    }
+    break;
+  case MB_OUTCOME_ERROR:
+  case MB_OUTCOME_TIMEOUT:
+    /* don't let a failing server look fast */
+    server_sample(s, (elapsed > MB_SERVER_PENALTY) ? elapsed : MB_SERVER_PENALTY);
+    s->errors++;
+    s->timeouts += (outcome == MB_OUTCOME_TIMEOUT);
+    s->failures++;
+    s->error_rate += MB_BREAKER_RATE_ALPHA * (1 - s->error_rate);
+
+    if (probe ||
+        (s->state == MB_BREAKER_CLOSED &&
+         (s->failures >= MB_BREAKER_FAILURES ||
+          (s->requests >= MB_BREAKER_MIN_REQS && s->error_rate >= MB_BREAKER_ERROR_RATE))))
+      server_trip(s, now);
+    break;
+  default:
+    if (elapsed > s->ewma)
+      server_sample(s, elapsed);
+  }
+  MB_SERVERS_UNLOCK();
+}
+
+/*
+ * Cached responses, for conditional revalidation (see
+ * MusicBrainz::Client#revalidate=).  Entries are keyed by the expanded
+ * request (see client_expand()), and keep the body and the validators
+ * (ETag and Last-Modified) the server sent with it.  gen is the
+ * client's rdf_gen once the body was loaded, so a 304 for the response
+ * that's still loaded can skip parsing it again.
+ */
+#define MB_CACHE_VALIDATOR    128
+
+/* default and most entries, and default size in bytes (see
+ * MusicBrainz::Client#revalidate=) */
+#define MB_CACHE_ENTRIES      64
+#define MB_CACHE_MAX_ENTRIES  65536
+#define MB_CACHE_BYTES        (16 << 20)
+
+typedef struct mb_cache_entry_t {
+  struct mb_cache_entry_t *next;
+  uint64_t hash, gen;
+  char *key, *body;
+  size_t key_len, body_len;
+  char etag[MB_CACHE_VALIDATOR], modified[MB_CACHE_VALIDATOR];
+} mb_cache_entry_t;
+
+/*
+ * Client state: the library handle, plus the settings and local index
+ * (see MusicBrainz::Client#index=) used to answer queries without a
+ * server round trip, and the transport (see
+ * MusicBrainz::Client#transport=) used for everything else.  The
+ * servers and proxy (NULL for none) are kept for transports, as
+ * registry entries; the first server is the one the library uses.  Each
+ * server has a weight, and a current weight for round-robin balancing
+ * (see client_balance()).  Timeouts and the deadline are in nanoseconds
+ * (the deadline is on the mb_now_ns() clock), and 0 means none.  The
+ * wake pipe interrupts requests (see client_wake()).  The retry policy
+ * is described in client_retry(); retry_attempts counts the first
+ * attempt, so 1 means no retries.  The response cache is a list, most
+ * recently used first, of at most cache_max entries (0 disables it)
+ * and cache_max_size bytes (see cache_entry_size());
+ * rdf_gen counts results loaded into the library handle.
+ */
+typedef struct {
+  musicbrainz_t mb;
+  int depth, max_items;
+  VALUE index;
+  mb_stats_t stats;
+  mb_server_t *servers[MB_MAX_SERVERS];
+  int weights[MB_MAX_SERVERS], current[MB_MAX_SERVERS];
+  int num_servers, hedge, balance, compress;
+  mb_server_t *proxy;
+  const struct mb_transport_vt *transport;
+  void *transport_data;
+  char error[MB_ERR_BUFSIZ];
+  uint64_t connect_timeout, read_timeout, timeout, deadline;
+  volatile int cancel, interrupted;
+  int wake[2];
+  int retry_attempts;
+  uint64_t retry_backoff, retry_max_backoff, rng;
+  double retry_budget;
+  mb_cache_entry_t *cache;
+  int cache_len, cache_max;
+  size_t cache_size, cache_max_size;
+  uint64_t rdf_gen;
+} mb_client_t;
+
+/* library defaults for depth and max_items */
+#define MB_CLIENT_DEPTH       2
+#define MB_CLIENT_MAX_ITEMS   25
+#define MB_CLIENT_HOST        "www.musicbrainz.org"
+
+static void client_mark(void *ptr) {
+  mb_client_t *mb = ptr;
+  rb_gc_mark(mb->index);
+}
+
+static void transport_free(mb_client_t *mb);
+static void client_prefetch(mb_client_t *mb);
+
+/*
+ * Replace the client's servers with new references (which it takes
+ * over).
+ */
+static void client_set_servers(mb_client_t *mb, mb_server_t **servers, const int *weights, int num) {
+  int i;
+
+  for (i = 0; i < mb->num_servers; i++)
+    server_put(mb->servers[i]);
+
+  memcpy(mb->servers, servers, num * sizeof(mb_server_t*));
+  memcpy(mb->weights, weights, num * sizeof(int));
+  memset(mb->current, 0, sizeof(mb->current));
+  mb->num_servers = num;
+}
+
+/*
+ * Memory used by a cached response.
+ */
+static size_t cache_entry_size(const mb_cache_entry_t *e) {
+  return sizeof(mb_cache_entry_t) + e->key_len + e->body_len;
+}
+
+static void cache_entry_free(mb_cache_entry_t *e) {
+  free(e->key);
+  free(e->body);
+  free(e);
+}
+
+/*
+ * Free the client's least recently used responses, so at most keep
+ * are left, using at most max_size bytes.
+ */
+static void cache_trim(mb_client_t *mb, int keep, size_t max_size) {
+  mb_cache_entry_t **p, *e;
+  size_t size = 0;
+  int i;
+
+  for (i = 0, p = &(mb->cache); *p && i < keep; i++) {
+    if (size + cache_entry_size(*p) > max_size)
+      break;
+    size += cache_entry_size(*p);
+    p = &((*p)->next);
+  }
+
+  while ((e = *p) != NULL) {
+    *p = e->next;
+    cache_entry_free(e);
+    mb->cache_len--;
+  }
+  mb->cache_size = size;
+}
+
+/* FNV-1a */
+static uint64_t cache_hash(const char *key, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char) key[i]) * 1099511628211ULL;
+
+  return h;
+}
+
+/*
+ * Find a cached response, and make it the most recently used.
+ */
+static mb_cache_entry_t *cache_find(mb_client_t *mb, const char *key, size_t len) {
+  mb_cache_entry_t **p, *e;
+  uint64_t h = cache_hash(key, len);
+
+  for (p = &(mb->cache); (e = *p) != NULL; p = &(e->next)) {
+    if (e->hash == h && e->key_len == len && !memcmp(e->key, key, len)) {
+      *p = e->next;
+      e->next = mb->cache;
+      mb->cache = e;
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+static void client_free(void *ptr) {
+  mb_client_t *mb = ptr;
+
+  transport_free(mb);
+  cache_trim(mb, 0, 0);
+  client_set_servers(mb, NULL, NULL, 0);
+  if (mb->proxy)
+    server_put(mb->proxy);
+  if (mb->wake[0] >= 0) {
+    close(mb->wake[0]);
+    close(mb->wake[1]);
+  }
+  if (mb->mb)
+    mb_Delete(mb->mb);
+  free(mb);
+}
+
+static VALUE mb_client_alloc(VALUE klass) {
+  mb_client_t *mb;
+
+  if ((mb = malloc(sizeof(mb_client_t))) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for Client structure");
+  memset(mb, 0, sizeof(mb_client_t));
+  if ((mb->servers[0] = server_get(MB_CLIENT_HOST, 80)) == NULL) {
+    free(mb);
+    rb_raise(eErr, "couldn't allocate memory for Client structure");
+  }
+  mb->weights[0] = 1;
+  mb->num_servers = 1;
+  mb->depth = MB_CLIENT_DEPTH;
+  mb->max_items = MB_CLIENT_MAX_ITEMS;
+  mb->index = Qnil;
+  mb->hedge = MB_HEDGE_PERCENTILE;
+  mb->compress = 1;
+  mb->wake[0] = mb->wake[1] = -1;
+  mb->retry_attempts = 1;
+  mb->retry_backoff = MB_RETRY_BACKOFF;
+  mb->retry_max_backoff = MB_RETRY_MAX_BACKOFF;
+  mb->retry_budget = MB_RETRY_BUDGET;
+  mb->rng = (mb_now_ns() ^ (uint64_t) (uintptr_t) mb) | 1;
+
+  return Data_Wrap_Struct(klass, client_mark, client_free, mb);
+}
+
+#ifndef HAVE_RB_DEFINE_ALLOC_FUNC
+/*
+ * Allocate and initialize a new MusicBrainz::Client object.
+ *
+ * Example:
+ *   mb = MusicBrainz::Client.new
+ */
+VALUE mb_client_new(VALUE klass) {
+  VALUE self;
+  mb_client_t *mb;
+
+  self = mb_client_alloc(klass);
+  rb_obj_call_init(self, 0, NULL);
+
+  return self;
+}
+#endif /* HAVE_RB_DEFINE_ALLOC_FUNC */
+
+/*
+ * :nodoc:
+ *
+ * Constructor for MusicBrainz::Client object.
+ */
+static VALUE mb_client_init(VALUE self) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  mb->mb = mb_New();
+  return self;
+}
+
+/*
+ * Get the version of a MusicBrainz::Client object.
+ *
+ * Note: this actually returns the version of the MusicBrainz library.
+ *
+ * Example:
+ *   puts 'MusicBrainz version: ' << mb.version
+ *   
+ */
+static VALUE mb_client_version(VALUE self) {
+  mb_client_t *mb;
+  MB_BUFFER buf[MB_VERSION_BUFSIZ];
+  int ver[3];
+
+  Data_Get_Struct(self, mb_client_t, mb);
+
+  mb_GetVersion(mb->mb, &(ver[0]), &(ver[1]), &(ver[2]));
+  snprintf(buf, sizeof(buf), "%d.%d.%d", ver[0], ver[1], ver[2]);
+
+  return rb_str_new2(buf);
+}
+
+/*
+ * Set the server name and port for the MusicBrainz::Client object.
+ * Replaces the list of servers (see MusicBrainz::Client#servers=).
+ *
+ * Returns false if MusicBrainz could not connect to the server. If this
+ * method is not called, the default server is 'www.musicbrainz.org',
+ * port 80.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_server
+ *
+ * Examples:
+ *   # connect to www.musicbrainz.org, port 80
+ *   mb.server = 'www.musicbrainz.org'
+ *
+ *   # connect to www.example.com, port 31337
+ *   mb.server = 'www.example.com:31337'
+ *
+ *   # connect to www.musicbrainz.org, port 80
+ *   mb.set_server 'www.musicbrainz.org'
+ *
+ *   # connect to www.example.com, port 31337
+ *   mb.set_server 'www.example.com', 31337
+ *
+ */
+static VALUE mb_client_set_server(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  mb_server_t *server;
+  MB_BUFFER host[MB_HOST_BUFSIZ];
+  int port, weight = 1;
+
+  /* grab mb handle */
+  Data_Get_Struct(self, mb_client_t, mb);
+  
+  /* clear host buffer and set default port */
+  memset(host, 0, sizeof(host));
+  port = 80;
+
+  parse_hostspec(argc, argv, host, sizeof(host), &port);
+
+  /* remember the server for transports (see client_expand()) */
+  if ((server = server_get(host, port)) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for server");
+  client_set_servers(mb, &server, &weight, 1);
+  client_prefetch(mb);
+  
+  return mb_SetServer(mb->mb, host, port) ? Qtrue : Qfalse;
+}
+
+/*
+ * Set the list of servers (mirrors) for the MusicBrainz::Client
+ * object.  Each server is a string ('host' or 'host:port'), or a
+ * [host, port] or [host, port, weight] array.  Weights (1 to 100, 1 by
+ * default) are used by the round_robin and least_outstanding policies
+ * (see MusicBrainz::Client#balance=).  The first server is the one the
+ * MusicBrainz library uses, so this is the same as
+ * MusicBrainz::Client#server= for every transport except "http".
+ *
+ * The http transport (see MusicBrainz::Client#transport=) tracks the
+ * latency and health of each server, and sends each query to the
+ * server picked by the balancing policy (by default, the fastest).  If
+ * that request fails, the query fails over to the next fastest server.
+ * If hedging is enabled (see MusicBrainz::Client#hedge=) and the
+ * server hasn't answered within its usual response time, a duplicate
+ * request is sent to the next fastest server; the first response wins,
+ * and the other request is abandoned.
+ *
+ * A server that fails 5 requests in a row (or half of its recent
+ * requests) is taken out of rotation for 2 seconds, then sent a single
+ * probe request, which puts it back if it succeeds.  Each time the
+ * probe fails, the server is left out twice as long, up to a minute.
+ * If every server is out of rotation, queries fail immediately.
+ *
+ * Servers are shared by every MusicBrainz::Client in the process, so
+ * what one client learns about a server is used by the others (see
+ * MusicBrainz::Client#server_stats).  Raises MusicBrainz::Error if the
+ * list is empty, or has more than 16 servers.
+ *
+ * Returns false if the MusicBrainz library could not connect to the
+ * first server.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_servers
+ *
+ * Examples:
+ *   # two internal mirrors, plus the public server
+ *   mb.transport = :http
+ *   mb.servers = ['mb1.example.com:8080', ['mb2.example.com', 8080],
+ *                 'www.musicbrainz.org']
+ *
+ *   # spread queries over two mirrors, one twice the size of the other
+ *   mb.servers = [['mb1.example.com', 80, 2], ['mb2.example.com', 80, 1]]
+ *   mb.balance = :round_robin
+ *
+ */
+static VALUE mb_client_set_servers(VALUE self, VALUE list) {
+  mb_client_t *mb;
+  mb_server_t *servers[MB_MAX_SERVERS];
+  int weights[MB_MAX_SERVERS], ports[MB_MAX_SERVERS];
+  MB_BUFFER hosts[MB_MAX_SERVERS][MB_HOST_BUFSIZ];
+  VALUE val;
+  long i, num, len;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  list = rb_Array(list);
+  if ((num = RARRAY_LEN(list)) < 1 || num > MB_MAX_SERVERS)
+    rb_raise(eErr, "invalid number of servers: %ld (must be 1 to %d)", num, MB_MAX_SERVERS);
+
+  /* parse everything first, so a bad entry leaves the list alone */
+  for (i = 0; i < num; i++) {
+    val = RARRAY_PTR(list)[i];
+    ports[i] = 80;
+    weights[i] = 1;
+
+    if (TYPE(val) == T_ARRAY) {
+      if ((len = RARRAY_LEN(val)) == 3 &&
+          ((weights[i] = NUM2INT(RARRAY_PTR(val)[2])) < 1 || weights[i] > 100))
+        rb_raise(eErr, "invalid server weight: %d", weights[i]);
+      parse_hostspec((len == 3) ? 2 : (int) len, RARRAY_PTR(val), hosts[i], MB_HOST_BUFSIZ, ports + i);
+    } else {
+      parse_hostspec(1, &val, hosts[i], MB_HOST_BUFSIZ, ports + i);
+    }
+  }
+
+  for (i = 0; i < num; i++) {
+    if ((servers[i] = server_get(hosts[i], ports[i])) == NULL) {
+      while (i-- > 0)
+        server_put(servers[i]);
+      rb_raise(eErr, "couldn't allocate memory for server");
+    }
+  }
+
+  client_set_servers(mb, servers, weights, (int) num);
+  client_prefetch(mb);
+
+  return mb_SetServer(mb->mb, mb->servers[0]->host, mb->servers[0]->port) ? Qtrue : Qfalse;
+}
+
+/*
+ * Get the list of servers for the MusicBrainz::Client object, as
+ * 'host:port' strings.
+ *
+ * Example:
+ *   puts 'Servers: ' << mb.servers.join(', ')
+ *
+ */
+static VALUE mb_client_servers(VALUE self) {
+  mb_client_t *mb;
+  VALUE ret;
+  char buf[MB_HOST_BUFSIZ + 16];
+  int i;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+
+  ret = rb_ary_new();
+  for (i = 0; i < mb->num_servers; i++) {
+    snprintf(buf, sizeof(buf), "%s:%d", mb->servers[i]->host, mb->servers[i]->port);
+    rb_ary_push(ret, rb_str_new2(buf));
+  }
+
+  return ret;
+}
+
+/*
+ * Set the latency percentile after which the http transport sends a
+ * hedged (duplicate) request to the next fastest server, or nil to
+ * disable hedging.  Defaults to 95, which hedges about 1 in 20
+ * requests.  Hedging only starts once a server has answered 8
+ * requests.  Has no effect with a single server.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_hedge
+ *
+ * Examples:
+ *   # hedge the slowest 1% of requests
+ *   mb.hedge = 99
+ *
+ *   # never send duplicate requests
+ *   mb.hedge = nil
+ *
+ */
+static VALUE mb_client_set_hedge(VALUE self, VALUE pct) {
+  mb_client_t *mb;
+  int hedge = 0;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  if (RTEST(pct) && ((hedge = NUM2INT(pct)) < 1 || hedge > 100))
+    rb_raise(eErr, "invalid hedge percentile: %d", hedge);
+  mb->hedge = hedge;
+
+  return self;
+}
+
+/*
+ * Set the policy the http transport uses to pick a server for each
+ * query (see MusicBrainz::Client#servers=).  Servers which are out of
+ * rotation are skipped.
+ *
+ * Policies:
+ *   latency::           the server with the lowest average latency
+ *                       (the default)
+ *   round_robin::       each server in turn, in proportion to its
+ *                       weight
+ *   least_outstanding:: the server with the fewest requests in
+ *                       progress (from every client in the process)
+ *                       for its weight
+ *
+ * Failover and hedged requests always go to the next fastest server.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_balance
+ *
+ * Examples:
+ *   mb.balance = :least_outstanding
+ *
+ */
+static VALUE mb_client_set_balance(VALUE self, VALUE policy) {
+  mb_client_t *mb;
+  const char *str;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  if (SYMBOL_P(policy))
+    policy = rb_funcall(policy, rb_intern("to_s"), 0);
+  str = StringValueCStr(policy);
+
+  if (!strcmp(str, "latency"))
+    mb->balance = MB_BALANCE_LATENCY;
+  else if (!strcmp(str, "round_robin"))
+    mb->balance = MB_BALANCE_ROUND_ROBIN;
+  else if (!strcmp(str, "least_outstanding"))
+    mb->balance = MB_BALANCE_LEAST_OUTSTANDING;
+  else
+    rb_raise(eErr, "unknown balancing policy: %s", str);
+
+  return self;
+}
+
+/*
+ * Enable or disable compressed responses for the http transport (see
+ * MusicBrainz::Client#transport=).  When enabled (the default, if the
+ * extension was built with zlib), requests advertise gzip and deflate
+ * encodings, and compressed responses are inflated as they arrive.
+ * RDF is verbose XML, so large responses typically shrink five- to
+ * tenfold on the wire.  The "compressed_bytes" and
+ * "uncompressed_bytes" entries of MusicBrainz::Client#stats count the
+ * savings.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_compression
+ *
+ * Example:
+ *   # the server is on the same host, so don't bother
+ *   mb.compression = false
+ *
+ */
+static VALUE mb_client_set_compression(VALUE self, VALUE val) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  mb->compress = RTEST(val);
+  return val;
+}
+
+/*
+ * Keep the responses to recent queries, and revalidate them with the
+ * server instead of fetching them again.  Takes the number of
+ * responses to keep (true for 64), a hash of options, or nil or false
+ * to stop (the default), which also empties the cache.
+ *
+ * Options:
+ *   responses::     responses to keep (default 64)
+ *   bytes::         memory the responses may use, in bytes (default
+ *                   16MB)
+ *
+ * Once either limit is reached, the least recently used responses are
+ * dropped to make room; a response too big for the cache on its own
+ * isn't kept.
+ *
+ * Responses are kept with their ETag and Last-Modified headers, and
+ * repeating a query sends them back (as If-None-Match and
+ * If-Modified-Since), so the server can answer "304 Not Modified"
+ * without a body.  The cached response is then loaded as if it had
+ * been sent again, or if it's still the client's current result, just
+ * rewound (as with MusicBrainz::Query::Rewind) without parsing it
+ * again.  Only the http transport revalidates (see
+ * MusicBrainz::Client#transport=).  The "revalidations" and
+ * "revalidation_hits" entries of MusicBrainz::Client#stats count
+ * conditional requests and 304 responses.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_revalidate
+ *
+ * Examples:
+ *   # refresh the same few hundred albums every hour
+ *   mb.transport = :http
+ *   mb.revalidate = 500
+ *
+ *   # keep as many responses as fit in 64MB
+ *   mb.revalidate = { :responses => 65536, :bytes => 64 << 20 }
+ *
+ *   stats = mb.stats
+ *   hits = stats['revalidation_hits']
+ *   puts 'hit rate: %.1f%%' % [100.0 * hits / stats['revalidations']]
+ *
+ */
+static VALUE mb_client_set_revalidate(VALUE self, VALUE val) {
+  mb_client_t *mb;
+  VALUE opt;
+  long bytes = MB_CACHE_BYTES;
+  int num;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+
+  if (val == Qtrue) {
+    num = MB_CACHE_ENTRIES;
+  } else if (!RTEST(val)) {
+    num = 0;
+  } else if (TYPE(val) == T_HASH) {
+    opt = rb_hash_aref(val, ID2SYM(rb_intern("responses")));
+    num = NIL_P(opt) ? MB_CACHE_ENTRIES : NUM2INT(opt);
+    if (!NIL_P(opt = rb_hash_aref(val, ID2SYM(rb_intern("bytes")))) &&
+        (bytes = NUM2LONG(opt)) < 0)
+      rb_raise(eErr, "invalid cache size: %ld", bytes);
+  } else {
+    num = NUM2INT(val);
+  }
+  if (num < 0 || num > MB_CACHE_MAX_ENTRIES)
+    rb_raise(eErr, "invalid number of responses: %d (must be 0 to %d)", num, MB_CACHE_MAX_ENTRIES);
+
+  mb->cache_max = num;
+  mb->cache_max_size = bytes;
+  cache_trim(mb, num, bytes);
+
+  return val;
+}
+
+/*
+ * Get a server's cached addresses, as an array of strings.
+ */
+static VALUE server_addr_list(mb_server_t *s) {
+  mb_addrs_t *a;
+  char buf[NI_MAXHOST];
+  VALUE ret;
+  int i;
+
+  MB_SERVERS_LOCK();
+  if ((a = s->addrs) != NULL)
+    a->refs++;
+  MB_SERVERS_UNLOCK();
+
+  ret = rb_ary_new();
+  for (i = 0; a && i < a->num; i++)
+    if (!getnameinfo((struct sockaddr*) &(a->addrs[i].addr), a->addrs[i].len,
+                     buf, sizeof(buf), NULL, 0, NI_NUMERICHOST))
+      rb_ary_push(ret, rb_str_new2(buf));
+
+  if (a)
+    addrs_put(a);
+  return ret;
+}
+
+/*
+ * Get statistics for each of the servers of this MusicBrainz::Client
+ * object (see MusicBrainz::Client#servers=), as an array of hashes
+ * with the following keys:
+ *
+ *   host::        host name
+ *   port::        port
+ *   weight::      weight (for this client)
+ *   state::       "closed" (in rotation), "open" (out of rotation),
+ *                 or "half_open" (due for a probe)
+ *   requests::    requests sent, including hedged ones
+ *   outstanding:: requests in progress
+ *   errors::      failed requests
+ *   timeouts::    failed requests that timed out
+ *   error_rate::  recent fraction of failed requests (a moving average)
+ *   opened::      number of times the server was taken out of rotation
+ *   hedges::      hedged requests sent
+ *   hedge_wins::  hedged requests which answered first
+ *   latency::     average latency, in seconds (an exponentially
+ *                 weighted moving average), or nil if unknown
+ *   hedge_after:: seconds the http transport waits for this server
+ *                 before hedging, or nil if it doesn't
+ *   addresses::   addresses in the DNS cache (see MusicBrainz.dns_ttl=)
+ *
+ * Only the http transport tracks servers.  Servers are shared by
+ * every client in the process, so the counts include requests made by
+ * other clients.
+ *
+ * Example:
+ *   mb.server_stats.each do |s|
+ *     ms = (s['latency'] || 0) * 1000
+ *     puts '%s: %s, %.1fms' % [s['host'], s['state'], ms]
+ *   end
+ *
+ */
+static VALUE mb_client_server_stats(VALUE self) {
+  static const char *states[] = { "closed", "open", "half_open" };
+  mb_client_t *mb;
+  mb_server_t *s, copy;
+  uint64_t delay;
+  VALUE ret, h;
+  int i;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+
+  ret = rb_ary_new();
+  for (i = 0; i < mb->num_servers; i++) {
+    s = mb->servers[i];
+    delay = (mb->hedge && mb->num_servers > 1) ? server_percentile(s, mb->hedge) : 0;
+
+    MB_SERVERS_LOCK();
+    copy = *s;
+    if (copy.state == MB_BREAKER_OPEN_STATE && mb_now_ns() >= copy.open_until)
+      copy.state = MB_BREAKER_HALF_OPEN;
+    MB_SERVERS_UNLOCK();
+
+    h = rb_hash_new();
+    rb_hash_aset(h, rb_str_new2("host"), rb_str_new2(copy.host));
+    rb_hash_aset(h, rb_str_new2("port"), INT2FIX(copy.port));
+    rb_hash_aset(h, rb_str_new2("weight"), INT2FIX(mb->weights[i]));
+    rb_hash_aset(h, rb_str_new2("state"), rb_str_new2(states[copy.state]));
+    rb_hash_aset(h, rb_str_new2("requests"), ULL2NUM(copy.requests));
+    rb_hash_aset(h, rb_str_new2("outstanding"), INT2FIX(copy.outstanding));
+    rb_hash_aset(h, rb_str_new2("errors"), ULL2NUM(copy.errors));
+    rb_hash_aset(h, rb_str_new2("timeouts"), ULL2NUM(copy.timeouts));
+    rb_hash_aset(h, rb_str_new2("error_rate"), rb_float_new(copy.error_rate));
+    rb_hash_aset(h, rb_str_new2("opened"), ULL2NUM(copy.opened));
+    rb_hash_aset(h, rb_str_new2("hedges"), ULL2NUM(copy.hedges));
+    rb_hash_aset(h, rb_str_new2("hedge_wins"), ULL2NUM(copy.wins));
+    rb_hash_aset(h, rb_str_new2("latency"), copy.num_samples ? rb_float_new(copy.ewma / 1e9) : Qnil);
+    rb_hash_aset(h, rb_str_new2("hedge_after"), delay ? rb_float_new(delay / 1e9) : Qnil);
+    rb_hash_aset(h, rb_str_new2("addresses"), server_addr_list(s));
+    rb_ary_push(ret, h);
+  }
+
+  return ret;
+}
+
+/*
+ * Set how long the http transport caches the addresses of servers and
+ * proxies, in seconds (60 by default, at most a year), or nil to look
+ * them up for every request.  The cache is shared by every
+ * MusicBrainz::Client in the process.  Addresses are refreshed in the
+ * background shortly before they expire, and if the resolver fails,
+ * expired addresses are used until it recovers.  A host that can't be
+ * connected to at any of its cached addresses is looked up again on the
+ * next request.
+ *
+ * Aliases:
+ *   MusicBrainz.set_dns_ttl
+ *
+ * Example:
+ *   # mirrors behind a DNS load balancer with a short TTL
+ *   MusicBrainz.dns_ttl = 5
+ *
+ */
+static VALUE mb_set_dns_ttl(VALUE self, VALUE secs) {
+  double d = NIL_P(secs) ? 0 : NUM2DBL(secs);
+  mb_server_t *s;
+  uint64_t now = mb_now_ns();
+
+  UNUSED(self);
+  if (!(d >= 0 && d <= MB_DNS_MAX_TTL))
+    rb_raise(eErr, "invalid DNS TTL: %g", d);
+
+  /* cut short addresses cached with a longer TTL */
+  MB_SERVERS_LOCK();
+  mb_dns_ttl = (uint64_t) (d * 1e9);
+  for (s = mb_servers; s; s = s->next)
+    if (s->expires > now + mb_dns_ttl)
+      s->expires = now + mb_dns_ttl;
+  MB_SERVERS_UNLOCK();
+
+  return secs;
+}
+
+/*
+ * Get the DNS cache TTL, in seconds (see MusicBrainz.dns_ttl=).
+ *
+ * Example:
+ *   puts "caching addresses for #{MusicBrainz.dns_ttl}s"
+ *
+ */
+static VALUE mb_dns_ttl_get(VALUE self) {
+  UNUSED(self);
+  return rb_float_new(mb_dns_ttl / 1e9);
+}
+
+/*
+ * Pin the addresses the http transport uses for a server or proxy
+ * ('host' or 'host:port'; the port defaults to 80), like curl's
+ * --resolve option.  Addresses are IPv4 or IPv6 literals, tried in
+ * order; pinned addresses never expire, and skip the resolver
+ * entirely.  With no addresses, the host is unpinned and looked up
+ * again on its next request.  Pins apply to every MusicBrainz::Client
+ * in the process.  Raises MusicBrainz::Error if an address isn't a
+ * literal, or if there are more than 16.
+ *
+ * Examples:
+ *   # send queries for the mirror straight to its two frontends
+ *   MusicBrainz.resolve 'mb.example.com:8080', '10.0.0.5', '10.0.0.6'
+ *   mb.server = 'mb.example.com:8080'
+ *
+ *   # go back to DNS
+ *   MusicBrainz.resolve 'mb.example.com:8080'
+ *
+ */
+static VALUE mb_resolve(int argc, VALUE *argv, VALUE self) {
+  mb_addr_t addrs[MB_DNS_MAX_ADDRS];
+  mb_addrs_t *a = NULL;
+  mb_server_t *s;
+  MB_BUFFER host[MB_HOST_BUFSIZ];
+  struct sockaddr_in *sin;
+  struct sockaddr_in6 *sin6;
+  const char *str;
+  int i, num, port = 80, pinned, drops;
+
+  UNUSED(self);
+  if (argc < 1)
+    rb_raise(rb_eArgError, "wrong number of arguments (0 for 1)");
+  if ((num = argc - 1) > MB_DNS_MAX_ADDRS)
+    rb_raise(eErr, "too many addresses: %d (at most %d)", num, MB_DNS_MAX_ADDRS);
+  parse_hostspec(1, argv, host, sizeof(host), &port);
+
+  /* parse everything before allocating anything */
+  memset(addrs, 0, sizeof(addrs));
+  for (i = 0; i < num; i++) {
+    str = StringValueCStr(argv[i + 1]);
+    addrs[i].socktype = SOCK_STREAM;
+    addrs[i].protocol = IPPROTO_TCP;
+
+    sin = (struct sockaddr_in*) &(addrs[i].addr);
+    sin6 = (struct sockaddr_in6*) &(addrs[i].addr);
+    if (inet_pton(AF_INET, str, &(sin->sin_addr)) == 1) {
+      addrs[i].family = sin->sin_family = AF_INET;
+      sin->sin_port = htons((unsigned short) port);
+      addrs[i].len = sizeof(struct sockaddr_in);
+    } else if (inet_pton(AF_INET6, str, &(sin6->sin6_addr)) == 1) {
+      addrs[i].family = sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons((unsigned short) port);
+      addrs[i].len = sizeof(struct sockaddr_in6);
+    } else {
+      rb_raise(eErr, "invalid address: \"%s\"", str);
+    }
+  }
+
+  if (num > 0) {
+    if ((a = malloc(sizeof(mb_addrs_t) + num * sizeof(mb_addr_t))) == NULL)
+      rb_raise(eErr, "couldn't allocate memory for addresses");
+    a->refs = 1;
+    a->num = num;
+    memcpy(a->addrs, addrs, num * sizeof(mb_addr_t));
+  }
+
+  if ((s = server_get(host, port)) == NULL) {
+    free(a);
+    rb_raise(eErr, "couldn't allocate memory for server");
+  }
+
+  /* a pin holds a reference to the server, so it outlives clients */
+  MB_SERVERS_LOCK();
+  pinned = s->pinned;
+  if (a) {
+    server_set_addrs(s, a, mb_now_ns());
+    s->pinned = 1;
+  } else if (pinned) {
+    addrs_unref(s->addrs);
+    s->addrs = NULL;
+    s->pinned = 0;
+  }
+  MB_SERVERS_UNLOCK();
+
+  for (drops = (a && !pinned) ? 0 : (!a && pinned) ? 2 : 1; drops > 0; drops--)
+    server_put(s);
+
+  return Qnil;
+}
+
+/*
+ * Enable debugging output for this MusicBrainz::Client object.
+ * 
+ * Note: Debugging output is sent to standard output, not standard
+ * error.
+ * 
+ * Example:
+ *   mb.debug = true
+ *
+ */
+static VALUE mb_client_set_debug(VALUE self, VALUE debug) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  mb_SetDebug(mb->mb, (debug == Qtrue));
+  return debug;
+}
+
+/*
+ * Set the proxy name and port for the MusicBrainz::Client object.
+ *
+ * Returns false if MusicBrainz could not connect to the proxy.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_proxy
+ *
+ * Examples:
+ *   # connect to 'proxy.localdomain', port 8080
+ *   mb.proxy = 'proxy.localdomain'
+ *
+ *   # connect to proxy.example.com, port 31337
+ *   mb.proxy = 'proxy.example.com:31337'
+ *
+ *   # connect to www.musicbrainz.org, port 8080
+ *   mb.set_proxy 'www.musicbrainz.org'
+ *
+ *   # connect to proxy.example.com, port 31337
+ *   mb.set_proxy 'proxy.example.com', 31337
+ *
+ */
+static VALUE mb_client_set_proxy(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  mb_server_t *proxy = NULL;
+  MB_BUFFER host[MB_HOST_BUFSIZ];
+  int port;
+
+  /* get musicbrainz handle */
+  Data_Get_Struct(self, mb_client_t, mb);
+  
+  /* clear host buffer and set default port */
+  memset(host, 0, sizeof(host));
+  port = 8080;
+
+  parse_hostspec(argc, argv, host, sizeof(host), &port);
+
+  /* remember the proxy for the http transport, and resolve it early */
+  if (*host && (proxy = server_get(host, port)) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for proxy");
+  if (mb->proxy)
+    server_put(mb->proxy);
+  mb->proxy = proxy;
+  client_prefetch(mb);
+  
+  return mb_SetProxy(mb->mb, host, port) ? Qtrue : Qfalse;
+}
+
+/*
+ * Set user authentication for a MusicBrainz::Client object.
+ *
+ * This method is optional.  It only needs to be called if you want to
+ * submit data to the server and give the user credit for the
+ * submission.  If you want to submit data anonymously, don't call this
+ * method.  Returns true if the authentication was successful.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#authenticate
+ *
+ * Examples:
+ *   # connect as user "MrMusic", password "s3kr3tp455w0rd"
+ *   mb.auth 'MrMusic', 's3kr3tp455w0rd'
+ *
+ *   # connect as user "MBrox", password "hithere!"
+ *   mb.authenticate 'MBrox', 'hithere!'
+ *
+ */
+static VALUE mb_client_auth(VALUE self, VALUE user, VALUE pass) {
+  mb_client_t *mb;
+  char *u, *p;
+  uint64_t start, finish;
+  int ok;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  u = StringValueCStr(user); 
+  p = StringValueCStr(pass);
+
+  /* authenticating replaces the loaded result */
+  start = mb_now_ns();
+  mb->rdf_gen++;
+  ok = mb_Authenticate(mb->mb, u, p);
+  finish = stats_time(&(mb->stats), MB_STATS_AUTH, start, ok);
+
+  /* the password is deliberately left out */
+  if (MB_EVENT_ON(MB_STATS_AUTH))
+    event_fire(MB_STATS_AUTH, start, finish, Qnil, rb_ary_new3(1, user), -1, ok);
+
+  return ok ? Qtrue : Qfalse;
+}
+
+/*
+ * Set CD-ROM device for a MusicBrainz::Client object.
+ *
+ * On Unix systems, this is a path (eg "/dev/scd0") and defaults to
+ * "/dev/cdrom". On Win32 systems, it's a drive letter (eg "E:").  This
+ * method always returns true.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_device
+ *
+ * Examples:
+ *   # set device to "/dev/scd1"
+ *   mb.device = '/dev/scd1'
+ *
+ *   # set CD-ROM to "E:" on a Win32 system
+ *   mb.set_device 'E:'
+ *
+ */
+static VALUE mb_client_set_device(VALUE self, VALUE device) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  return mb_SetDevice(mb->mb, StringValueCStr(device)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Enable UTF-8 output for a MusicBrainz::Client object.
+ * 
+ * Note: Defaults to ISO-8859-1 output.  If this is set to true, then
+ * UTF-8 will be used instead.
+ * 
+ * Aliases:
+ *   MusicBrainz::Client#use_utf8=
+ *   MusicBrainz::Client#set_use_utf8
+ *
+ * Examples:
+ *   mb.utf8 = true
+ *   mb.use_utf8 = true
+ *   mb.set_use_utf8 true
+ *
+ */
+static VALUE mb_client_set_use_utf8(VALUE self, VALUE use_utf8) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  mb_UseUTF8(mb->mb, (use_utf8 == Qtrue));
+  return use_utf8;
+}
+
+/*
+ * Set the search depth for a MusicBrainz::Client object.
+ * 
+ * Note: Defaults to 2.
+ * 
+ * Aliases:
+ *   MusicBrainz::Client#set_depth
+ *
+ * Examples:
+ *   mb.depth = 5
+ *   mb.set_depth 5
+ *
+ */
+static VALUE mb_client_set_depth(VALUE self, VALUE depth) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  mb->depth = NUM2INT(depth);
+  mb_SetDepth(mb->mb, mb->depth);
+  return self;
+}
+
+/*
+ * Set the maximum number of items for a MusicBrainz::Client object.
+ * 
+ * Set the maximum number of items to return from a query for a
+ * MusicBrainz::Client object.  If the query yields more items than this
+ * number, the server will omit the excess results.  Defaults to 25.
+ * 
+ * Aliases:
+ *   MusicBrainz::Client#set_max_items
+ *
+ * Examples:
+ *   mb.max_items = 5
+ *   mb.set_max_items 5
+ *
+ */
+static VALUE mb_client_set_max_items(VALUE self, VALUE max_items) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  mb->max_items = NUM2INT(max_items);
+  mb_SetMaxItems(mb->mb, mb->max_items);
+  return self;
+}
+
+/*
+ * Get the local index used by this MusicBrainz::Client object, or nil
+ * if queries always go to the server.
+ *
+ * Examples:
+ *   puts 'using a local index' if mb.index
+ *
+ */
+static VALUE mb_client_index(VALUE self) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  return mb->index;
+}
+
+/*
+ * Set the local index for a MusicBrainz::Client object.
+ *
+ * Queries the index can answer (GetArtistById, GetAlbumById,
+ * GetTrackById, TrackInfoFromTRMId, FindArtistByName, FindAlbumByName,
+ * and FindTrackByName) are answered from the index instead of the
+ * server, and the results are read with the usual MusicBrainz::Client
+ * methods.  Name searches are fuzzy, and each result has a relevance
+ * from 0 to 100 (see MusicBrainz::Index#search); results less than 50
+ * relevant are dropped.  Everything else (including searches with no
+ * results left, and anything missing from the index) goes to the
+ * server.  Set to nil to send every query to the server.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_index
+ *
+ * Examples:
+ *   mb.index = MusicBrainz::Index.new('mb.idx')
+ *   mb.set_index nil
+ *
+ */
+static VALUE mb_client_set_index(VALUE self, VALUE index) {
+  mb_client_t *mb;
+
+  if (!NIL_P(index) && !rb_obj_is_kind_of(index, cIndex))
+    rb_raise(rb_eTypeError, "expected MusicBrainz::Index or nil");
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  mb->index = index;
+  return self;
+}
+
+/*
+ * Get statistics for this MusicBrainz::Client object.
+ *
+ * Returns a hash with an entry for each timed operation ("query",
+ * "select", "result" (including result_int and exists?), "auth", and
+ * "mp3_info"), each a hash of "calls", "errors", total "seconds", and a
+ * "latency" histogram.  Histograms are arrays of counts, where entry i
+ * counts values below 2**i (microseconds for latencies, bytes for
+ * sizes) and the last entry also counts everything larger.  Also
+ * includes query calls by type ("queries"), "local_queries" answered
+ * from the index, "bytes_received" from the server, an "rdf_len"
+ * histogram of result sizes, "result_truncated" results cut off by the
+ * result buffer, "retries" sent and "retries_denied" by a retry budget
+ * (see MusicBrainz::Client#retries=), and the http transport's host
+ * lookups: "dns_hits" answered from the DNS cache, "dns_misses" sent to
+ * the resolver, "dns_errors", and "dns_stale" expired addresses used
+ * because the resolver failed (see MusicBrainz.dns_ttl=), and
+ * "compressed_bytes" of compressed responses, which inflated to
+ * "uncompressed_bytes" (see MusicBrainz::Client#compression=), and
+ * "revalidations" of cached responses, of which "revalidation_hits"
+ * were still current (see MusicBrainz::Client#revalidate=).  The "trm",
+ * "trm_bytes", and "dns_refreshes" entries are only counted globally
+ * (see MusicBrainz.stats).
+ *
+ * Pass :prometheus to get a string in the Prometheus text format.
+ *
+ * Examples:
+ *   stats = mb.stats
+ *   puts "#{stats['query']['calls']} queries, #{stats['query']['seconds']}s"
+ *
+ *   File.write('mb.prom', mb.stats(:prometheus))
+ *
+ */
+static VALUE mb_client_stats(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  return stats_format(&(mb->stats), argc, argv);
+}
+
+/*
+ * Reset statistics for this MusicBrainz::Client object.
+ */
+static VALUE mb_client_reset_stats(VALUE self) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  memset(&(mb->stats), 0, sizeof(mb_stats_t));
+  return self;
+}
+
+/*
+ * Load result RDF into the client, as if it came from the server.
+ */
+static int client_set_rdf(mb_client_t *mb, char *rdf, long len) {
+  int ok;
+
+  UNUSED(len);
+  mb->rdf_gen++;
+  MB_PROBE1(rdf__parse__start, len);
+  ok = mb_SetResultRDF(mb->mb, rdf);
+  MB_PROBE2(rdf__parse__done, len, ok);
+
+  return ok;
+}
+
+/*
+ * Answer a query from the client's local index.  Returns 0 if there's
+ * no index, or the index can't answer the query.
+ */
+static int client_index_query(mb_client_t *mb, const char *query, int argc, char **args) {
+  mb_index_t *ix;
+  mb_strbuf_t b;
+  int ok;
+
+  if (NIL_P(mb->index))
+    return 0;
+  Data_Get_Struct(mb->index, mb_index_t, ix);
+  if (!ix->map)
+    return 0;
+
+  memset(&b, 0, sizeof(b));
+  ok = index_query(ix, query, argc, args, mb->depth, mb->max_items, &b) && !b.err;
+  MB_PROBE3(index__lookup, query, argc ? args[0] : NULL, ok);
+  ok = ok && client_set_rdf(mb, b.ptr, b.len);
+  free(b.ptr);
+
+  return ok;
+}
+
+/*
+ * Transports.  A transport performs the server round trip for a query
+ * the local index can't answer: send() makes the request, and recv()
+ * gets the response body (as RDF).  Unless the transport sets
+ * MB_TRANSPORT_LOADED (meaning send() has already loaded the result
+ * into the library handle, as the network transport does), the client
+ * loads the body returned by recv() with client_set_rdf().
+ *
+ * Transports other than the network one work on the request as
+ * libmusicbrainz would send it (see client_expand()).  Errors are
+ * reported by copying a message into mb->error with client_error(),
+ * and transports that honor the request's deadline set timed_out if
+ * it (or one of the client's timeouts) expires.  Transports set
+ * retriable if a failed request is worth retrying (see client_send()),
+ * and server to the server they used, if they know it.
+ *
+ * Transports that set MB_TRANSPORT_CONDITIONAL revalidate the
+ * request's cached response (cache, if any) with its validators, set
+ * not_modified if the server says it's current (in which case recv()
+ * isn't called), and return the validators of the response in etag and
+ * modified (see client_send()).
+ *
+ * Transports that set MB_TRANSPORT_BLOCKING wait on the MusicBrainz
+ * library's HTTP client, which can't be interrupted, so the client
+ * refuses timeouts, deadlines, and cancellation with them (see
+ * client_check_blocking()).
+ */
+#define MB_TRANSPORT_LOADED       1
+#define MB_TRANSPORT_CONDITIONAL  2
+#define MB_TRANSPORT_BLOCKING     4
+
+typedef struct {
+  const char *query;
+  char **args;
+  int argc;
+  mb_strbuf_t text, res;
+  int expanded, timed_out, retriable, attempt;
+  uint64_t deadline;
+  mb_server_t *server; /* referenced, if set */
+  void *data;
+  mb_cache_entry_t *cache;
+  int not_modified;
+  char etag[MB_CACHE_VALIDATOR], modified[MB_CACHE_VALIDATOR];
+} mb_request_t;
+
+typedef struct mb_transport_vt {
+  const char *name;
+  int flags;
+  int (*send)(mb_client_t *, mb_request_t *);
+  int (*recv)(mb_client_t *, mb_request_t *, mb_strbuf_t *);
+  void (*free)(void *);
+} mb_transport_vt;
+
+#ifdef __GNUC__
+static void client_error(mb_client_t *, const char *, ...) __attribute__((format(printf, 2, 3)));
+#endif /* __GNUC__ */
+
+static void client_error(mb_client_t *mb, const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(mb->error, sizeof(mb->error), fmt, ap);
+  va_end(ap);
+}
+
+/*
+ * Append a query template with @URL@, @DEPTH@, @MAX_ITEMS@, and
+ * @1@..@n@ filled in.  Arguments are XML-escaped if xml is set, and
+ * missing arguments are left empty.
+ */
+static void sb_template(mb_strbuf_t *b, mb_client_t *mb, const char *tmpl, mb_request_t *req, int xml) {
+  const char *p, *q;
+  size_t n;
+  int i;
+
+  for (p = tmpl; (q = strchr(p, '@')) != NULL; ) {
+    sb_cat(b, p, q - p);
+    n = strcspn(q + 1, "@");
+
+    if (!q[n + 1]) {
+      /* no closing @ */
+      break;
+    } else if (n == 3 && !strncmp(q + 1, "URL", 3)) {
+      sb_hostport(b, mb->servers[0]->host, mb->servers[0]->port);
+    } else if (n == 5 && !strncmp(q + 1, "DEPTH", 5)) {
+      sb_int(b, mb->depth);
+    } else if (n == 9 && !strncmp(q + 1, "MAX_ITEMS", 9)) {
+      sb_int(b, mb->max_items);
+    } else if (n > 0 && n < 4 && strspn(q + 1, "0123456789") == n) {
+      if ((i = atoi(q + 1)) >= 1 && i <= req->argc) {
+        if (xml)
+          sb_xml(b, req->args[i - 1]);
+        else
+          sb_str(b, req->args[i - 1]);
+      }
+    } else {
+      /* not a placeholder: keep the @ and rescan from the next one */
+      sb_cat(b, q, 1);
+      p = q + 1;
+      continue;
+    }
+
+    p = q + n + 2;
+  }
+
+  sb_str(b, p);
+}
+
+/*
+ * Expand a request into what libmusicbrainz would send: "GET <url>"
+ * for queries that are URLs (eg MBQ_GetAlbumById), or "POST <url>",
+ * a newline, and the RDF query for the rest.  Returns 0 for queries
+ * that aren't sent to the server as-is (eg MBQ_GetCDInfo, which reads
+ * the disc first).
+ */
+static int client_expand(mb_client_t *mb, mb_request_t *req) {
+  mb_strbuf_t *b = &(req->text);
+
+  if (!req->expanded) {
+    req->expanded = 1;
+
+    if (!strncmp(req->query, "http://", 7)) {
+      sb_str(b, "GET ");
+      sb_template(b, mb, req->query, req, 0);
+    } else if (!strncmp(req->query, "<mq:", 4)) {
+      sb_str(b, "POST ");
+      sb_template(b, mb, "http://@URL@/cgi-bin/mq_2_1.pl\n", req, 0);
+      sb_template(b, mb, req->query, req, 1);
+    } else {
+      b->err = 1;
+    }
+  }
+
+  return !b->err;
+}
+
+/*
+ * Network transport: libmusicbrainz's own HTTP client.
+ */
+static int net_send(mb_client_t *mb, mb_request_t *req) {
+  int ok;
+
+  mb->rdf_gen++;
+  if (req->argc > 0)
+    ok = mb_QueryWithArgs(mb->mb, (char*) req->query, req->args);
+  else
+    ok = mb_Query(mb->mb, (char*) req->query);
+
+  /* the library doesn't say why a query failed; assume the network */
+  req->retriable = !ok;
+
+  return ok;
+}
+
+static int net_recv(mb_client_t *mb, mb_request_t *req, mb_strbuf_t *b) {
+  int len;
+
+  UNUSED(req);
+  if ((len = mb_GetResultRDFLen(mb->mb)) <= 0 || !sb_reserve(b, len))
+    return 0;
+
+  mb_GetResultRDF(mb->mb, b->ptr + b->len, len + 1);
+  b->len += len;
+
+  return 1;
+}
+
+static const mb_transport_vt transport_network = {
+  "network",
+  MB_TRANSPORT_LOADED | MB_TRANSPORT_BLOCKING,
+  net_send,
+  net_recv,
+  NULL,
+};
+
+/*
+ * Recorder: the network transport, plus each request and its response
+ * appended to a file.  Entries look like this, where the numbers are
+ * byte counts:
+ *
+ *   > 62
+ *   GET http://www.musicbrainz.org/mm-2.1/artist/<id>/2
+ *   < 1234
+ *   <?xml version="1.0" ...
+ *
+ * with a newline after the request and the response.
+ */
+static int rec_send(mb_client_t *mb, mb_request_t *req) {
+  FILE *fh = mb->transport_data;
+  mb_strbuf_t b;
+  int ok = 1;
+
+  if (!net_send(mb, req))
+    return 0;
+
+  /* only record requests a replayer could match */
+  if (!client_expand(mb, req))
+    return 1;
+
+  memset(&b, 0, sizeof(b));
+  if (net_recv(mb, req, &b)) {
+    fprintf(fh, "> %lu\n", (unsigned long) req->text.len);
+    fwrite(req->text.ptr, 1, req->text.len, fh);
+    fprintf(fh, "\n< %lu\n", (unsigned long) b.len);
+    fwrite(b.ptr, 1, b.len, fh);
+    fputc('\n', fh);
+
+    if (fflush(fh) || ferror(fh)) {
+      client_error(mb, "couldn't write recording: %s", strerror(errno));
+      ok = 0;
+    }
+  }
+  free(b.ptr);
+
+  return ok;
+}
+
+static void rec_free(void *data) {
+  fclose(data);
+}
+
+static const mb_transport_vt transport_record = {
+  "record",
+  MB_TRANSPORT_LOADED | MB_TRANSPORT_BLOCKING,
+  rec_send,
+  net_recv,
+  rec_free,
+};
+
+/*
+ * Replayer: serves responses from a recording (see rec_send()) loaded
+ * into memory, without touching the network.  Entries are sorted by
+ * request, and if a request was recorded more than once, the last
+ * response wins.
+ */
+typedef struct {
+  const char *req, *res;
+  size_t req_len, res_len;
+  long seq;
+} mb_replay_entry_t;
+
+typedef struct {
+  char *buf;
+  mb_replay_entry_t *entries;
+  long num;
+} mb_replay_t;
+
+static int replay_cmp(const void *a, const void *b) {
+  const mb_replay_entry_t *x = a, *y = b;
+  int r;
+
+  if (x->req_len != y->req_len)
+    return (x->req_len < y->req_len) ? -1 : 1;
+  if ((r = memcmp(x->req, y->req, x->req_len)) != 0)
+    return r;
+  return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+static int replay_key_cmp(const void *a, const void *b) {
+  const mb_replay_entry_t *x = a, *y = b;
+
+  if (x->req_len != y->req_len)
+    return (x->req_len < y->req_len) ? -1 : 1;
+  return memcmp(x->req, y->req, x->req_len);
+}
+
+static void replay_free(void *data) {
+  mb_replay_t *r = data;
+
+  free(r->buf);
+  free(r->entries);
+  free(r);
+}
+
+/*
+ * Parse one "> len" or "< len" line plus the data that follows it.
+ * Returns a pointer just past the data, or NULL on error.
+ */
+static char *replay_field(char *p, char *end, char mark, const char **ret, size_t *ret_len) {
+  unsigned long len;
+  char *q;
+
+  if (end - p < 3 || p[0] != mark || p[1] != ' ')
+    return NULL;
+
+  errno = 0;
+  len = strtoul(p + 2, &q, 10);
+  if (errno || q == p + 2 || q >= end || *q != '\n' || len >= (unsigned long) (end - q))
+    return NULL;
+
+  *ret = q + 1;
+  *ret_len = len;
+  q += len + 1;
+
+  return (q < end && *q == '\n') ? q + 1 : NULL;
+}
+
+/*
+ * Load a recording.  Returns NULL and sets err (to a static string)
+ * on error.
+ */
+static mb_replay_t *replay_load(const char *path, const char **err) {
+  mb_replay_t *r;
+  mb_replay_entry_t *e;
+  struct stat st;
+  char *p, *end;
+  long capa = 0;
+  FILE *fh;
+
+  if ((fh = fopen(path, "rb")) == NULL) {
+    *err = strerror(errno);
+    return NULL;
+  }
+
+  if ((r = calloc(1, sizeof(mb_replay_t))) == NULL ||
+      fstat(fileno(fh), &st) ||
+      (r->buf = malloc(st.st_size + 1)) == NULL ||
+      fread(r->buf, 1, st.st_size, fh) != (size_t) st.st_size) {
+    *err = "couldn't read recording";
+    goto fail;
+  }
+  fclose(fh);
+  fh = NULL;
+
+  for (p = r->buf, end = r->buf + st.st_size; p < end; r->num++) {
+    if (r->num == capa) {
+      capa = capa ? capa * 2 : 64;
+      if ((e = realloc(r->entries, capa * sizeof(mb_replay_entry_t))) == NULL) {
+        *err = "couldn't allocate memory for recording";
+        goto fail;
+      }
+      r->entries = e;
+    }
+
+    e = r->entries + r->num;
+    e->seq = r->num;
+    if ((p = replay_field(p, end, '>', &(e->req), &(e->req_len))) == NULL ||
+        (p = replay_field(p, end, '<', &(e->res), &(e->res_len))) == NULL) {
+      *err = "invalid recording";
+      goto fail;
+    }
+  }
+
+  if (r->num > 1)
+    qsort(r->entries, r->num, sizeof(mb_replay_entry_t), replay_cmp);
+
+  return r;
+
+fail:
+  if (fh)
+    fclose(fh);
+  if (r)
+    replay_free(r);
+  return NULL;
+}
+
+static int replay_send(mb_client_t *mb, mb_request_t *req) {
+  mb_replay_t *r = mb->transport_data;
+  mb_replay_entry_t key, *e, *last;
+
+  if (!client_expand(mb, req)) {
+    client_error(mb, "query can't be replayed");
+    return 0;
+  }
+
+  key.req = req->text.ptr;
+  key.req_len = req->text.len;
+  if ((e = bsearch(&key, r->entries, r->num, sizeof(mb_replay_entry_t), replay_key_cmp)) == NULL) {
+    client_error(mb, "no recorded response for request");
+    return 0;
+  }
+
+  /* use the last recorded response */
+  for (last = r->entries + r->num - 1; e < last && !replay_key_cmp(e + 1, &key); e++)
+    ;
+  req->data = e;
+
+  return 1;
+}
+
+static int replay_recv(mb_client_t *mb, mb_request_t *req, mb_strbuf_t *b) {
+  mb_replay_entry_t *e = req->data;
+
+  UNUSED(mb);
+  sb_cat(b, e->res, e->res_len);
+  return !b->err;
+}
+
+static const mb_transport_vt transport_replay = {
+  "replay",
+  0,
+  replay_send,
+  replay_recv,
+  replay_free,
+};
+
+/*
+ * HTTP transport: a small HTTP/1.0 client, run without the global
+ * interpreter lock.  Unlike the network transport, it honors the
+ * client's timeouts and deadline, and can be cancelled by
+ * MusicBrainz::Client#cancel from another thread.  Each wait polls the
+ * socket and the client's wake pipe, which the canceller writes to.
+ * Ruby interrupts write to it too: the request is suspended while the
+ * interrupt is handled, and resumed unless it raised (Thread#kill,
+ * Thread#raise, Timeout, etc).
+ */
+#define MB_HTTP_OK         0
+#define MB_HTTP_ERROR      1
+#define MB_HTTP_TIMEOUT    2
+#define MB_HTTP_CANCELLED  3
+
+#define MB_HTTP_READSIZ    16384
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif /* !MSG_NOSIGNAL */
+
+/* RDF envelope for queries POSTed to mq_2_1.pl */
+#define MB_HTTP_RDF_HEAD \
+  "<?xml version=\"1.0\"?>\n" \
+  "<rdf:RDF xmlns:rdf = \"http://www.w3.org/1999/02/22-rdf-syntax-ns#\"\n" \
+  "         xmlns:dc  = \"http://purl.org/dc/elements/1.1/\"\n" \
+  "         xmlns:mq  = \"http://musicbrainz.org/mm/mq-1.1#\"\n" \
+  "         xmlns:mm  = \"http://musicbrainz.org/mm/mm-2.1#\">\n"
+#define MB_HTTP_RDF_TAIL "</rdf:RDF>\n"
+
+/* connections per query: at most one per server */
+#define MB_HTTP_CONNS      MB_MAX_SERVERS
+
+/* connection states */
+#define MB_CONN_RESOLVE    1
+#define MB_CONN_CONNECT    2
+#define MB_CONN_SEND       3
+#define MB_CONN_READ       4
+#define MB_CONN_DONE       5
+#define MB_CONN_FAILED     6
+
+typedef struct {
+  mb_server_t *server;
+  int hedge, probe;
+
+  /* host we connect to (the server, or the proxy), and its addresses
+   * (next_addr is the next one to try); while they're being resolved,
+   * the refresh being waited on (see server_resolved()) */
+  mb_server_t *host;
+  mb_addrs_t *addrs;
+  int next_addr;
+  unsigned resolve_gen;
+
+  int fd, state;
+
+  /* request, and how much of it has been sent */
+  mb_strbuf_t req;
+  size_t sent;
+
+  /* response, end of its headers (-1 until seen), and content length
+   * (-1 if unknown) */
+  mb_strbuf_t res;
+  long hdr, len;
+
+  /* when the connection was started, and when the current lookup,
+   * connect, write, or read times out (0 for never) */
+  uint64_t start, timer;
+
+  /* set for errors that retrying won't fix */
+  int status, result, fatal;
+  char error[MB_ERR_BUFSIZ];
+
+  /* whether the request was conditional, and the server said the
+   * cached response is current; validators from the response */
+  int conditional, not_modified;
+  char etag[MB_CACHE_VALIDATOR], modified[MB_CACHE_VALIDATOR];
+
+#ifdef HAVE_ZLIB_H
+  /* compressed body (see conn_inflate()): whether it's compressed, the
+   * stream, the last inflate() result, compressed bytes received, and
+   * the inflated body */
+  int zipped, zraw, zerr;
+  z_stream z;
+  long zlen;
+  mb_strbuf_t body;
+#endif /* HAVE_ZLIB_H */
+} mb_http_conn_t;
+
+typedef struct {
+  /* proxy to connect to instead of each server, if any */
+  mb_server_t *proxy;
+
+  /* request path, and body (NULL unless it's a POST) */
+  const char *path, *body;
+  size_t path_len;
+
+  /* servers (referenced), fastest first, and the next one to use */
+  mb_server_t *servers[MB_MAX_SERVERS];
+  int num_servers, next_server;
+
+  /* timeouts (relative) and deadline (absolute), in ns; 0 for none */
+  uint64_t connect_timeout, read_timeout, deadline;
+
+  /* whether to hedge, and how long to wait before doing so (0 for
+   * never) */
+  int hedge;
+  uint64_t hedge_delay;
+
+  /* whether to ask for a compressed response */
+  int compress;
+
+  /* validators of the cached response (empty if none), the validators
+   * of the response, and whether the cached one is still current */
+  char etag[MB_CACHE_VALIDATOR], modified[MB_CACHE_VALIDATOR];
+  char res_etag[MB_CACHE_VALIDATOR], res_modified[MB_CACHE_VALIDATOR];
+  int not_modified;
+
+  mb_http_conn_t conns[MB_HTTP_CONNS];
+  int num_conns;
+
+  /* when to hedge (0 for not yet), and the connection that won */
+  uint64_t hedge_at;
+  int winner;
+
+  mb_client_t *client;
+  volatile int *cancel, *interrupted;
+  int wake, done, suspended;
+
+  /* response body (from the first connection to finish), or error
+   * (and whether it's worth retrying), and the server used */
+  mb_strbuf_t res;
+  int result, retriable;
+  char error[MB_ERR_BUFSIZ];
+  mb_server_t *server;
+} mb_http_t;
+
+/*
+ * Wake the client's current request (if any).
+ */
+static void client_notify(mb_client_t *mb) {
+  if (mb->wake[1] >= 0 && write(mb->wake[1], "", 1) < 0) {
+    /* pipe full: a wakeup is already pending */
+  }
+}
+
+/*
+ * Cancel the client's current request (if any).  Safe to call from
+ * any thread, with or without the global interpreter lock.
+ */
+static void client_wake(mb_client_t *mb) {
+  mb->cancel = 1;
+  client_notify(mb);
+}
+
+/*
+ * Drain the client's wake pipe.
+ */
+static void client_drain(mb_client_t *mb) {
+  char buf[64];
+
+  while (read(mb->wake[0], buf, sizeof(buf)) > 0)
+    ;
+}
+
+/*
+ * Create the client's wake pipe, if necessary.  Returns 0 on error.
+ */
+static int client_wake_open(mb_client_t *mb) {
+  int i;
+
+  if (mb->wake[0] < 0) {
+    if (pipe(mb->wake))
+      return 0;
+    for (i = 0; i < 2; i++) {
+      fcntl(mb->wake[i], F_SETFD, FD_CLOEXEC);
+      fcntl(mb->wake[i], F_SETFL, fcntl(mb->wake[i], F_GETFL) | O_NONBLOCK);
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Create the client's wake pipe (if necessary), and clear any stale
+ * cancellation.  Returns 0 on error.
+ */
+static int client_wake_init(mb_client_t *mb) {
+  if (!client_wake_open(mb))
+    return 0;
+
+  client_drain(mb);
+  mb->cancel = 0;
+
+  return 1;
+}
+
+#ifdef __GNUC__
+static void http_fail(mb_http_t *h, int result, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+#endif /* __GNUC__ */
+
+static void http_fail(mb_http_t *h, int result, const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(h->error, sizeof(h->error), fmt, ap);
+  va_end(ap);
+  h->result = result;
+}
+
+#ifdef __GNUC__
+static void conn_fail(mb_http_conn_t *c, int result, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+#endif /* __GNUC__ */
+
+/*
+ * Fail a connection.  Only used for errors which end it; see
+ * conn_error() for ones which leave other addresses to try.
+ */
+static void conn_fail(mb_http_conn_t *c, int result, const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(c->error, sizeof(c->error), fmt, ap);
+  va_end(ap);
+  c->result = result;
+  c->state = MB_CONN_FAILED;
+
+  if (c->fd >= 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+}
+
+static uint64_t http_timer(uint64_t timeout) {
+  return timeout ? mb_now_ns() + timeout : 0;
+}
+
+/*
+ * Build a connection's request.  Only the Host header (and the URL,
+ * when going through a proxy) differ between servers.
+ */
+static void http_request(mb_http_t *h, mb_http_conn_t *c) {
+  mb_strbuf_t *b = &(c->req);
+
+  sb_str(b, h->body ? "POST " : "GET ");
+  if (h->proxy) {
+    sb_str(b, "http://");
+    sb_hostport(b, c->server->host, c->server->port);
+  }
+  sb_cat(b, h->path, h->path_len);
+  sb_str(b, " HTTP/1.0\r\nHost: ");
+  sb_hostport(b, c->server->host, c->server->port);
+  sb_str(b, "\r\nUser-Agent: mb-ruby/" MB_VERSION "\r\n");
+#ifdef HAVE_ZLIB_H
+  if (h->compress)
+    sb_str(b, "Accept-Encoding: gzip, deflate\r\n");
+#endif /* HAVE_ZLIB_H */
+  if (*h->etag) {
+    sb_str(b, "If-None-Match: ");
+    sb_str(b, h->etag);
+    sb_str(b, "\r\n");
+  }
+  if (*h->modified) {
+    sb_str(b, "If-Modified-Since: ");
+    sb_str(b, h->modified);
+    sb_str(b, "\r\n");
+  }
+  if (h->body) {
+    sb_str(b, "Content-Type: text/plain\r\nContent-Length: ");
+    sb_int(b, strlen(MB_HTTP_RDF_HEAD) + strlen(h->body) + strlen(MB_HTTP_RDF_TAIL));
+    sb_str(b, "\r\n\r\n" MB_HTTP_RDF_HEAD);
+    sb_str(b, h->body);
+    sb_str(b, MB_HTTP_RDF_TAIL);
+  } else {
+    sb_str(b, "\r\n");
+  }
+}
+
+/*
+ * Start connecting to the next of the connection's addresses, or fail
+ * the connection (keeping the last error) if there are none left.
+ */
+static void conn_connect(mb_http_t *h, mb_http_conn_t *c) {
+  mb_addr_t *a;
+  int one = 1;
+
+  while (c->next_addr < c->addrs->num) {
+    a = c->addrs->addrs + c->next_addr++;
+
+    if ((c->fd = socket(a->family, a->socktype, a->protocol)) < 0) {
+      conn_fail(c, MB_HTTP_ERROR, "couldn't create socket: %s", strerror(errno));
+      continue;
+    }
+
+    fcntl(c->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!connect(c->fd, (struct sockaddr*) &(a->addr), a->len)) {
+      c->state = MB_CONN_SEND;
+      c->timer = http_timer(h->read_timeout);
+      return;
+    } else if (errno == EINPROGRESS) {
+      c->state = MB_CONN_CONNECT;
+      c->timer = http_timer(h->connect_timeout);
+      return;
+    }
+
+    conn_fail(c, MB_HTTP_ERROR, "couldn't connect to %s:%d: %s", c->host->host, c->host->port, strerror(errno));
+  }
+
+  /* none of the addresses work: maybe the host moved */
+  server_expire(c->host, c->addrs);
+  c->state = MB_CONN_FAILED;
+}
+
+/*
+ * Fail a connection whose host couldn't be resolved.
+ */
+static void conn_unresolved(mb_http_conn_t *c, int err) {
+  conn_fail(c, MB_HTTP_ERROR, "couldn't resolve \"%s\": %s", c->host->host, gai_strerror(err));
+  c->fatal = (err != EAI_AGAIN);
+}
+
+/*
+ * Connect once the resolver has finished with a connection's host.
+ */
+static void conn_resolve(mb_http_t *h, mb_http_conn_t *c) {
+  int err;
+
+  if ((c->addrs = server_resolved(c->host, &(h->client->stats), c->resolve_gen, &err)) != NULL)
+    conn_connect(h, c);
+  else if (err)
+    conn_unresolved(c, err);
+}
+
+/*
+ * Start a request to a server.
+ */
+static void conn_start(mb_http_t *h, mb_http_conn_t *c, mb_server_t *server, int hedge, int probe) {
+  int err;
+
+  memset(c, 0, sizeof(mb_http_conn_t));
+  c->server = server;
+  c->hedge = hedge;
+  c->probe = probe;
+  c->fd = -1;
+  c->hdr = c->len = -1;
+  c->start = mb_now_ns();
+  c->conditional = *h->etag || *h->modified;
+
+  /* connect to the proxy (if there is one) instead of the server */
+  c->host = h->proxy ? h->proxy : server;
+
+  http_request(h, c);
+  if (c->req.err) {
+    conn_fail(c, MB_HTTP_ERROR, "couldn't allocate memory for request");
+    c->fatal = 1;
+    return;
+  }
+
+  if ((c->addrs = server_addrs(c->host, &(h->client->stats), &err, &(c->resolve_gen))) != NULL) {
+    conn_connect(h, c);
+  } else if (!err) {
+    /* wait for the resolver (see conn_resolve()) */
+    c->state = MB_CONN_RESOLVE;
+    c->timer = http_timer(h->connect_timeout);
+  } else {
+    conn_unresolved(c, err);
+  }
+}
+
+#ifdef HAVE_ZLIB_H
+/*
+ * Set up decompression for a response's Content-Encoding (the value
+ * of the header).  Returns 0 on error.
+ */
+static int conn_encoding(mb_http_conn_t *c, const char *val) {
+  val += strspn(val, " \t");
+  if (!strncasecmp(val, "identity", 8))
+    return 1;
+
+  if (strncasecmp(val, "gzip", 4) && strncasecmp(val, "x-gzip", 6) && strncasecmp(val, "deflate", 7)) {
+    conn_fail(c, MB_HTTP_ERROR, "unsupported content encoding from server: %.*s",
+              (int) strcspn(val, "\r\n"), val);
+    c->fatal = 1;
+    return 0;
+  }
+
+  /* 32 detects gzip or zlib framing (see conn_inflate() for raw
+   * deflate) */
+  if (inflateInit2(&(c->z), 15 + 32) != Z_OK) {
+    conn_fail(c, MB_HTTP_ERROR, "couldn't allocate memory for decompression");
+    c->fatal = 1;
+    return 0;
+  }
+  c->zipped = 1;
+  c->zerr = Z_OK;
+
+  return 1;
+}
+
+/*
+ * Inflate the compressed body received so far, and drop it from the
+ * response buffer, so a large response is never held compressed and
+ * inflated at once.  Returns 0 on error.
+ */
+static int conn_inflate(mb_http_conn_t *c) {
+  mb_strbuf_t *b = &(c->res);
+  size_t len = b->len - c->hdr;
+
+  c->z.next_in = (Bytef*) b->ptr + c->hdr;
+  c->z.avail_in = (uInt) len;
+
+  while (c->z.avail_in > 0 && c->zerr == Z_OK) {
+    if (!sb_reserve(&(c->body), MB_HTTP_READSIZ)) {
+      conn_fail(c, MB_HTTP_ERROR, "couldn't allocate memory for response");
+      c->fatal = 1;
+      return 0;
+    }
+
+    c->z.next_out = (Bytef*) c->body.ptr + c->body.len;
+    c->z.avail_out = MB_HTTP_READSIZ;
+    c->zerr = inflate(&(c->z), Z_NO_FLUSH);
+    c->body.len += MB_HTTP_READSIZ - c->z.avail_out;
+    c->body.ptr[c->body.len] = '\0';
+
+    /* some servers send raw deflate data for "deflate" */
+    if (c->zerr == Z_DATA_ERROR && !c->zraw && !c->zlen && !c->body.len &&
+        inflateReset2(&(c->z), -15) == Z_OK) {
+      c->zraw = 1;
+      c->zerr = Z_OK;
+      c->z.next_in = (Bytef*) b->ptr + c->hdr;
+      c->z.avail_in = (uInt) len;
+    } else if (c->zerr == Z_BUF_ERROR) {
+      c->zerr = Z_OK;
+      break;
+    }
+  }
+
+  c->zlen += len;
+  b->len = c->hdr;
+  b->ptr[b->len] = '\0';
+
+  if (c->zerr != Z_OK && c->zerr != Z_STREAM_END) {
+    conn_fail(c, MB_HTTP_ERROR, "invalid compressed response from server: %s",
+              c->z.msg ? c->z.msg : "unknown error");
+    return 0;
+  }
+
+  return 1;
+}
+#endif /* HAVE_ZLIB_H */
+
+/*
+ * Copy a response header's value (up to the end of the line), or
+ * leave the buffer empty if it doesn't fit; a truncated validator
+ * would never match.
+ */
+static void conn_header(char *buf, size_t buf_len, const char *val) {
+  size_t len;
+
+  val += strspn(val, " \t");
+  len = strcspn(val, "\r\n");
+  while (len > 0 && (val[len - 1] == ' ' || val[len - 1] == '\t'))
+    len--;
+
+  if (len < buf_len) {
+    memcpy(buf, val, len);
+    buf[len] = '\0';
+  } else {
+    *buf = '\0';
+  }
+}
+
+/*
+ * Body bytes received so far.
+ */
+static long conn_received(const mb_http_conn_t *c) {
+#ifdef HAVE_ZLIB_H
+  return (long) c->res.len - c->hdr + c->zlen;
+#else /* !HAVE_ZLIB_H */
+  return (long) c->res.len - c->hdr;
+#endif /* HAVE_ZLIB_H */
+}
+
+/*
+ * The response is complete: parse the status line and move the body
+ * to the start of the buffer.
+ */
+static void conn_finish(mb_http_conn_t *c) {
+  mb_strbuf_t *b = &(c->res);
+  char *p;
+
+  close(c->fd);
+  c->fd = -1;
+
+  if (strncmp(b->ptr ? b->ptr : "", "HTTP/1.", 7) || (p = strchr(b->ptr, ' ')) == NULL) {
+    conn_fail(c, MB_HTTP_ERROR, "invalid response from server");
+    return;
+  }
+  c->status = (int) strtol(p + 1, NULL, 10);
+
+  if (c->hdr < 0) {
+    conn_fail(c, MB_HTTP_ERROR, "truncated response from server");
+    return;
+  } else if (c->status == 304 && c->conditional) {
+    /* the cached response is current, so there's no body */
+    c->not_modified = 1;
+    b->len = 0;
+    b->ptr[0] = '\0';
+    c->state = MB_CONN_DONE;
+    return;
+  } else if (c->status != 200) {
+    /* server errors and "too many requests" may pass */
+    conn_fail(c, MB_HTTP_ERROR, "server returned HTTP status %d", c->status);
+    c->fatal = c->status < 500 && c->status != 429;
+    return;
+  }
+
+#ifdef HAVE_ZLIB_H
+  /* the body was inflated as it arrived */
+  if (c->zipped) {
+    if (c->zerr != Z_STREAM_END) {
+      conn_fail(c, MB_HTTP_ERROR, "truncated compressed response from server");
+      return;
+    }
+    free(b->ptr);
+    *b = c->body;
+    memset(&(c->body), 0, sizeof(mb_strbuf_t));
+    c->state = MB_CONN_DONE;
+    return;
+  }
+#endif /* HAVE_ZLIB_H */
+
+  if (c->len >= 0 && (long) b->len > c->hdr + c->len)
+    b->len = c->hdr + c->len;
+  memmove(b->ptr, b->ptr + c->hdr, b->len - c->hdr + 1);
+  b->len -= c->hdr;
+  b->ptr[b->len] = '\0';
+
+  c->state = MB_CONN_DONE;
+}
+
+/*
+ * Make progress on a connection whose socket is ready.
+ */
+static void conn_step(mb_http_t *h, mb_http_conn_t *c) {
+  mb_strbuf_t *b = &(c->res);
+  socklen_t len;
+  long n;
+  char *p;
+  int err;
+
+  if (c->state == MB_CONN_CONNECT) {
+    len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len))
+      err = errno;
+    if (err) {
+      conn_fail(c, MB_HTTP_ERROR, "couldn't connect to %s:%d: %s", c->host->host, c->host->port, strerror(err));
+      conn_connect(h, c);
+      return;
+    }
+
+    c->state = MB_CONN_SEND;
+    c->timer = http_timer(h->read_timeout);
+  }
+
+  if (c->state == MB_CONN_SEND) {
+    while (c->sent < c->req.len) {
+      if ((n = send(c->fd, c->req.ptr + c->sent, c->req.len - c->sent, MSG_NOSIGNAL)) >= 0) {
+        c->sent += n;
+        c->timer = http_timer(h->read_timeout);
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else if (errno != EINTR) {
+        conn_fail(c, MB_HTTP_ERROR, "couldn't send request: %s", strerror(errno));
+        return;
+      }
+    }
+
+    /* wait for the response */
+    c->state = MB_CONN_READ;
+    return;
+  }
+
+  /* read until the server closes the connection, or we have
+   * Content-Length bytes of body */
+  for (;;) {
+    if (!sb_reserve(b, MB_HTTP_READSIZ)) {
+      conn_fail(c, MB_HTTP_ERROR, "couldn't allocate memory for response");
+      c->fatal = 1;
+      return;
+    }
+
+    if ((n = recv(c->fd, b->ptr + b->len, MB_HTTP_READSIZ, 0)) > 0) {
+      b->len += n;
+      b->ptr[b->len] = '\0';
+      c->timer = http_timer(h->read_timeout);
+    } else if (!n) {
+      conn_finish(c);
+      return;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else if (errno != EINTR) {
+      conn_fail(c, MB_HTTP_ERROR, "couldn't read response: %s", strerror(errno));
+      return;
+    }
+
+    /* find the end of the headers, the content length, and the
+     * content encoding */
+    if (c->hdr < 0 && (p = strstr(b->ptr, "\r\n\r\n")) != NULL) {
+      c->hdr = p + 4 - b->ptr;
+      for (p = strchr(b->ptr, '\n'); p && p < b->ptr + c->hdr; p = strchr(p, '\n')) {
+        p++;
+        if (!strncasecmp(p, "Content-Length:", 15))
+          c->len = strtol(p + 15, NULL, 10);
+        else if (!strncasecmp(p, "ETag:", 5))
+          conn_header(c->etag, sizeof(c->etag), p + 5);
+        else if (!strncasecmp(p, "Last-Modified:", 14))
+          conn_header(c->modified, sizeof(c->modified), p + 14);
+#ifdef HAVE_ZLIB_H
+        else if (!strncasecmp(p, "Content-Encoding:", 17) && !conn_encoding(c, p + 17))
+          return;
+#endif /* HAVE_ZLIB_H */
+      }
+    }
+
+#ifdef HAVE_ZLIB_H
+    if (c->zipped && !conn_inflate(c))
+      return;
+#endif /* HAVE_ZLIB_H */
+
+    if (c->hdr >= 0 && c->len >= 0 && conn_received(c) >= c->len) {
+      conn_finish(c);
+      return;
+    }
+  }
+}
+
+/*
+ * A connection's lookup, connect, write, or read timer expired.  If
+ * it was connecting, try the server's next address.
+ */
+static void conn_timeout(mb_http_t *h, mb_http_conn_t *c) {
+  switch (c->state) {
+  case MB_CONN_RESOLVE:
+    conn_fail(c, MB_HTTP_TIMEOUT, "couldn't resolve \"%s\": timed out", c->host->host);
+    break;
+  case MB_CONN_CONNECT:
+    conn_fail(c, MB_HTTP_TIMEOUT, "connect timed out");
+    conn_connect(h, c);
+    break;
+  case MB_CONN_SEND:
+    conn_fail(c, MB_HTTP_TIMEOUT, "write timed out");
+    break;
+  default:
+    conn_fail(c, MB_HTTP_TIMEOUT, "read timed out");
+  }
+}
+
+static int conn_active(const mb_http_conn_t *c) {
+  return c->state != MB_CONN_DONE && c->state != MB_CONN_FAILED;
+}
+
+/*
+ * Start a request to the next server that's in rotation.  Returns 0
+ * if there are none left.
+ */
+static int http_start(mb_http_t *h, int hedge) {
+  mb_server_t *s;
+  int probe;
+
+  while (h->next_server < h->num_servers) {
+    s = h->servers[h->next_server++];
+    if (server_acquire(s, hedge, &probe)) {
+      conn_start(h, h->conns + h->num_conns++, s, hedge, probe);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Close the request's connections, and track latency and health.
+ */
+static void http_finish(mb_http_t *h) {
+  mb_http_conn_t *c;
+  uint64_t now = mb_now_ns();
+  int i, outcome;
+
+  for (i = 0; i < h->num_conns; i++) {
+    c = h->conns + i;
+
+    if (c->state == MB_CONN_DONE)
+      outcome = MB_OUTCOME_OK;
+    else if (c->state != MB_CONN_FAILED)
+      outcome = MB_OUTCOME_ABANDONED;
+    else if (c->result == MB_HTTP_TIMEOUT)
+      outcome = MB_OUTCOME_TIMEOUT;
+    else
+      outcome = MB_OUTCOME_ERROR;
+    server_release(c->server, outcome, now - c->start, c->hedge && i == h->winner, c->probe);
+
+    if (c->fd >= 0)
+      close(c->fd);
+    if (c->addrs)
+      addrs_put(c->addrs);
+#ifdef HAVE_ZLIB_H
+    if (c->zipped)
+      inflateEnd(&(c->z));
+    free(c->body.ptr);
+#endif /* HAVE_ZLIB_H */
+    free(c->req.ptr);
+    free(c->res.ptr);
+  }
+  h->num_conns = 0;
+}
+
+/*
+ * Send the request to the first server and wait for the response.  If
+ * a request fails, fail over to the next server.  If hedging, send a
+ * duplicate to the next server when the first hasn't answered within
+ * hedge_delay, and take whichever response arrives first.  Runs
+ * without the global interpreter lock.  If the thread is interrupted,
+ * returns with h->suspended set, and can be called again to carry on
+ * (or http_finish() to give up).
+ */
+static void *http_run(void *ptr) {
+  mb_http_t *h = ptr;
+  mb_http_conn_t *c, *polled[MB_HTTP_CONNS];
+  struct pollfd fds[MB_HTTP_CONNS + 1];
+  uint64_t now, until;
+  int i, n, active, ms, hedge;
+
+  h->suspended = 0;
+  for (;;) {
+    if (*h->cancel) {
+      http_fail(h, MB_HTTP_CANCELLED, "query cancelled");
+      break;
+    }
+
+    now = mb_now_ns();
+    for (i = 0, active = 0; i < h->num_conns; i++) {
+      c = h->conns + i;
+      if (c->state == MB_CONN_RESOLVE)
+        conn_resolve(h, c);
+      if (conn_active(c) && c->timer && c->timer <= now)
+        conn_timeout(h, c);
+      if (c->state == MB_CONN_DONE)
+        break;
+      active += conn_active(c);
+    }
+
+    /* first response wins */
+    if (i < h->num_conns) {
+      h->winner = i;
+#ifdef HAVE_ZLIB_H
+      if (c->zipped) {
+        MB_STATS_COUNT(&(h->client->stats), compressed_bytes, c->zlen);
+        MB_STATS_COUNT(&(h->client->stats), uncompressed_bytes, c->res.len);
+      }
+#endif /* HAVE_ZLIB_H */
+      h->not_modified = c->not_modified;
+      memcpy(h->res_etag, c->etag, sizeof(h->res_etag));
+      memcpy(h->res_modified, c->modified, sizeof(h->res_modified));
+      h->server = c->server;
+      h->res = c->res;
+      memset(&(c->res), 0, sizeof(mb_strbuf_t));
+      h->result = MB_HTTP_OK;
+      break;
+    }
+
+    /* start the first request, fail over if every request so far has
+     * failed, or hedge if the first is taking too long */
+    if (!h->num_conns || !active || (h->hedge_at && now >= h->hedge_at)) {
+      hedge = h->num_conns && active;
+      h->hedge_at = 0;
+
+      if (http_start(h, hedge)) {
+        if (h->num_conns == 1 && h->hedge && h->hedge_delay)
+          h->hedge_at = h->conns[0].start + h->hedge_delay;
+        continue;
+      } else if (!h->num_conns) {
+        http_fail(h, MB_HTTP_ERROR, "no servers available (all are out of rotation)");
+        break;
+      }
+    }
+
+    if (!active) {
+      /* report the error from the last request */
+      c = h->conns + h->num_conns - 1;
+      http_fail(h, c->result, "%s", c->error);
+      h->retriable = !c->fatal;
+      h->server = c->server;
+      break;
+    }
+
+    if (h->deadline && now >= h->deadline) {
+      http_fail(h, MB_HTTP_TIMEOUT, "query deadline exceeded");
+      break;
+    }
+
+    /* wait until the first of: the deadline, the hedge, a
+     * connection's timer, or the next check on the resolver */
+    until = h->deadline;
+    if (h->hedge_at && (!until || h->hedge_at < until))
+      until = h->hedge_at;
+
+    for (i = 0, n = 0; i < h->num_conns; i++) {
+      c = h->conns + i;
+      if (!conn_active(c))
+        continue;
+      if (c->timer && (!until || c->timer < until))
+        until = c->timer;
+      if (c->state == MB_CONN_RESOLVE) {
+        if (!until || now + MB_DNS_POLL < until)
+          until = now + MB_DNS_POLL;
+        continue;
+      }
+
+      polled[n] = c;
+      fds[n].fd = c->fd;
+      fds[n].events = (c->state == MB_CONN_READ) ? POLLIN : POLLOUT;
+      fds[n].revents = 0;
+      n++;
+    }
+
+    fds[n].fd = h->wake;
+    fds[n].events = POLLIN;
+    fds[n].revents = 0;
+
+    /* round up, so we don't wake just short of the limit */
+    now = mb_now_ns();
+    ms = until ? ((until > now) ? (int) ((until - now + 999999) / 1000000) : 0) : -1;
+
+    if (poll(fds, n + (h->wake >= 0), ms) < 0) {
+      if (errno == EINTR)
+        continue;
+      http_fail(h, MB_HTTP_ERROR, "poll failed: %s", strerror(errno));
+      break;
+    }
+
+    if (h->wake >= 0 && fds[n].revents) {
+      client_drain(h->client);
+      if (*h->cancel) {
+        http_fail(h, MB_HTTP_CANCELLED, "query cancelled");
+        break;
+      }
+      if (*h->interrupted) {
+        h->suspended = 1;
+        return NULL;
+      }
+    }
+
+    for (i = 0; i < n; i++)
+      if (fds[i].revents)
+        conn_step(h, polled[i]);
+  }
+
+  http_finish(h);
+  return NULL;
+}
+
+/*
+ * Interrupt a request (or retry backoff) from another thread, so the
+ * interrupt can be handled with the global interpreter lock.
+ */
+static void http_ubf(void *ptr) {
+  mb_client_t *mb = ptr;
+  mb->interrupted = 1;
+  client_notify(mb);
+}
+
+/*
+ * The outcome of a request, copied out of its mb_http_t (which
+ * http_cleanup() frees) for http_send().
+ */
+typedef struct {
+  mb_http_t *h;
+  mb_strbuf_t res;
+  int result, retriable, not_modified;
+  char error[MB_ERR_BUFSIZ];
+  char etag[MB_CACHE_VALIDATOR], modified[MB_CACHE_VALIDATOR];
+  mb_server_t *server; /* referenced */
+} mb_http_call_t;
+
+static VALUE http_call(VALUE ptr) {
+  mb_http_call_t *call = (mb_http_call_t*) ptr;
+  mb_http_t *h = call->h;
+
+  do {
+    h->client->interrupted = 0;
+    mb_without_gvl(http_run, h, http_ubf, h->client);
+
+    /* raises if the interrupt was Thread#kill, Thread#raise, etc */
+    if (h->suspended)
+      mb_check_ints();
+  } while (h->suspended);
+  h->done = 1;
+
+  return Qnil;
+}
+
+/*
+ * Copy out the outcome of a request, and free it.  If the thread was
+ * killed (or had an exception raised in it) during the request, the
+ * response is freed too.
+ */
+static VALUE http_cleanup(VALUE ptr) {
+  mb_http_call_t *call = (mb_http_call_t*) ptr;
+  mb_http_t *h = call->h;
+  int i;
+
+  if (h->done) {
+    call->res = h->res;
+    call->result = h->result;
+    call->retriable = h->retriable;
+    call->not_modified = h->not_modified;
+    if ((call->server = h->server) != NULL) {
+      MB_SERVERS_LOCK();
+      call->server->refs++;
+      MB_SERVERS_UNLOCK();
+    }
+    memcpy(call->error, h->error, sizeof(call->error));
+    memcpy(call->etag, h->res_etag, sizeof(call->etag));
+    memcpy(call->modified, h->res_modified, sizeof(call->modified));
+  } else {
+    http_finish(h);
+    free(h->res.ptr);
+  }
+
+  for (i = 0; i < h->num_servers; i++)
+    server_put(h->servers[i]);
+  if (h->proxy)
+    server_put(h->proxy);
+  free(h);
+  call->h = NULL;
+
+  return Qnil;
+}
+
+/*
+ * Pick a server with the client's balancing policy.  Returns the index
+ * of the server, or -1 to go by latency.  Called with the lock held.
+ */
+static int client_balance(mb_client_t *mb, uint64_t now) {
+  mb_server_t *s, *b;
+  int i, best = -1, total = 0;
+
+  if (mb->num_servers < 2)
+    return -1;
+
+  switch (mb->balance) {
+  case MB_BALANCE_ROUND_ROBIN:
+    /* smooth weighted round-robin, as in nginx: every server's current
+     * weight grows by its weight, and the heaviest is picked and cut
+     * back by the total */
+    for (i = 0; i < mb->num_servers; i++) {
+      if (!server_available(mb->servers[i], now))
+        continue;
+      mb->current[i] += mb->weights[i];
+      total += mb->weights[i];
+      if (best < 0 || mb->current[i] > mb->current[best])
+        best = i;
+    }
+    if (best >= 0)
+      mb->current[best] -= total;
+    break;
+  case MB_BALANCE_LEAST_OUTSTANDING:
+    /* fewest requests in progress per unit of weight, counting the
+     * one we're about to send; ties go to the faster server */
+    for (i = 0; i < mb->num_servers; i++) {
+      s = mb->servers[i];
+      if (!server_available(s, now))
+        continue;
+      if (best >= 0) {
+        b = mb->servers[best];
+        if ((s->outstanding + 1) * mb->weights[best] > (b->outstanding + 1) * mb->weights[i] ||
+            ((s->outstanding + 1) * mb->weights[best] == (b->outstanding + 1) * mb->weights[i] &&
+             !server_slower(b, s)))
+          continue;
+      }
+      best = i;
+    }
+    break;
+  }
+
+  return best;
+}
+
+static int http_send(mb_client_t *mb, mb_request_t *req) {
+  mb_http_call_t call;
+  mb_http_t *h;
+  mb_server_t *s;
+  const char *url;
+  size_t url_len;
+  int ok = 0, i, j;
+
+  if (!client_expand(mb, req)) {
+    client_error(mb, "query can't be sent over HTTP");
+    return 0;
+  }
+
+  /* retries keep the cancellation state of the first attempt */
+  if (!(req->attempt ? client_wake_open(mb) : client_wake_init(mb))) {
+    client_error(mb, "couldn't create pipe: %s", strerror(errno));
+    return 0;
+  }
+
+  /* mb_http_t is too big for the stack */
+  if ((h = calloc(1, sizeof(mb_http_t))) == NULL) {
+    client_error(mb, "couldn't allocate memory for request");
+    return 0;
+  }
+
+  /* split "GET <url>" or "POST <url>\n<query>", and find the path */
+  if (!strncmp(req->text.ptr, "POST ", 5)) {
+    url = req->text.ptr + 5;
+    h->body = strchr(url, '\n') + 1;
+    url_len = h->body - url - 1;
+  } else {
+    url = req->text.ptr + 4;
+    url_len = strlen(url);
+  }
+  if ((h->path = memchr(url + 7, '/', url_len - 7)) != NULL) {
+    h->path_len = url + url_len - h->path;
+  } else {
+    h->path = "/";
+    h->path_len = 1;
+  }
+
+  h->client = mb;
+  h->wake = mb->wake[0];
+  h->cancel = &(mb->cancel);
+  h->interrupted = &(mb->interrupted);
+  h->winner = -1;
+  h->connect_timeout = mb->connect_timeout;
+  h->read_timeout = mb->read_timeout;
+  h->deadline = req->deadline;
+  h->compress = mb->compress;
+
+  /* revalidate the cached response, if any */
+  if (req->cache) {
+    memcpy(h->etag, req->cache->etag, sizeof(h->etag));
+    memcpy(h->modified, req->cache->modified, sizeof(h->modified));
+  }
+
+  /* order servers by latency (ones we haven't heard from yet go
+   * first, so every server gets measured), then move the one picked
+   * by the balancing policy to the front; the request holds a
+   * reference to each, in case the client's servers are changed
+   * while it runs */
+  MB_SERVERS_LOCK();
+  if ((h->proxy = mb->proxy) != NULL)
+    h->proxy->refs++;
+  for (i = 0; i < mb->num_servers; i++) {
+    s = mb->servers[i];
+    s->refs++;
+    for (j = i; j > 0 && server_slower(h->servers[j - 1], s); j--)
+      h->servers[j] = h->servers[j - 1];
+    h->servers[j] = s;
+  }
+  h->num_servers = mb->num_servers;
+
+  if ((i = client_balance(mb, mb_now_ns())) >= 0) {
+    s = mb->servers[i];
+    for (j = 0; h->servers[j] != s; j++)
+      ;
+    for (; j > 0; j--)
+      h->servers[j] = h->servers[j - 1];
+    h->servers[0] = s;
+  }
+  MB_SERVERS_UNLOCK();
+
+  if (mb->hedge && h->num_servers > 1) {
+    h->hedge = 1;
+    h->hedge_delay = server_percentile(h->servers[0], mb->hedge);
+  }
+
+  /* free the request even if the thread is killed during it */
+  memset(&call, 0, sizeof(call));
+  call.h = h;
+  rb_ensure(http_call, (VALUE) &call, http_cleanup, (VALUE) &call);
+
+  if (call.result != MB_HTTP_OK)
+    client_error(mb, "%s", call.error);
+  else
+    ok = 1;
+
+  /* hand the body to http_recv() */
+  if (ok)
+    req->res = call.res;
+  else
+    free(call.res.ptr);
+  req->timed_out = (call.result == MB_HTTP_TIMEOUT);
+  req->retriable = call.retriable;
+  req->server = call.server;
+  req->not_modified = ok && call.not_modified;
+  memcpy(req->etag, call.etag, sizeof(req->etag));
+  memcpy(req->modified, call.modified, sizeof(req->modified));
+
+  return ok;
+}
+
+static int http_recv(mb_client_t *mb, mb_request_t *req, mb_strbuf_t *b) {
+  UNUSED(mb);
+  *b = req->res;
+  memset(&(req->res), 0, sizeof(mb_strbuf_t));
+  return b->ptr != NULL;
+}
+
+static const mb_transport_vt transport_http = {
+  "http",
+  MB_TRANSPORT_CONDITIONAL,
+  http_send,
+  http_recv,
+  NULL,
+};
+
+static void transport_free(mb_client_t *mb) {
+  if (mb->transport && mb->transport->free && mb->transport_data)
+    mb->transport->free(mb->transport_data);
+  mb->transport = NULL;
+  mb->transport_data = NULL;
+}
+
+/*
+ * Start resolving the client's servers and proxy, if the http
+ * transport (the only one that uses them) is active.
+ */
+static void client_prefetch(mb_client_t *mb) {
+  int i;
+
+  if (mb->transport != &transport_http)
+    return;
+
+  for (i = 0; i < mb->num_servers; i++)
+    server_prefetch(mb->servers[i]);
+  if (mb->proxy)
+    server_prefetch(mb->proxy);
+}
+
+/*
+ * Raise an exception if transport t (NULL for the client's) can't
+ * honor what (a timeout, deadline, or cancellation), rather than
+ * quietly ignoring it.
+ */
+static void client_check_blocking(mb_client_t *mb, const mb_transport_vt *t, const char *what) {
+  if (!t)
+    t = mb->transport ? mb->transport : &transport_network;
+  if (t->flags & MB_TRANSPORT_BLOCKING)
+    rb_raise(eErr, "the %s transport doesn't support %s (use the http transport)", t->name, what);
+}
+
+typedef struct {
+  mb_client_t *client;
+  uint64_t until;
+  int cancelled, suspended;
+} mb_sleep_t;
+
+static void *client_sleep_run(void *ptr) {
+  mb_sleep_t *s = ptr;
+  mb_client_t *mb = s->client;
+  struct pollfd fd;
+  uint64_t now;
+
+  fd.fd = mb->wake[0];
+  fd.events = POLLIN;
+
+  s->suspended = 0;
+  while (!mb->cancel && (now = mb_now_ns()) < s->until) {
+    fd.revents = 0;
+    if (poll(&fd, (fd.fd >= 0) ? 1 : 0, (int) ((s->until - now + 999999) / 1000000)) > 0) {
+      client_drain(mb);
+      if (!mb->cancel && mb->interrupted) {
+        s->suspended = 1;
+        break;
+      }
+    }
+  }
+
+  s->cancelled = mb->cancel;
+  return NULL;
+}
+
+/*
+ * Sleep for ns nanoseconds without the global interpreter lock, or
+ * until the query is cancelled (see MusicBrainz::Client#cancel).
+ * Returns 0 if it was cancelled.
+ */
+static int client_sleep(mb_client_t *mb, uint64_t ns) {
+  mb_sleep_t s;
+
+  s.client = mb;
+  s.until = mb_now_ns() + ns;
+  s.cancelled = 0;
+  client_wake_open(mb);
+
+  do {
+    mb->interrupted = 0;
+    mb_without_gvl(client_sleep_run, &s, http_ubf, mb);
+
+    /* raises if the interrupt was Thread#kill, Thread#raise, etc */
+    if (s.suspended)
+      mb_check_ints();
+  } while (s.suspended);
+
+  return !s.cancelled;
+}
+
+/*
+ * Next number from the client's xorshift64* generator, for backoff
+ * jitter.
+ */
+static uint64_t client_random(mb_client_t *mb) {
+  mb->rng ^= mb->rng >> 12;
+  mb->rng ^= mb->rng << 25;
+  mb->rng ^= mb->rng >> 27;
+  return mb->rng * 2685821657736338717ULL;
+}
+
+/*
+ * Add a request's share of retry budget to a server, or (if take is
+ * set) take a retry out of it.  Returns 0 if the budget is spent.
+ */
+static int server_budget(mb_server_t *s, double share, int take) {
+  int ok = 1;
+
+  MB_SERVERS_LOCK();
+  if (take) {
+    if ((ok = (s->retry_tokens >= 1)) != 0)
+      s->retry_tokens -= 1;
+  } else if ((s->retry_tokens += share) > MB_RETRY_TOKENS) {
+    s->retry_tokens = MB_RETRY_TOKENS;
+  }
+  MB_SERVERS_UNLOCK();
+
+  return ok;
+}
+
+/*
+ * Decide whether to retry a failed request, and wait out the backoff
+ * if so.  Returns 1 to retry.
+ *
+ * Backoff is exponential with full jitter: a random delay between 0
+ * and min(max_backoff, backoff * 2^attempt).  A retry also needs a
+ * token from the server's retry budget (see server_budget()), and
+ * must be able to start before the deadline.
+ */
+static int client_retry(mb_client_t *mb, mb_request_t *req) {
+  mb_server_t *server = req->server ? req->server : mb->servers[0];
+  uint64_t delay;
+
+  if (!req->retriable || req->attempt + 1 >= mb->retry_attempts)
+    return 0;
+
+  delay = mb->retry_backoff << ((req->attempt < 32) ? req->attempt : 32);
+  if (delay > mb->retry_max_backoff || delay < mb->retry_backoff)
+    delay = mb->retry_max_backoff;
+  delay = delay ? client_random(mb) % (delay + 1) : 0;
+
+  if (req->deadline && mb_now_ns() + delay >= req->deadline)
+    return 0;
+
+  if (!server_budget(server, 0, 1)) {
+    MB_STATS_COUNT(&(mb->stats), retries_denied, 1);
+    return 0;
+  }
+
+  /* drop the expanded request, so nothing leaks if the thread is
+   * killed while we sleep; the next attempt rebuilds it */
+  free(req->text.ptr);
+  memset(&(req->text), 0, sizeof(mb_strbuf_t));
+  req->expanded = 0;
+
+  if (delay && !client_sleep(mb, delay)) {
+    client_error(mb, "query cancelled");
+    return 0;
+  }
+
+  MB_STATS_COUNT(&(mb->stats), retries, 1);
+  req->attempt++;
+
+  return 1;
+}
+
+/*
+ * Remember a response the client just loaded, with its validators, so
+ * the next request for it can be conditional.  Takes over the body.
+ * Cached responses without validators are sent unconditionally.
+ */
+static void cache_store(mb_client_t *mb, mb_request_t *req, mb_strbuf_t *b) {
+  mb_cache_entry_t *e;
+
+  if ((e = req->cache) == NULL) {
+    if (!client_expand(mb, req) || req->text.err ||
+        (e = calloc(1, sizeof(mb_cache_entry_t))) == NULL)
+      return;
+    if ((e->key = malloc(req->text.len + 1)) == NULL) {
+      free(e);
+      return;
+    }
+    memcpy(e->key, req->text.ptr, req->text.len + 1);
+    e->key_len = req->text.len;
+    e->hash = cache_hash(e->key, e->key_len);
+
+    e->next = mb->cache;
+    mb->cache = e;
+    mb->cache_len++;
+    mb->cache_size += cache_entry_size(e);
+    req->cache = e;
+  }
+
+  mb->cache_size += b->len - e->body_len;
+  free(e->body);
+  e->body = b->ptr;
+  e->body_len = b->len;
+  e->gen = mb->rdf_gen;
+  memcpy(e->etag, req->etag, sizeof(e->etag));
+  memcpy(e->modified, req->modified, sizeof(e->modified));
+  memset(b, 0, sizeof(mb_strbuf_t));
+
+  /* a response too big for the cache on its own isn't kept (it's the
+   * most recently used, so it's first) */
+  if (cache_entry_size(e) > mb->cache_max_size) {
+    mb->cache = e->next;
+    mb->cache_len--;
+    mb->cache_size -= cache_entry_size(e);
+    cache_entry_free(e);
+    req->cache = NULL;
+  }
+
+  if (mb->cache_len > mb->cache_max || mb->cache_size > mb->cache_max_size)
+    cache_trim(mb, mb->cache_max, mb->cache_max_size);
+}
+
+/*
+ * The server says the cached response is current: load it, unless
+ * it's still loaded, in which case rewind to the top of the result the
+ * way loading it would.  Returns 0 on error.
+ */
+static int cache_load(mb_client_t *mb, mb_request_t *req) {
+  mb_cache_entry_t *e = req->cache;
+
+  MB_STATS_COUNT(&(mb->stats), revalidation_hits, 1);
+
+  /* a 304 may carry new validators */
+  if (*req->etag)
+    memcpy(e->etag, req->etag, sizeof(e->etag));
+  if (*req->modified)
+    memcpy(e->modified, req->modified, sizeof(e->modified));
+
+  if (e->gen == mb->rdf_gen) {
+    mb_Select(mb->mb, (char*) MBS_Rewind);
+    return 1;
+  }
+
+  if (!client_set_rdf(mb, e->body, e->body_len))
+    return 0;
+  e->gen = mb->rdf_gen;
+
+  return 1;
+}
+
+/*
+ * Send a query with the client's transport, and load the result,
+ * retrying failed requests if the client has a retry policy (see
+ * MusicBrainz::Client#retries=).  Transports that support it
+ * revalidate a cached copy of the response instead of fetching it
+ * again, if the client keeps one (see MusicBrainz::Client#revalidate=).
+ * Returns 1 on success, MB_SEND_CACHED if the cached response was
+ * current, 0 on error, or MB_SEND_TIMEOUT if the deadline (or a
+ * timeout) expired.
+ */
+#define MB_SEND_TIMEOUT -1
+#define MB_SEND_CACHED  2
+
+typedef struct {
+  mb_client_t *client;
+  const mb_transport_vt *transport;
+  mb_request_t req;
+  int ok;
+} mb_send_t;
+
+static VALUE client_send_run(VALUE ptr) {
+  mb_send_t *s = (mb_send_t*) ptr;
+  mb_client_t *mb = s->client;
+  const mb_transport_vt *t = s->transport;
+  mb_request_t *req = &(s->req);
+  mb_strbuf_t b;
+  int ok;
+
+  if (mb->cache_max && (t->flags & MB_TRANSPORT_CONDITIONAL) &&
+      client_expand(mb, req) && !req->text.err &&
+      (req->cache = cache_find(mb, req->text.ptr, req->text.len)) != NULL &&
+      (*req->cache->etag || *req->cache->modified))
+    MB_STATS_COUNT(&(mb->stats), revalidations, 1);
+
+  for (;;) {
+    req->timed_out = req->retriable = req->not_modified = 0;
+    if (req->server)
+      server_put(req->server);
+    req->server = NULL;
+
+    if ((ok = t->send(mb, req)) && !(t->flags & MB_TRANSPORT_LOADED)) {
+      if (req->not_modified && req->cache) {
+        ok = cache_load(mb, req);
+      } else {
+        memset(&b, 0, sizeof(b));
+        ok = t->recv(mb, req, &b) && client_set_rdf(mb, b.ptr, b.len);
+        /* a response without validators replaces a cached one, but
+         * isn't worth caching otherwise */
+        if (ok && mb->cache_max && (req->cache || *req->etag || *req->modified))
+          cache_store(mb, req, &b);
+        free(b.ptr);
+      }
+    }
+    free(req->res.ptr);
+    memset(&(req->res), 0, sizeof(mb_strbuf_t));
+
+    /* each query earns its server a fraction of a retry */
+    if (!req->attempt && mb->retry_attempts > 1)
+      server_budget(req->server ? req->server : mb->servers[0], mb->retry_budget, 0);
+
+    if (ok || mb->retry_attempts < 2 || !client_retry(mb, req))
+      break;
+  }
+
+  s->ok = ok;
+  return Qnil;
+}
+
+/*
+ * Free the request, even if the thread was killed during it.
+ */
+static VALUE client_send_cleanup(VALUE ptr) {
+  mb_send_t *s = (mb_send_t*) ptr;
+
+  free(s->req.text.ptr);
+  free(s->req.res.ptr);
+  if (s->req.server)
+    server_put(s->req.server);
+
+  return Qnil;
+}
+
+static int client_send(mb_client_t *mb, const char *query, int argc, char **args, uint64_t deadline) {
+  mb_send_t s;
+
+  /* don't start a request that's already out of time */
+  if (deadline && mb_now_ns() >= deadline) {
+    client_error(mb, "query deadline exceeded");
+    return MB_SEND_TIMEOUT;
+  }
+
+  memset(&s, 0, sizeof(s));
+  s.client = mb;
+  s.transport = mb->transport ? mb->transport : &transport_network;
+  s.req.query = query;
+  s.req.args = args;
+  s.req.argc = argc;
+  s.req.deadline = deadline;
+
+  rb_ensure(client_send_run, (VALUE) &s, client_send_cleanup, (VALUE) &s);
+
+  if (s.req.timed_out)
+    return MB_SEND_TIMEOUT;
+  return (s.ok && s.req.not_modified) ? MB_SEND_CACHED : s.ok;
+}
+
+/*
+ * Get the name of the transport used by this MusicBrainz::Client object
+ * for queries: "network", "http", "record", or "replay" (see
+ * MusicBrainz::Client#transport=).
+ *
+ * Example:
+ *   puts 'replaying' if mb.transport == 'replay'
+ *
+ */
+static VALUE mb_client_transport(VALUE self) {
+  mb_client_t *mb;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  return rb_str_new2(mb->transport ? mb->transport->name : transport_network.name);
+}
+
+/*
+ * Does the client have a timeout or deadline set?
+ */
+static int client_has_timeouts(mb_client_t *mb) {
+  return mb->connect_timeout || mb->read_timeout || mb->timeout || mb->deadline;
+}
+
+/*
+ * Set the transport used by this MusicBrainz::Client object for queries
+ * that aren't answered by a local index.
+ *
+ * Transports:
+ *   network::      the MusicBrainz library's HTTP client (the default)
+ *   http::         a built-in HTTP client which, unlike the library's,
+ *                  honors timeouts (see MusicBrainz::Client#timeout=)
+ *                  and can be interrupted by
+ *                  MusicBrainz::Client#cancel; uses the same server
+ *                  and proxy settings
+ *   record::       same as network, but each request and its response
+ *                  is appended to the given file
+ *   replay::       answers queries from a file written by the record
+ *                  transport, which is loaded into memory; the network
+ *                  is never used, and queries that weren't recorded
+ *                  fail (see MusicBrainz::Client#error)
+ *
+ * Requests are matched by the URL or RDF query the MusicBrainz library
+ * would send, so a recording can only be replayed with the same
+ * server, depth, and max_items settings.  Queries that aren't sent to
+ * the server as-is (eg MusicBrainz::Query::GetCDInfo) aren't recorded,
+ * and can't be replayed.
+ *
+ * Raises MusicBrainz::Error if the file can't be opened or isn't a
+ * valid recording, or if a timeout or deadline is set and the
+ * transport is network or record (which can't honor them).
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_transport
+ *
+ * Examples:
+ *   # record queries to traffic.rec
+ *   mb.set_transport :record, 'traffic.rec'
+ *
+ *   # later, replay them without a network
+ *   mb.transport = :replay, 'traffic.rec'
+ *
+ *   # back to the network
+ *   mb.transport = :network
+ *
+ */
+static VALUE mb_client_set_transport(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  const mb_transport_vt *vt;
+  VALUE name, path;
+  const char *str, *err = NULL;
+  void *data = NULL;
+
+  /* mb.transport = :record, 'path' passes an array */
+  if (argc == 1 && TYPE(argv[0]) == T_ARRAY) {
+    argc = (int) RARRAY_LEN(argv[0]);
+    argv = RARRAY_PTR(argv[0]);
+  }
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  rb_scan_args(argc, argv, "11", &name, &path);
+  if (SYMBOL_P(name))
+    name = rb_funcall(name, rb_intern("to_s"), 0);
+  str = StringValueCStr(name);
+
+  if (!strcmp(str, transport_network.name)) {
+    vt = NULL;
+    if (client_has_timeouts(mb))
+      client_check_blocking(mb, &transport_network, "timeouts");
+  } else if (!strcmp(str, transport_http.name)) {
+    vt = &transport_http;
+  } else if (!strcmp(str, transport_record.name)) {
+    vt = &transport_record;
+    if (client_has_timeouts(mb))
+      client_check_blocking(mb, vt, "timeouts");
+    if (NIL_P(path))
+      rb_raise(eErr, "missing recording path");
+    if ((data = fopen(StringValueCStr(path), "ab")) == NULL)
+      err = strerror(errno);
+  } else if (!strcmp(str, transport_replay.name)) {
+    vt = &transport_replay;
+    if (NIL_P(path))
+      rb_raise(eErr, "missing recording path");
+    data = replay_load(StringValueCStr(path), &err);
+  } else {
+    rb_raise(eErr, "unknown transport: %s", str);
+    return Qnil;
+  }
+
+  if (err)
+    rb_raise(eErr, "couldn't load \"%s\": %s", RSTRING_PTR(path), err);
+
+  transport_free(mb);
+  mb->transport = vt;
+  mb->transport_data = data;
+  client_prefetch(mb);
+
+  return self;
+}
+
+/*
+ * Convert a number of seconds (nil for none) to nanoseconds.
+ */
+static uint64_t secs_to_ns(VALUE secs) {
+  double d;
+
+  if (NIL_P(secs))
+    return 0;
+  if ((d = NUM2DBL(secs)) < 0)
+    rb_raise(eErr, "invalid timeout: %f", d);
+
+  /* round tiny timeouts up, since 0 means none */
+  return (d > 0 && d < 1e-9) ? 1 : (uint64_t) (d * 1e9);
+}
+
+/*
+ * Get the deadline for a query started at start: the earlier of the
+ * client's deadline and its timeout (or the timeout: option).
+ */
+static uint64_t client_deadline(mb_client_t *mb, VALUE opts, uint64_t start) {
+  uint64_t timeout = mb->timeout, deadline;
+  VALUE val;
+
+  if (!NIL_P(opts)) {
+    val = rb_hash_aref(opts, ID2SYM(rb_intern("timeout")));
+    if (!NIL_P(val) && (timeout = secs_to_ns(val)) != 0)
+      client_check_blocking(mb, NULL, "timeouts");
+  }
+
+  deadline = timeout ? start + timeout : 0;
+  if (mb->deadline && (!deadline || mb->deadline < deadline))
+    deadline = mb->deadline;
+
+  return deadline;
+}
+
+/*
+ * Set the connect timeout (in seconds) for this MusicBrainz::Client
+ * object, or nil for none (the default).  Applies to each address of
+ * the server; if one times out, the next is tried.
+ *
+ * Note: timeouts, deadlines, and MusicBrainz::Client#cancel need the
+ * "http" (or "replay") transport (see MusicBrainz::Client#transport=);
+ * the MusicBrainz library's own HTTP client can't be interrupted, so
+ * setting them with the "network" or "record" transport raises
+ * MusicBrainz::Error.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_connect_timeout
+ *
+ * Examples:
+ *   mb.transport = :http
+ *   mb.connect_timeout = 0.5
+ *
+ */
+static VALUE mb_client_set_connect_timeout(VALUE self, VALUE secs) {
+  mb_client_t *mb;
+  uint64_t ns = secs_to_ns(secs);
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  if (ns)
+    client_check_blocking(mb, NULL, "timeouts");
+  mb->connect_timeout = ns;
+  return self;
+}
+
+/*
+ * Set the read timeout (in seconds) for this MusicBrainz::Client
+ * object, or nil for none (the default).  This is the longest the
+ * client will wait for the server to send (or accept) more data, not a
+ * limit on the whole response; see MusicBrainz::Client#timeout= for
+ * that.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_read_timeout
+ *
+ * Examples:
+ *   mb.transport = :http
+ *   mb.read_timeout = 5
+ *
+ */
+static VALUE mb_client_set_read_timeout(VALUE self, VALUE secs) {
+  mb_client_t *mb;
+  uint64_t ns = secs_to_ns(secs);
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  if (ns)
+    client_check_blocking(mb, NULL, "timeouts");
+  mb->read_timeout = ns;
+  return self;
+}
+
+/*
+ * Set the default timeout (in seconds) for each query made with this
+ * MusicBrainz::Client object, or nil for none (the default).  Queries
+ * that run out of time raise MusicBrainz::TimeoutError.  Can be
+ * overridden per query with the timeout: option of
+ * MusicBrainz::Client#query.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_timeout
+ *
+ * Examples:
+ *   mb.transport = :http
+ *   mb.timeout = 10
+ *
+ */
+static VALUE mb_client_set_timeout(VALUE self, VALUE secs) {
+  mb_client_t *mb;
+  uint64_t ns = secs_to_ns(secs);
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  if (ns)
+    client_check_blocking(mb, NULL, "timeouts");
+  mb->timeout = ns;
+  return self;
+}
+
+/*
+ * Set a deadline (a Time) for all queries made with this
+ * MusicBrainz::Client object, or nil for none (the default).
+ *
+ * Unlike MusicBrainz::Client#timeout=, which limits each query, the
+ * deadline covers everything done until it's cleared, so a caller
+ * with a fixed time budget for a series of queries can set it once.
+ * Queries made after the deadline raise MusicBrainz::TimeoutError
+ * without contacting the server.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_deadline
+ *
+ * Examples:
+ *   # look up a whole album, but give up after 30 seconds
+ *   mb.transport = :http
+ *   mb.deadline = Time.now + 30
+ *   tracks.each { |id| mb.query MusicBrainz::Query::GetTrackById, id }
+ *   mb.deadline = nil
+ *
+ */
+static VALUE mb_client_set_deadline(VALUE self, VALUE time) {
+  mb_client_t *mb;
+  struct timeval tv;
+  double left;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  if (NIL_P(time)) {
+    mb->deadline = 0;
+    return self;
+  }
+  client_check_blocking(mb, NULL, "deadlines");
+
+  /* convert from wall-clock time to the monotonic clock */
+  gettimeofday(&tv, NULL);
+  left = NUM2DBL(rb_funcall(time, rb_intern("to_f"), 0)) - (tv.tv_sec + tv.tv_usec / 1e6);
+  mb->deadline = mb_now_ns() + ((left > 0) ? (uint64_t) (left * 1e9) : 0);
+
+  return self;
+}
+
+/*
+ * Cancel the query in progress (if any) on this MusicBrainz::Client
+ * object.  Meant to be called from another thread; the query returns
+ * false, and MusicBrainz::Client#error returns "query cancelled".
+ * Does nothing if no query is in progress.
+ *
+ * Note: only queries sent with the "http" transport can be cancelled
+ * (see MusicBrainz::Client#transport=); raises MusicBrainz::Error with
+ * the "network" or "record" transport.
+ *
+ * Examples:
+ *   th = Thread.new { mb.query MusicBrainz::Query::FindTrackByName, name }
+ *   sleep 1
+ *   mb.cancel
+ *   puts 'Error: ' << mb.error unless th.value
+ *
+ */
+static VALUE mb_client_cancel(VALUE self) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  client_check_blocking(mb, NULL, "cancellation");
+  client_wake(mb);
+  return self;
+}
+
+/*
+ * Set the retry policy for queries made with this MusicBrainz::Client
+ * object: either the number of attempts (including the first), a hash
+ * of options, or nil to disable retries (the default).
+ *
+ * Options:
+ *   attempts::      attempts per query, including the first (default 3)
+ *   backoff::       seconds to wait before the first retry (default
+ *                   0.05); doubles with each retry
+ *   max_backoff::   longest wait between attempts, in seconds (default
+ *                   2)
+ *   budget::        retries a server may get, as a percentage of the
+ *                   queries sent to it (default 10)
+ *
+ * Waits are picked at random between 0 and the backoff ("full
+ * jitter"), so clients that fail together don't retry together.
+ *
+ * Only failures that may be transient are retried: connection errors,
+ * connect and read timeouts, and HTTP 5xx and 429 responses.  The
+ * "network" and "record" transports can't tell why the MusicBrainz
+ * library failed, so they retry every failure.  Cancelled queries,
+ * queries that run out of time (see MusicBrainz::Client#timeout=), and
+ * the "replay" transport are never retried.
+ *
+ * So that retries can't pile extra load onto an overloaded server,
+ * each server has a retry budget shared by every client in the
+ * process.  Each query sent to a server adds a fraction of a retry to
+ * the budget (up to 10 saved up), and each retry takes a whole one;
+ * once the budget is spent, failures aren't retried until it has been
+ * refilled.  The "retries" and "retries_denied" entries of
+ * MusicBrainz::Client#stats count retries sent and refused.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_retries
+ *
+ * Examples:
+ *   # up to 3 attempts per query
+ *   mb.retries = 3
+ *
+ *   # up to 5 attempts, starting at 100ms apart, with a 20% budget
+ *   mb.retries = { :attempts => 5, :backoff => 0.1, :budget => 20 }
+ *
+ */
+static VALUE mb_client_set_retries(VALUE self, VALUE policy) {
+  mb_client_t *mb;
+  VALUE val;
+  int attempts;
+  double budget;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+
+  if (!RTEST(policy)) {
+    mb->retry_attempts = 1;
+    return self;
+  }
+
+  if (TYPE(policy) != T_HASH) {
+    attempts = NUM2INT(policy);
+    policy = Qnil;
+  } else {
+    val = rb_hash_aref(policy, ID2SYM(rb_intern("attempts")));
+    attempts = NIL_P(val) ? 3 : NUM2INT(val);
+  }
+  if (attempts < 1)
+    rb_raise(eErr, "invalid number of attempts: %d", attempts);
+
+  mb->retry_backoff = MB_RETRY_BACKOFF;
+  mb->retry_max_backoff = MB_RETRY_MAX_BACKOFF;
+  mb->retry_budget = MB_RETRY_BUDGET;
+
+  if (!NIL_P(policy)) {
+    if (!NIL_P(val = rb_hash_aref(policy, ID2SYM(rb_intern("backoff")))))
+      mb->retry_backoff = secs_to_ns(val);
+    if (!NIL_P(val = rb_hash_aref(policy, ID2SYM(rb_intern("max_backoff")))))
+      mb->retry_max_backoff = secs_to_ns(val);
+    if (!NIL_P(val = rb_hash_aref(policy, ID2SYM(rb_intern("budget"))))) {
+      if ((budget = NUM2DBL(val)) < 0)
+        rb_raise(eErr, "invalid retry budget: %f", budget);
+      mb->retry_budget = budget / 100;
+    }
+  }
+  mb->retry_attempts = attempts;
+
+  return self;
+}
+
+/*
+ * Query the MusicBrainz server with this MusicBrainz::Client object.
+ *
+ * Returns true if the query was successful (even if it didn't return
+ * any results).  If the client has a local index (see
+ * MusicBrainz::Client#index=) that can answer the query, the server
+ * isn't contacted at all.  Otherwise the query goes through the
+ * client's transport (see MusicBrainz::Client#transport=).
+ *
+ * An optional hash of options may follow the query arguments:
+ *   timeout::    seconds the query may take (nil for the default set
+ *                with MusicBrainz::Client#timeout=)
+ *
+ * Raises MusicBrainz::TimeoutError if the query runs out of time (see
+ * MusicBrainz::Client#timeout=).
+ *
+ * See the MusicBrainz::Query documentation for information on various
+ * query types.
+ *
+ * Examples:
+ *   # get general return status of prior query
+ *   mb.query MusicBrainz::Query::GetStatus
+ *
+ *   # query the MusicBrainz server for an album titled "Airdrawndagger"
+ *   # by an artist "Sasha"
+ *   mb.query MusicBrainz::Query::AlbumFindAlbum,
+ *            'Sasha',
+ *            'Airdrawndagger'
+ *
+ *   # give up on an album search after 2.5 seconds
+ *   mb.transport = :http
+ *   mb.query MusicBrainz::Query::FindAlbumByName, 'Dummy', :timeout => 2.5
+ *
+ */
+typedef struct {
+  mb_client_t *client;
+  const char *obj;
+  char **args;
+  int argc, local, sent;
+  uint64_t deadline;
+} mb_query_t;
+
+/*
+ * Run a query with arguments, locally if possible.
+ */
+static VALUE client_query_run(VALUE ptr) {
+  mb_query_t *q = (mb_query_t*) ptr;
+
+  if ((q->local = client_index_query(q->client, q->obj, q->argc, q->args)) == 0) {
+    MB_PROBE2(server__start, q->obj, q->argc);
+    q->sent = client_send(q->client, q->obj, q->argc, q->args, q->deadline);
+  }
+
+  return Qnil;
+}
+
+/*
+ * Free a query's argument list, even if the query raised.
+ */
+static VALUE client_query_free(VALUE ptr) {
+  free(((mb_query_t*) ptr)->args);
+  return Qnil;
+}
+
+static VALUE mb_client_query(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  VALUE ret = Qfalse, opts = Qnil;
+  char *obj, **args;
+  uint64_t start = mb_now_ns(), finish, deadline;
+  int i, local = 0, len, sent = 0;
+  mb_query_t q;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  *mb->error = '\0';
+
+  /* trailing option hash */
+  if (argc > 1 && TYPE(argv[argc - 1]) == T_HASH)
+    opts = argv[--argc];
+  deadline = client_deadline(mb, opts, start);
+
+  switch (argc) {
+    case 0:
+      rb_raise(eErr, "Invalid argument count: %d.", argc);
+      break;
+    case 1:
+      obj = StringValueCStr(argv[0]);
+      MB_PROBE3(query__start, obj, 0, NULL);
+      MB_PROBE2(server__start, obj, 0);
+      sent = client_send(mb, obj, 0, NULL, deadline);
+      ret = (sent > 0) ? Qtrue : Qfalse;
+      break;
+    default:
+      /* grab object */
+      obj = RSTRING(argv[0])->ptr;
+
+      /* allocate argument list */
+      if ((args = malloc(sizeof(char*) * argc)) == NULL)
+        rb_raise(eErr, "couldn't allocate query argument list");
+
+      /* add each argument list, then terminate the list  */
+      for (i = 1; i < argc; i++)
+        args[i - 1] = RSTRING(argv[i])->ptr;
+      args[argc - 1] = NULL;
+      MB_PROBE3(query__start, obj, argc - 1, args[0]);
+
+      /* execute query (locally if possible), and free the argument
+       * list even if sending the query raises */
+      memset(&q, 0, sizeof(q));
+      q.client = mb;
+      q.obj = obj;
+      q.args = args;
+      q.argc = argc - 1;
+      q.deadline = deadline;
+      rb_ensure(client_query_run, (VALUE) &q, client_query_free, (VALUE) &q);
+
+      local = q.local;
+      sent = q.sent;
+      ret = (local || sent > 0) ? Qtrue : Qfalse;
+  }
+
+  /* update statistics */
+  finish = stats_time(&(mb->stats), MB_STATS_QUERY, start, RTEST(ret));
+  stats_query(&(mb->stats), obj);
+  if (local)
+    MB_STATS_COUNT(&(mb->stats), local_queries, 1);
+  len = RTEST(ret) ? mb_GetResultRDFLen(mb->mb) : 0;
+  if (!local)
+    MB_PROBE3(server__done, obj, RTEST(ret), len);
+  if (len > 0) {
+    if (!local && sent != MB_SEND_CACHED)
+      MB_STATS_COUNT(&(mb->stats), bytes_received, len);
+    MB_STATS_COUNT(&(mb->stats), rdf_bytes, len);
+    MB_STATS_COUNT(&(mb->stats), rdf_len[stats_bucket(len)], 1);
+  }
+  MB_PROBE4(query__done, obj, RTEST(ret), len, local);
+
+  if (MB_EVENT_ON(MB_STATS_QUERY))
+    event_fire(MB_STATS_QUERY, start, finish, argv[0], rb_ary_new4(argc - 1, argv + 1), len, RTEST(ret));
+
+  if (sent == MB_SEND_TIMEOUT)
+    rb_raise(eTimeout, "%s", mb->error);
+
+  return ret;
+}
+
+/*
+ * Get web-based MusicBrainz CD-ROM submission URL for CD-ROM device associated with this MusicBrainz::Client object.
+ *
+ * Use MusicBrainz::Client#device to set the CD-ROM device. Returns nil
+ * on error.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#get_url
+ *   MusicBrainz::Client#get_web_submit_url
+ *
+ * Examples:
+ *   url = mb.url
+ *   url = mb.get_url
+ *   url = mb.get_web_submit_url
+ *
+ */
+static VALUE mb_client_url(VALUE self) {
+  mb_client_t *mb;
+  MB_BUFFER buf[MB_HOST_BUFSIZ];
+  VALUE ret = Qnil;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  if (mb_GetWebSubmitURL(mb->mb, buf, sizeof(buf)))
+    ret = rb_str_new2(buf);
+
+  return ret;
+}
+
+/*
+ * Retrieve error from last call to MusicBrainz::Client#query with this MusicBrainz::Client object.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#get_error
+ *   MusicBrainz::Client#get_query_error
+ *
+ * Example:
+ *   # simple query and error return
+ *   query = MusicBrainz::Query::GetStatus
+ *   puts 'Error: ' << mb.error unless mb.query query
+ *
+ */
+static VALUE mb_client_error(VALUE self) {
+  mb_client_t *mb;
+  MB_BUFFER buf[MB_ERR_BUFSIZ];
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  if (*mb->error)
+    return rb_str_new2(mb->error);
+  mb_GetQueryError(mb->mb, buf, sizeof(buf));
+
+  return rb_str_new2(buf);
+}
+  
+/*
+ * Select a context in the query result of this MusicBrainz::Client object.
+ *
+ * Returns true if the select query was successful (even if it didn't
+ * return any results).
+ *
+ * See the MusicBrainz::Query documentation for information on various
+ * query types.
+ *
+ * Examples:
+ *   # return to the top-level context of the current query
+ *   mb.select MusicBrainz::Query::Rewind
+ *
+ *   # select the second artist from a query that returned a list of
+ *   # artists
+ *   mb.select MusicBrainz::Query::SelectArtist, 2
+ *
+ */
+static VALUE mb_client_select(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  VALUE ret = Qfalse;
+  char *obj;
+  int i, *args;
+  uint64_t start = mb_now_ns(), finish;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  switch (argc) {
+    case 0:
+      rb_raise(eErr, "Invalid argument count: %d.", argc);
+      break;
+    case 1:
+      ret = mb_Select(mb->mb, StringValueCStr(argv[0])) ? Qtrue : Qfalse;
+      break;
+    case 2:
+      obj = StringValueCStr(argv[0]);
+      i = FIX2INT(argv[1]);
+      ret = mb_Select1(mb->mb, obj, i) ? Qtrue : Qfalse;
+      break;
+    default:
+      /* grab object */
+      obj = StringValueCStr(argv[0]);
+
+      /* allocate argument list */
+      if ((args = malloc(sizeof(int) * argc)) == NULL)
+        rb_raise(eErr, "couldn't allocate memory for argument list");
+
+      /* add arguments to list and NULL-terminate list */
+      for (i = 1; i < argc; i++)
+        args[i - 1] = FIX2INT(argv[i]);
+      args[argc - 1] = 0;
+
+      /* run query and free argument list */
+      ret = mb_SelectWithArgs(mb->mb, obj, args) ? Qtrue : Qfalse;
+      free(args);
+  }
+
+  finish = stats_time(&(mb->stats), MB_STATS_SELECT, start, RTEST(ret));
+  if (MB_EVENT_ON(MB_STATS_SELECT))
+    event_fire(MB_STATS_SELECT, start, finish, argv[0], rb_ary_new4(argc - 1, argv + 1), -1, RTEST(ret));
+
+  return ret;
+}
+
+/* 
+ * Extract a piece of information from the data returned by a successful query by a MusicBrainz::Client object.
+ *
+ * Returns nil if there was an error or if the correct piece of data was
+ * not found.
+ *
+ * Note: Certain result queries require an ordinal argument.  See the
+ * MusicBrainz result query (MBE_*) documentation for additional
+ * information.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#get_result 
+ *   MusicBrainz::Client#get_result_data
+ *
+ * Examples:
+ *   # get the name of the currently selected album
+ *   album_name = mb.result MusicBrainz::Query::AlbumGetAlbumName
+ *
+ *   # get the duration of the 5th track on the current album
+ *   duration = mb.result MusicBrainz::Query::AlbumGetTrackDuration, 5
+ */
+static VALUE mb_client_result(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  VALUE ret = Qnil;
+  MB_BUFFER buf[MB_RESULT_BUFSIZ];
+  uint64_t start = mb_now_ns(), finish;
+  char *obj;
+  int ok = 0;
+  size_t len;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  obj = argc ? StringValueCStr(argv[0]) : NULL;
+  switch (argc) {
+    case 1:
+      ok = mb_GetResultData(mb->mb, obj, buf, sizeof(buf));
+      break;
+    case 2:
+      ok = mb_GetResultData1(mb->mb, obj, buf, sizeof(buf), FIX2INT(argv[1]));
+      break;
+    default:
+      rb_raise(eErr, "Invalid argument count: %d.", argc);
+  }
+
+  if (ok && (len = strlen(buf)) > 0) {
+    ret = rb_str_new(buf, len);
+
+    /* a full buffer means the result was (probably) cut off */
+    if (len >= sizeof(buf) - 1)
+      MB_STATS_COUNT(&(mb->stats), result_truncated, 1);
+  }
+  finish = stats_time(&(mb->stats), MB_STATS_RESULT, start, ok);
+  if (MB_EVENT_ON(MB_STATS_RESULT))
+    event_fire(MB_STATS_RESULT, start, finish, argv[0], rb_ary_new4(argc - 1, argv + 1), 
+               NIL_P(ret) ? 0 : RSTRING_LEN(ret), ok);
+
+  return ret;
+}
+
+/* 
+ * Return the integer value of a query by a MusicBrainz::Client object.
+ *
+ * Note: Certain result queries require an ordinal argument.  See the
+ * MusicBrainz result query (MBE_*) documentation for additional
+ * information.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#result_int
+ *   MusicBrainz::Client#get_result_int
+ *
+ * Examples:
+ *   # get the name of the currently selected album
+ *   album_name = mb.result MusicBrainz::Query::AlbumGetAlbumName
+ *
+ *   # get the duration of the 5th track on the current album
+ *   duration = mb.result MusicBrainz::Query::AlbumGetTrackDuration, 5
+ */
+static VALUE mb_client_result_int(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  uint64_t start = mb_now_ns(), finish;
+  int ret;
+  char *obj;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  obj = argc ? StringValueCStr(argv[0]) : NULL;
+
+  switch (argc) {
+    case 1:
+      ret = mb_GetResultInt(mb->mb, obj);
+      break;
+    case 2:
+      ret = mb_GetResultInt1(mb->mb, obj, FIX2INT(argv[1]));
+      break;
+    default:
+      rb_raise(eErr, "Invalid argument count: %d.", argc);
+  }
+
+  finish = stats_time(&(mb->stats), MB_STATS_RESULT, start, 1);
+  if (MB_EVENT_ON(MB_STATS_RESULT))
+    event_fire(MB_STATS_RESULT, start, finish, argv[0], rb_ary_new4(argc - 1, argv + 1), -1, 1);
+
+  return INT2FIX(ret);
+}
+
+/* 
+ * See if a piece of information exists in data returned by a successful query by a MusicBrainz::Client object.
+ *
+ * Note: Certain result queries require an ordinal argument.  See the
+ * MusicBrainz result query (MBE_*) documentation for additional
+ * information.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#result_exists?
+ *   MusicBrainz::Client#does_result_exist?
+ *
+ * Examples:
+ *   # does the current album have a name?
+ *   puts 'named album' if mb.exists? MusicBrainz::Query::AlbumGetAlbumName
+ *
+ *   # does the current album have a type?
+ *   puts 'has a type' if mb.exists? MusicBrainz::Query::AlbumGetAlbumType
+ */
+static VALUE mb_client_exists(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  VALUE ret = Qfalse;
+  uint64_t start = mb_now_ns(), finish;
+  char *obj;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  obj = argc ? StringValueCStr(argv[0]) : NULL;
+  switch (argc) {
+    case 1:
+      ret = mb_DoesResultExist(mb->mb, obj) ? Qtrue : Qfalse;
+      break;
+    case 2:
+      ret = mb_DoesResultExist1(mb->mb, obj, FIX2INT(argv[1])) ? Qtrue : Qfalse;
+      break;
+    default:
+      rb_raise(eErr, "Invalid argument count: %d.", argc);
+  }
+
+  finish = stats_time(&(mb->stats), MB_STATS_RESULT, start, 1);
+  if (MB_EVENT_ON(MB_STATS_RESULT))
+    event_fire(MB_STATS_RESULT, start, finish, argv[0], rb_ary_new4(argc - 1, argv + 1), -1, 1);
+
+  return ret;
+}
+
+/*
+ * Get the RDF that was returned by the server of a MusicBrainz::Client object.
+ *
+ * Returns nil if a string could not be allocated or if there was an
+ * error.
+ * 
+ * Aliases:
+ *   MusicBrainz::Client#get_rdf
+ *   MusicBrainz::Client#result_rdf
+ *   MusicBrainz::Client#get_result_rdf
+ *   
+ * Example:
+ *   rdf = mb.rdf
+ *
+ */
+static VALUE mb_client_rdf(VALUE self) {
+  mb_client_t *mb;
+  VALUE ret = Qnil;
+  char *buf;
+  int len;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  if ((len = mb_GetResultRDFLen(mb->mb)) > 0) {
+    if ((buf = malloc(len + 1)) != NULL) {
+      mb_GetResultRDF(mb->mb, buf, len + 1);
+      ret = rb_str_new(buf, len);
+      free(buf);
+    } else {
+      rb_raise(eErr, "couldn't allocate memory for RDF buffer");
+    }
+  }
+
+  return ret;
+}
+
+/*
+ * Get the length of the RDF that was returned by the server of a MusicBrainz::Client object.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#get_rdf_len
+ *   MusicBrainz::Client#result_rdf_len
+ *   MusicBrainz::Client#get_result_rdf_len
+ *   
+ * Example:
+ *   rdf_len = mb.rdf_len
+ *
+ */
+static VALUE mb_client_rdf_len(VALUE self) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  return INT2FIX(mb_GetResultRDFLen(mb->mb));
+}
+
+/*
+ * Set the RDF to use for data extraction for a MusicBrainz::Client object.
+ *
+ * Note: Advanced users only.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#set_rdf
+ *   MusicBrainz::Client#result_rdf=
+ *   MusicBrainz::Client#set_result_rdf
+ *
+ * Example:
+ *   mb.rdf = result_rdf
+ *
+ */
+static VALUE mb_client_set_rdf(VALUE self, VALUE rdf) {
+  mb_client_t *mb;
+  char *str;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  str = StringValueCStr(rdf);
+
+  return client_set_rdf(mb, str, RSTRING_LEN(rdf)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Extract the actual artist/album/track ID from a MBE_GetxxxxxId query.
+ *
+ * The MBE_GETxxxxxId queries return a URL where additional RDF metadata
+ * for a given ID can be retrieved.  Callers may wish to extract only
+ * the ID of an artist/album/track for reference.
+ *
+ * If as_mbid is true, the ID is returned as a MusicBrainz::MBID (or
+ * nil if the URL doesn't end in a valid ID) instead of a string.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#get_id_from_url
+ *
+ * Examples:
+ *   # get the artist name of the first track on the album
+ *   url = mb.result MusicBrainz::Query::AlbumGetArtistId, 1
+ *   id = mb.id_from_url url
+ *
+ *   # get the same ID as a MusicBrainz::MBID
+ *   id = mb.id_from_url url, true
+ *   
+ */
+static VALUE mb_client_id_from_url(int argc, VALUE *argv, VALUE self) {
+  mb_client_t *mb;
+  MB_BUFFER buf[MB_ID_BUFSIZ];
+  unsigned char id[MB_MBID_LEN];
+  VALUE url, as_mbid;
+
+  rb_scan_args(argc, argv, "11", &url, &as_mbid);
+
+  if (RTEST(as_mbid)) {
+    StringValue(url);
+    return mbid_parse(RSTRING_PTR(url), RSTRING_LEN(url), id) ? mbid_new(id) : Qnil;
+  }
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  mb_GetIDFromURL(mb->mb, StringValueCStr(url), buf, sizeof(buf));
+
+  return rb_str_new2(buf);
+}
+
+/*
+ * Extract an identifier fragment from a URL.
+ *
+ * Given a URI, this method will return the string that follows the #
+ * separator (e.g. when passed
+ * "http://musicbrainz.org/mm/mq-1.1#ArtistResult", this method will
+ * return "ArtistResult").
+ * 
+ *
+ * Aliases:
+ *   MusicBrainz::Client#get_fragment_from_url
+ *
+ * Examples:
+ *   # get the artist name of the first track on the album
+ *   url = mb.result MusicBrainz::Query::AlbumGetArtistId, 1
+ *   frag = mb.fragment_from_url url
+ *   
+ */
+static VALUE mb_client_frag_from_url(VALUE self, VALUE url) {
+  mb_client_t *mb;
+  MB_BUFFER buf[MB_FRAG_BUFSIZ];
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  mb_GetFragmentFromURL(mb->mb, StringValueCStr(url), buf, sizeof(buf));
+
+  return rb_str_new2(buf);
+}
+
+/*
+ * Get the ordinal (list position) of an item in a list.
+ *
+ * Normally used to retrieve the track number out of a list of tracks in
+ * an album.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#get_ordinal
+ *   MusicBrainz::Client#get_ordinal_from_list
+ *
+ * Examples:
+ *   # get the ordinal of a track based on the URI
+ *   list = mb.result MusicBrainz::Query::AlbumGetTrackList
+ *   uri  = mb.result MusicBrainz::Query::AlbumGetTrackId, 5
+ *   ordinal = mb.ordinal list, uri
+ *   
+ */
+static VALUE mb_client_ordinal(VALUE self, VALUE list, VALUE uri) {
+  mb_client_t *mb;
+  Data_Get_Struct(self, mb_client_t, mb);
+  return INT2FIX(mb_GetOrdinalFromList(mb->mb, StringValueCStr(list), StringValueCStr(uri)));
+}
+
+/* 
+ * Calculate the SHA1 hash for a given filename.
+ *
+ * The hash is calculated natively (see MusicBrainz.sha1), without
+ * blocking other Ruby threads.  Returns a 40 character hex string.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#calculate_sha1
+ *
+ * Examples:
+ *   sha1 = mb.sha1 'foo.mp3'
+ *
+ */
+static VALUE mb_client_sha1(VALUE self, VALUE path) {
+  UNUSED(self);
+  return hash_file(path, MB_HASH_SHA1, 1);
+}
+
+/*
+ * Calculate the crucial pieces of information for an MP3 file.
+ *
+ * Note: This method returns the duration of the MP3 in milliseconds, so
+ * you'll need to divide the duration by 1000 before passing it to
+ * MusicBrainz::TRM methods.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#get_mp3_info
+ *
+ * Examples:
+ *   # get the duration and stereo of an MP3 named 'foo.mp3'
+ *   info = mb.mp3_info 'foo.mp3'
+ *   puts 'duration (ms): ' << info['duration'] << ', ' <<
+ *        'stereo: ' << (info['stereo'] ? 'yes' : 'no')
+ *   
+ */
+static VALUE mb_client_mp3_info(VALUE self, VALUE path) {
+  mb_client_t *mb;
+  VALUE ret = Qnil;
+  uint64_t start, finish;
+  int dr, br, st, sr;
+  char *str;
+
+  Data_Get_Struct(self, mb_client_t, mb);
+  str = StringValueCStr(path);
+
+  start = mb_now_ns();
+  if (mb_GetMP3Info(mb->mb, str, &dr, &br, &st, &sr))
+    ret = mp3_info_hash(dr, br, st, sr);
+  finish = stats_time(&(mb->stats), MB_STATS_MP3_INFO, start, !NIL_P(ret));
+  if (MB_EVENT_ON(MB_STATS_MP3_INFO))
+    event_fire(MB_STATS_MP3_INFO, start, finish, path, Qnil, -1, !NIL_P(ret));
+
+  return ret;
+}
+
+/*
+ * Launch a URL in the specified browser.
+ *
+ * Aliases:
+ *   MusicBrainz::Client#browser
+ *   MusicBrainz::Client#launch_browser
+ *
+ * Examples:
+ *   mb.launch uri, 'galeon'
+ *
+ */
+static VALUE mb_client_launch(VALUE self, VALUE url, VALUE browser) {
+  char *url_str, *browser_str;
+  url_str = url ? StringValueCStr(url) : NULL;
+  browser_str = browser ? StringValueCStr(browser) : NULL;
+  return LaunchBrowser(url_str, browser_str) ? Qtrue : Qfalse;
+}
+
+
+/*
+ * Document-class: MusicBrainz::TRM
+ *
+ * Client API to generate MusicBrainz TRM signatures.  The
+ * easiest way to explain the code is probably with a simple example.
+ *
+ *   # load the musicbrainz library
+ *   require 'musicbrainz'
+ *
+ *   # create a musicbrainz trm handle
+ *   trm = MusicBrainz::TRM.new
+ *
+ *   # prepare for CD-quality audio
+ *   samples, channels, bits = 44100, 2, 16
+ *   trm.pcm_data samples, channels, bits
+ *   
+ *   # read data from file and pass it to the TRM handle
+ *   # until MusicBrainz has enough information to generate
+ *   # a signature
+ *   while buf = fh.read(4096)
+ *     break if trm.generate_signature(buf)
+ *   end
+ *
+ *   # (alternatively, let the TRM handle read only as much of 
+ *   # the file as it needs)
+ *   # trm.feed(fh)
+ *   
+ *   # check for signature
+ *   if sig = trm.finalize_signature
+ *     # print human-readable version of signature
+ *     puts trm.convert_sig(sig)
+ *   else
+ *     $stderr.puts "Couldn't generate signature"
+ *   end
+ *
+ */
+
+/****************************/
+/* MusicBrainz::TRM methods */
+/****************************/
+
+/*
+ * TRM handle, along with enough bookkeeping to figure out how much
+ * more PCM data the signature generator needs.
+ */
+typedef struct {
+  trm_t trm;
+
+  /* audio format (set by pcm_data) and song length (set by length=) */
+  int samples, channels, bits, length;
+
+  /* number of bytes passed to trm_GenerateSignature() so far */
+  long fed;
+
+  /* set once trm_GenerateSignature() has returned true */
+  int done;
+} mb_trm_t;
+
+static void trm_free(void *ptr) {
+  mb_trm_t *t = ptr;
+  trm_Delete(t->trm);
+  free(t);
+}
+
+static VALUE mb_trm_alloc(VALUE klass) {
+  mb_trm_t *t;
+
+  if ((t = malloc(sizeof(mb_trm_t))) == NULL)
+    rb_raise(eErr, "Couldn't allocate memory for TRM structure");
+  memset(t, 0, sizeof(mb_trm_t));
+
+  return Data_Wrap_Struct(klass, 0, trm_free, t);
+}
+
+#ifndef HAVE_RB_DEFINE_ALLOC_FUNC
+/*
+ * Allocate and initialize a new MusicBrainz::TRM object.
+ *
+ * Example:
+ *   trm = MusicBrainz::TRM.new
+ */
+VALUE mb_trm_new(VALUE klass) {
+  VALUE self;
+
+  self = mb_trm_alloc(klass);
+  rb_obj_call_init(self, 0, NULL);
+
+  return self;
+}
+#endif /* !HAVE_RB_DEFINE_ALLOC_FUNC */
+
+/*
+ * :nodoc:
+ *
+ * Constructor for MusicBrainz::TRM object.
+ */
+static VALUE mb_trm_init(VALUE self) {
+  mb_trm_t *t;
+
+  Data_Get_Struct(self, mb_trm_t, t);
+  t->trm = trm_New();
+
+  return self;
+}
+
+/*
+ * Set the proxy name and port for the MusicBrainz::TRM object.
+ * 
+ * Note: If unspecified, the port defaults to 8080.
+ *
+ * Returns false if MusicBrainz could not connect to the proxy.
+ *
+ * Aliases:
+ *   MusicBrainz::TRM#set_proxy
+ *
+ * Examples:
+ *   # connect to 'proxy.localdomain', port 8080
+ *   trm.proxy = 'proxy.localdomain'
+ *
+ *   # connect to proxy.example.com, port 31337
+ *   trm.proxy = 'proxy.example.com:31337'
+ *
+ *   # connect to www.musicbrainz.org, port 8080
+ *   trm.set_proxy 'www.musicbrainz.org'
+ *
+ *   # connect to proxy.example.com, port 31337
+ *   trm.set_proxy 'proxy.example.com', 31337
+ *
+ */
+static VALUE mb_trm_set_proxy(int argc, VALUE *argv, VALUE self) {
+  mb_trm_t *t;
+  MB_BUFFER host[MB_HOST_BUFSIZ];
+  int port;
+
+  Data_Get_Struct(self, mb_trm_t, t);
+  
+  memset(host, 0, sizeof(host));
+  port = 8080;
+  
+  parse_hostspec(argc, argv, host, sizeof(host), &port);
+  
+  return trm_SetProxy(t->trm, host, port) ? Qtrue : Qfalse;
+}
+
+/*
+ * Set the PCM format of a TRM handle and reset the byte count.
+ */
+static void trm_set_format(mb_trm_t *t, int samples, int channels, int bits) {
+  t->samples = samples;
+  t->channels = channels;
+  t->bits = bits;
+  t->fed = 0;
+  t->done = 0;
+
+  trm_SetPCMDataInfo(t->trm, samples, channels, bits);
+}
+
+/*
+ * Set the information of an audio stream to be signatured.
+ *
+ * Note: this MUST be called before attempting to generate a signature.
+ *
+ * samples: samples per second (Hz) of audio data (eg 44100)
+ * channels: number of audio channels (eg 1 for mono, or two for stereo)
+ * bits: bits per sample (eg 8 or 16)
+ * 
+ * Aliases:
+ *   MusicBrainz::TRM#set_pcm_data
+ *   MusicBrainz::TRM#pcm_data_info
+ *   MusicBrainz::TRM#set_pcm_data_info
+ *
+ * Examples:
+ *   # prepare for CD-quality audio
+ *   samples, channels, bits = 44100, 2, 16
+ *   trm.pcm_data samples, channels, bits
+ *
+ */
+static VALUE mb_trm_set_pcm_data(VALUE self, VALUE samples, VALUE chans, VALUE bps) {
+  mb_trm_t *t;
+  Data_Get_Struct(self, mb_trm_t, t);
+
+  trm_set_format(t, NUM2INT(samples), NUM2INT(chans), NUM2INT(bps));
+  return self;
+}
+
+/*
+ * Set the length of an audio stream (in seconds).
+ *
+ * Note: This method is optional, but if it is called, it must be called
+ * after MusicBrainz::TRM#pcm_data and before any calls to
+ * MusicBrainz::TRM#generate_signature.
+ *
+ * Aliases:
+ *   MusicBrainz::TRM#set_length
+ *   MusicBrainz::TRM#song_length=
+ *   MusicBrainz::TRM#set_song_length
+ *
+ * Examples:
+ *   trm.length = 4000
+ */
+static VALUE mb_trm_set_length(VALUE self, VALUE len) {
+  mb_trm_t *t;
+  Data_Get_Struct(self, mb_trm_t, t);
+  t->length = NUM2INT(len);
+  trm_SetSongLength(t->trm, t->length);
+  return self;
+}
+
+/*
+ * Pass a chunk of PCM data to the signature generator and update the
+ * byte count.  Returns non-zero once the generator has enough data.
+ * Later data still goes to the generator, which decides what to do
+ * with it; only the readers (which stop at trm_bytes_needed()) skip it.
+ */
+static int trm_feed(mb_trm_t *t, char *buf, long len) {
+  uint64_t start = mb_now_ns();
+
+  MB_PROBE2(trm__chunk__start, len, t->fed);
+  t->fed += len;
+  if (trm_GenerateSignature(t->trm, buf, len))
+    t->done = 1;
+  MB_PROBE2(trm__chunk__done, len, t->done);
+
+  /* TRM generators don't belong to a client, so only count globally */
+  stats_time(NULL, MB_STATS_TRM, start, 1);
+  MB_STATS_ADD(mb_stats.trm_bytes, len);
+
+  return t->done;
+}
+
+/*
+ * Number of bytes of PCM data per second of audio, or 0 if 
+ * MusicBrainz::TRM#pcm_data hasn't been called yet.
+ */
+static long trm_bytes_per_sec(mb_trm_t *t) {
+  return (long) t->samples * t->channels * ((t->bits + 7) / 8);
+}
+
+/*
+ * Number of bytes of PCM data the signature generator still needs.
+ */
+static long trm_bytes_needed(mb_trm_t *t) {
+  long secs, bytes;
+
+  if (t->done)
+    return 0;
+
+  /* the generator never looks past the first MB_TRM_SECONDS of audio */
+  secs = MB_TRM_SECONDS;
+  if (t->length > 0 && t->length < secs)
+    secs = t->length;
+
+  bytes = secs * trm_bytes_per_sec(t) - t->fed;
+  return (bytes > 0) ? bytes : 0;
+}
+
+/*
+ * Pass raw PCM data to generate a signature.
+ *
+ * Note: MusicBrainz::TRM#pcm_data must be called before this function.
+ *
+ * Returns true if enough data has been sent to generate a signature,
+ * and false if more data is needed.
+ *
+ * Example:
+ *   trm.generate_signature buf
+ *
+ */
+static VALUE mb_trm_gen_sig(VALUE self, VALUE buf) {
+  mb_trm_t *t;
+  uint64_t start = mb_now_ns();
+  int done;
+
+  Data_Get_Struct(self, mb_trm_t, t);
+  StringValue(buf);
+
+  done = trm_feed(t, RSTRING_PTR(buf), RSTRING_LEN(buf));
+  if (MB_EVENT_ON(MB_STATS_TRM))
+    event_fire(MB_STATS_TRM, start, mb_now_ns(), Qnil, Qnil, RSTRING_LEN(buf), done);
+
+  return done ? Qtrue : Qfalse;
+}
+
+/*
+ * Get the number of bytes of PCM data still needed to generate a
+ * signature.
+ *
+ * The result is based on the audio format passed to
+ * MusicBrainz::TRM#pcm_data, the (optional) song length set with
+ * MusicBrainz::TRM#length=, and the amount of data already passed to
+ * MusicBrainz::TRM#generate_signature.  Returns 0 once the generator
+ * has enough data.  Use this to avoid reading (and decoding) more of a
+ * file than necessary.
+ *
+ * Raises MusicBrainz::Error if MusicBrainz::TRM#pcm_data hasn't been
+ * called.
+ *
+ * Aliases:
+ *   MusicBrainz::TRM#get_bytes_needed
+ *
+ * Example:
+ *   trm.pcm_data 44100, 2, 16
+ *   buf = fh.read(trm.bytes_needed)
+ *
+ */
+static VALUE mb_trm_bytes_needed(VALUE self) {
+  mb_trm_t *t;
+
+  Data_Get_Struct(self, mb_trm_t, t);
+  if (!trm_bytes_per_sec(t))
+    rb_raise(eErr, "PCM data info not set (call pcm_data first)");
+
+  return LONG2NUM(trm_bytes_needed(t));
+}
+
+/*
+ * Get the number of seconds of audio still needed to generate a
+ * signature.
+ *
+ * Same as MusicBrainz::TRM#bytes_needed, but in seconds of audio
+ * (as a Float) rather than bytes.
+ *
+ * Aliases:
+ *   MusicBrainz::TRM#get_seconds_needed
+ *
+ * Example:
+ *   puts "need #{trm.seconds_needed} more seconds of audio"
+ *
+ */
+static VALUE mb_trm_seconds_needed(VALUE self) {
+  mb_trm_t *t;
+  long bps;
+
+  Data_Get_Struct(self, mb_trm_t, t);
+  if (!(bps = trm_bytes_per_sec(t)))
+    rb_raise(eErr, "PCM data info not set (call pcm_data first)");
+
+  return rb_float_new((double) trm_bytes_needed(t) / bps);
+}
+
+/*
+ * Feeding a TRM handle from a file: the handle, the path and the file
+ * (NULL until opened), the read buffer and its size, whether the file
+ * ran out (or couldn't be opened or read), the error from opening it,
+ * and whether a signal interrupted the reader.
+ */
+typedef struct {
+  mb_trm_t *t;
+  char *path;
+  FILE *fh;
+  char *buf;
+  long len;
+  int eof, err, intr;
+} trm_read_t;
+
+/*
+ * Open the file if it isn't yet, and read it until the generator has
+ * enough data, or the file runs out.  Doesn't touch any Ruby objects,
+ * so it's safe to call without the global interpreter lock.
+ */
+static void *trm_read_blocking(void *ptr) {
+  trm_read_t *job = ptr;
+  size_t want, got;
+  long need;
+
+  if (!job->fh && (job->fh = fopen(job->path, "rb")) == NULL) {
+    if (errno == EINTR)
+      job->intr = 1;
+    else
+      job->eof = 1;
+    job->err = errno;
+    return NULL;
+  }
+
+  while ((need = trm_bytes_needed(job->t)) > 0) {
+    want = (need < job->len) ? need : job->len;
+    if ((got = fread(job->buf, 1, want, job->fh)) > 0)
+      trm_feed(job->t, job->buf, (long) got);
+
+    if (got < want) {
+      if (ferror(job->fh) && errno == EINTR) {
+        clearerr(job->fh);
+        job->intr = 1;
+      } else {
+        job->eof = 1;
+      }
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Read the file without the global interpreter lock.  An interrupt
+ * (Thread#kill, or a signal) breaks the blocking open or read; if
+ * handling it doesn't raise, the reader picks up where it left off.
+ */
+static VALUE trm_read_call(VALUE ptr) {
+  trm_read_t *job = (trm_read_t*) ptr;
+
+  while (!job->eof && trm_bytes_needed(job->t) > 0) {
+    job->intr = job->err = 0;
+    mb_without_gvl(trm_read_blocking, job, NULL, NULL);
+    if (!job->intr)
+      break;
+    mb_check_ints();
+  }
+
+  return Qnil;
+}
+
+/*
+ * Close the file and free the path and buffer, even if the thread was
+ * interrupted while reading.
+ */
+static VALUE trm_read_free(VALUE ptr) {
+  trm_read_t *job = (trm_read_t*) ptr;
+
+  if (job->fh)
+    fclose(job->fh);
+  free(job->path);
+  free(job->buf);
+  return Qnil;
+}
+
+/*
+ * Feed PCM data from a file or IO object to the signature generator.
+ *
+ * Reads only as much data as the signature generator needs (see
+ * MusicBrainz::TRM#bytes_needed) from the given path or IO object
+ * (anything that responds to "read"), and passes it to
+ * MusicBrainz::TRM#generate_signature.  Reading stops at the end of
+ * the input, or once the generator has enough data.  The optional
+ * second argument sets the read size (defaults to 64k).
+ *
+ * Returns true if enough data has been sent to generate a signature,
+ * and false if the input ran out first.
+ *
+ * Aliases:
+ *   MusicBrainz::TRM#generate_signature_from
+ *
+ * Examples:
+ *   # read raw PCM data from a file
+ *   trm.pcm_data 44100, 2, 16
+ *   sig = trm.finalize_signature if trm.feed('foo.raw')
+ *
+ *   # read raw PCM data from a decoder pipe
+ *   IO.popen("mpg123 -s foo.mp3") { |io| trm.feed(io) }
+ *
+ */
+static VALUE mb_trm_feed(int argc, VALUE *argv, VALUE self) {
+  mb_trm_t *t;
+  VALUE src, chunk, buf;
+  long len, need, fed;
+  uint64_t start = mb_now_ns();
+  trm_read_t job;
+
+  Data_Get_Struct(self, mb_trm_t, t);
+  rb_scan_args(argc, argv, "11", &src, &chunk);
+  if (!trm_bytes_per_sec(t))
+    rb_raise(eErr, "PCM data info not set (call pcm_data first)");
+
+  len = NIL_P(chunk) ? MB_TRM_BUFSIZ : NUM2LONG(chunk);
+  if (len <= 0)
+    rb_raise(eErr, "invalid read size: %ld", len);
+  fed = t->fed;
+
+  if (rb_respond_to(src, rb_intern("read"))) {
+    /* read from IO object */
+    while ((need = trm_bytes_needed(t)) > 0) {
+      buf = rb_funcall(src, rb_intern("read"), 1, LONG2NUM((need < len) ? need : len));
+      if (NIL_P(buf) || !RSTRING_LEN(StringValue(buf)))
+        break;
+      trm_feed(t, RSTRING_PTR(buf), RSTRING_LEN(buf));
+    }
+  } else {
+    /* read from file, without the global interpreter lock */
+    memset(&job, 0, sizeof(job));
+    job.t = t;
+    job.len = len;
+    job.path = strdup(StringValueCStr(src));
+    job.buf = malloc(len);
+    if (!job.path || !job.buf) {
+      free(job.path);
+      free(job.buf);
+      rb_raise(eErr, "couldn't allocate memory for TRM read buffer");
+    }
+
+    rb_ensure(trm_read_call, (VALUE) &job, trm_read_free, (VALUE) &job);
+    if (!job.fh)
+      rb_raise(eErr, "couldn't open \"%s\": %s", RSTRING_PTR(src), strerror(job.err));
+  }
+
+  if (MB_EVENT_ON(MB_STATS_TRM))
+    event_fire(MB_STATS_TRM, start, mb_now_ns(), Qnil, rb_ary_new3(1, src), t->fed - fed, t->done);
+
+  return t->done ? Qtrue : Qfalse;
+}
+
+/*
+ * Finalize generated signature.
+ *
+ * Call this after MusicBrainz::TRM#generate_signature has returned true.
+ *
+ * Accepts an optional 16-byte string, used to associate the signature
+ * with a particular collection in the RElatable Engine.  Returns nil on
+ * error, or a 16 byte signature on success.
+ *
+ * Example:
+ *   sig = trm.finalize_signature
+ *
+ */
+static VALUE mb_trm_finalize_sig(int argc, VALUE *argv, VALUE self) {
+  mb_trm_t *t;
+  MB_BUFFER sig[32];
+  char *id = NULL;
+  VALUE ret = Qnil;
+
+  Data_Get_Struct(self, mb_trm_t, t);
+  switch (argc) {
+    case 0:
+      break;
+    case 1:
+      if (argv[0] != Qnil)
+        id = RSTRING(argv[0])->ptr;
+      break;
+    default:
+      rb_raise(eErr, "Invalid argument count: %d.", argc);
+  }
+
+  if (!trm_FinalizeSignature(t->trm, sig, id))
+    ret = rb_str_new(sig, 16);
+
+  return ret;
+}
+
+/*
+ * Convert 16-byte raw signature into a human-readable 36-byte ASCII string.
+ *
+ * Used after MusicBrainz::TRM#generate_signature has returned true and
+ * MusicBrainz::TRM#finalize_signature has returned a signature.
+ *
+ * Aliases:
+ *   MusicBrainz::TRM#sig_to_ascii
+ *   MusicBrainz::TRM#convert_sig_to_ascii
+ *
+ * Examples:
+ *   puts 'signature: ' << trm.convert_sig raw_sig
+ *
+ */
+static VALUE mb_trm_convert_sig(VALUE self, VALUE sig) {
+  mb_trm_t *t;
+  MB_BUFFER buf[64];
+
+  Data_Get_Struct(self, mb_trm_t, t);
+  trm_ConvertSigToASCII(t->trm, StringValuePtr(sig), buf);
+
+  return rb_str_new(buf, MB_ID_LEN);
+}
+
+/*****************************/
+/* MusicBrainz::MBID methods */
+/*****************************/
+
+/*
+ * Document-class: MusicBrainz::MBID
+ *
+ * A MusicBrainz ID (artist, album, track, etc), stored as 16 raw bytes
+ * instead of a 36 character string.  MBIDs can be used as Hash keys,
+ * compared, and sorted.
+ *
+ * Examples:
+ *   id = MusicBrainz::MBID.new 'c0b2500e-0cef-4130-869d-732b23ed9df5'
+ *   id = mb.id_from_url(url, true)
+ *   puts id.to_url('artist')
+ *
+ */
+
+static VALUE mb_mbid_alloc(VALUE klass) {
+  return mbid_wrap(klass, NULL);
+}
+
+#ifndef HAVE_RB_DEFINE_ALLOC_FUNC
+/*
+ * Allocate and initialize a new MusicBrainz::MBID object.
+ *
+ * Example:
+ *   id = MusicBrainz::MBID.new 'c0b2500e-0cef-4130-869d-732b23ed9df5'
+ */
+VALUE mb_mbid_new(VALUE klass, VALUE str) {
+  VALUE self;
+
+  self = mb_mbid_alloc(klass);
+  rb_obj_call_init(self, 1, &str);
+
+  return self;
+}
+#endif /* !HAVE_RB_DEFINE_ALLOC_FUNC */
+
+/*
+ * :nodoc:
+ *
+ * Constructor for MusicBrainz::MBID object.  Accepts a hyphenated
+ * UUID, 32 hex digits, or a URL ending in either.  Raises
+ * MusicBrainz::Error if the string isn't a valid ID.
+ */
+static VALUE mb_mbid_init(VALUE self, VALUE str) {
+  mb_mbid_t *m, *src;
+
+  Data_Get_Struct(self, mb_mbid_t, m);
+
+  if (rb_obj_is_kind_of(str, cMBID)) {
+    Data_Get_Struct(str, mb_mbid_t, src);
+    memcpy(m->id, src->id, MB_MBID_LEN);
+    return self;
+  }
+
+  StringValue(str);
+  if (!mbid_parse(RSTRING_PTR(str), RSTRING_LEN(str), m->id))
+    rb_raise(eErr, "invalid MBID: %s", RSTRING_PTR(str));
+
+  return self;
+}
+
+/*
+ * :nodoc:
+ */
+static VALUE mb_mbid_init_copy(VALUE self, VALUE orig) {
+  mb_mbid_t *m, *src;
+
+  if (self == orig)
+    return self;
+  if (!rb_obj_is_kind_of(orig, cMBID))
+    rb_raise(rb_eTypeError, "wrong argument class");
+
+  Data_Get_Struct(self, mb_mbid_t, m);
+  Data_Get_Struct(orig, mb_mbid_t, src);
+  memcpy(m->id, src->id, MB_MBID_LEN);
+
+  return self;
+}
+
+/*
+ * Parse an ID from a string.  Works like MusicBrainz::MBID.new, but
+ * returns nil instead of raising an exception if the string isn't a
+ * valid ID.
+ *
+ * Examples:
+ *   id = MusicBrainz::MBID.parse(url) or puts "bad url: #{url}"
+ *
+ */
+static VALUE mb_mbid_parse(VALUE klass, VALUE str) {
+  unsigned char id[MB_MBID_LEN];
+
+  StringValue(str);
+  if (!mbid_parse(RSTRING_PTR(str), RSTRING_LEN(str), id))
+    return Qnil;
+
+  return mbid_wrap(klass, id);
+}
+
+/*
+ * Is the given string a valid ID (or a URL ending in one)?
+ *
+ * Examples:
+ *   MusicBrainz::MBID.valid? 'c0b2500e-0cef-4130-869d-732b23ed9df5'
+ *
+ */
+static VALUE mb_mbid_valid(VALUE klass, VALUE str) {
+  unsigned char id[MB_MBID_LEN];
+
+  UNUSED(klass);
+  StringValue(str);
+  return mbid_parse(RSTRING_PTR(str), RSTRING_LEN(str), id) ? Qtrue : Qfalse;
+}
+
+/*
+ * Create an ID from its 16 byte binary form (see
+ * MusicBrainz::MBID#raw).
+ *
+ * Examples:
+ *   id = MusicBrainz::MBID.from_raw(data[0, 16])
+ *
+ */
+static VALUE mb_mbid_from_raw(VALUE klass, VALUE str) {
+  StringValue(str);
+  if (RSTRING_LEN(str) != MB_MBID_LEN)
+    rb_raise(eErr, "raw MBID must be %d bytes", MB_MBID_LEN);
+
+  return mbid_wrap(klass, (const unsigned char*) RSTRING_PTR(str));
+}
+
+/*
+ * Get the ID as a lower-case hyphenated UUID string.
+ *
+ * Examples:
+ *   puts id.to_s
+ *
+ */
+static VALUE mb_mbid_to_s(VALUE self) {
+  char buf[MB_MBID_STRLEN + 1];
+  mb_mbid_t *m;
+
+  Data_Get_Struct(self, mb_mbid_t, m);
+  mbid_format(m->id, buf);
+
+  return rb_str_new(buf, MB_MBID_STRLEN);
+}
+
+/*
+ * :nodoc:
+ */
+static VALUE mb_mbid_inspect(VALUE self) {
+  char buf[MB_MBID_STRLEN + 32];
+  mb_mbid_t *m;
+
+  Data_Get_Struct(self, mb_mbid_t, m);
+  strcpy(buf, "#<MusicBrainz::MBID ");
+  mbid_format(m->id, buf + strlen(buf));
+  strcat(buf, ">");
+
+  return rb_str_new2(buf);
+}
+
+/*
+ * Get the 16 byte binary form of the ID.
+ *
+ * Examples:
+ *   File.open('ids.bin', 'ab') { |fh| fh << id.raw }
+ *
+ */
+static VALUE mb_mbid_raw(VALUE self) {
+  mb_mbid_t *m;
+
+  Data_Get_Struct(self, mb_mbid_t, m);
+  return rb_str_new((const char*) m->id, MB_MBID_LEN);
+}
+
+/*
+ * Get the RDF URL of the ID, given the type of object it refers to
+ * (eg 'artist', 'album', or 'track').  The server defaults to
+ * 'musicbrainz.org'.
+ *
+ * Examples:
+ *   url = id.to_url 'album'
+ *   # => "http://musicbrainz.org/mm-2.1/album/..."
+ *
+ */
+static VALUE mb_mbid_to_url(int argc, VALUE *argv, VALUE self) {
+  VALUE type, server, ret;
+  char buf[MB_MBID_STRLEN + 1];
+  mb_mbid_t *m;
+
+  rb_scan_args(argc, argv, "11", &type, &server);
+  Data_Get_Struct(self, mb_mbid_t, m);
+  mbid_format(m->id, buf);
+
+  ret = rb_str_new2("http://");
+  rb_str_cat2(ret, NIL_P(server) ? "musicbrainz.org" : StringValueCStr(server));
+  rb_str_cat2(ret, "/mm-2.1/");
+  rb_str_cat2(ret, StringValueCStr(type));
+  rb_str_cat2(ret, "/");
+  rb_str_cat(ret, buf, MB_MBID_STRLEN);
+
+  return ret;
+}
+
+/*
+ * :nodoc:
+ */
+static VALUE mb_mbid_hash(VALUE self) {
+  mb_mbid_t *m;
+  uint64_t a, b;
+
+  /* IDs are (mostly) random, so folding the halves together will do */
+  Data_Get_Struct(self, mb_mbid_t, m);
+  memcpy(&a, m->id, 8);
+  memcpy(&b, m->id + 8, 8);
+
+  return LONG2FIX((long) ((a ^ b) & FIXNUM_MAX));
+}
+
+/*
+ * Compare two IDs.  IDs sort in the same order as their string forms.
+ */
+static VALUE mb_mbid_cmp(VALUE self, VALUE other) {
+  mb_mbid_t *a, *b;
+  int r;
+
+  if (!rb_obj_is_kind_of(other, cMBID))
+    return Qnil;
+
+  Data_Get_Struct(self, mb_mbid_t, a);
+  Data_Get_Struct(other, mb_mbid_t, b);
+  r = memcmp(a->id, b->id, MB_MBID_LEN);
+
+  return INT2FIX((r > 0) - (r < 0));
+}
+
+/*
+ * Are two IDs equal?
+ */
+static VALUE mb_mbid_eql(VALUE self, VALUE other) {
+  mb_mbid_t *a, *b;
+
+  if (!rb_obj_is_kind_of(other, cMBID))
+    return Qfalse;
+
+  Data_Get_Struct(self, mb_mbid_t, a);
+  Data_Get_Struct(other, mb_mbid_t, b);
+
+  return memcmp(a->id, b->id, MB_MBID_LEN) ? Qfalse : Qtrue;
+}
+
+/****************************************/
+/* MusicBrainz::IDSet and IDMap methods */
+/****************************************/
+
+/*
+ * Document-class: MusicBrainz::IDSet
+ *
+ * A set of MusicBrainz IDs, stored as 16 byte binary keys in a native
+ * hash table.  Uses a fraction of the memory of a Hash of ID strings,
+ * and gives the garbage collector nothing to scan.  IDs can be passed
+ * as MusicBrainz::MBID objects or strings.
+ *
+ * Examples:
+ *   seen = MusicBrainz::IDSet.new
+ *   queue.each { |url| crawl(url) if seen.add?(url) }
+ *   seen.save 'seen.ids'
+ *
+ */
+
+/*
+ * Document-class: MusicBrainz::IDMap
+ *
+ * A map from MusicBrainz IDs to 64-bit integers, stored like
+ * MusicBrainz::IDSet.
+ *
+ * Examples:
+ *   plays = MusicBrainz::IDMap.new
+ *   plays[id] = (plays[id] || 0) + 1
+ *
+ */
+
+/*
+ * Open addressing hash table keyed by binary MBIDs, used by both
+ * MusicBrainz::IDSet and MusicBrainz::IDMap (maps also have a 64-bit
+ * integer value per key).  Keys are stored inline, 16 bytes each, with
+ * linear probing; an all-zero key marks an empty slot, so the nil UUID
+ * itself is tracked separately.  Capacity is always a power of two.
+ */
+typedef struct {
+  unsigned char *keys;
+  int64_t *vals, zero_val;
+  size_t size, capa;
+  int has_zero, is_map;
+} mb_idtab_t;
+
+/* maximum load factor is IDTAB_LOAD_NUM / IDTAB_LOAD_DEN */
+#define IDTAB_MIN_CAPA  16
+#define IDTAB_LOAD_NUM  3
+#define IDTAB_LOAD_DEN  4
+
+/* saved file magic */
+#define IDSET_MAGIC     "MBIDSET1"
+#define IDMAP_MAGIC     "MBIDMAP1"
+
+static int idtab_empty(const unsigned char *key) {
+  uint64_t a, b;
+
+  memcpy(&a, key, 8);
+  memcpy(&b, key + 8, 8);
+  return !(a | b);
+}
+
+static size_t idtab_slot(const mb_idtab_t *t, const unsigned char *key) {
+  uint64_t a, b;
+
+  /* IDs are mostly random, but mix anyway in case some aren't */
+  memcpy(&a, key, 8);
+  memcpy(&b, key + 8, 8);
+  return (size_t) (((a ^ b) * 0x9e3779b97f4a7c15ULL) >> 32) & (t->capa - 1);
+}
+
+/*
+ * Find the slot containing key, or the empty slot where it belongs.
+ * The table must have a non-zero capacity, and key must not be zero.
+ */
+static size_t idtab_find(const mb_idtab_t *t, const unsigned char *key) {
+  size_t i = idtab_slot(t, key);
+
+  while (!idtab_empty(t->keys + MB_MBID_LEN * i) && 
+         memcmp(t->keys + MB_MBID_LEN * i, key, MB_MBID_LEN))
+    i = (i + 1) & (t->capa - 1);
+
+  return i;
+}
+
+static void idtab_free_data(mb_idtab_t *t) {
+  free(t->keys);
+  free(t->vals);
+  t->keys = NULL;
+  t->vals = NULL;
+  t->size = t->capa = 0;
+  t->has_zero = 0;
+}
+
+static void idtab_free(void *ptr) {
+  idtab_free_data(ptr);
+  free(ptr);
+}
+
+/*
+ * Resize the table so it can hold at least num keys without growing.
+ */
+static void idtab_reserve(mb_idtab_t *t, size_t num) {
+  unsigned char *old_keys = t->keys;
+  int64_t *old_vals = t->vals;
+  size_t i, j, old_capa = t->capa, capa = IDTAB_MIN_CAPA;
+
+  /* more than this, and doubling capa would overflow */
+  if (num > SIZE_MAX / MB_MBID_LEN / 2)
+    rb_raise(eErr, "too many IDs: %lu", (unsigned long) num);
+
+  while (capa / IDTAB_LOAD_DEN * IDTAB_LOAD_NUM < num)
+    capa *= 2;
+  if (capa <= t->capa)
+    return;
+
+  t->keys = calloc(capa, MB_MBID_LEN);
+  t->vals = t->is_map ? malloc(sizeof(int64_t) * capa) : NULL;
+  if (!t->keys || (t->is_map && !t->vals)) {
+    free(t->keys);
+    free(t->vals);
+    t->keys = old_keys;
+    t->vals = old_vals;
+    rb_raise(eErr, "couldn't allocate memory for %lu IDs", (unsigned long) num);
+  }
+  t->capa = capa;
+
+  for (i = 0; i < old_capa; i++) {
+    if (idtab_empty(old_keys + MB_MBID_LEN * i))
+      continue;
+    j = idtab_find(t, old_keys + MB_MBID_LEN * i);
+    memcpy(t->keys + MB_MBID_LEN * j, old_keys + MB_MBID_LEN * i, MB_MBID_LEN);
+    if (t->is_map)
+      t->vals[j] = old_vals[i];
+  }
+
+  free(old_keys);
+  free(old_vals);
+}
+
+/*
+ * Get a pointer to the value slot for key (or NULL if key isn't in
+ * the table).  For sets, this returns a pointer to a dummy value.
+ */
+static int64_t *idtab_get(mb_idtab_t *t, const unsigned char *key) {
+  size_t i;
+
+  if (idtab_empty(key))
+    return t->has_zero ? &(t->zero_val) : NULL;
+  if (!t->capa)
+    return NULL;
+
+  i = idtab_find(t, key);
+  if (idtab_empty(t->keys + MB_MBID_LEN * i))
+    return NULL;
+
+  return t->is_map ? t->vals + i : &(t->zero_val);
+}
+
+/*
+ * Insert key into the table (and set its value, for maps).  Returns 1
+ * if the key is new, and 0 if it was already in the table.
+ */
+static int idtab_put(mb_idtab_t *t, const unsigned char *key, int64_t val) {
+  size_t i;
+
+  if (idtab_empty(key)) {
+    int ret = !t->has_zero;
+
+    if (ret)
+      t->size++;
+    t->has_zero = 1;
+    if (t->is_map)
+      t->zero_val = val;
+    return ret;
+  }
+
+  if ((t->size + 1) > t->capa / IDTAB_LOAD_DEN * IDTAB_LOAD_NUM)
+    idtab_reserve(t, t->size + 1);
+
+  i = idtab_find(t, key);
+  if (t->is_map)
+    t->vals[i] = val;
+  if (!idtab_empty(t->keys + MB_MBID_LEN * i))
+    return 0;
+
+  memcpy(t->keys + MB_MBID_LEN * i, key, MB_MBID_LEN);
+  t->size++;
+  return 1;
+}
+
+/*
+ * Remove key from the table.  Returns 1 (and the old value, for maps)
+ * if the key was in the table.  Uses backward shift deletion, so there
+ * are no tombstones to clean up.
+ */
+static int idtab_del(mb_idtab_t *t, const unsigned char *key, int64_t *old_val) {
+  size_t i, j, k, mask = t->capa - 1;
+
+  if (idtab_empty(key)) {
+    if (!t->has_zero)
+      return 0;
+    *old_val = t->zero_val;
+    t->has_zero = 0;
+    t->size--;
+    return 1;
+  }
+
+  if (!t->capa)
+    return 0;
+  i = idtab_find(t, key);
+  if (idtab_empty(t->keys + MB_MBID_LEN * i))
+    return 0;
+  if (t->is_map)
+    *old_val = t->vals[i];
+
+  /* shift back any entries that would become unreachable */
+  for (j = (i + 1) & mask; !idtab_empty(t->keys + MB_MBID_LEN * j); j = (j + 1) & mask) {
+    k = idtab_slot(t, t->keys + MB_MBID_LEN * j);
+    if ((j > i) ? (k <= i || k > j) : (k <= i && k > j)) {
+      memcpy(t->keys + MB_MBID_LEN * i, t->keys + MB_MBID_LEN * j, MB_MBID_LEN);
+      if (t->is_map)
+        t->vals[i] = t->vals[j];
+      i = j;
+    }
+  }
+
+  memset(t->keys + MB_MBID_LEN * i, 0, MB_MBID_LEN);
+  t->size--;
+  return 1;
+}
+
+/*
+ * Get the binary form of an ID from a MusicBrainz::MBID or a string
+ * (see MusicBrainz::MBID.new for accepted formats).
+ */
+static void mbid_key(VALUE val, unsigned char *out) {
+  mb_mbid_t *m;
+
+  if (rb_obj_is_kind_of(val, cMBID)) {
+    Data_Get_Struct(val, mb_mbid_t, m);
+    memcpy(out, m->id, MB_MBID_LEN);
+    return;
+  }
+
+  StringValue(val);
+  if (!mbid_parse(RSTRING_PTR(val), RSTRING_LEN(val), out))
+    rb_raise(eErr, "invalid MBID: %s", RSTRING_PTR(val));
+}
+
+static VALUE idtab_alloc(VALUE klass, int is_map) {
+  mb_idtab_t *t;
+
+  if ((t = malloc(sizeof(mb_idtab_t))) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for ID table");
+  memset(t, 0, sizeof(mb_idtab_t));
+  t->is_map = is_map;
+
+  return Data_Wrap_Struct(klass, 0, idtab_free, t);
+}
+
+static VALUE mb_idset_alloc(VALUE klass) {
+  return idtab_alloc(klass, 0);
+}
+
+static VALUE mb_idmap_alloc(VALUE klass) {
+  return idtab_alloc(klass, 1);
+}
+
+#ifndef HAVE_RB_DEFINE_ALLOC_FUNC
+/*
+ * Allocate and initialize a new MusicBrainz::IDSet object.
+ *
+ * Example:
+ *   seen = MusicBrainz::IDSet.new
+ */
+VALUE mb_idset_new(int argc, VALUE *argv, VALUE klass) {
+  VALUE self;
+
+  self = mb_idset_alloc(klass);
+  rb_obj_call_init(self, argc, argv);
+
+  return self;
+}
+
+/*
+ * Allocate and initialize a new MusicBrainz::IDMap object.
+ *
+ * Example:
+ *   counts = MusicBrainz::IDMap.new
+ */
+VALUE mb_idmap_new(int argc, VALUE *argv, VALUE klass) {
+  VALUE self;
+
+  self = mb_idmap_alloc(klass);
+  rb_obj_call_init(self, argc, argv);
+
+  return self;
+}
+#endif /* !HAVE_RB_DEFINE_ALLOC_FUNC */
+
+/*
+ * :nodoc:
+ *
+ * Constructor for MusicBrainz::IDSet and MusicBrainz::IDMap objects.
+ * The optional argument is the number of IDs to reserve space for.
+ */
+static VALUE mb_idtab_init(int argc, VALUE *argv, VALUE self) {
+  mb_idtab_t *t;
+  VALUE capa;
+
+  rb_scan_args(argc, argv, "01", &capa);
+  Data_Get_Struct(self, mb_idtab_t, t);
+  if (!NIL_P(capa))
+    idtab_reserve(t, NUM2ULONG(capa));
+
+  return self;
+}
+
+/*
+ * Number of IDs in the set (or map).
+ *
+ * Aliases:
+ *   MusicBrainz::IDSet#length
+ *
+ */
+static VALUE mb_idtab_size(VALUE self) {
+  mb_idtab_t *t;
+  Data_Get_Struct(self, mb_idtab_t, t);
+  return ULONG2NUM(t->size);
+}
+
+/*
+ * Is the set (or map) empty?
+ */
+static VALUE mb_idtab_empty(VALUE self) {
+  mb_idtab_t *t;
+  Data_Get_Struct(self, mb_idtab_t, t);
+  return t->size ? Qfalse : Qtrue;
+}
+
+/*
+ * Approximate memory used by the set (or map), in bytes.
+ */
+static VALUE mb_idtab_bytesize(VALUE self) {
+  mb_idtab_t *t;
+  Data_Get_Struct(self, mb_idtab_t, t);
+  return ULONG2NUM(sizeof(mb_idtab_t) + t->capa * (MB_MBID_LEN + (t->is_map ? sizeof(int64_t) : 0)));
+}
+
+/*
+ * Remove every ID from the set (or map).
+ */
+static VALUE mb_idtab_clear(VALUE self) {
+  mb_idtab_t *t;
+  Data_Get_Struct(self, mb_idtab_t, t);
+  idtab_free_data(t);
+  return self;
+}
+
+/*
+ * Is the given ID (a MusicBrainz::MBID or a string) in the set (or
+ * map)?
+ *
+ * Aliases:
+ *   MusicBrainz::IDSet#member?
+ *   MusicBrainz::IDSet#===
+ *   MusicBrainz::IDMap#key?
+ *   MusicBrainz::IDMap#has_key?
+ *
+ * Examples:
+ *   next if seen.include?(id)
+ *
+ */
+static VALUE mb_idtab_include(VALUE self, VALUE id) {
+  unsigned char key[MB_MBID_LEN];
+  mb_idtab_t *t;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+  mbid_key(id, key);
+
+  return idtab_get(t, key) ? Qtrue : Qfalse;
+}
+
+/*
+ * Add an ID (a MusicBrainz::MBID or a string) to the set.  Returns
+ * true if the ID is new, and false if it was already in the set.
+ *
+ * Examples:
+ *   # only visit each album once
+ *   crawl(id) if seen.add?(id)
+ *
+ */
+static VALUE mb_idset_add_p(VALUE self, VALUE id) {
+  unsigned char key[MB_MBID_LEN];
+  mb_idtab_t *t;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+  mbid_key(id, key);
+
+  return idtab_put(t, key, 0) ? Qtrue : Qfalse;
+}
+
+/*
+ * Add an ID (a MusicBrainz::MBID or a string) to the set.  Returns
+ * the set.
+ *
+ * Aliases:
+ *   MusicBrainz::IDSet#<<
+ *
+ */
+static VALUE mb_idset_add(VALUE self, VALUE id) {
+  mb_idset_add_p(self, id);
+  return self;
+}
+
+/*
+ * Remove an ID from the set.  Returns true if the ID was in the set.
+ */
+static VALUE mb_idset_delete(VALUE self, VALUE id) {
+  unsigned char key[MB_MBID_LEN];
+  mb_idtab_t *t;
+  int64_t val;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+  mbid_key(id, key);
+
+  return idtab_del(t, key, &val) ? Qtrue : Qfalse;
+}
+
+/*
+ * Get the value for an ID (a MusicBrainz::MBID or a string), or nil
+ * if the ID isn't in the map.
+ */
+static VALUE mb_idmap_aref(VALUE self, VALUE id) {
+  unsigned char key[MB_MBID_LEN];
+  mb_idtab_t *t;
+  int64_t *val;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+  mbid_key(id, key);
+
+  return (val = idtab_get(t, key)) ? LL2NUM(*val) : Qnil;
+}
+
+/*
+ * Set the value (an Integer) for an ID.
+ *
+ * Aliases:
+ *   MusicBrainz::IDMap#store
+ *
+ * Examples:
+ *   offsets[id] = fh.pos
+ *
+ */
+static VALUE mb_idmap_aset(VALUE self, VALUE id, VALUE val) {
+  unsigned char key[MB_MBID_LEN];
+  mb_idtab_t *t;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+  mbid_key(id, key);
+  idtab_put(t, key, NUM2LL(val));
+
+  return val;
+}
+
+/*
+ * Remove an ID from the map.  Returns the old value, or nil if the ID
+ * wasn't in the map.
+ */
+static VALUE mb_idmap_delete(VALUE self, VALUE id) {
+  unsigned char key[MB_MBID_LEN];
+  mb_idtab_t *t;
+  int64_t val;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+  mbid_key(id, key);
+
+  return idtab_del(t, key, &val) ? LL2NUM(val) : Qnil;
+}
+
+/*
+ * Call the block once for each ID (as a MusicBrainz::MBID) in the
+ * set, or each ID and value pair in the map.  Order is unspecified.
+ *
+ * Aliases:
+ *   MusicBrainz::IDMap#each_pair
+ *
+ */
+static VALUE mb_idtab_each(VALUE self) {
+  mb_idtab_t *t;
+  size_t i;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+
+  if (t->has_zero) {
+    unsigned char zero[MB_MBID_LEN];
+    VALUE id;
+
+    memset(zero, 0, MB_MBID_LEN);
+    id = mbid_new(zero);
+    if (t->is_map)
+      rb_yield(rb_assoc_new(id, LL2NUM(t->zero_val)));
+    else
+      rb_yield(id);
+  }
+
+  /* re-read capa and keys each pass, in case the block changes them */
+  for (i = 0; i < t->capa; i++) {
+    if (idtab_empty(t->keys + MB_MBID_LEN * i))
+      continue;
+    if (t->is_map)
+      rb_yield(rb_assoc_new(mbid_new(t->keys + MB_MBID_LEN * i), LL2NUM(t->vals[i])));
+    else
+      rb_yield(mbid_new(t->keys + MB_MBID_LEN * i));
+  }
+
+  return self;
+}
+
+/*
+ * Add a batch of IDs to the set (or map).  Sets accept an array (or
+ * other Enumerable) of IDs, another MusicBrainz::IDSet, or a string of
+ * packed 16 byte raw IDs (see MusicBrainz::MBID#raw).  Maps accept a
+ * Hash or another MusicBrainz::IDMap.  Returns self.
+ *
+ * Examples:
+ *   seen.merge(File.open('ids.bin', 'rb') { |fh| fh.read })
+ *
+ */
+static VALUE mb_idtab_merge(VALUE self, VALUE src) {
+  mb_idtab_t *t, *s;
+  unsigned char key[MB_MBID_LEN];
+  long i, len;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+
+  if (rb_obj_is_kind_of(src, CLASS_OF(self))) {
+    Data_Get_Struct(src, mb_idtab_t, s);
+    if (s == t)
+      return self;
+    idtab_reserve(t, t->size + s->size);
+    if (s->has_zero) {
+      memset(key, 0, MB_MBID_LEN);
+      idtab_put(t, key, s->zero_val);
+    }
+    for (i = 0; i < (long) s->capa; i++)
+      if (!idtab_empty(s->keys + MB_MBID_LEN * i))
+        idtab_put(t, s->keys + MB_MBID_LEN * i, s->is_map ? s->vals[i] : 0);
+  } else if (!t->is_map && TYPE(src) == T_STRING) {
+    len = RSTRING_LEN(src);
+    if (len % MB_MBID_LEN)
+      rb_raise(eErr, "raw ID string length must be a multiple of %d", MB_MBID_LEN);
+    idtab_reserve(t, t->size + len / MB_MBID_LEN);
+    for (i = 0; i < len; i += MB_MBID_LEN) {
+      memcpy(key, RSTRING_PTR(src) + i, MB_MBID_LEN);
+      idtab_put(t, key, 0);
+    }
+  } else if (t->is_map && TYPE(src) != T_HASH) {
+    rb_raise(eErr, "can't merge %s into ID map", rb_obj_classname(src));
+  } else {
+    /* arrays (or other enumerables) of IDs, or hashes of ID => value */
+    src = rb_funcall(src, rb_intern("to_a"), 0);
+    len = RARRAY_LEN(src);
+    idtab_reserve(t, t->size + len);
+
+    for (i = 0; i < len; i++) {
+      VALUE ent = rb_ary_entry(src, i);
+      if (t->is_map)
+        mb_idmap_aset(self, rb_ary_entry(ent, 0), rb_ary_entry(ent, 1));
+      else
+        mb_idset_add_p(self, ent);
+    }
+  }
+
+  return self;
+}
+
+static void idtab_put_u64(unsigned char *buf, uint64_t v) {
+  int i;
+  for (i = 0; i < 8; i++)
+    buf[i] = (unsigned char) (v >> (8 * i));
+}
+
+static uint64_t idtab_get_u64(const unsigned char *buf) {
+  uint64_t ret = 0;
+  int i;
+  for (i = 7; i >= 0; i--)
+    ret = (ret << 8) | buf[i];
+  return ret;
+}
+
+/*
+ * Save the set (or map) to a file, which can be read back with
+ * MusicBrainz::IDSet.load (or MusicBrainz::IDMap.load).  The file is an
+ * 8 byte magic string, a 64-bit little-endian count, then each raw ID
+ * (followed by its 64-bit little-endian value, for maps).
+ *
+ * Examples:
+ *   seen.save 'seen-albums.ids'
+ *
+ */
+static VALUE mb_idtab_save(VALUE self, VALUE path) {
+  unsigned char buf[MB_MBID_LEN + 8];
+  size_t i, ent_len;
+  mb_idtab_t *t;
+  FILE *fh;
+  int ok;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+  ent_len = MB_MBID_LEN + (t->is_map ? 8 : 0);
+
+  if ((fh = fopen(StringValueCStr(path), "wb")) == NULL)
+    rb_raise(eErr, "couldn't open \"%s\": %s", RSTRING_PTR(path), strerror(errno));
+
+  idtab_put_u64(buf, t->size);
+  ok = fwrite(t->is_map ? IDMAP_MAGIC : IDSET_MAGIC, 8, 1, fh) == 1 && 
+       fwrite(buf, 8, 1, fh) == 1;
+
+  if (ok && t->has_zero) {
+    memset(buf, 0, MB_MBID_LEN);
+    idtab_put_u64(buf + MB_MBID_LEN, t->zero_val);
+    ok = fwrite(buf, ent_len, 1, fh) == 1;
+  }
+
+  for (i = 0; ok && i < t->capa; i++) {
+    if (idtab_empty(t->keys + MB_MBID_LEN * i))
+      continue;
+    memcpy(buf, t->keys + MB_MBID_LEN * i, MB_MBID_LEN);
+    if (t->is_map)
+      idtab_put_u64(buf + MB_MBID_LEN, t->vals[i]);
+    ok = fwrite(buf, ent_len, 1, fh) == 1;
+  }
+
+  if (fclose(fh) || !ok)
+    rb_raise(eErr, "couldn't write \"%s\": %s", RSTRING_PTR(path), strerror(errno));
+
+  return self;
+}
+
+/*
+ * Loading a saved set or map: the table being filled, the open file,
+ * and the path and class (for errors).
+ */
+typedef struct {
+  mb_idtab_t *t;
+  FILE *fh;
+  VALUE path, klass;
+} idtab_load_t;
+
+static VALUE idtab_load_call(VALUE ptr) {
+  idtab_load_t *job = (idtab_load_t*) ptr;
+  unsigned char buf[MB_MBID_LEN + 8];
+  mb_idtab_t *t = job->t;
+  size_t ent_len = MB_MBID_LEN + (t->is_map ? 8 : 0);
+  uint64_t num, i;
+
+  if (fread(buf, 16, 1, job->fh) != 1 || memcmp(buf, t->is_map ? IDMAP_MAGIC : IDSET_MAGIC, 8))
+    rb_raise(eErr, "\"%s\" isn't a saved %s", RSTRING_PTR(job->path), rb_class2name(job->klass));
+
+  num = idtab_get_u64(buf + 8);
+  for (i = 0; i < num; i++) {
+    if (fread(buf, ent_len, 1, job->fh) != 1)
+      rb_raise(eErr, "\"%s\" is truncated", RSTRING_PTR(job->path));
+
+    /* reserve space as we go, so a bogus count can't eat all memory */
+    if (i % 65536 == 0)
+      idtab_reserve(t, (num - i < 65536) ? (size_t) num : (size_t) (i + 65536));
+    idtab_put(t, buf, t->is_map ? (int64_t) idtab_get_u64(buf + MB_MBID_LEN) : 0);
+  }
+
+  return Qnil;
+}
+
+/*
+ * Close the file, even if loading raised.
+ */
+static VALUE idtab_load_close(VALUE ptr) {
+  fclose(((idtab_load_t*) ptr)->fh);
+  return Qnil;
+}
+
+/*
+ * Load a set (or map) saved with MusicBrainz::IDSet#save (or
+ * MusicBrainz::IDMap#save).
  *
- * Aliases:
- *   MusicBrainz::Client#set_device
+ * Examples:
+ *   seen = MusicBrainz::IDSet.load 'seen-albums.ids'
+ *
+ */
+static VALUE mb_idtab_load(VALUE klass, VALUE path) {
+  idtab_load_t job;
+  VALUE self;
+
+  self = rb_class_new_instance(0, NULL, klass);
+
+  memset(&job, 0, sizeof(job));
+  Data_Get_Struct(self, mb_idtab_t, job.t);
+  job.path = path;
+  job.klass = klass;
+
+  if ((job.fh = fopen(StringValueCStr(path), "rb")) == NULL)
+    rb_raise(eErr, "couldn't open \"%s\": %s", RSTRING_PTR(path), strerror(errno));
+
+  rb_ensure(idtab_load_call, (VALUE) &job, idtab_load_close, (VALUE) &job);
+
+  return self;
+}
+
+/*
+ * :nodoc:
+ */
+static VALUE mb_idtab_inspect(VALUE self) {
+  char buf[128];
+  mb_idtab_t *t;
+
+  Data_Get_Struct(self, mb_idtab_t, t);
+  snprintf(buf, sizeof(buf), "#<%s size=%lu>", rb_obj_classname(self), (unsigned long) t->size);
+
+  return rb_str_new2(buf);
+}
+
+/*******************************/
+/* MusicBrainz::Index methods  */
+/*******************************/
+
+/*
+ * Document-class: MusicBrainz::Index
+ *
+ * A read-only local copy of (part of) the MusicBrainz database.  Build
+ * one from a tab-separated export with MusicBrainz::Index.build, then
+ * attach it to a client with MusicBrainz::Client#index= to answer
+ * supported queries locally.
  *
  * Examples:
- *   # set device to "/dev/scd1"
- *   mb.device = '/dev/scd1'
+ *   MusicBrainz::Index.build('export.tsv', 'mb.idx')
+ *   mb.index = MusicBrainz::Index.new('mb.idx')
+ *   mb.query(MusicBrainz::Query::GetArtistById, artist_id)
  *
- *   # set CD-ROM to "E:" on a Win32 system
- *   mb.set_device 'E:'
+ */
+
+/*
+ * Index builder state.  Albums, tracks, and TRM IDs refer to other
+ * records by ID until everything has been read and sorted.
+ */
+typedef struct {
+  mb_index_album_t rec;
+  unsigned char artist_id[MB_MBID_LEN];
+} index_build_album_t;
+
+typedef struct {
+  mb_index_track_t rec;
+  unsigned char album_id[MB_MBID_LEN], artist_id[MB_MBID_LEN];
+  int has_artist;
+} index_build_track_t;
+
+typedef struct {
+  mb_index_trm_t rec;
+  unsigned char track_id[MB_MBID_LEN];
+} index_build_trm_t;
+
+typedef struct {
+  uint32_t album, num, track;
+} index_build_pos_t;
+
+typedef struct {
+  uint64_t key;
+  uint32_t rec;
+} index_build_gram_t;
+
+typedef struct {
+  const char *in_path, *out_path;
+
+  mb_index_artist_t *artists;
+  index_build_album_t *albums;
+  index_build_track_t *tracks;
+  index_build_trm_t *trms;
+  size_t num_artists, num_albums, num_tracks, num_trms;
+  size_t capa_artists, capa_albums, capa_tracks, capa_trms;
+  mb_strbuf_t strings;
+
+  char err[256];
+} index_build_t;
+
+#define INDEX_BUILD_FIELDS  8
+
+/*
+ * Make room for one more item in a growable array.
+ */
+static int build_grow(void *ptr, size_t *capa, size_t num, size_t size) {
+  void **p = ptr, *q;
+  size_t new_capa;
+
+  if (num < *capa)
+    return 1;
+
+  new_capa = *capa ? *capa * 2 : 1024;
+  if ((q = realloc(*p, new_capa * size)) == NULL)
+    return 0;
+  *p = q;
+  *capa = new_capa;
+
+  return 1;
+}
+
+static uint32_t build_str(index_build_t *b, const char *s) {
+  uint32_t ret = (uint32_t) b->strings.len;
+
+  /* empty strings share the NUL at offset 0 */
+  if (!*s)
+    return 0;
+
+  sb_cat(&(b->strings), s, strlen(s) + 1);
+  return ret;
+}
+
+static int build_cmp_id(const void *a, const void *b) {
+  return memcmp(a, b, MB_MBID_LEN);
+}
+
+static int build_cmp_pos(const void *a, const void *b) {
+  const index_build_pos_t *x = a, *y = b;
+
+  if (x->album != y->album)
+    return (x->album < y->album) ? -1 : 1;
+  if (x->num != y->num)
+    return (x->num < y->num) ? -1 : 1;
+  return (x->track < y->track) ? -1 : (x->track > y->track);
+}
+
+static int build_cmp_gram(const void *a, const void *b) {
+  const index_build_gram_t *x = a, *y = b;
+
+  if (x->key != y->key)
+    return (x->key < y->key) ? -1 : 1;
+  return (x->rec < y->rec) ? -1 : (x->rec > y->rec);
+}
+
+/*
+ * Undo export escaping (\t, \n, \\, and \N for NULL) in place.
+ */
+static void build_unescape(char *s) {
+  char *d = s;
+
+  if (!strcmp(s, "\\N")) {
+    *s = '\0';
+    return;
+  }
+
+  for (; *s; s++) {
+    if (*s == '\\' && s[1]) {
+      s++;
+      *(d++) = (*s == 't') ? '\t' : (*s == 'n') ? '\n' : (*s == 'r') ? '\r' : *s;
+    } else {
+      *(d++) = *s;
+    }
+  }
+  *d = '\0';
+}
+
+static int build_id(index_build_t *b, long line, const char *s, unsigned char *out) {
+  if (mbid_parse(s, strlen(s), out))
+    return 1;
+
+  snprintf(b->err, sizeof(b->err), "%s:%ld: invalid ID \"%.64s\"", b->in_path, line, s);
+  return 0;
+}
+
+/*
+ * Parse one line of the export.  Returns 0 (and sets b->err) on error.
+ */
+static int build_line(index_build_t *b, long line, char *s) {
+  char *f[INDEX_BUILD_FIELDS];
+  int n = 0;
+
+  /* split into fields */
+  f[n++] = s;
+  for (; *s && n < INDEX_BUILD_FIELDS; s++) {
+    if (*s == '\t') {
+      *s = '\0';
+      f[n++] = s + 1;
+    }
+  }
+  for (s = f[0]; n < INDEX_BUILD_FIELDS; n++)
+    f[n] = s + strlen(s);
+  for (n = 1; n < INDEX_BUILD_FIELDS; n++)
+    build_unescape(f[n]);
+
+  if (!strcmp(f[0], "artist")) {
+    mb_index_artist_t *a;
+
+    if (!build_grow(&(b->artists), &(b->capa_artists), b->num_artists, sizeof(mb_index_artist_t)))
+      goto nomem;
+    a = b->artists + b->num_artists;
+    memset(a, 0, sizeof(mb_index_artist_t));
+    if (!build_id(b, line, f[1], a->id))
+      return 0;
+    a->name = build_str(b, f[2]);
+    a->sort_name = build_str(b, *f[3] ? f[3] : f[2]);
+    b->num_artists++;
+  } else if (!strcmp(f[0], "album")) {
+    index_build_album_t *l;
+
+    if (!build_grow(&(b->albums), &(b->capa_albums), b->num_albums, sizeof(index_build_album_t)))
+      goto nomem;
+    l = b->albums + b->num_albums;
+    memset(l, 0, sizeof(index_build_album_t));
+    if (!build_id(b, line, f[1], l->rec.id) || !build_id(b, line, f[2], l->artist_id))
+      return 0;
+    l->rec.name = build_str(b, f[3]);
+    l->rec.type = build_str(b, f[4]);
+    l->rec.status = build_str(b, f[5]);
+    b->num_albums++;
+  } else if (!strcmp(f[0], "track")) {
+    index_build_track_t *t;
+
+    if (!build_grow(&(b->tracks), &(b->capa_tracks), b->num_tracks, sizeof(index_build_track_t)))
+      goto nomem;
+    t = b->tracks + b->num_tracks;
+    memset(t, 0, sizeof(index_build_track_t));
+    if (!build_id(b, line, f[1], t->rec.id) || !build_id(b, line, f[2], t->album_id))
+      return 0;
+    t->rec.num = strtoul(f[3], NULL, 10);
+    t->rec.name = build_str(b, f[4]);
+    t->rec.duration = strtoul(f[5], NULL, 10);
+    if (*f[6]) {
+      if (!build_id(b, line, f[6], t->artist_id))
+        return 0;
+      t->has_artist = 1;
+    }
+    b->num_tracks++;
+  } else if (!strcmp(f[0], "trm")) {
+    index_build_trm_t *m;
+
+    if (!build_grow(&(b->trms), &(b->capa_trms), b->num_trms, sizeof(index_build_trm_t)))
+      goto nomem;
+    m = b->trms + b->num_trms;
+    memset(m, 0, sizeof(index_build_trm_t));
+    if (!build_id(b, line, f[1], m->rec.id) || !build_id(b, line, f[2], m->track_id))
+      return 0;
+    b->num_trms++;
+  } else if (f[0][0] && f[0][0] != '#') {
+    snprintf(b->err, sizeof(b->err), "%s:%ld: unknown record type \"%.32s\"", b->in_path, line, f[0]);
+    return 0;
+  }
+
+  return 1;
+
+nomem:
+  snprintf(b->err, sizeof(b->err), "couldn't allocate memory for index");
+  return 0;
+}
+
+static int build_read(index_build_t *b) {
+  char *buf = NULL, *p;
+  size_t capa = 0, len;
+  long line = 0;
+  FILE *fh;
+  int ok = 1;
+
+  if ((fh = fopen(b->in_path, "rb")) == NULL) {
+    snprintf(b->err, sizeof(b->err), "couldn't open \"%s\": %s", b->in_path, strerror(errno));
+    return 0;
+  }
+
+  for (;;) {
+    /* read a whole line, however long */
+    len = 0;
+    do {
+      if (capa - len < 2) {
+        capa = capa ? capa * 2 : 4096;
+        if ((p = realloc(buf, capa)) == NULL) {
+          snprintf(b->err, sizeof(b->err), "couldn't allocate memory for index");
+          ok = 0;
+          goto done;
+        }
+        buf = p;
+      }
+      if (!fgets(buf + len, capa - len, fh))
+        break;
+      len += strlen(buf + len);
+    } while (len > 0 && buf[len - 1] != '\n');
+
+    if (!len)
+      break;
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+      buf[--len] = '\0';
+
+    if (!build_line(b, ++line, buf)) {
+      ok = 0;
+      break;
+    }
+  }
+
+done:
+  if (ok && ferror(fh)) {
+    snprintf(b->err, sizeof(b->err), "couldn't read \"%s\": %s", b->in_path, strerror(errno));
+    ok = 0;
+  }
+  fclose(fh);
+  free(buf);
+
+  return ok;
+}
+
+/*
+ * Check a sorted table for duplicate IDs.
+ */
+static int build_unique(index_build_t *b, const void *table, size_t size, size_t num, const char *type) {
+  const unsigned char *p = table;
+  char buf[MB_MBID_STRLEN + 1];
+  size_t i;
+
+  for (i = 1; i < num; i++) {
+    if (!memcmp(p + size * (i - 1), p + size * i, MB_MBID_LEN)) {
+      mbid_format(p + size * i, buf);
+      snprintf(b->err, sizeof(b->err), "%s: duplicate %s %s", b->in_path, type, buf);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Write a table, padded to a multiple of 8 bytes.
+ */
+static int build_write(FILE *fh, const void *ptr, size_t len, uint64_t *ofs) {
+  static const char pad[8];
+
+  if (len && fwrite(ptr, len, 1, fh) != 1)
+    return 0;
+  *ofs += len;
+
+  if (*ofs % 8) {
+    len = 8 - *ofs % 8;
+    if (fwrite(pad, len, 1, fh) != 1)
+      return 0;
+    *ofs += len;
+  }
+
+  return 1;
+}
+
+/*
+ * Write the trigram tables (see index_grams()) for the names of one
+ * kind of record.  recs is the (sorted) table of records, each size
+ * bytes with the string table offset of its name at name_ofs.
+ */
+static int build_grams(index_build_t *b, FILE *fh, mb_index_hdr_t *h, int kind, const void *recs,
+                       size_t num, size_t size, size_t name_ofs, uint64_t *ofs) {
+  uint64_t grams[MB_INDEX_GRAMS_MAX], *keys = NULL;
+  uint32_t name, *starts = NULL, *postings = NULL;
+  uint16_t *lens = NULL;
+  index_build_gram_t *pairs = NULL;
+  size_t i, j, n, total = 0, num_keys = 0;
+  int ok = 0;
+
+  /* count trigrams, so everything can be allocated up front */
+  if ((lens = malloc(sizeof(uint16_t) * (num + 1))) == NULL)
+    goto nomem;
+  for (i = 0; i < num; i++) {
+    memcpy(&name, (const char*) recs + size * i + name_ofs, sizeof(uint32_t));
+    lens[i] = index_grams(b->strings.ptr + name, grams);
+    total += lens[i];
+  }
+  if (total > UINT32_MAX) {
+    snprintf(b->err, sizeof(b->err), "too many names for index");
+    goto done;
+  }
+
+  pairs = malloc(sizeof(index_build_gram_t) * (total + 1));
+  keys = malloc(sizeof(uint64_t) * (total + 1));
+  starts = malloc(sizeof(uint32_t) * (total + 2));
+  postings = malloc(sizeof(uint32_t) * (total + 1));
+  if (!pairs || !keys || !starts || !postings)
+    goto nomem;
+
+  /* collect (trigram, record) pairs, then group them by trigram */
+  for (i = 0, j = 0; i < num; i++) {
+    memcpy(&name, (const char*) recs + size * i + name_ofs, sizeof(uint32_t));
+    n = index_grams(b->strings.ptr + name, grams);
+    while (n > 0) {
+      pairs[j].key = grams[--n];
+      pairs[j++].rec = i;
+    }
+  }
+  qsort(pairs, total, sizeof(index_build_gram_t), build_cmp_gram);
+
+  for (i = 0; i < total; i++) {
+    if (!num_keys || pairs[i].key != keys[num_keys - 1]) {
+      keys[num_keys] = pairs[i].key;
+      starts[num_keys++] = i;
+    }
+    postings[i] = pairs[i].rec;
+  }
+  starts[num_keys] = total;
+
+  h->grams[kind].num_keys = num_keys;
+  h->grams[kind].num_postings = total;
+  h->grams[kind].keys = *ofs;
+  ok = build_write(fh, keys, sizeof(uint64_t) * num_keys, ofs);
+  h->grams[kind].starts = *ofs;
+  ok = ok && build_write(fh, starts, sizeof(uint32_t) * (num_keys + 1), ofs);
+  h->grams[kind].postings = *ofs;
+  ok = ok && build_write(fh, postings, sizeof(uint32_t) * total, ofs);
+  h->grams[kind].lens = *ofs;
+  ok = ok && build_write(fh, lens, sizeof(uint16_t) * num, ofs);
+  goto done;
+
+nomem:
+  snprintf(b->err, sizeof(b->err), "couldn't allocate memory for index");
+
+done:
+  free(lens);
+  free(pairs);
+  free(keys);
+  free(starts);
+  free(postings);
+
+  return ok;
+}
+
+/*
+ * Sort and link the records read by build_read(), then write the
+ * index file.
+ */
+static int build_finish(index_build_t *b) {
+  mb_index_hdr_t h;
+  mb_index_album_t *albums = NULL;
+  mb_index_track_t *tracks = NULL;
+  mb_index_trm_t *trms = NULL;
+  index_build_pos_t *pos = NULL;
+  uint32_t *artist_albums = NULL, *album_tracks = NULL, *fill = NULL;
+  size_t i, j, num_trms = 0;
+  char tmp_path[4096];
+  uint64_t ofs;
+  FILE *fh = NULL;
+  int ok = 0;
+
+  qsort(b->artists, b->num_artists, sizeof(mb_index_artist_t), build_cmp_id);
+  qsort(b->albums, b->num_albums, sizeof(index_build_album_t), build_cmp_id);
+  qsort(b->tracks, b->num_tracks, sizeof(index_build_track_t), build_cmp_id);
+  qsort(b->trms, b->num_trms, sizeof(index_build_trm_t), build_cmp_id);
+
+  if (!build_unique(b, b->artists, sizeof(mb_index_artist_t), b->num_artists, "artist") ||
+      !build_unique(b, b->albums, sizeof(index_build_album_t), b->num_albums, "album") ||
+      !build_unique(b, b->tracks, sizeof(index_build_track_t), b->num_tracks, "track"))
+    return 0;
+
+  albums = malloc(sizeof(mb_index_album_t) * (b->num_albums + 1));
+  tracks = malloc(sizeof(mb_index_track_t) * (b->num_tracks + 1));
+  trms = malloc(sizeof(mb_index_trm_t) * (b->num_trms + 1));
+  pos = malloc(sizeof(index_build_pos_t) * (b->num_tracks + 1));
+  artist_albums = malloc(sizeof(uint32_t) * (b->num_albums + 1));
+  album_tracks = malloc(sizeof(uint32_t) * (b->num_tracks + 1));
+  fill = calloc(b->num_artists + 1, sizeof(uint32_t));
+  if (!albums || !tracks || !trms || !pos || !artist_albums || 
+      !album_tracks || !fill || b->strings.err) {
+    snprintf(b->err, sizeof(b->err), "couldn't allocate memory for index");
+    goto done;
+  }
+
+  /* link albums to artists, and group albums by artist */
+  for (i = 0; i < b->num_albums; i++) {
+    albums[i] = b->albums[i].rec;
+    albums[i].artist = index_find(b->artists, sizeof(mb_index_artist_t), b->num_artists, b->albums[i].artist_id);
+    if (albums[i].artist != MB_INDEX_NONE)
+      b->artists[albums[i].artist].num_albums++;
+    artist_albums[i] = MB_INDEX_NONE;
+  }
+  for (i = 0, j = 0; i < b->num_artists; i++) {
+    b->artists[i].albums = j;
+    j += b->artists[i].num_albums;
+  }
+  for (i = 0; i < b->num_albums; i++)
+    if ((j = albums[i].artist) != MB_INDEX_NONE)
+      artist_albums[b->artists[j].albums + fill[j]++] = i;
+
+  /* link tracks to albums and artists, and order them within albums */
+  for (i = 0; i < b->num_tracks; i++) {
+    tracks[i] = b->tracks[i].rec;
+    tracks[i].album = index_find(b->albums, sizeof(index_build_album_t), b->num_albums, b->tracks[i].album_id);
+    if (b->tracks[i].has_artist)
+      tracks[i].artist = index_find(b->artists, sizeof(mb_index_artist_t), b->num_artists, b->tracks[i].artist_id);
+    else
+      tracks[i].artist = (tracks[i].album != MB_INDEX_NONE) ? albums[tracks[i].album].artist : MB_INDEX_NONE;
+
+    pos[i].album = tracks[i].album;
+    pos[i].num = tracks[i].num;
+    pos[i].track = i;
+  }
+  qsort(pos, b->num_tracks, sizeof(index_build_pos_t), build_cmp_pos);
+  for (i = 0; i < b->num_tracks; i++) {
+    album_tracks[i] = pos[i].track;
+    if (pos[i].album != MB_INDEX_NONE && !albums[pos[i].album].num_tracks++)
+      albums[pos[i].album].tracks = i;
+  }
+
+  /* link TRM IDs to tracks, dropping unknown tracks */
+  for (i = 0; i < b->num_trms; i++) {
+    trms[num_trms] = b->trms[i].rec;
+    trms[num_trms].track = index_find(tracks, sizeof(mb_index_track_t), b->num_tracks, b->trms[i].track_id);
+    if (trms[num_trms].track != MB_INDEX_NONE)
+      num_trms++;
+  }
+
+  /* write everything to a temporary file, then move it into place */
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", b->out_path);
+  if ((fh = fopen(tmp_path, "wb")) == NULL) {
+    snprintf(b->err, sizeof(b->err), "couldn't open \"%s\": %s", tmp_path, strerror(errno));
+    goto done;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MB_INDEX_MAGIC, 8);
+  h.bom = MB_INDEX_BOM;
+  h.version = MB_INDEX_VERSION;
+  h.num_artists = b->num_artists;
+  h.num_albums = b->num_albums;
+  h.num_tracks = b->num_tracks;
+  h.num_trms = num_trms;
+  h.strings_len = b->strings.len;
+
+  ofs = 0;
+  ok = build_write(fh, &h, sizeof(h), &ofs);
+  h.artists = ofs;
+  ok = ok && build_write(fh, b->artists, sizeof(mb_index_artist_t) * b->num_artists, &ofs);
+  h.albums = ofs;
+  ok = ok && build_write(fh, albums, sizeof(mb_index_album_t) * b->num_albums, &ofs);
+  h.tracks = ofs;
+  ok = ok && build_write(fh, tracks, sizeof(mb_index_track_t) * b->num_tracks, &ofs);
+  h.trms = ofs;
+  ok = ok && build_write(fh, trms, sizeof(mb_index_trm_t) * num_trms, &ofs);
+  h.artist_albums = ofs;
+  ok = ok && build_write(fh, artist_albums, sizeof(uint32_t) * b->num_albums, &ofs);
+  h.album_tracks = ofs;
+  ok = ok && build_write(fh, album_tracks, sizeof(uint32_t) * b->num_tracks, &ofs);
+  h.strings = ofs;
+  ok = ok && build_write(fh, b->strings.ptr, b->strings.len, &ofs);
+  ok = ok && build_grams(b, fh, &h, MB_INDEX_ARTIST, b->artists, b->num_artists, 
+                         sizeof(mb_index_artist_t), offsetof(mb_index_artist_t, name), &ofs);
+  ok = ok && build_grams(b, fh, &h, MB_INDEX_ALBUM, albums, b->num_albums, 
+                         sizeof(mb_index_album_t), offsetof(mb_index_album_t, name), &ofs);
+  ok = ok && build_grams(b, fh, &h, MB_INDEX_TRACK, tracks, b->num_tracks, 
+                         sizeof(mb_index_track_t), offsetof(mb_index_track_t, name), &ofs);
+
+  /* now that the offsets are known, rewrite the header */
+  ok = ok && !fseek(fh, 0, SEEK_SET) && fwrite(&h, sizeof(h), 1, fh) == 1;
+  ok = !fclose(fh) && ok;
+  fh = NULL;
+
+  if (!ok || rename(tmp_path, b->out_path)) {
+    if (!b->err[0])
+      snprintf(b->err, sizeof(b->err), "couldn't write \"%s\": %s", b->out_path, strerror(errno));
+    unlink(tmp_path);
+    ok = 0;
+  }
+  b->num_trms = num_trms;
+
+done:
+  free(albums);
+  free(tracks);
+  free(trms);
+  free(pos);
+  free(artist_albums);
+  free(album_tracks);
+  free(fill);
+
+  return ok;
+}
+
+static void *index_build_blocking(void *ptr) {
+  index_build_t *b = ptr;
+
+  /* the string table starts with an empty string */
+  sb_cat(&(b->strings), "", 1);
+
+  if (build_read(b))
+    build_finish(b);
+
+  return NULL;
+}
+
+static VALUE index_build_call(VALUE ptr) {
+  index_build_t *b = (index_build_t*) ptr;
+
+  if (b->in_path && b->out_path)
+    mb_without_gvl(index_build_blocking, b, NULL, NULL);
+  else
+    snprintf(b->err, sizeof(b->err), "couldn't allocate memory for index");
+
+  return Qnil;
+}
+
+/*
+ * Free an index build, even if the thread was interrupted during it.
+ */
+static VALUE index_build_free(VALUE ptr) {
+  index_build_t *b = (index_build_t*) ptr;
+
+  free((char*) b->in_path);
+  free((char*) b->out_path);
+  free(b->artists);
+  free(b->albums);
+  free(b->tracks);
+  free(b->trms);
+  free(b->strings.ptr);
+
+  return Qnil;
+}
+
+/*
+ * Build an index file from a tab-separated export.  Each line of the
+ * export is one record; fields are separated by tabs, with tabs,
+ * newlines, and backslashes escaped as \t, \n, and \\:
+ *
+ *   artist  <id>  <name>  [<sort name>]
+ *   album   <id>  <artist id>  <name>  [<type>]  [<status>]
+ *   track   <id>  <album id>  <track number>  <name>  [<duration (ms)>]
+ *           [<artist id>]
+ *   trm     <trm id>  <track id>
+ *
+ * Blank lines and lines starting with # are ignored.  Album types and
+ * statuses are the mm-2.1 names without the prefix (eg "Album" and
+ * "Official").  Tracks without an artist belong to the album artist.
+ *
+ * The index is written to a temporary file and moved into place, so
+ * it's safe to rebuild an index that's in use.  Returns a hash of
+ * record counts.  Raises MusicBrainz::Error if the export can't be
+ * read or contains invalid records.
+ *
+ * Examples:
+ *   MusicBrainz::Index.build('export.tsv', 'mb.idx')
  *
  */
-static VALUE mb_client_set_device(VALUE self, VALUE device) {
-  musicbrainz_t *mb;
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  return mb_SetDevice(*mb, StringValueCStr(device)) ? Qtrue : Qfalse;
+static VALUE mb_index_build(VALUE klass, VALUE in_path, VALUE out_path) {
+  index_build_t b;
+  VALUE ret;
+
+  UNUSED(klass);
+  StringValueCStr(in_path);
+  StringValueCStr(out_path);
+
+  memset(&b, 0, sizeof(b));
+  b.in_path = strdup(RSTRING_PTR(in_path));
+  b.out_path = strdup(RSTRING_PTR(out_path));
+  rb_ensure(index_build_call, (VALUE) &b, index_build_free, (VALUE) &b);
+
+  if (b.err[0])
+    rb_raise(eErr, "%s", b.err);
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, rb_str_new2("artists"), ULONG2NUM(b.num_artists));
+  rb_hash_aset(ret, rb_str_new2("albums"), ULONG2NUM(b.num_albums));
+  rb_hash_aset(ret, rb_str_new2("tracks"), ULONG2NUM(b.num_tracks));
+  rb_hash_aset(ret, rb_str_new2("trms"), ULONG2NUM(b.num_trms));
+
+  return ret;
 }
 
+static void index_free(void *ptr) {
+  index_close(ptr);
+  free(ptr);
+}
+
+static VALUE mb_index_alloc(VALUE klass) {
+  mb_index_t *ix;
+
+  if ((ix = malloc(sizeof(mb_index_t))) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for Index structure");
+  memset(ix, 0, sizeof(mb_index_t));
+
+  return Data_Wrap_Struct(klass, 0, index_free, ix);
+}
+
+#ifndef HAVE_RB_DEFINE_ALLOC_FUNC
 /*
- * Enable UTF-8 output for a MusicBrainz::Client object.
- * 
- * Note: Defaults to ISO-8859-1 output.  If this is set to true, then
- * UTF-8 will be used instead.
- * 
- * Aliases:
- *   MusicBrainz::Client#use_utf8=
- *   MusicBrainz::Client#set_use_utf8
+ * Allocate and initialize a new MusicBrainz::Index object.
+ *
+ * Example:
+ *   index = MusicBrainz::Index.new 'mb.idx'
+ */
+VALUE mb_index_new(VALUE klass, VALUE path) {
+  VALUE self;
+
+  self = mb_index_alloc(klass);
+  rb_obj_call_init(self, 1, &path);
+
+  return self;
+}
+#endif /* !HAVE_RB_DEFINE_ALLOC_FUNC */
+
+/*
+ * :nodoc:
+ *
+ * Constructor for MusicBrainz::Index object.  Maps the index file at
+ * path into memory.
+ */
+static VALUE mb_index_init(VALUE self, VALUE path) {
+  mb_index_t *ix;
+  int err;
+
+  Data_Get_Struct(self, mb_index_t, ix);
+  index_close(ix);
+
+  if ((err = index_open(ix, StringValueCStr(path))) == EINVAL)
+    rb_raise(eErr, "\"%s\" isn't a valid index", RSTRING_PTR(path));
+  else if (err)
+    rb_raise(eErr, "couldn't open \"%s\": %s", RSTRING_PTR(path), strerror(err));
+
+  return self;
+}
+
+/*
+ * Unmap the index.  Clients using the index fall back to the server
+ * for every query.
+ */
+static VALUE mb_index_close(VALUE self) {
+  mb_index_t *ix;
+
+  Data_Get_Struct(self, mb_index_t, ix);
+  index_close(ix);
+
+  return self;
+}
+
+/*
+ * Has the index been closed?
+ */
+static VALUE mb_index_closed(VALUE self) {
+  mb_index_t *ix;
+
+  Data_Get_Struct(self, mb_index_t, ix);
+  return ix->map ? Qfalse : Qtrue;
+}
+
+/*
+ * Get a hash of record counts (artists, albums, tracks, and trms).
  *
  * Examples:
- *   mb.utf8 = true
- *   mb.use_utf8 = true
- *   mb.set_use_utf8 true
+ *   puts "#{index.counts['tracks']} tracks"
  *
  */
-static VALUE mb_client_set_use_utf8(VALUE self, VALUE use_utf8) {
-  musicbrainz_t *mb;
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  mb_UseUTF8(*mb, (use_utf8 == Qtrue));
-  return use_utf8;
+static VALUE mb_index_counts(VALUE self) {
+  mb_index_t *ix;
+  VALUE ret;
+
+  Data_Get_Struct(self, mb_index_t, ix);
+  if (!ix->map)
+    rb_raise(eErr, "index is closed");
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, rb_str_new2("artists"), ULONG2NUM(ix->hdr->num_artists));
+  rb_hash_aset(ret, rb_str_new2("albums"), ULONG2NUM(ix->hdr->num_albums));
+  rb_hash_aset(ret, rb_str_new2("tracks"), ULONG2NUM(ix->hdr->num_tracks));
+  rb_hash_aset(ret, rb_str_new2("trms"), ULONG2NUM(ix->hdr->num_trms));
+
+  return ret;
 }
 
 /*
- * Set the search depth for a MusicBrainz::Client object.
- * 
- * Note: Defaults to 2.
- * 
- * Aliases:
- *   MusicBrainz::Client#set_depth
+ * Search the index for artists, albums, or tracks by name.  Names
+ * are compared by trigram after Unicode case folding, so misspelled
+ * and partial names still match.  Returns an array of up to limit
+ * (default 10, at most 128) [MBID, relevance] pairs, best match first.
+ * Relevance ranges from 0 to 100, where 100 is an exact match (apart
+ * from case and punctuation).
+ *
+ * This is the search used by MusicBrainz::Client for FindArtistByName,
+ * FindAlbumByName, and FindTrackByName queries when it has an index.
  *
  * Examples:
- *   mb.depth = 5
- *   mb.set_depth 5
+ *   index.search(:artist, 'tori amso').each do |id, relevance|
+ *     puts "#{id} (#{relevance}%)"
+ *   end
  *
  */
-static VALUE mb_client_set_depth(VALUE self, VALUE depth) {
-  musicbrainz_t *mb;
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  mb_SetDepth(*mb, NUM2INT(depth));
-  return self;
+static VALUE mb_index_search(int argc, VALUE *argv, VALUE self) {
+  static const char *kinds[MB_INDEX_KINDS] = { "artist", "album", "track" };
+  mb_index_hit_t hits[MB_INDEX_HITS_MAX];
+  mb_index_t *ix;
+  VALUE kind, name, limit, pair, ret;
+  const unsigned char *id;
+  int i, k, num, max = 10;
+
+  rb_scan_args(argc, argv, "21", &kind, &name, &limit);
+  Data_Get_Struct(self, mb_index_t, ix);
+  if (!ix->map)
+    rb_raise(eErr, "index is closed");
+
+  kind = rb_funcall(kind, rb_intern("to_s"), 0);
+  for (k = 0; k < MB_INDEX_KINDS; k++)
+    if (!strcmp(RSTRING_PTR(kind), kinds[k]))
+      break;
+  if (k == MB_INDEX_KINDS)
+    rb_raise(eErr, "unknown search type: %s", RSTRING_PTR(kind));
+
+  if (!NIL_P(limit))
+    max = NUM2INT(limit);
+  if (max < 1)
+    return rb_ary_new();
+  if (max > MB_INDEX_HITS_MAX)
+    max = MB_INDEX_HITS_MAX;
+
+  num = index_search(ix, k, StringValueCStr(name), hits, max);
+
+  ret = rb_ary_new();
+  for (i = 0; i < num; i++) {
+    id = (k == MB_INDEX_ARTIST) ? ix->artists[hits[i].rec].id :
+         (k == MB_INDEX_ALBUM) ? ix->albums[hits[i].rec].id :
+         ix->tracks[hits[i].rec].id;
+    pair = rb_ary_new();
+    rb_ary_push(pair, mbid_new(id));
+    rb_ary_push(pair, INT2FIX(hits[i].relevance));
+    rb_ary_push(ret, pair);
+  }
+
+  return ret;
+}
+
+/************************/
+/* Bulk URL conversions */
+/************************/
+
+/*
+ * Convert a list of URLs in one pass.  Entries for which func returns
+ * Qnil are left as nil, or dropped if skip is set.
+ */
+static VALUE urls_convert(VALUE urls, int skip, VALUE (*func)(VALUE, int), int arg) {
+  VALUE ret, val;
+  long i, len;
+
+  Check_Type(urls, T_ARRAY);
+  len = RARRAY_LEN(urls);
+  ret = rb_ary_new2(len);
+
+  for (i = 0; i < len; i++) {
+    val = func(rb_ary_entry(urls, i), arg);
+    if (!NIL_P(val) || !skip)
+      rb_ary_push(ret, val);
+  }
+
+  return ret;
+}
+
+static VALUE url_to_id(VALUE url, int binary) {
+  unsigned char id[MB_MBID_LEN];
+  char buf[MB_MBID_STRLEN + 1];
+
+  if (NIL_P(url))
+    return Qnil;
+  StringValue(url);
+  if (!mbid_parse(RSTRING_PTR(url), RSTRING_LEN(url), id))
+    return Qnil;
+  if (binary)
+    return mbid_new(id);
+
+  mbid_format(id, buf);
+  return rb_str_new(buf, MB_MBID_STRLEN);
+}
+
+static VALUE url_to_frag(VALUE url, int unused) {
+  long ofs;
+
+  UNUSED(unused);
+  if (NIL_P(url))
+    return Qnil;
+  StringValue(url);
+  if ((ofs = url_rfind(RSTRING_PTR(url), RSTRING_LEN(url), '#')) < 0)
+    return Qnil;
+
+  return rb_str_new(RSTRING_PTR(url) + ofs + 1, RSTRING_LEN(url) - ofs - 1);
 }
 
 /*
- * Set the maximum number of items for a MusicBrainz::Client object.
- * 
- * Set the maximum number of items to return from a query for a
- * MusicBrainz::Client object.  If the query yields more items than this
- * number, the server will omit the excess results.  Defaults to 25.
- * 
- * Aliases:
- *   MusicBrainz::Client#set_max_items
+ * Extract the IDs from a list of URLs (eg the results of
+ * MBE_GetxxxxxId queries) in one pass.  Works like
+ * MusicBrainz::Client#id_from_url, but validates each ID and doesn't
+ * need a client.  Accepts the following options:
+ *
+ * - binary: return MusicBrainz::MBID objects instead of strings.
+ * - skip_invalid: drop URLs which don't end in a valid ID, instead of
+ *   returning nil for them.
  *
  * Examples:
- *   mb.max_items = 5
- *   mb.set_max_items 5
+ *   num = mb.result(MusicBrainz::Query::GetNumTracks).to_i
+ *   urls = (1 .. num).map do |i|
+ *     mb.result(MusicBrainz::Query::TrackGetTrackId, i)
+ *   end
+ *   ids = MusicBrainz.ids_from_urls(urls, :binary => true)
  *
  */
-static VALUE mb_client_set_max_items(VALUE self, VALUE max_items) {
-  musicbrainz_t *mb;
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  mb_SetMaxItems(*mb, NUM2INT(max_items));
-  return self;
+static VALUE mb_ids_from_urls(int argc, VALUE *argv, VALUE self) {
+  VALUE urls, opts;
+
+  UNUSED(self);
+  rb_scan_args(argc, argv, "11", &urls, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
+
+  return urls_convert(urls, scan_opt(opts, "skip_invalid", 0), url_to_id, scan_opt(opts, "binary", 0));
 }
 
 /*
- * Query the MusicBrainz server with this MusicBrainz::Client object.
- *
- * Returns true if the query was successful (even if it didn't return
- * any results).
- *
- * See the MusicBrainz::Query documentation for information on various
- * query types.
+ * Extract the identifier fragments (the part after the last #) from a
+ * list of URLs in one pass.  Works like
+ * MusicBrainz::Client#fragment_from_url.  URLs without a fragment map
+ * to nil, or are dropped if the skip_invalid: option is set.
  *
  * Examples:
- *   # get general return status of prior query
- *   mb.query MusicBrainz::Query::GetStatus
- *
- *   # query the MusicBrainz server for an album titled "Airdrawndagger"
- *   # by an artist "Sasha"
- *   mb.query MusicBrainz::Query::AlbumFindAlbum,
- *            'Sasha',
- *            'Airdrawndagger'
+ *   url = 'http://musicbrainz.org/mm/mq-1.1#ArtistResult'
+ *   MusicBrainz.fragments_from_urls([url])
+ *   # => ["ArtistResult"]
  *
  */
-static VALUE mb_client_query(int argc, VALUE *argv, VALUE self) {
-  musicbrainz_t *mb;
-  VALUE ret = Qfalse;
-  char *obj, **args;
-  int i;
+static VALUE mb_frags_from_urls(int argc, VALUE *argv, VALUE self) {
+  VALUE urls, opts;
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  switch (argc) {
-    case 0:
-      rb_raise(eErr, "Invalid argument count: %d.", argc);
-      break;
-    case 1:
-      ret = mb_Query(*mb, StringValueCStr(argv[0])) ? Qtrue : Qfalse;
-      break;
-    default:
-      /* grab object */
-      obj = RSTRING(argv[0])->ptr;
+  UNUSED(self);
+  rb_scan_args(argc, argv, "11", &urls, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
 
-      /* allocate argument list */
-      if ((args = malloc(sizeof(char*) * argc)) == NULL)
-        rb_raise(eErr, "couldn't allocate query argument list");
+  return urls_convert(urls, scan_opt(opts, "skip_invalid", 0), url_to_frag, 0);
+}
 
-      /* add each argument list, then terminate the list  */
-      for (i = 1; i < argc; i++)
-        args[i - 1] = RSTRING(argv[i])->ptr;
-      args[argc - 1] = NULL;
+/***************************/
+/* MusicBrainz file scans  */
+/***************************/
 
-      /* execute query and free argument list */
-      ret = mb_QueryWithArgs(*mb, obj, args) ? Qtrue : Qfalse;
-      free(args);
+/*
+ * Parse the header of a RIFF WAVE file at the start of buf.  If the
+ * "fmt " and "data" chunks are both found in buf, then fill in the
+ * PCM format, and return the offset of the audio data.  Returns -1 if
+ * buf doesn't start with a (usable) WAVE header.
+ */
+static long wav_parse_header(const unsigned char *buf, long len, int *samples, int *channels, int *bits) {
+  long ofs, size;
+  int have_fmt = 0;
+
+  if (len < 12 || memcmp(buf, "RIFF", 4) || memcmp(buf + 8, "WAVE", 4))
+    return -1;
+
+  for (ofs = 12; ofs + 8 <= len; ofs += 8 + size + (size & 1)) {
+    size = buf[ofs + 4] | (buf[ofs + 5] << 8) | (buf[ofs + 6] << 16) | ((long) buf[ofs + 7] << 24);
+
+    if (!memcmp(buf + ofs, "fmt ", 4) && ofs + 24 <= len) {
+      *channels = buf[ofs + 10] | (buf[ofs + 11] << 8);
+      *samples = buf[ofs + 12] | (buf[ofs + 13] << 8) | (buf[ofs + 14] << 16) | (buf[ofs + 15] << 24);
+      *bits = buf[ofs + 22] | (buf[ofs + 23] << 8);
+      have_fmt = 1;
+    } else if (!memcmp(buf + ofs, "data", 4)) {
+      return have_fmt ? ofs + 8 : -1;
+    }
   }
 
-  return ret;
+  return -1;
 }
 
 /*
- * Get web-based MusicBrainz CD-ROM submission URL for CD-ROM device associated with this MusicBrainz::Client object.
- *
- * Use MusicBrainz::Client#device to set the CD-ROM device. Returns nil
- * on error.
- *
- * Aliases:
- *   MusicBrainz::Client#get_url
- *   MusicBrainz::Client#get_web_submit_url
- *
- * Examples:
- *   url = mb.url
- *   url = mb.get_url
- *   url = mb.get_web_submit_url
- *
+ * Get the number of reads to keep in flight from the depth: (or
+ * threads:) entry of an option hash.
  */
-static VALUE mb_client_url(VALUE self) {
-  musicbrainz_t *mb;
-  MB_BUFFER buf[MB_HOST_BUFSIZ];
-  VALUE ret = Qnil;
+static int bulk_depth(VALUE opts) {
+  VALUE val = Qnil;
+  int ret;
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  if (mb_GetWebSubmitURL(*mb, buf, sizeof(buf)))
-    ret = rb_str_new2(buf);
+  if (!NIL_P(opts)) {
+    val = rb_hash_aref(opts, ID2SYM(rb_intern("depth")));
+    if (NIL_P(val))
+      val = rb_hash_aref(opts, ID2SYM(rb_intern("threads")));
+  }
+
+  ret = NIL_P(val) ? MB_BULK_DEPTH : NUM2INT(val);
+  if (ret < 1 || ret > 4096)
+    rb_raise(eErr, "invalid read depth: %d", ret);
 
   return ret;
 }
 
 /*
- * Retrieve error from last call to MusicBrainz::Client#query with this MusicBrainz::Client object.
- *
- * Aliases:
- *   MusicBrainz::Client#get_error
- *   MusicBrainz::Client#get_query_error
- *
- * Example:
- *   # simple query and error return
- *   query = MusicBrainz::Query::GetStatus
- *   puts 'Error: ' << mb.error unless mb.query query
- *
+ * Single-pass file scan state: each chunk of the file is passed to the
+ * MPEG frame scanner, a SHA-1 hash, and a TRM handle.
  */
-static VALUE mb_client_error(VALUE self) {
-  musicbrainz_t *mb;
-  MB_BUFFER buf[MB_ERR_BUFSIZ];
+typedef struct {
+  int do_mp3, do_sha1, tail_seen;
+  mb_trm_t *trm;
+  mb_mp3_t mp3;
+  mb_hash_t sha1;
+  long long size, pos;
+} mb_scan_t;
+
+/*
+ * Compact result of a file scan.
+ */
+typedef struct {
+  int ok, mp3_ok, trm_done;
+  long long size;
+  mb_mp3_info_t mp3;
+  unsigned char sha1[MB_SHA1_LEN];
+} mb_scan_result_t;
+
+static void scan_init(mb_scan_t *s, int do_mp3, int do_sha1, mb_trm_t *t, long long size) {
+  memset(s, 0, sizeof(mb_scan_t));
+  s->do_mp3 = do_mp3;
+  s->do_sha1 = do_sha1;
+  s->trm = t;
+  s->size = size;
+
+  mp3_init(&(s->mp3));
+  s->mp3.file_size = size;
+  hash_init(&(s->sha1), MB_HASH_SHA1);
+}
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  mb_GetQueryError(*mb, buf, sizeof(buf));
+static void scan_feed(mb_scan_t *s, const unsigned char *buf, long len) {
+  long long tag = s->size - 128;
+  long ofs, need;
+  int rate, chans, bits;
 
-  return rb_str_new2(buf);
+  if (s->do_mp3) {
+    mp3_feed(&(s->mp3), buf, len);
+
+    /* check for ID3v1 tag on the way past */
+    if (tag >= s->pos && tag + 3 <= s->pos + len) {
+      s->mp3.id3v1 = !memcmp(buf + (tag - s->pos), "TAG", 3);
+      s->tail_seen = 1;
+    }
+  }
+
+  if (s->do_sha1)
+    hash_update(&(s->sha1), buf, len);
+
+  if (s->trm) {
+    /* use the format from the WAVE header, if there is one */
+    if (s->pos || (ofs = wav_parse_header(buf, len, &rate, &chans, &bits)) < 0)
+      ofs = 0;
+    else
+      trm_set_format(s->trm, rate, chans, bits);
+
+    if (trm_bytes_per_sec(s->trm) && (need = trm_bytes_needed(s->trm)) > 0)
+      trm_feed(s->trm, (char*) buf + ofs, (need < len - ofs) ? need : len - ofs);
+  }
+
+  s->pos += len;
 }
-  
+
 /*
- * Select a context in the query result of this MusicBrainz::Client object.
- *
- * Returns true if the select query was successful (even if it didn't
- * return any results).
- *
- * See the MusicBrainz::Query documentation for information on various
- * query types.
- *
- * Examples:
- *   # return to the top-level context of the current query
- *   mb.select MusicBrainz::Query::Rewind
- *
- *   # select the second artist from a query that returned a list of
- *   # artists
- *   mb.select MusicBrainz::Query::SelectArtist, 2
- *
+ * Does anybody need more of the file?
  */
-static VALUE mb_client_select(int argc, VALUE *argv, VALUE self) {
-  musicbrainz_t *mb;
-  VALUE ret = Qfalse;
-  char *obj;
-  int i, *args;
+static int scan_more(mb_scan_t *s) {
+  return s->pos < s->size &&
+         ((s->do_mp3 && !s->mp3.done) || s->do_sha1 ||
+          (s->trm && trm_bytes_per_sec(s->trm) && !s->trm->done));
+}
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  switch (argc) {
-    case 0:
-      rb_raise(eErr, "Invalid argument count: %d.", argc);
-      break;
-    case 1:
-      ret = mb_Select(*mb, StringValueCStr(argv[0])) ? Qtrue : Qfalse;
-      break;
-    case 2:
-      obj = StringValueCStr(argv[0]);
-      i = FIX2INT(argv[1]);
-      ret = mb_Select1(*mb, obj, i) ? Qtrue : Qfalse;
-      break;
-    default:
-      /* grab object */
-      obj = StringValueCStr(argv[0]);
+/*
+ * Offset of the ID3v1 tag, if it still needs to be checked, or -1.
+ */
+static long long scan_tail(mb_scan_t *s) {
+  return (s->do_mp3 && !s->tail_seen && s->size >= 128) ? s->size - 128 : -1;
+}
 
-      /* allocate argument list */
-      if ((args = malloc(sizeof(int) * argc)) == NULL)
-        rb_raise(eErr, "couldn't allocate memory for argument list");
+static void scan_finish(mb_scan_t *s, mb_scan_result_t *r) {
+  r->ok = 1;
+  r->size = s->size;
+  r->mp3_ok = s->do_mp3 && mp3_result(&(s->mp3), &(r->mp3));
+  r->trm_done = s->trm && s->trm->done;
+  if (s->do_sha1)
+    hash_final(&(s->sha1), r->sha1);
+}
 
-      /* add arguments to list and NULL-terminate list */
-      for (i = 1; i < argc; i++)
-        args[i - 1] = FIX2INT(argv[i]);
-      args[argc - 1] = 0;
+/*
+ * Build the hash returned by MusicBrainz.scan_file.
+ */
+static VALUE scan_result_hash(mb_scan_result_t *r, int do_mp3, int do_sha1, int do_trm) {
+  char hex[2 * MB_SHA1_LEN + 1];
+  VALUE ret;
 
-      /* run query and free argument list */
-      ret = mb_SelectWithArgs(*mb, obj, args) ? Qtrue : Qfalse;
-      free(args);
+  if (!r->ok)
+    return Qnil;
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, rb_str_new2("size"), LL2NUM(r->size));
+
+  if (do_mp3)
+    rb_hash_aset(ret, rb_str_new2("mp3_info"), r->mp3_ok ?
+                 mp3_info_hash(r->mp3.duration, r->mp3.bitrate, r->mp3.stereo, r->mp3.samplerate) : Qnil);
+
+  if (do_sha1) {
+    digest_to_hex(r->sha1, MB_SHA1_LEN, hex);
+    rb_hash_aset(ret, rb_str_new2("sha1"), rb_str_new2(hex));
   }
 
+  if (do_trm)
+    rb_hash_aset(ret, rb_str_new2("trm"), r->trm_done ? Qtrue : Qfalse);
+
   return ret;
 }
 
-/* 
- * Extract a piece of information from the data returned by a successful query by a MusicBrainz::Client object.
- *
- * Returns nil if there was an error or if the correct piece of data was
- * not found.
- *
- * Note: Certain result queries require an ordinal argument.  See the
- * MusicBrainz result query (MBE_*) documentation for additional
- * information.
+typedef struct {
+  char *path;
+  int do_mp3, do_sha1, err;
+  mb_trm_t *trm;
+  mb_scan_result_t result;
+} scan_job_t;
+
+static void *scan_path_blocking(void *ptr) {
+  scan_job_t *job = ptr;
+  unsigned char *buf;
+  long long tail;
+  struct stat st;
+  mb_scan_t s;
+  ssize_t len;
+  int fd;
+
+  if ((fd = open(job->path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+    job->err = errno;
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  if ((buf = malloc(MB_BULK_BUFSIZ)) == NULL) {
+    job->err = ENOMEM;
+    close(fd);
+    return NULL;
+  }
+
+  scan_init(&s, job->do_mp3, job->do_sha1, job->trm, st.st_size);
+  while (scan_more(&s) && (len = read(fd, buf, MB_BULK_BUFSIZ)) > 0)
+    scan_feed(&s, buf, len);
+
+  if ((tail = scan_tail(&s)) >= 0 && pread(fd, buf, 3, tail) == 3)
+    s.mp3.id3v1 = !memcmp(buf, "TAG", 3);
+
+  scan_finish(&s, &(job->result));
+
+  free(buf);
+  close(fd);
+  return NULL;
+}
+
+static VALUE scan_path_call(VALUE ptr) {
+  mb_without_gvl(scan_path_blocking, (void*) ptr, NULL, NULL);
+  return Qnil;
+}
+
+/*
+ * Free the path, even if the thread was interrupted during the scan.
+ */
+static VALUE scan_path_free(VALUE ptr) {
+  free(((scan_job_t*) ptr)->path);
+  return Qnil;
+}
+
+/*
+ * Scan a file in a single pass.
+ *
+ * Reads the file once, and passes each chunk to the MPEG frame scanner
+ * (see MusicBrainz.mp3_info), a SHA-1 hash, and (optionally) a
+ * MusicBrainz::TRM handle.  Use this instead of calling mp3_info,
+ * hashing the file, and generating a TRM signature separately, each of
+ * which would read the file again.  Reading stops as soon as nothing
+ * needs any more of the file.  Other Ruby threads keep running during
+ * the scan.
+ *
+ * Options:
+ *   mp3_info: scan MPEG audio frames (defaults to true)
+ *   sha1: calculate the SHA-1 hash of the file (defaults to true)
+ *   trm: a MusicBrainz::TRM handle to feed (defaults to nil)
+ *
+ * The TRM handle is only fed as much data as it needs.  If the file is
+ * a RIFF WAVE file, the PCM format is read from the header, and only
+ * the audio data is passed to the handle.  Otherwise the raw file
+ * contents are passed as-is, so MusicBrainz::TRM#pcm_data must be
+ * called first.  Note that MP3 files need to be decoded before they
+ * can be signatured; use MusicBrainz::TRM#feed with the output of a
+ * decoder for those.
+ *
+ * Returns a hash containing the following keys:
+ *   size: size of the file, in bytes
+ *   mp3_info: same as MusicBrainz::Client#mp3_info (nil if no MPEG
+ *             frames were found)
+ *   sha1: SHA-1 hash of the file, as a hex string
+ *   trm: true if the TRM handle has enough data to generate a signature
  *
  * Aliases:
- *   MusicBrainz::Client#get_result 
- *   MusicBrainz::Client#get_result_data
+ *   MusicBrainz.scan
  *
  * Examples:
- *   # get the name of the currently selected album
- *   album_name = mb.result MusicBrainz::Query::AlbumGetAlbumName
+ *   # get mp3 info and sha1 hash of 'foo.mp3'
+ *   info = MusicBrainz.scan_file('foo.mp3')
+ *   puts "#{info['sha1']}: #{info['mp3_info']['duration']} ms"
+ *
+ *   # hash a WAVE file and feed it to a TRM handle
+ *   trm = MusicBrainz::TRM.new
+ *   info = MusicBrainz.scan_file('foo.wav', :mp3_info => false, :trm => trm)
+ *   sig = trm.finalize_signature if info['trm']
  *
- *   # get the duration of the 5th track on the current album
- *   duration = mb.result MusicBrainz::Query::AlbumGetTrackDuration, 5
  */
-static VALUE mb_client_result(int argc, VALUE *argv, VALUE self) {
-  musicbrainz_t *mb;
-  VALUE ret = Qnil;
-  MB_BUFFER buf[MB_RESULT_BUFSIZ];
-  char *obj;
+static VALUE mb_scan_file(int argc, VALUE *argv, VALUE self) {
+  VALUE path, opts, trm_obj;
+  scan_job_t job;
+
+  UNUSED(self);
+  rb_scan_args(argc, argv, "11", &path, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
+
+  memset(&job, 0, sizeof(job));
+  job.do_mp3 = scan_opt(opts, "mp3_info", 1);
+  job.do_sha1 = scan_opt(opts, "sha1", 1);
+
+  /* grab TRM handle */
+  trm_obj = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("trm")));
+  if (!NIL_P(trm_obj)) {
+    if (!rb_obj_is_kind_of(trm_obj, cTRM))
+      rb_raise(eErr, "trm option must be a MusicBrainz::TRM object");
+    Data_Get_Struct(trm_obj, mb_trm_t, job.trm);
+  }
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  obj = argc ? StringValueCStr(argv[0]) : NULL;
-  switch (argc) {
-    case 1:
-      if (mb_GetResultData(*mb, obj, buf, sizeof(buf)))
-        if (strlen(buf))
-          ret = rb_str_new2(buf);
-      break;
-    case 2:
-      if (mb_GetResultData1(*mb, obj, buf, sizeof(buf), FIX2INT(argv[1])))
-        if (strlen(buf))
-          ret = rb_str_new2(buf);
-      break;
-    default:
-      rb_raise(eErr, "Invalid argument count: %d.", argc);
+  if ((job.path = strdup(StringValueCStr(path))) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for path");
+
+  rb_ensure(scan_path_call, (VALUE) &job, scan_path_free, (VALUE) &job);
+
+  if (job.err)
+    rb_raise(eErr, "couldn't scan \"%s\": %s", RSTRING_PTR(path), strerror(job.err));
+
+  return scan_result_hash(&(job.result), job.do_mp3, job.do_sha1, job.trm != NULL);
+}
+
+typedef struct {
+  int do_mp3, do_sha1;
+  VALUE trm_objs;
+  mb_trm_t **trms;
+  mb_scan_t **states;
+  mb_scan_result_t *results;
+} scan_bulk_t;
+
+static long long scan_bulk_start(mb_bulk_t *b, long i, int fd) {
+  scan_bulk_t *job = b->data;
+  struct stat st;
+
+  if (fstat(fd, &st) || (job->states[i] = malloc(sizeof(mb_scan_t))) == NULL)
+    return -1;
+
+  scan_init(job->states[i], job->do_mp3, job->do_sha1, job->trms ? job->trms[i] : NULL, st.st_size);
+  return 0;
+}
+
+static long long scan_bulk_consume(mb_bulk_t *b, long i, const unsigned char *buf, long len) {
+  scan_bulk_t *job = b->data;
+  mb_scan_t *s = job->states[i];
+  long long tail;
+
+  if (s->tail_seen) {
+    /* this is the ID3v1 tag read */
+    if (len >= 3)
+      s->mp3.id3v1 = !memcmp(buf, "TAG", 3);
+  } else {
+    if (len > 0) {
+      scan_feed(s, buf, len);
+      if (scan_more(s))
+        return s->pos;
+    }
+
+    if ((tail = scan_tail(s)) >= 0) {
+      s->tail_seen = 1;
+      return tail;
+    }
   }
 
+  scan_finish(s, job->results + i);
+  free(s);
+  job->states[i] = NULL;
+  return -1;
+}
+
+static VALUE scan_batch_run(VALUE ptr) {
+  mb_bulk_t *b = (mb_bulk_t*) ptr;
+  scan_bulk_t *job = b->data;
+  VALUE ret;
+  long i;
+
+  if (job->trms)
+    for (i = 0; i < b->num; i++)
+      Data_Get_Struct(rb_ary_entry(job->trm_objs, i), mb_trm_t, job->trms[i]);
+
+  bulk_run(b);
+
+  ret = rb_ary_new2(b->num);
+  for (i = 0; i < b->num; i++)
+    rb_ary_push(ret, scan_result_hash(job->results + i, job->do_mp3, job->do_sha1, job->trms != NULL));
+
   return ret;
 }
 
-/* 
- * Return the integer value of a query by a MusicBrainz::Client object.
+/*
+ * Free a bulk scan, even if the thread was interrupted during it.
+ */
+static VALUE scan_batch_free(VALUE ptr) {
+  mb_bulk_t *b = (mb_bulk_t*) ptr;
+  scan_bulk_t *job = b->data;
+  long i;
+
+  for (i = 0; i < b->num; i++)
+    free(job->states[i]);
+  free(job->states);
+  free(job->results);
+  free(job->trms);
+  batch_free_paths(b->paths, b->num);
+
+  return Qnil;
+}
+
+/*
+ * Scan a list of files in a single pass each.
  *
- * Note: Certain result queries require an ordinal argument.  See the
- * MusicBrainz result query (MBE_*) documentation for additional
- * information.
+ * Like MusicBrainz.scan_file, but for many files at once.  Files are
+ * read with up to depth: reads in flight (defaults to 32), using
+ * io_uring on Linux, or a pool of reader threads elsewhere.  The trm:
+ * option, if given, must be an array of distinct MusicBrainz::TRM
+ * handles, one for each path; raises ArgumentError if a handle
+ * appears more than once.
+ *
+ * Returns an array of hashes (see MusicBrainz.scan_file), or nil for
+ * files that couldn't be read, in the same order as the list of paths.
  *
  * Aliases:
- *   MusicBrainz::Client#result_int
- *   MusicBrainz::Client#get_result_int
+ *   MusicBrainz.scan_batch
  *
- * Examples:
- *   # get the name of the currently selected album
- *   album_name = mb.result MusicBrainz::Query::AlbumGetAlbumName
+ * Example:
+ *   MusicBrainz.scan_files(paths, :depth => 64).each_with_index do |info, i|
+ *     puts "#{paths[i]}: #{info['sha1']}" if info
+ *   end
  *
- *   # get the duration of the 5th track on the current album
- *   duration = mb.result MusicBrainz::Query::AlbumGetTrackDuration, 5
  */
-static VALUE mb_client_result_int(int argc, VALUE *argv, VALUE self) {
-  musicbrainz_t *mb;
-  int ret;
-  char *obj;
+static VALUE mb_scan_files(int argc, VALUE *argv, VALUE self) {
+  VALUE paths, opts, trms, trm, seen;
+  scan_bulk_t job;
+  mb_bulk_t b;
+  long i;
+
+  UNUSED(self);
+  rb_scan_args(argc, argv, "11", &paths, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
+
+  memset(&b, 0, sizeof(b));
+  memset(&job, 0, sizeof(job));
+  b.depth = bulk_depth(opts);
+  job.do_mp3 = scan_opt(opts, "mp3_info", 1);
+  job.do_sha1 = scan_opt(opts, "sha1", 1);
+
+  trms = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("trm")));
+  if (!NIL_P(trms)) {
+    Check_Type(trms, T_ARRAY);
+    Check_Type(paths, T_ARRAY);
+    if (RARRAY_LEN(trms) != RARRAY_LEN(paths))
+      rb_raise(eErr, "trm option must have one TRM handle for each path");
+
+    /* each handle is fed from its own worker, so they can't repeat */
+    seen = rb_hash_new();
+    for (i = 0; i < RARRAY_LEN(trms); i++) {
+      trm = rb_ary_entry(trms, i);
+      if (!rb_obj_is_kind_of(trm, cTRM))
+        rb_raise(eErr, "trm option must only contain MusicBrainz::TRM objects");
+      if (!NIL_P(rb_hash_aref(seen, trm)))
+        rb_raise(rb_eArgError, "trm option has the same TRM handle more than once");
+      rb_hash_aset(seen, trm, Qtrue);
+    }
+  }
+
+  b.paths = batch_paths(paths, &(b.num));
+  job.states = calloc(b.num + 1, sizeof(mb_scan_t*));
+  job.results = calloc(b.num + 1, sizeof(mb_scan_result_t));
+  job.trms = NIL_P(trms) ? NULL : calloc(b.num + 1, sizeof(mb_trm_t*));
+  if (!job.states || !job.results || (!NIL_P(trms) && !job.trms)) {
+    free(job.states);
+    free(job.results);
+    free(job.trms);
+    batch_free_paths(b.paths, b.num);
+    rb_raise(eErr, "couldn't allocate memory for scan results");
+  }
+
+  job.trm_objs = trms;
+
+  b.start = scan_bulk_start;
+  b.consume = scan_bulk_consume;
+  b.data = &job;
+
+  return rb_ensure(scan_batch_run, (VALUE) &b, scan_batch_free, (VALUE) &b);
+}
+
+/*
+ * Scan the MPEG audio frames of a file, reading only as much of the
+ * file as the scanner needs.  Doesn't touch any Ruby objects, so it's
+ * safe to call without the global interpreter lock.  Returns 0 if the
+ * file couldn't be read or doesn't have any MPEG audio frames.
+ */
+static int mp3_scan_path(const char *path, int full, mb_mp3_info_t *info) {
+  unsigned char buf[MB_MP3_BUFSIZ];
+  struct stat st;
+  mb_mp3_t m;
+  ssize_t len;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return 0;
+  }
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  obj = argc ? StringValueCStr(argv[0]) : NULL;
+  mp3_init(&m);
+  m.full = full;
+  m.file_size = st.st_size;
+
+  while (!m.done) {
+    /* seek past large tags instead of reading them */
+    if (m.skip > (long long) sizeof(buf)) {
+      if (lseek(fd, m.skip, SEEK_CUR) < 0)
+        break;
+      m.offset += m.skip;
+      m.skip = 0;
+    }
 
-  switch (argc) {
-    case 1:
-      ret = mb_GetResultInt(*mb, obj);
-      break;
-    case 2:
-      ret = mb_GetResultInt1(*mb, obj, FIX2INT(argv[1]));
+    if ((len = read(fd, buf, sizeof(buf))) <= 0)
       break;
-    default:
-      rb_raise(eErr, "Invalid argument count: %d.", argc);
+    mp3_feed(&m, buf, len);
   }
 
-  return INT2FIX(ret);
+  /* check for ID3v1 tag */
+  if (st.st_size >= 128 && pread(fd, buf, 3, st.st_size - 128) == 3)
+    m.id3v1 = !memcmp(buf, "TAG", 3);
+
+  close(fd);
+  return mp3_result(&m, info);
 }
 
-/* 
- * See if a piece of information exists in data returned by a successful query by a MusicBrainz::Client object.
+/*
+ * Build a MusicBrainz::MP3Info from a scan result.
+ */
+static VALUE mp3_info_struct(mb_mp3_info_t *info) {
+  return rb_struct_new(cMP3Info, INT2FIX(info->duration), 
+                       INT2FIX(info->bitrate), info->stereo ? Qtrue : Qfalse,
+                       INT2FIX(info->samplerate), LONG2NUM(info->frames),
+                       info->vbr ? Qtrue : Qfalse);
+}
+
+typedef struct {
+  char *path;
+  int full, ok;
+  mb_mp3_info_t info;
+} mp3_scan_job_t;
+
+static void *mp3_scan_blocking(void *ptr) {
+  mp3_scan_job_t *job = ptr;
+  uint64_t start = mb_now_ns();
+
+  job->ok = mp3_scan_path(job->path, job->full, &(job->info));
+  stats_time(NULL, MB_STATS_MP3_INFO, start, job->ok);
+
+  return NULL;
+}
+
+static VALUE mp3_scan_call(VALUE ptr) {
+  mb_without_gvl(mp3_scan_blocking, (void*) ptr, NULL, NULL);
+  return Qnil;
+}
+
+/*
+ * Free the path, even if the thread was interrupted during the scan.
+ */
+static VALUE mp3_scan_free(VALUE ptr) {
+  free(((mp3_scan_job_t*) ptr)->path);
+  return Qnil;
+}
+
+/*
+ * Calculate the crucial pieces of information for an MP3 file.
  *
- * Note: Certain result queries require an ordinal argument.  See the
- * MusicBrainz result query (MBE_*) documentation for additional
- * information.
+ * This is a faster alternative to MusicBrainz::Client#mp3_info.  Only
+ * the start of the file is read: the duration is taken from the
+ * Xing/Info/VBRI header (adjusted by the LAME encoder delay and
+ * padding, if present), or estimated from the file size for CBR files.
+ * VBR files without a header are scanned frame by frame.  Set the
+ * full: option to force a full frame scan.  Other Ruby threads keep
+ * running during the scan.
  *
- * Aliases:
- *   MusicBrainz::Client#result_exists?
- *   MusicBrainz::Client#does_result_exist?
+ * Returns a MusicBrainz::MP3Info (a Struct with duration (ms), bitrate
+ * (kbps, average for VBR files), stereo, samplerate (Hz), frames, and
+ * vbr members), or nil if the file couldn't be read or isn't an MPEG
+ * audio file.
  *
  * Examples:
- *   # does the current album have a name?
- *   puts 'named album' if mb.exists? MusicBrainz::Query::AlbumGetAlbumName
+ *   info = MusicBrainz.mp3_info('foo.mp3')
+ *   puts "duration (ms): #{info.duration}, vbr: #{info.vbr}"
+ *
+ *   # ignore VBR headers and count every frame
+ *   info = MusicBrainz.mp3_info('foo.mp3', :full => true)
  *
- *   # does the current album have a type?
- *   puts 'has a type' if mb.exists? MusicBrainz::Query::AlbumGetAlbumType
  */
-static VALUE mb_client_exists(int argc, VALUE *argv, VALUE self) {
-  musicbrainz_t *mb;
-  VALUE ret = Qfalse;
-  char *obj;
+static VALUE mb_mp3_info(int argc, VALUE *argv, VALUE self) {
+  VALUE path, opts;
+  mp3_scan_job_t job;
+  uint64_t start;
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  obj = argc ? StringValueCStr(argv[0]) : NULL;
-  switch (argc) {
-    case 1:
-      ret = mb_DoesResultExist(*mb, obj) ? Qtrue : Qfalse;
-      break;
-    case 2:
-      ret = mb_DoesResultExist1(*mb, obj, FIX2INT(argv[1])) ? Qtrue : Qfalse;
-      break;
-    default:
-      rb_raise(eErr, "Invalid argument count: %d.", argc);
-  }
+  UNUSED(self);
+  rb_scan_args(argc, argv, "11", &path, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
 
-  return ret;
+  memset(&job, 0, sizeof(job));
+  job.full = scan_opt(opts, "full", 0);
+  if ((job.path = strdup(StringValueCStr(path))) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for path");
+
+  start = mb_now_ns();
+  rb_ensure(mp3_scan_call, (VALUE) &job, mp3_scan_free, (VALUE) &job);
+
+  if (MB_EVENT_ON(MB_STATS_MP3_INFO))
+    event_fire(MB_STATS_MP3_INFO, start, mb_now_ns(), path, Qnil, -1, job.ok);
+
+  return job.ok ? mp3_info_struct(&(job.info)) : Qnil;
 }
 
 /*
- * Get the RDF that was returned by the server of a MusicBrainz::Client object.
- *
- * Returns nil if a string could not be allocated or if there was an
- * error.
- * 
- * Aliases:
- *   MusicBrainz::Client#get_rdf
- *   MusicBrainz::Client#result_rdf
- *   MusicBrainz::Client#get_result_rdf
- *   
- * Example:
- *   rdf = mb.rdf
- *
+ * Per-file state for bulk MPEG scans.
  */
-static VALUE mb_client_rdf(VALUE self) {
-  musicbrainz_t *mb;
-  VALUE ret = Qnil;
-  char *buf;
-  int len;
+typedef struct {
+  mb_mp3_t m;
+  int tail;
+} mp3_bulk_file_t;
+
+typedef struct {
+  int full, *oks;
+  mp3_bulk_file_t **states;
+  mb_mp3_info_t *infos;
+} mp3_bulk_t;
+
+static long long mp3_bulk_start(mb_bulk_t *b, long i, int fd) {
+  mp3_bulk_t *job = b->data;
+  mp3_bulk_file_t *f;
+  struct stat st;
+
+  if (fstat(fd, &st) || (f = malloc(sizeof(mp3_bulk_file_t))) == NULL)
+    return -1;
+
+  mp3_init(&(f->m));
+  f->m.full = job->full;
+  f->m.file_size = st.st_size;
+  f->tail = 0;
+  job->states[i] = f;
+
+  return 0;
+}
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  if ((len = mb_GetResultRDFLen(*mb)) > 0) {
-    if ((buf = malloc(len + 1)) != NULL) {
-      mb_GetResultRDF(*mb, buf, len + 1);
-      ret = rb_str_new(buf, len);
-      free(buf);
-    } else {
-      rb_raise(eErr, "couldn't allocate memory for RDF buffer");
+static long long mp3_bulk_consume(mb_bulk_t *b, long i, const unsigned char *buf, long len) {
+  mp3_bulk_t *job = b->data;
+  mp3_bulk_file_t *f = job->states[i];
+
+  if (f->tail) {
+    /* this is the ID3v1 tag read */
+    if (len >= 3)
+      f->m.id3v1 = !memcmp(buf, "TAG", 3);
+  } else {
+    if (len > 0) {
+      mp3_feed(&(f->m), buf, len);
+
+      /* read the next chunk the scanner needs (skipping past tags and
+       * frame data it doesn't care about) */
+      if (!f->m.done) {
+        f->m.offset += f->m.skip;
+        f->m.skip = 0;
+        if (f->m.offset < f->m.file_size)
+          return f->m.offset;
+      }
+    }
+
+    if (f->m.file_size >= 128) {
+      f->tail = 1;
+      return f->m.file_size - 128;
     }
   }
 
+  job->oks[i] = mp3_result(&(f->m), job->infos + i);
+  free(f);
+  job->states[i] = NULL;
+  return -1;
+}
+
+static VALUE mp3_batch_run(VALUE ptr) {
+  mb_bulk_t *b = (mb_bulk_t*) ptr;
+  mp3_bulk_t *job = b->data;
+  VALUE ret;
+  long i;
+
+  bulk_run(b);
+
+  ret = rb_ary_new2(b->num);
+  for (i = 0; i < b->num; i++)
+    rb_ary_push(ret, job->oks[i] ? mp3_info_struct(job->infos + i) : Qnil);
+
   return ret;
 }
 
 /*
- * Get the length of the RDF that was returned by the server of a MusicBrainz::Client object.
- *
- * Aliases:
- *   MusicBrainz::Client#get_rdf_len
- *   MusicBrainz::Client#result_rdf_len
- *   MusicBrainz::Client#get_result_rdf_len
- *   
- * Example:
- *   rdf_len = mb.rdf_len
- *
+ * Free a bulk MPEG scan, even if the thread was interrupted during it.
  */
-static VALUE mb_client_rdf_len(VALUE self) {
-  musicbrainz_t *mb;
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  return INT2FIX(mb_GetResultRDFLen(*mb));
+static VALUE mp3_batch_free(VALUE ptr) {
+  mb_bulk_t *b = (mb_bulk_t*) ptr;
+  mp3_bulk_t *job = b->data;
+  long i;
+
+  for (i = 0; i < b->num; i++)
+    free(job->states[i]);
+  free(job->oks);
+  free(job->infos);
+  free(job->states);
+  batch_free_paths(b->paths, b->num);
+
+  return Qnil;
 }
 
 /*
- * Set the RDF to use for data extraction for a MusicBrainz::Client object.
- *
- * Note: Advanced users only.
+ * Calculate the crucial pieces of information for a list of MP3 files.
  *
- * Aliases:
- *   MusicBrainz::Client#set_rdf
- *   MusicBrainz::Client#result_rdf=
- *   MusicBrainz::Client#set_result_rdf
+ * Scans each file like MusicBrainz.mp3_info.  Files are read with up to
+ * depth: reads in flight (defaults to 32; threads: is accepted as an
+ * alias), using io_uring on Linux, or a pool of reader threads
+ * elsewhere.  Returns an array of MusicBrainz::MP3Info objects (or nil
+ * for files that couldn't be scanned), in the same order as the list
+ * of paths.
  *
- * Example:
- *   mb.rdf = result_rdf
+ * Examples:
+ *   paths = File.readlines('mp3-list.txt').map { |line| line.chomp }
+ *   infos = MusicBrainz.mp3_info_batch(paths, :depth => 64)
+ *   total = infos.compact.inject(0) { |sum, info| sum + info.duration }
  *
  */
-static VALUE mb_client_set_rdf(VALUE self, VALUE rdf) {
-  musicbrainz_t *mb;
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  return mb_SetResultRDF(*mb, StringValueCStr(rdf)) ? Qtrue : Qfalse;
+static VALUE mb_mp3_info_batch(int argc, VALUE *argv, VALUE self) {
+  VALUE paths, opts;
+  mp3_bulk_t job;
+  mb_bulk_t b;
+
+  UNUSED(self);
+  rb_scan_args(argc, argv, "11", &paths, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
+
+  memset(&b, 0, sizeof(b));
+  memset(&job, 0, sizeof(job));
+  b.depth = bulk_depth(opts);
+  job.full = scan_opt(opts, "full", 0);
+  b.paths = batch_paths(paths, &(b.num));
+
+  job.oks = calloc(b.num + 1, sizeof(int));
+  job.infos = calloc(b.num + 1, sizeof(mb_mp3_info_t));
+  job.states = calloc(b.num + 1, sizeof(mp3_bulk_file_t*));
+  if (!job.oks || !job.infos || !job.states) {
+    free(job.oks);
+    free(job.infos);
+    free(job.states);
+    batch_free_paths(b.paths, b.num);
+    rb_raise(eErr, "couldn't allocate memory for scan results");
+  }
+
+  b.start = mp3_bulk_start;
+  b.consume = mp3_bulk_consume;
+  b.data = &job;
+
+  return rb_ensure(mp3_batch_run, (VALUE) &b, mp3_batch_free, (VALUE) &b);
 }
 
+/****************/
+/* File digests */
+/****************/
+
 /*
- * Extract the actual artist/album/track ID from a MBE_GetxxxxxId query.
- *
- * The MBE_GETxxxxxId queries return a URL where additional RDF metadata
- * for a given ID can be retrieved.  Callers may wish to extract only
- * the ID of an artist/album/track for reference.
- *
- * Aliases:
- *   MusicBrainz::Client#get_id_from_url
- *
- * Examples:
- *   # get the artist name of the first track on the album
- *   url = mb.result MusicBrainz::Query::AlbumGetArtistId, 1
- *   id = mb.id_from_url url
- *   
+ * Get the digest algorithm from the algorithm: entry of an option hash.
  */
-static VALUE mb_client_id_from_url(VALUE self, VALUE url) {
-  musicbrainz_t *mb;
-  MB_BUFFER buf[MB_ID_BUFSIZ];
+static int hash_algo(VALUE opts) {
+  VALUE val;
+  const char *name;
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  mb_GetIDFromURL(*mb, StringValueCStr(url), buf, sizeof(buf));
+  val = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("algorithm")));
+  if (NIL_P(val))
+    return MB_HASH_SHA1;
 
-  return rb_str_new2(buf);
+  if (SYMBOL_P(val))
+    val = rb_funcall(val, rb_intern("to_s"), 0);
+  name = StringValueCStr(val);
+
+  if (!strcmp(name, "sha1"))
+    return MB_HASH_SHA1;
+  if (!strcmp(name, "sha256"))
+    return MB_HASH_SHA256;
+
+  rb_raise(eErr, "unknown digest algorithm: %s", name);
+  return -1;
 }
 
-/*
- * Extract an identifier fragment from a URL.
- *
- * Given a URI, this method will return the string that follows the #
- * separator (e.g. when passed
- * "http://musicbrainz.org/mm/mq-1.1#ArtistResult", this method will
- * return "ArtistResult").
- * 
- *
- * Aliases:
- *   MusicBrainz::Client#get_fragment_from_url
- *
- * Examples:
- *   # get the artist name of the first track on the album
- *   url = mb.result MusicBrainz::Query::AlbumGetArtistId, 1
- *   frag = mb.fragment_from_url url
- *   
- */
-static VALUE mb_client_frag_from_url(VALUE self, VALUE url) {
-  musicbrainz_t *mb;
-  MB_BUFFER buf[MB_FRAG_BUFSIZ];
+static VALUE hash_file_opts(int argc, VALUE *argv, int algo) {
+  VALUE path, opts;
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  mb_GetFragmentFromURL(*mb, StringValueCStr(url), buf, sizeof(buf));
+  rb_scan_args(argc, argv, "11", &path, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
 
-  return rb_str_new2(buf);
+  return hash_file(path, algo, scan_opt(opts, "hex", 1));
 }
 
 /*
- * Get the ordinal (list position) of an item in a list.
- *
- * Normally used to retrieve the track number out of a list of tracks in
- * an album.
+ * Calculate the SHA-1 hash of a file.
  *
- * Aliases:
- *   MusicBrainz::Client#get_ordinal
- *   MusicBrainz::Client#get_ordinal_from_list
+ * The file is mapped into memory and hashed natively, without blocking
+ * other Ruby threads; the SHA extensions are used on processors that
+ * have them.  Returns a 40 character hex string, or the raw 20 byte
+ * digest if hex: is false.  Raises MusicBrainz::Error if the file can't
+ * be read.
  *
  * Examples:
- *   # get the ordinal of a track based on the URI
- *   list = mb.result MusicBrainz::Query::AlbumGetTrackList
- *   uri  = mb.result MusicBrainz::Query::AlbumGetTrackId, 5
- *   ordinal = mb.ordinal list, uri
- *   
+ *   sha1 = MusicBrainz.sha1('foo.mp3')
+ *   raw = MusicBrainz.sha1('foo.mp3', :hex => false)
+ *
  */
-static VALUE mb_client_ordinal(VALUE self, VALUE list, VALUE uri) {
-  musicbrainz_t *mb;
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  return INT2FIX(mb_GetOrdinalFromList(*mb, StringValueCStr(list), StringValueCStr(uri)));
+static VALUE mb_sha1(int argc, VALUE *argv, VALUE self) {
+  UNUSED(self);
+  return hash_file_opts(argc, argv, MB_HASH_SHA1);
 }
 
-#if 0
-/* 
- * Calculate the SHA1 hash for a given filename.
+/*
+ * Calculate the SHA-256 hash of a file.
  *
- * Aliases:
- *   MusicBrainz::Client#calculate_sha1
+ * Works like MusicBrainz.sha1, but returns a 64 character hex string
+ * (or the raw 32 byte digest if hex: is false).
  *
  * Examples:
- *   sha1 = mb.sha1 'foo.mp3'
+ *   sha256 = MusicBrainz.sha256('foo.mp3')
  *
  */
-static VALUE mb_client_sha1(VALUE self, VALUE path) {
-  musicbrainz_t *mb;
-  MB_BUFFER buf[41];
+static VALUE mb_sha256(int argc, VALUE *argv, VALUE self) {
+  UNUSED(self);
+  return hash_file_opts(argc, argv, MB_HASH_SHA256);
+}
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  mb_CalculateSha1(*mb, StringValueCStr(path), buf);
+typedef struct {
+  char **paths;
+  int algo, hex, *errs;
+  unsigned char *digests;
+} hash_batch_t;
 
-  return rb_str_new2(buf);
+static void hash_batch_file(mb_batch_t *b, long i) {
+  hash_batch_t *job = b->data;
+  job->errs[i] = hash_path(job->paths[i], job->algo, job->digests + i * MB_HASH_MAXLEN);
+}
+
+static VALUE hash_batch_run(VALUE ptr) {
+  mb_batch_t *b = (mb_batch_t*) ptr;
+  hash_batch_t *job = b->data;
+  VALUE ret;
+  long i;
+
+  batch_run(b);
+
+  ret = rb_ary_new2(b->num);
+  for (i = 0; i < b->num; i++)
+    rb_ary_push(ret, job->errs[i] ? Qnil : hash_str(job->digests + i * MB_HASH_MAXLEN, job->algo, job->hex));
+
+  return ret;
 }
-#endif /* 0 */
 
 /*
- * Calculate the crucial pieces of information for an MP3 file.
- *
- * Note: This method returns the duration of the MP3 in milliseconds, so
- * you'll need to divide the duration by 1000 before passing it to
- * MusicBrainz::TRM methods.
- *
- * Aliases:
- *   MusicBrainz::Client#get_mp3_info
- *
- * Examples:
- *   # get the duration and stereo of an MP3 named 'foo.mp3'
- *   info = mb.mp3_info 'foo.mp3'
- *   puts 'duration (ms): ' << info['duration'] << ', ' <<
- *        'stereo: ' << (info['stereo'] ? 'yes' : 'no')
- *   
+ * Free a batch of hashes, even if the thread was interrupted during
+ * it.
  */
-static VALUE mb_client_mp3_info(VALUE self, VALUE path) {
-  musicbrainz_t *mb;
-  VALUE ret = Qnil;
-  int dr, br, st, sr;
+static VALUE hash_batch_free(VALUE ptr) {
+  mb_batch_t *b = (mb_batch_t*) ptr;
+  hash_batch_t *job = b->data;
 
-  Data_Get_Struct(self, musicbrainz_t, mb);
-  if (mb_GetMP3Info(*mb, StringValueCStr(path), &dr, &br, &st, &sr)) {
-    ret = rb_hash_new();
-    rb_hash_aset(ret, rb_str_new2("duration"), INT2FIX(dr));
-    rb_hash_aset(ret, rb_str_new2("bitrate"), INT2FIX(br));
-    rb_hash_aset(ret, rb_str_new2("stereo"), st ? Qtrue : Qfalse);
-    rb_hash_aset(ret, rb_str_new2("samplerate"), INT2FIX(sr));
-  }
+  free(job->errs);
+  free(job->digests);
+  batch_free_paths(job->paths, b->num);
 
-  return ret;
+  return Qnil;
 }
 
 /*
- * Launch a URL in the specified browser.
+ * Calculate the hashes of a list of files.
+ *
+ * Files are hashed like MusicBrainz.sha1, in parallel on up to
+ * threads: native threads (defaults to 4).  Accepts the following
+ * options:
+ *
+ * - algorithm: :sha1 (the default) or :sha256.
+ * - hex: return hex strings (the default), or raw digests if false.
+ * - threads: number of worker threads.
+ *
+ * Returns an array of digests (or nil for files that couldn't be read),
+ * in the same order as the list of paths.
  *
  * Aliases:
- *   MusicBrainz::Client#browser
- *   MusicBrainz::Client#launch_browser
+ *   MusicBrainz.digest_batch
  *
  * Examples:
- *   mb.launch uri, 'galeon'
+ *   paths = File.readlines('mp3-list.txt').map { |line| line.chomp }
+ *   sums = MusicBrainz.digest_files(paths, :algorithm => :sha256, :threads => 8)
+ *   paths.zip(sums) { |path, sum| puts "#{sum}  #{path}" if sum }
  *
  */
-static VALUE mb_client_launch(VALUE self, VALUE url, VALUE browser) {
-  char *url_str, *browser_str;
-  url_str = url ? StringValueCStr(url) : NULL;
-  browser_str = browser ? StringValueCStr(browser) : NULL;
-  return LaunchBrowser(url_str, browser_str) ? Qtrue : Qfalse;
+static VALUE mb_digest_files(int argc, VALUE *argv, VALUE self) {
+  VALUE paths, opts;
+  hash_batch_t job;
+  mb_batch_t b;
+  long i;
+
+  UNUSED(self);
+  rb_scan_args(argc, argv, "11", &paths, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
+
+  memset(&b, 0, sizeof(b));
+  memset(&job, 0, sizeof(job));
+  b.threads = batch_threads(opts);
+  job.algo = hash_algo(opts);
+  job.hex = scan_opt(opts, "hex", 1);
+  job.paths = batch_paths(paths, &(b.num));
+
+  job.errs = malloc(sizeof(int) * (b.num + 1));
+  job.digests = malloc(MB_HASH_MAXLEN * (b.num + 1));
+  if (!job.errs || !job.digests) {
+    free(job.errs);
+    free(job.digests);
+    batch_free_paths(job.paths, b.num);
+    rb_raise(eErr, "couldn't allocate memory for digests");
+  }
+
+  /* files skipped by an interrupted batch have no digest */
+  for (i = 0; i < b.num; i++)
+    job.errs[i] = EINTR;
+
+  b.func = hash_batch_file;
+  b.data = &job;
+
+  return rb_ensure(hash_batch_run, (VALUE) &b, hash_batch_free, (VALUE) &b);
+}
+
+/*******************************/
+/* MusicBrainz::DiscID methods */
+/*******************************/
+
+/*
+ * Disc IDs are computed locally from a table of contents: the SHA-1
+ * of the first and last track numbers ("%02X" each) and 100 sector
+ * offsets ("%08X" each; the lead-out, then tracks 1 to 99, with 0 for
+ * missing tracks), base64 encoded with ".", "_", and "-" in place of
+ * "+", "/", and "=".  Offsets include the 150 sector lead-in.
+ */
+#define MB_DISCID_LEN       28
+#define MB_DISCID_LEADIN    150
+
+/* gap between the audio and data sessions of an enhanced CD */
+#define MB_DISCID_DATA_GAP  11400
+
+/* largest cue sheet or log file read by DiscID.from_eac_logs */
+#define MB_DISCID_MAX_FILE  (4 << 20)
+
+typedef struct {
+  int first, last;
+
+  /* offsets[0] is the lead-out, offsets[n] is the start of track n */
+  long offsets[100];
+} mb_toc_t;
+
+static int toc_valid(const mb_toc_t *toc) {
+  int i;
+
+  if (toc->first < 1 || toc->last > 99 || toc->first > toc->last)
+    return 0;
+
+  for (i = toc->first; i <= toc->last; i++)
+    if (toc->offsets[i] < 0 || (i > toc->first && toc->offsets[i] <= toc->offsets[i - 1]))
+      return 0;
+
+  return toc->offsets[0] > toc->offsets[toc->last];
+}
+
+/*
+ * Compute the disc ID of a (valid) table of contents.  The output
+ * buffer must hold at least (MB_DISCID_LEN + 1) bytes.
+ */
+static void toc_discid(const mb_toc_t *toc, char *out) {
+  static const char b64[] = 
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._";
+  unsigned char digest[MB_SHA1_LEN + 1];
+  char buf[4 + 8 * 100 + 1];
+  mb_hash_t c;
+  int i;
+
+  sprintf(buf, "%02X%02X", toc->first, toc->last);
+  for (i = 0; i < 100; i++)
+    sprintf(buf + 4 + 8 * i, "%08lX", 
+            (i == 0 || (i >= toc->first && i <= toc->last)) ? (unsigned long) toc->offsets[i] : 0UL);
+
+  hash_init(&c, MB_HASH_SHA1);
+  hash_update(&c, (const unsigned char*) buf, 4 + 8 * 100);
+  hash_final(&c, digest);
+  digest[MB_SHA1_LEN] = 0;
+
+  /* 20 bytes: six full groups and one 2 byte group */
+  for (i = 0; i < 7; i++) {
+    uint32_t v = (digest[3 * i] << 16) | (digest[3 * i + 1] << 8) | (i < 6 ? digest[3 * i + 2] : 0);
+    out[4 * i] = b64[(v >> 18) & 0x3f];
+    out[4 * i + 1] = b64[(v >> 12) & 0x3f];
+    out[4 * i + 2] = b64[(v >> 6) & 0x3f];
+    out[4 * i + 3] = (i < 6) ? b64[v & 0x3f] : '-';
+  }
+  out[MB_DISCID_LEN] = '\0';
+}
+
+/*
+ * Skip leading whitespace, and check for a (case-insensitive) keyword
+ * followed by whitespace.  Returns a pointer to the rest of the line,
+ * or NULL if the keyword doesn't match.
+ */
+static const char *cue_keyword(const char *line, const char *key) {
+  size_t len = strlen(key);
+
+  while (*line == ' ' || *line == '\t')
+    line++;
+  if (strncasecmp(line, key, len) || (line[len] != ' ' && line[len] != '\t'))
+    return NULL;
+
+  return line + len;
 }
 
+/*
+ * Parse a cue sheet.  Cue sheets don't include the length of the last
+ * track, so the total length of the audio (in sectors) has to be
+ * passed in.  Multi-file cue sheets aren't supported, since their
+ * index times are relative to each file.  Returns 0 if the cue sheet
+ * couldn't be parsed.
+ */
+static int toc_parse_cue(const char *s, long len, long leadout, mb_toc_t *toc) {
+  char line[512];
+  const char *p, *end = s + len;
+  int track = 0, files = 0, data_track = 0, mm, ss, ff;
+  long n;
+
+  memset(toc, 0, sizeof(mb_toc_t));
+
+  while (s < end) {
+    /* copy the next line */
+    for (n = 0; s < end && *s != '\n' && *s != '\r'; s++)
+      if (n < (long) sizeof(line) - 1)
+        line[n++] = *s;
+    line[n] = '\0';
+    while (s < end && (*s == '\n' || *s == '\r'))
+      s++;
+
+    if (cue_keyword(line, "FILE")) {
+      if (++files > 1)
+        return 0;
+    } else if ((p = cue_keyword(line, "TRACK")) != NULL) {
+      if (sscanf(p, "%d", &track) != 1 || track < 1 || track > 99)
+        return 0;
+      if (!toc->first)
+        toc->first = track;
+      toc->last = track;
+      if (!strstr(p, "AUDIO") && !strstr(p, "audio") && track > toc->first)
+        data_track = track;
+    } else if ((p = cue_keyword(line, "INDEX")) != NULL) {
+      if (!track || sscanf(p, "%ld %d:%d:%d", &n, &mm, &ss, &ff) != 4)
+        return 0;
+      if (n == 1)
+        toc->offsets[track] = MB_DISCID_LEADIN + (mm * 60 + ss) * 75 + ff;
+    }
+  }
+
+  toc->offsets[0] = MB_DISCID_LEADIN + leadout;
+
+  /* enhanced CD: the ID only covers the audio session */
+  if (data_track && data_track == toc->last) {
+    toc->last--;
+    toc->offsets[0] = toc->offsets[data_track] - MB_DISCID_DATA_GAP;
+  }
+
+  return toc_valid(toc);
+}
 
 /*
- * Document-class: MusicBrainz::TRM
- *
- * Client API to generate MusicBrainz TRM signatures.  The
- * easiest way to explain the code is probably with a simple example.
- *
- *   # load the musicbrainz library
- *   require 'musicbrainz'
+ * Parse the TOC table from an Exact Audio Copy log:
  *
- *   # create a musicbrainz trm handle
- *   trm = MusicBrainz::TRM.new
- *
- *   # prepare for CD-quality audio
- *   samples, channels, bits = 44100, 2, 16
- *   trm.pcm_data samples, channels, bits
- *   
- *   # read data from file and pass it to the TRM handle
- *   # until MusicBrainz has enough information to generate
- *   # a signature
- *   while buf = fh.read(4096)
- *     break if trm.generate_signature(buf)
- *   end
- *   
- *   # check for signature
- *   if sig = trm.finalize_signature
- *     # print human-readable version of signature
- *     puts trm.convert_sig(sig)
- *   else
- *     $stderr.puts "Couldn't generate signature"
- *   end
+ *   Track |   Start  |  Length  | Start sector | End sector
+ *   ---------------------------------------------------------
+ *      1  |  0:00.00 |  3:38.37 |         0    |    16386
  *
+ * Only the numeric columns are used, so translated logs work too.  If
+ * the log has more than one TOC (eg several rips), the first one is
+ * used.  Returns 0 if the log doesn't have a usable TOC.
  */
+static int toc_parse_eac(const char *s, long len, mb_toc_t *toc) {
+  char line[512];
+  const char *end = s + len;
+  long n, start, stop, last_stop = 0;
+  int track;
+
+  memset(toc, 0, sizeof(mb_toc_t));
+
+  while (s < end) {
+    for (n = 0; s < end && *s != '\n' && *s != '\r'; s++)
+      if (n < (long) sizeof(line) - 1)
+        line[n++] = *s;
+    line[n] = '\0';
+    while (s < end && (*s == '\n' || *s == '\r'))
+      s++;
+
+    if (sscanf(line, " %d | %*[^|] | %*[^|] | %ld | %ld", &track, &start, &stop) != 3) {
+      /* the first table ends at the first line that doesn't match */
+      if (toc->last)
+        break;
+      continue;
+    }
 
-/****************************/
-/* MusicBrainz::TRM methods */
-/****************************/
-static void trm_free(void *trm) {
-  trm_Delete(* (trm_t*) trm);
-  free(trm);
-}
+    if (track < 1 || track > 99 || (toc->last && track != toc->last + 1))
+      return 0;
 
-static VALUE mb_trm_alloc(VALUE klass) {
-  trm_t *trm;
+    /* enhanced CD: stop at the data session */
+    if (toc->last && start - last_stop - 1 >= MB_DISCID_DATA_GAP)
+      break;
 
-  if ((trm = malloc(sizeof(trm_t))) == NULL)
-    rb_raise(eErr, "Couldn't allocate memory for TRM structure");
+    if (!toc->first)
+      toc->first = track;
+    toc->last = track;
+    toc->offsets[track] = MB_DISCID_LEADIN + start;
+    last_stop = stop;
+  }
 
-  return Data_Wrap_Struct(klass, 0, trm_free, trm);
+  toc->offsets[0] = MB_DISCID_LEADIN + last_stop + 1;
+  return toc_valid(toc);
 }
 
-#ifndef HAVE_RB_DEFINE_ALLOC_FUNC
 /*
- * Allocate and initialize a new MusicBrainz::TRM object.
- *
- * Example:
- *   trm = MusicBrainz::TRM.new
+ * EAC writes UTF-16 logs (with a byte order mark); squash those down
+ * to ASCII in place, replacing anything else with '?'.  Returns the
+ * new length.
  */
-VALUE mb_trm_new(VALUE klass) {
-  VALUE self;
+static long toc_text_ascii(char *s, long len) {
+  long i, ofs;
+  int le;
+
+  if (len < 2)
+    return len;
+  if (!((unsigned char) s[0] == 0xff && (unsigned char) s[1] == 0xfe) &&
+      !((unsigned char) s[0] == 0xfe && (unsigned char) s[1] == 0xff))
+    return len;
+
+  le = ((unsigned char) s[0] == 0xff);
+  for (i = 2, ofs = 0; i + 1 < len; i += 2) {
+    unsigned char lo = s[i + !le], hi = s[i + le];
+    s[ofs++] = (hi || lo > 0x7f) ? '?' : (char) lo;
+  }
 
-  self = mb_trm_alloc(klass);
-  rb_obj_call_init(self, 0, NULL);
+  return ofs;
+}
 
-  return self;
+static VALUE toc_struct(const mb_toc_t *toc) {
+  char id[MB_DISCID_LEN + 1];
+  VALUE offsets;
+  int i;
+
+  toc_discid(toc, id);
+
+  offsets = rb_ary_new2(toc->last - toc->first + 2);
+  rb_ary_push(offsets, LONG2NUM(toc->offsets[0]));
+  for (i = toc->first; i <= toc->last; i++)
+    rb_ary_push(offsets, LONG2NUM(toc->offsets[i]));
+
+  return rb_struct_new(cDiscID, rb_str_new(id, MB_DISCID_LEN), INT2FIX(toc->first), 
+                       INT2FIX(toc->last), offsets);
 }
-#endif /* !HAVE_RB_DEFINE_ALLOC_FUNC */
 
 /*
- * :nodoc:
- *
- * Constructor for MusicBrainz::TRM object.
+ * Build a TOC from Ruby arguments.  Returns 0 if it's invalid.
  */
-static VALUE mb_trm_init(VALUE self) {
-  trm_t *trm;
+static int toc_from_args(VALUE first, VALUE last, VALUE offsets, mb_toc_t *toc) {
+  long i;
 
-  Data_Get_Struct(self, trm_t, trm);
-  *trm = trm_New();
+  memset(toc, 0, sizeof(mb_toc_t));
+  toc->first = NUM2INT(first);
+  toc->last = NUM2INT(last);
 
-  return self;
+  Check_Type(offsets, T_ARRAY);
+  if (toc->first < 1 || toc->last > 99 || toc->first > toc->last || 
+      RARRAY_LEN(offsets) != toc->last - toc->first + 2)
+    return 0;
+
+  toc->offsets[0] = NUM2LONG(rb_ary_entry(offsets, 0));
+  for (i = 1; i < RARRAY_LEN(offsets); i++)
+    toc->offsets[toc->first + i - 1] = NUM2LONG(rb_ary_entry(offsets, i));
+
+  return toc_valid(toc);
 }
 
 /*
- * Set the proxy name and port for the MusicBrainz::TRM object.
- * 
- * Note: If unspecified, the port defaults to 8080.
- *
- * Returns false if MusicBrainz could not connect to the proxy.
+ * Compute a disc ID from a table of contents, without a CD drive or a
+ * server query.  offsets is an array of sector offsets: the lead-out,
+ * followed by the start of each track from first to last.  Offsets
+ * include the 150 sector lead-in (ie, track 1 usually starts at 150).
+ * Returns a MusicBrainz::DiscID, or raises MusicBrainz::Error if the
+ * table of contents is invalid.
  *
- * Aliases:
- *   MusicBrainz::TRM#set_proxy
+ * The id can be passed to the
+ * MusicBrainz::Query::GetCDInfoFromCDIndexId query.
  *
  * Examples:
- *   # connect to 'proxy.localdomain', port 8080
- *   trm.proxy = 'proxy.localdomain'
- *
- *   # connect to proxy.example.com, port 31337
- *   trm.proxy = 'proxy.example.com:31337'
- *
- *   # connect to www.musicbrainz.org, port 8080
- *   trm.set_proxy 'www.musicbrainz.org'
- *
- *   # connect to proxy.example.com, port 31337
- *   trm.set_proxy 'proxy.example.com', 31337
+ *   disc = MusicBrainz::DiscID.from_toc(1, 3, [95462, 150, 16537, 34770])
+ *   mb.query(MusicBrainz::Query::GetCDInfoFromCDIndexId, disc.id)
  *
  */
-static VALUE mb_trm_set_proxy(int argc, VALUE *argv, VALUE self) {
-  trm_t *trm;
-  MB_BUFFER host[MB_HOST_BUFSIZ];
-  int port;
+static VALUE mb_discid_from_toc(VALUE klass, VALUE first, VALUE last, VALUE offsets) {
+  mb_toc_t toc;
 
-  Data_Get_Struct(self, trm_t, trm);
-  
-  memset(host, 0, sizeof(host));
-  port = 8080;
-  
-  parse_hostspec(argc, argv, host, sizeof(host), &port);
-  
-  return trm_SetProxy(*trm, host, port) ? Qtrue : Qfalse;
+  UNUSED(klass);
+  if (!toc_from_args(first, last, offsets, &toc))
+    rb_raise(eErr, "invalid table of contents");
+
+  return toc_struct(&toc);
 }
 
 /*
- * Set the information of an audio stream to be signatured.
- *
- * Note: this MUST be called before attempting to generate a signature.
- *
- * samples: samples per second (Hz) of audio data (eg 44100)
- * channels: number of audio channels (eg 1 for mono, or two for stereo)
- * bits: bits per sample (eg 8 or 16)
- * 
- * Aliases:
- *   MusicBrainz::TRM#set_pcm_data
- *   MusicBrainz::TRM#pcm_data_info
- *   MusicBrainz::TRM#set_pcm_data_info
- *
- * Examples:
- *   # prepare for CD-quality audio
- *   samples, channels, bits = 44100, 2, 16
- *   trm.pcm_data samples, channels, bits
- *
+ * Check that an entry passed to MusicBrainz::DiscID.from_tocs has the
+ * types toc_from_args() expects, which would raise otherwise.
  */
-static VALUE mb_trm_set_pcm_data(VALUE self, VALUE samples, VALUE chans, VALUE bps) {
-  trm_t *trm;
-  Data_Get_Struct(self, trm_t, trm);
-  trm_SetPCMDataInfo(*trm, FIX2INT(samples), FIX2INT(chans), FIX2INT(bps));
-  return self;
+static int toc_entry_ok(VALUE ent) {
+  VALUE first, last, offsets;
+  long i;
+
+  if (TYPE(ent) != T_ARRAY || RARRAY_LEN(ent) != 3)
+    return 0;
+
+  first = rb_ary_entry(ent, 0);
+  last = rb_ary_entry(ent, 1);
+  offsets = rb_ary_entry(ent, 2);
+  if (!FIXNUM_P(first) || FIX2LONG(first) < 1 || FIX2LONG(first) > 99 ||
+      !FIXNUM_P(last) || FIX2LONG(last) < 1 || FIX2LONG(last) > 99 ||
+      TYPE(offsets) != T_ARRAY)
+    return 0;
+
+  for (i = 0; i < RARRAY_LEN(offsets); i++)
+    if (!FIXNUM_P(rb_ary_entry(offsets, i)))
+      return 0;
+
+  return 1;
 }
 
 /*
- * Set the length of an audio stream (in seconds).
- *
- * Note: This method is optional, but if it is called, it must be called
- * after MusicBrainz::TRM#pcm_data and before any calls to
- * MusicBrainz::TRM#generate_signature.
- *
- * Aliases:
- *   MusicBrainz::TRM#set_length
- *   MusicBrainz::TRM#song_length=
- *   MusicBrainz::TRM#set_song_length
+ * Compute disc IDs for a list of tables of contents, each an array of
+ * [first, last, offsets] (see MusicBrainz::DiscID.from_toc).  Returns
+ * an array of MusicBrainz::DiscID objects, with nil for entries that
+ * aren't valid tables of contents (including ones of the wrong type).
  *
  * Examples:
- *   trm.length = 4000
+ *   ids = MusicBrainz::DiscID.from_tocs(tocs).map { |disc| disc && disc.id }
+ *
  */
-static VALUE mb_trm_set_length(VALUE self, VALUE len) {
-  trm_t *trm;
-  Data_Get_Struct(self, trm_t, trm);
-  trm_SetSongLength(*trm, FIX2INT(len));
-  return self;
+static VALUE mb_discid_from_tocs(VALUE klass, VALUE tocs) {
+  VALUE ret, ent;
+  mb_toc_t toc;
+  long i;
+
+  UNUSED(klass);
+  Check_Type(tocs, T_ARRAY);
+  ret = rb_ary_new2(RARRAY_LEN(tocs));
+
+  for (i = 0; i < RARRAY_LEN(tocs); i++) {
+    ent = rb_ary_entry(tocs, i);
+    if (toc_entry_ok(ent) &&
+        toc_from_args(rb_ary_entry(ent, 0), rb_ary_entry(ent, 1), rb_ary_entry(ent, 2), &toc))
+      rb_ary_push(ret, toc_struct(&toc));
+    else
+      rb_ary_push(ret, Qnil);
+  }
+
+  return ret;
 }
 
 /*
- * Pass raw PCM data to generate a signature.
- *
- * Note: MusicBrainz::TRM#pcm_data must be called before this function.
- *
- * Returns true if enough data has been sent to generate a signature,
- * and false if more data is needed.
+ * Compute a disc ID from the contents of a single-file cue sheet.
+ * Cue sheets don't say how long the last track is, so leadout must be
+ * the total length of the image in sectors (eg the size of the raw
+ * audio in bytes / 2352).  Data tracks at the end of the disc (enhanced
+ * CDs) are left out, like a CD drive would.  Raises MusicBrainz::Error
+ * if the cue sheet can't be parsed.
  *
- * Example:
- *   trm.generate_signature buf
+ * Examples:
+ *   sectors = File.size('disc.wav') / 2352
+ *   disc = MusicBrainz::DiscID.from_cue(File.read('disc.cue'), sectors)
  *
  */
-static VALUE mb_trm_gen_sig(VALUE self, VALUE buf) {
-  trm_t *trm;
-  char *ptr;
-  int len;
+static VALUE mb_discid_from_cue(VALUE klass, VALUE cue, VALUE leadout) {
+  mb_toc_t toc;
 
-  Data_Get_Struct(self, trm_t, trm);
-  ptr = RSTRING(buf)->ptr;
-  len = RSTRING(buf)->len;
+  UNUSED(klass);
+  StringValue(cue);
+  if (!toc_parse_cue(RSTRING_PTR(cue), RSTRING_LEN(cue), NUM2LONG(leadout), &toc))
+    rb_raise(eErr, "couldn't parse cue sheet");
 
-  return trm_GenerateSignature(*trm, ptr, len) ? Qtrue : Qfalse;
+  return toc_struct(&toc);
 }
 
 /*
- * Finalize generated signature.
+ * Compute a disc ID from the TOC in the contents of an Exact Audio Copy
+ * log (UTF-16 or ASCII).  Data tracks at the end of the disc (enhanced
+ * CDs) are left out.  Raises MusicBrainz::Error if the log doesn't
+ * have a usable TOC.
  *
- * Call this after MusicBrainz::TRM#generate_signature has returned true.
- *
- * Accepts an optional 16-byte string, used to associate the signature
- * with a particular collection in the RElatable Engine.  Returns nil on
- * error, or a 16 byte signature on success.
- *
- * Example:
- *   sig = trm.finalize_signature
+ * Examples:
+ *   log = File.open('rip.log', 'rb') { |fh| fh.read }
+ *   disc = MusicBrainz::DiscID.from_eac_log(log)
  *
  */
-static VALUE mb_trm_finalize_sig(int argc, VALUE *argv, VALUE self) {
-  trm_t *trm;
-  MB_BUFFER sig[32];
-  char *id = NULL;
-  VALUE ret = Qnil;
+static VALUE mb_discid_from_eac_log(VALUE klass, VALUE log) {
+  mb_toc_t toc;
+  char *buf;
+  long len;
+  int ok;
 
-  Data_Get_Struct(self, trm_t, trm);
-  switch (argc) {
-    case 0:
-      break;
-    case 1:
-      if (argv[0] != Qnil)
-        id = RSTRING(argv[0])->ptr;
+  UNUSED(klass);
+  StringValue(log);
+  len = RSTRING_LEN(log);
+  if ((buf = malloc(len + 1)) == NULL)
+    rb_raise(eErr, "couldn't allocate memory for log");
+  memcpy(buf, RSTRING_PTR(log), len);
+
+  len = toc_text_ascii(buf, len);
+  ok = toc_parse_eac(buf, len, &toc);
+  free(buf);
+
+  if (!ok)
+    rb_raise(eErr, "couldn't find TOC in log");
+
+  return toc_struct(&toc);
+}
+
+typedef struct {
+  char **paths;
+  int *oks;
+  mb_toc_t *tocs;
+} discid_batch_t;
+
+static void discid_batch_file(mb_batch_t *b, long i) {
+  discid_batch_t *job = b->data;
+  struct stat st;
+  char *buf;
+  long len = 0;
+  ssize_t n;
+  int fd;
+
+  if ((fd = open(job->paths[i], O_RDONLY)) == -1)
+    return;
+  if (fstat(fd, &st) || st.st_size > MB_DISCID_MAX_FILE || (buf = malloc(st.st_size + 1)) == NULL) {
+    close(fd);
+    return;
+  }
+
+  while (len < st.st_size && (n = read(fd, buf + len, st.st_size - len)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
       break;
-    default:
-      rb_raise(eErr, "Invalid argument count: %d.", argc);
+    }
+    len += n;
   }
+  close(fd);
 
-  if (!trm_FinalizeSignature(*trm, sig, id))
-    ret = rb_str_new(sig, 16);
+  len = toc_text_ascii(buf, len);
+  job->oks[i] = toc_parse_eac(buf, len, job->tocs + i);
+  free(buf);
+}
+
+static VALUE discid_batch_run(VALUE ptr) {
+  mb_batch_t *b = (mb_batch_t*) ptr;
+  discid_batch_t *job = b->data;
+  VALUE ret;
+  long i;
+
+  batch_run(b);
+
+  ret = rb_ary_new2(b->num);
+  for (i = 0; i < b->num; i++)
+    rb_ary_push(ret, job->oks[i] ? toc_struct(job->tocs + i) : Qnil);
 
   return ret;
 }
 
 /*
- * Convert 16-byte raw signature into a human-readable 36-byte ASCII string.
- *
- * Used after MusicBrainz::TRM#generate_signature has returned true and
- * MusicBrainz::TRM#finalize_signature has returned a signature.
- *
- * Aliases:
- *   MusicBrainz::TRM#sig_to_ascii
- *   MusicBrainz::TRM#convert_sig_to_ascii
+ * Free a batch of logs, even if the thread was interrupted during it.
+ */
+static VALUE discid_batch_free(VALUE ptr) {
+  mb_batch_t *b = (mb_batch_t*) ptr;
+  discid_batch_t *job = b->data;
+
+  free(job->oks);
+  free(job->tocs);
+  batch_free_paths(job->paths, b->num);
+
+  return Qnil;
+}
+
+/*
+ * Compute disc IDs for a list of Exact Audio Copy log files.  Files are
+ * read and parsed in parallel on up to threads: native threads
+ * (defaults to 4), without blocking other Ruby threads.  Returns an
+ * array of MusicBrainz::DiscID objects (or nil for files that couldn't
+ * be read or don't have a usable TOC), in the same order as the list of
+ * paths.
  *
  * Examples:
- *   puts 'signature: ' << trm.convert_sig raw_sig
+ *   logs = File.readlines('log-list.txt').map { |line| line.chomp }
+ *   discs = MusicBrainz::DiscID.from_eac_logs(logs, :threads => 8)
  *
  */
-static VALUE mb_trm_convert_sig(VALUE self, VALUE sig) {
-  trm_t *trm;
-  MB_BUFFER buf[64];
+static VALUE mb_discid_from_eac_logs(int argc, VALUE *argv, VALUE klass) {
+  VALUE paths, opts;
+  discid_batch_t job;
+  mb_batch_t b;
+
+  UNUSED(klass);
+  rb_scan_args(argc, argv, "11", &paths, &opts);
+  if (!NIL_P(opts))
+    Check_Type(opts, T_HASH);
+
+  memset(&b, 0, sizeof(b));
+  memset(&job, 0, sizeof(job));
+  b.threads = batch_threads(opts);
+  job.paths = batch_paths(paths, &(b.num));
+
+  job.oks = calloc(b.num + 1, sizeof(int));
+  job.tocs = calloc(b.num + 1, sizeof(mb_toc_t));
+  if (!job.oks || !job.tocs) {
+    free(job.oks);
+    free(job.tocs);
+    batch_free_paths(job.paths, b.num);
+    rb_raise(eErr, "couldn't allocate memory for disc IDs");
+  }
 
-  Data_Get_Struct(self, trm_t, trm);
-  trm_ConvertSigToASCII(*trm, StringValuePtr(sig), buf);
+  b.func = discid_batch_file;
+  b.data = &job;
 
-  return rb_str_new(buf, MB_ID_LEN);
+  return rb_ensure(discid_batch_run, (VALUE) &b, discid_batch_free, (VALUE) &b);
 }
 
-
 /******************/
 /* INIT FUNCTIONS */
 /******************/
@@ -1793,12 +12699,96 @@ static void define_queries(void) {
 }
 
 void Init_musicbrainz(void) {
+  int i;
+
   mMB = rb_define_module("MusicBrainz");
+  hash_init_cpu();
 
   /* Version of the MB-Ruby bindings.  (use MusicBrainz::Client#version for the client library version). 
    */
   rb_define_const(mMB, "VERSION", rb_str_new2(MB_VERSION));
 
+  rb_define_module_function(mMB, "scan_file", mb_scan_file, -1);
+  rb_define_module_function(mMB, "scan", mb_scan_file, -1);
+
+  rb_define_module_function(mMB, "mp3_info", mb_mp3_info, -1);
+  rb_define_module_function(mMB, "mp3_info_batch", mb_mp3_info_batch, -1);
+
+  rb_define_module_function(mMB, "scan_files", mb_scan_files, -1);
+  rb_define_module_function(mMB, "scan_batch", mb_scan_files, -1);
+
+  rb_define_module_function(mMB, "ids_from_urls", mb_ids_from_urls, -1);
+  rb_define_module_function(mMB, "fragments_from_urls", mb_frags_from_urls, -1);
+
+  rb_define_module_function(mMB, "sha1", mb_sha1, -1);
+  rb_define_module_function(mMB, "sha256", mb_sha256, -1);
+  rb_define_module_function(mMB, "digest_files", mb_digest_files, -1);
+  rb_define_module_function(mMB, "digest_batch", mb_digest_files, -1);
+
+  rb_define_module_function(mMB, "stats", mb_stats_get, -1);
+  rb_define_module_function(mMB, "reset_stats", mb_stats_reset, 0);
+
+  rb_define_module_function(mMB, "dns_ttl=", mb_set_dns_ttl, 1);
+  rb_define_module_function(mMB, "set_dns_ttl", mb_set_dns_ttl, 1);
+  rb_define_module_function(mMB, "dns_ttl", mb_dns_ttl_get, 0);
+  rb_define_module_function(mMB, "resolve", mb_resolve, -1);
+#ifdef HAVE_PTHREAD_H
+  pthread_atfork(servers_atfork_prepare, servers_atfork_parent, servers_atfork_child);
+#endif /* HAVE_PTHREAD_H */
+
+  rb_define_module_function(mMB, "subscribe", mb_subscribe, -1);
+  rb_define_module_function(mMB, "unsubscribe", mb_unsubscribe, 1);
+  for (i = 0; i < MB_STATS_OPS; i++) {
+    mb_subscribers[i] = rb_ary_new();
+    rb_global_variable(&(mb_subscribers[i]));
+  }
+
+  /*
+   * Document-class: MusicBrainz::MP3Info
+   *
+   * Information about an MP3 file, returned by MusicBrainz.mp3_info and
+   * MusicBrainz.mp3_info_batch.  Members are duration (ms), bitrate
+   * (kbps), stereo, samplerate (Hz), frames, and vbr.
+   */
+  cMP3Info = rb_struct_define(NULL, "duration", "bitrate", "stereo", 
+                              "samplerate", "frames", "vbr", NULL);
+  rb_define_const(mMB, "MP3Info", cMP3Info);
+
+  /*
+   * Document-class: MusicBrainz::Event
+   *
+   * A native call, passed to MusicBrainz.subscribe blocks.  Members are
+   * name (:query, :select, :result, :auth, :trm, or :mp3_info), start
+   * and finish (monotonic clock, in nanoseconds, like
+   * Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)),
+   * query (the query, select, or result constant, or the file for
+   * mp3_info), args (the remaining arguments), bytes (size of the
+   * result, or of the PCM data for :trm; nil if there isn't one), and
+   * ok (false if the call failed; for :trm, whether the signature has
+   * enough data).
+   */
+  cEvent = rb_struct_define(NULL, "name", "start", "finish", "query", 
+                            "args", "bytes", "ok", NULL);
+  rb_define_const(mMB, "Event", cEvent);
+  rb_define_method(cEvent, "duration", mb_event_duration, 0);
+
+  /*
+   * Document-class: MusicBrainz::DiscID
+   *
+   * A disc ID computed locally from a table of contents, returned by
+   * MusicBrainz::DiscID.from_toc and friends.  Members are id (for
+   * MusicBrainz::Query::GetCDInfoFromCDIndexId), first and last (track
+   * numbers), and offsets (the lead-out, then the start of each track,
+   * in sectors).
+   */
+  cDiscID = rb_struct_define(NULL, "id", "first", "last", "offsets", NULL);
+  rb_define_const(mMB, "DiscID", cDiscID);
+  rb_define_singleton_method(cDiscID, "from_toc", mb_discid_from_toc, 3);
+  rb_define_singleton_method(cDiscID, "from_tocs", mb_discid_from_tocs, 1);
+  rb_define_singleton_method(cDiscID, "from_cue", mb_discid_from_cue, 2);
+  rb_define_singleton_method(cDiscID, "from_eac_log", mb_discid_from_eac_log, 1);
+  rb_define_singleton_method(cDiscID, "from_eac_logs", mb_discid_from_eac_logs, -1);
+
   /*
    * Document-class: MusicBrainz::Error
    *
@@ -1825,6 +12815,14 @@ void Init_musicbrainz(void) {
    */
   eErr = rb_define_class_under(mMB, "Error", rb_eStandardError);
 
+  /*
+   * Document-class: MusicBrainz::TimeoutError
+   *
+   * Raised by MusicBrainz::Client#query when a query runs out of time
+   * (see MusicBrainz::Client#timeout=).
+   */
+  eTimeout = rb_define_class_under(mMB, "TimeoutError", eErr);
+
   /* Length of a returned ID value. */
   rb_define_const(mMB, "ID_LEN", INT2FIX(MB_ID_LEN));
   /* Length of a returned ID value. */
@@ -1854,6 +12852,18 @@ void Init_musicbrainz(void) {
   
   rb_define_method(cClient, "server=", mb_client_set_server, -1);
   rb_define_alias(cClient, "set_server", "server=");
+  rb_define_method(cClient, "servers=", mb_client_set_servers, 1);
+  rb_define_alias(cClient, "set_servers", "servers=");
+  rb_define_method(cClient, "servers", mb_client_servers, 0);
+  rb_define_method(cClient, "hedge=", mb_client_set_hedge, 1);
+  rb_define_alias(cClient, "set_hedge", "hedge=");
+  rb_define_method(cClient, "balance=", mb_client_set_balance, 1);
+  rb_define_alias(cClient, "set_balance", "balance=");
+  rb_define_method(cClient, "compression=", mb_client_set_compression, 1);
+  rb_define_alias(cClient, "set_compression", "compression=");
+  rb_define_method(cClient, "revalidate=", mb_client_set_revalidate, 1);
+  rb_define_alias(cClient, "set_revalidate", "revalidate=");
+  rb_define_method(cClient, "server_stats", mb_client_server_stats, 0);
 
   rb_define_method(cClient, "debug=", mb_client_set_debug, 1);
 
@@ -1875,6 +12885,26 @@ void Init_musicbrainz(void) {
 
   rb_define_method(cClient, "max_items=", mb_client_set_max_items, 1);
   rb_define_alias(cClient, "set_max_items", "max_items=");
+  rb_define_method(cClient, "index", mb_client_index, 0);
+  rb_define_method(cClient, "index=", mb_client_set_index, 1);
+  rb_define_alias(cClient, "set_index", "index=");
+  rb_define_method(cClient, "transport", mb_client_transport, 0);
+  rb_define_method(cClient, "transport=", mb_client_set_transport, -1);
+  rb_define_alias(cClient, "set_transport", "transport=");
+  rb_define_method(cClient, "connect_timeout=", mb_client_set_connect_timeout, 1);
+  rb_define_alias(cClient, "set_connect_timeout", "connect_timeout=");
+  rb_define_method(cClient, "read_timeout=", mb_client_set_read_timeout, 1);
+  rb_define_alias(cClient, "set_read_timeout", "read_timeout=");
+  rb_define_method(cClient, "timeout=", mb_client_set_timeout, 1);
+  rb_define_alias(cClient, "set_timeout", "timeout=");
+  rb_define_method(cClient, "deadline=", mb_client_set_deadline, 1);
+  rb_define_alias(cClient, "set_deadline", "deadline=");
+  rb_define_method(cClient, "cancel", mb_client_cancel, 0);
+  rb_define_method(cClient, "retries=", mb_client_set_retries, 1);
+  rb_define_alias(cClient, "set_retries", "retries=");
+
+  rb_define_method(cClient, "stats", mb_client_stats, -1);
+  rb_define_method(cClient, "reset_stats", mb_client_reset_stats, 0);
 
   rb_define_method(cClient, "query", mb_client_query, -1);
 
@@ -1914,7 +12944,7 @@ void Init_musicbrainz(void) {
   rb_define_alias(cClient, "result_rdf=", "rdf=");
   rb_define_alias(cClient, "set_result_rdf", "rdf=");
 
-  rb_define_method(cClient, "id_from_url", mb_client_id_from_url, 1);
+  rb_define_method(cClient, "id_from_url", mb_client_id_from_url, -1);
   rb_define_alias(cClient, "get_id_from_url", "id_from_url");
 
   rb_define_method(cClient, "fragment_from_url", mb_client_frag_from_url, 1);
@@ -1924,6 +12954,9 @@ void Init_musicbrainz(void) {
   rb_define_alias(cClient, "get_ordinal", "ordinal");
   rb_define_alias(cClient, "get_ordinal_from_list", "ordinal");
 
+  rb_define_method(cClient, "sha1", mb_client_sha1, 1);
+  rb_define_alias(cClient, "calculate_sha1", "sha1");
+
   rb_define_method(cClient, "mp3_info", mb_client_mp3_info, 1);
   rb_define_alias(cClient, "get_mp3_info", "mp3_info");
 
@@ -1937,7 +12970,7 @@ void Init_musicbrainz(void) {
   cTRM = rb_define_class_under(mMB, "TRM", rb_cObject);
 
 #ifdef HAVE_RB_DEFINE_ALLOC_FUNC
-  rb_define_alloc_func(cClient, mb_trm_alloc);
+  rb_define_alloc_func(cTRM, mb_trm_alloc);
 #else /* !HAVE_RB_DEFINE_ALLOC_FUNC */
   rb_define_singleton_method(cTRM, "new", mb_trm_new, 0);
 #endif /* HAVE_RB_DEFINE_ALLOC_FUNC */
@@ -1957,9 +12990,129 @@ void Init_musicbrainz(void) {
   rb_define_alias(cTRM, "set_song_length", "length=");
 
   rb_define_method(cTRM, "generate_signature", mb_trm_gen_sig, 1);
+
+  rb_define_method(cTRM, "bytes_needed", mb_trm_bytes_needed, 0);
+  rb_define_alias(cTRM, "get_bytes_needed", "bytes_needed");
+
+  rb_define_method(cTRM, "seconds_needed", mb_trm_seconds_needed, 0);
+  rb_define_alias(cTRM, "get_seconds_needed", "seconds_needed");
+
+  rb_define_method(cTRM, "feed", mb_trm_feed, -1);
+  rb_define_alias(cTRM, "generate_signature_from", "feed");
+
   rb_define_method(cTRM, "finalize_signature", mb_trm_finalize_sig, -1);
 
   rb_define_method(cTRM, "convert_sig", mb_trm_convert_sig, 1);
   rb_define_alias(cTRM, "sig_to_ascii", "convert_sig");
   rb_define_alias(cTRM, "convert_sig_to_ascii", "convert_sig");
+
+  /*********************/
+  /* define MBID class */
+  /*********************/
+  cMBID = rb_define_class_under(mMB, "MBID", rb_cObject);
+  rb_include_module(cMBID, rb_mComparable);
+
+#ifdef HAVE_RB_DEFINE_ALLOC_FUNC
+  rb_define_alloc_func(cMBID, mb_mbid_alloc);
+#else /* !HAVE_RB_DEFINE_ALLOC_FUNC */
+  rb_define_singleton_method(cMBID, "new", mb_mbid_new, 1);
+#endif /* HAVE_RB_DEFINE_ALLOC_FUNC */
+  rb_define_method(cMBID, "initialize", mb_mbid_init, 1);
+  rb_define_method(cMBID, "initialize_copy", mb_mbid_init_copy, 1);
+
+  rb_define_singleton_method(cMBID, "parse", mb_mbid_parse, 1);
+  rb_define_singleton_method(cMBID, "valid?", mb_mbid_valid, 1);
+  rb_define_singleton_method(cMBID, "from_raw", mb_mbid_from_raw, 1);
+
+  /* Size of a binary MBID, in bytes. */
+  rb_define_const(cMBID, "RAW_LEN", INT2FIX(MB_MBID_LEN));
+
+  rb_define_method(cMBID, "to_s", mb_mbid_to_s, 0);
+  rb_define_alias(cMBID, "id", "to_s");
+  rb_define_method(cMBID, "inspect", mb_mbid_inspect, 0);
+  rb_define_method(cMBID, "raw", mb_mbid_raw, 0);
+  rb_define_method(cMBID, "to_url", mb_mbid_to_url, -1);
+
+  rb_define_method(cMBID, "hash", mb_mbid_hash, 0);
+  rb_define_method(cMBID, "<=>", mb_mbid_cmp, 1);
+  rb_define_method(cMBID, "eql?", mb_mbid_eql, 1);
+  rb_define_method(cMBID, "==", mb_mbid_eql, 1);
+
+  /**********************************/
+  /* define IDSet and IDMap classes */
+  /**********************************/
+  cIDSet = rb_define_class_under(mMB, "IDSet", rb_cObject);
+  rb_include_module(cIDSet, rb_mEnumerable);
+
+#ifdef HAVE_RB_DEFINE_ALLOC_FUNC
+  rb_define_alloc_func(cIDSet, mb_idset_alloc);
+#else /* !HAVE_RB_DEFINE_ALLOC_FUNC */
+  rb_define_singleton_method(cIDSet, "new", mb_idset_new, -1);
+#endif /* HAVE_RB_DEFINE_ALLOC_FUNC */
+  rb_define_method(cIDSet, "initialize", mb_idtab_init, -1);
+  rb_define_singleton_method(cIDSet, "load", mb_idtab_load, 1);
+
+  rb_define_method(cIDSet, "size", mb_idtab_size, 0);
+  rb_define_alias(cIDSet, "length", "size");
+  rb_define_method(cIDSet, "empty?", mb_idtab_empty, 0);
+  rb_define_method(cIDSet, "bytesize", mb_idtab_bytesize, 0);
+  rb_define_method(cIDSet, "clear", mb_idtab_clear, 0);
+  rb_define_method(cIDSet, "include?", mb_idtab_include, 1);
+  rb_define_alias(cIDSet, "member?", "include?");
+  rb_define_alias(cIDSet, "===", "include?");
+  rb_define_method(cIDSet, "add", mb_idset_add, 1);
+  rb_define_alias(cIDSet, "<<", "add");
+  rb_define_method(cIDSet, "add?", mb_idset_add_p, 1);
+  rb_define_method(cIDSet, "delete", mb_idset_delete, 1);
+  rb_define_method(cIDSet, "merge", mb_idtab_merge, 1);
+  rb_define_method(cIDSet, "each", mb_idtab_each, 0);
+  rb_define_method(cIDSet, "save", mb_idtab_save, 1);
+  rb_define_method(cIDSet, "inspect", mb_idtab_inspect, 0);
+
+  cIDMap = rb_define_class_under(mMB, "IDMap", rb_cObject);
+  rb_include_module(cIDMap, rb_mEnumerable);
+
+#ifdef HAVE_RB_DEFINE_ALLOC_FUNC
+  rb_define_alloc_func(cIDMap, mb_idmap_alloc);
+#else /* !HAVE_RB_DEFINE_ALLOC_FUNC */
+  rb_define_singleton_method(cIDMap, "new", mb_idmap_new, -1);
+#endif /* HAVE_RB_DEFINE_ALLOC_FUNC */
+  rb_define_method(cIDMap, "initialize", mb_idtab_init, -1);
+  rb_define_singleton_method(cIDMap, "load", mb_idtab_load, 1);
+
+  rb_define_method(cIDMap, "size", mb_idtab_size, 0);
+  rb_define_alias(cIDMap, "length", "size");
+  rb_define_method(cIDMap, "empty?", mb_idtab_empty, 0);
+  rb_define_method(cIDMap, "bytesize", mb_idtab_bytesize, 0);
+  rb_define_method(cIDMap, "clear", mb_idtab_clear, 0);
+  rb_define_method(cIDMap, "key?", mb_idtab_include, 1);
+  rb_define_alias(cIDMap, "has_key?", "key?");
+  rb_define_alias(cIDMap, "include?", "key?");
+  rb_define_method(cIDMap, "[]", mb_idmap_aref, 1);
+  rb_define_method(cIDMap, "[]=", mb_idmap_aset, 2);
+  rb_define_alias(cIDMap, "store", "[]=");
+  rb_define_method(cIDMap, "delete", mb_idmap_delete, 1);
+  rb_define_method(cIDMap, "merge", mb_idtab_merge, 1);
+  rb_define_method(cIDMap, "each", mb_idtab_each, 0);
+  rb_define_alias(cIDMap, "each_pair", "each");
+  rb_define_method(cIDMap, "save", mb_idtab_save, 1);
+  rb_define_method(cIDMap, "inspect", mb_idtab_inspect, 0);
+
+  /*****************************/
+  /* define MusicBrainz::Index */
+  /*****************************/
+  cIndex = rb_define_class_under(mMB, "Index", rb_cObject);
+
+#ifdef HAVE_RB_DEFINE_ALLOC_FUNC
+  rb_define_alloc_func(cIndex, mb_index_alloc);
+#else /* !HAVE_RB_DEFINE_ALLOC_FUNC */
+  rb_define_singleton_method(cIndex, "new", mb_index_new, 1);
+#endif /* HAVE_RB_DEFINE_ALLOC_FUNC */
+  rb_define_method(cIndex, "initialize", mb_index_init, 1);
+  rb_define_singleton_method(cIndex, "build", mb_index_build, 2);
+
+  rb_define_method(cIndex, "close", mb_index_close, 0);
+  rb_define_method(cIndex, "closed?", mb_index_closed, 0);
+  rb_define_method(cIndex, "counts", mb_index_counts, 0);
+  rb_define_method(cIndex, "search", mb_index_search, -1);
 }
@@ -0,0 +1,38 @@
+#
+# Shared setup for the tests in test/.
+#
+# Run every test with "make test" after building the extension, or a
+# single file with "ruby test/test_digest.rb".
+#
+
+# load the extension from the source tree if it has been built there
+$LOAD_PATH.unshift(File.expand_path('..', File.dirname(__FILE__)))
+
+require 'test/unit'
+require 'tmpdir'
+require 'fileutils'
+require 'musicbrainz'
+
+module MBTest
+  #
+  # Create a scratch directory for the duration of the block, and pass
+  # its path to the block.
+  #
+  def with_tmpdir
+    dir = File.join(Dir.tmpdir, "mb-ruby-test-#{$$}-#{rand(1 << 30)}")
+    Dir.mkdir(dir)
+    begin
+      yield dir
+    ensure
+      FileUtils.rm_rf(dir)
+    end
+  end
+
+  #
+  # Write data to path (in binary mode), and return the path.
+  #
+  def write_file(path, data)
+    File.open(path, 'wb') { |fh| fh.write(data) }
+    path
+  end
+end
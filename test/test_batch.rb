@@ -0,0 +1,110 @@
+#
+# Regression tests for the batch methods (MusicBrainz.digest_files,
+# MusicBrainz.scan_files, MusicBrainz.mp3_info_batch, and
+# MusicBrainz::DiscID.from_eac_logs): a trapped signal arriving while a
+# batch runs must not cut it short.  The handler returns, so the batch
+# has to carry on and finish every file, instead of returning nil for
+# the ones it hadn't started.
+#
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestBatch < Test::Unit::TestCase
+  include MBTest
+
+  NUM_FILES = 200
+  FILE_SIZE = 256 * 1024
+  FRAME_SIZE = 417
+
+  def setup
+    @dir = File.join(Dir.tmpdir, "mb-ruby-test-#{$$}-#{rand(1 << 30)}")
+    Dir.mkdir(@dir)
+
+    # distinct files of MPEG audio frames (MPEG-1 layer III, 128 kbps,
+    # 44.1 kHz: 417 bytes each), numbered so their digests differ
+    @paths = (0...NUM_FILES).map do |i|
+      frame = [0xfffb9064, i].pack('NN') + ([0].pack('C') * (FRAME_SIZE - 8))
+      write_file(File.join(@dir, "f#{i}.mp3"), frame * (FILE_SIZE / FRAME_SIZE))
+    end
+  end
+
+  def teardown
+    FileUtils.rm_rf(@dir)
+  end
+
+  #
+  # Call the block while another thread keeps sending the process a
+  # trapped signal, and return the block's value and the number of
+  # signals handled.
+  #
+  def with_signals
+    count = 0
+    old = trap('USR1') { count += 1 }
+    done = false
+    sender = Thread.new do
+      until done
+        Process.kill('USR1', $$)
+        sleep 0.001
+      end
+    end
+
+    begin
+      ret = yield
+    ensure
+      done = true
+      sender.join
+      trap('USR1', old)
+    end
+
+    [ret, count]
+  end
+
+  def signals?
+    Signal.list.key?('USR1')
+  end
+
+  def test_digest_files
+    return unless signals?
+    want = MusicBrainz.digest_files(@paths, :threads => 2)
+    assert(!want.include?(nil))
+
+    got, count = with_signals { MusicBrainz.digest_files(@paths, :threads => 2) }
+    assert(count > 0, 'no signals were handled')
+    assert_equal(want, got)
+  end
+
+  def test_scan_files
+    return unless signals?
+    want = MusicBrainz.scan_files(@paths, :mp3_info => false, :depth => 4)
+    assert(!want.include?(nil))
+
+    got, count = with_signals { MusicBrainz.scan_files(@paths, :mp3_info => false, :depth => 4) }
+    assert(count > 0, 'no signals were handled')
+    assert_equal(want, got)
+  end
+
+  def test_mp3_info_batch
+    return unless signals?
+    want = MusicBrainz.mp3_info_batch(@paths, :depth => 4)
+    assert(!want.include?(nil))
+
+    got, count = with_signals { MusicBrainz.mp3_info_batch(@paths, :depth => 4) }
+    assert(count > 0, 'no signals were handled')
+    assert_equal(want, got)
+  end
+
+  def test_from_eac_logs
+    return unless signals?
+    log = "Exact Audio Copy V1.0\n\nTOC of the extracted CD\n\n" <<
+          "     Track |   Start  |  Length  | Start sector | End sector \n" <<
+          "        1  |  0:00.00 | 3:38.37  |    0    |    15212   \n" <<
+          "        2  |  0:00.00 | 3:38.37  |    15213    |    95311   \n"
+    path = write_file(File.join(@dir, 'disc.log'), log)
+    paths = [path] * 20000
+    id = MusicBrainz::DiscID.from_eac_log(log).id
+
+    got, count = with_signals { MusicBrainz::DiscID.from_eac_logs(paths, :threads => 2) }
+    assert(count > 0, 'no signals were handled')
+    assert_equal([id] * paths.size, got.map { |d| d && d.id })
+  end
+end
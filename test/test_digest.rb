@@ -0,0 +1,65 @@
+#
+# Known-answer tests for MusicBrainz.sha1, MusicBrainz.sha256, and
+# MusicBrainz.digest_files, using the FIPS 180-2 test vectors.
+#
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestDigest < Test::Unit::TestCase
+  include MBTest
+
+  VECTORS = [
+    # [input, sha1, sha256]
+    ['',
+     'da39a3ee5e6b4b0d3255bfef95601890afd80709',
+     'e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855'],
+    ['abc',
+     'a9993e364706816aba3e25717850c26c9cd0d89d',
+     'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad'],
+    ['abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq',
+     '84983e441c3bd26ebaae4aa1f95129e5e54670f1',
+     '248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1'],
+    ['a' * 1_000_000,
+     '34aa973cd4c4daa4f61eeb2bdbad27316534016f',
+     'cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0'],
+  ]
+
+  def test_sha1
+    with_tmpdir do |dir|
+      VECTORS.each_with_index do |(data, sha1, sha256), i|
+        path = write_file(File.join(dir, "v#{i}"), data)
+        assert_equal(sha1, MusicBrainz.sha1(path), "vector #{i}")
+        assert_equal([sha1].pack('H*'), MusicBrainz.sha1(path, :hex => false), "vector #{i}")
+      end
+    end
+  end
+
+  def test_sha256
+    with_tmpdir do |dir|
+      VECTORS.each_with_index do |(data, sha1, sha256), i|
+        path = write_file(File.join(dir, "v#{i}"), data)
+        assert_equal(sha256, MusicBrainz.sha256(path), "vector #{i}")
+        assert_equal([sha256].pack('H*'), MusicBrainz.sha256(path, :hex => false), "vector #{i}")
+      end
+    end
+  end
+
+  def test_digest_files
+    with_tmpdir do |dir|
+      paths = []
+      VECTORS.each_with_index do |(data, sha1, sha256), i|
+        paths << write_file(File.join(dir, "v#{i}"), data)
+      end
+      paths << File.join(dir, 'missing')
+
+      sha1s = VECTORS.map { |v| v[1] } + [nil]
+      sha256s = VECTORS.map { |v| v[2] } + [nil]
+      assert_equal(sha1s, MusicBrainz.digest_files(paths))
+      assert_equal(sha256s, MusicBrainz.digest_files(paths, :algorithm => :sha256, :threads => 2))
+    end
+  end
+
+  def test_missing_file
+    assert_raise(MusicBrainz::Error) { MusicBrainz.sha1('/nonexistent/mb-ruby-test') }
+  end
+end
@@ -0,0 +1,72 @@
+#
+# Known-answer tests for MusicBrainz::DiscID.  The first TOC is the
+# example from MusicBrainz's disc ID documentation; the other IDs were
+# computed from the algorithm (a SHA-1 of the hex TOC, in MusicBrainz's
+# base64 alphabet), independently of the extension.
+#
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestDiscID < Test::Unit::TestCase
+  include MBTest
+
+  TOCS = [
+    # [first, last, offsets, id]
+    [1, 6, [95462, 150, 15363, 32314, 46592, 63414, 80489], '49HHV7Eb8UKF3aQiNmu1GR8vKTY-'],
+    [1, 3, [95462, 150, 16537, 34770], 'BzZlCGerRVRpoHRNSP3W_I6EKiA-'],
+    [1, 6, [199305, 150, 17525, 51900, 96262, 141697, 173082], 'TjKzGvKW.TqwifO.oNgHcOIoInw-'],
+    [3, 4, [60000, 150, 30000], 'LH8M92V.zfV_lfQvjvntHy5k..0-'],
+  ]
+
+  def test_from_toc
+    TOCS.each do |first, last, offsets, id|
+      disc = MusicBrainz::DiscID.from_toc(first, last, offsets)
+      assert_equal(id, disc.id)
+      assert_equal(first, disc.first)
+      assert_equal(last, disc.last)
+      assert_equal(offsets, disc.offsets)
+    end
+  end
+
+  def test_from_tocs
+    tocs = TOCS.map { |first, last, offsets, id| [first, last, offsets] }
+    ids = MusicBrainz::DiscID.from_tocs(tocs + [[1, 2, [100]], 'junk']).map { |d| d && d.id }
+    assert_equal(TOCS.map { |t| t[3] } + [nil, nil], ids)
+  end
+
+  #
+  # An Exact Audio Copy log for the first TOC.
+  #
+  def eac_log
+    first, last, offsets, id = TOCS[0]
+    starts = offsets[1..-1]
+    log = "Exact Audio Copy V1.0\n\nTOC of the extracted CD\n\n" <<
+          "     Track |   Start  |  Length  | Start sector | End sector \n" <<
+          "    " << ('-' * 57) << "\n"
+    starts.each_with_index do |start, i|
+      stop = (starts[i + 1] || offsets[0]) - 150 - 1
+      log << "        #{i + 1}  |  0:00.00 | 3:38.37  |    #{start - 150}    |    #{stop}   \n"
+    end
+    log << "\n\nTrack  1\n\n     Filename x.wav\n"
+  end
+
+  def test_from_eac_log
+    assert_equal(TOCS[0][3], MusicBrainz::DiscID.from_eac_log(eac_log).id)
+  end
+
+  def test_from_eac_logs
+    with_tmpdir do |dir|
+      good = write_file(File.join(dir, 'good.log'), eac_log)
+      junk = write_file(File.join(dir, 'junk.log'), 'junk')
+      paths = [good, junk, File.join(dir, 'missing.log')] * 3
+      ids = MusicBrainz::DiscID.from_eac_logs(paths, :threads => 2).map { |d| d && d.id }
+      assert_equal([TOCS[0][3], nil, nil] * 3, ids)
+    end
+  end
+
+  def test_invalid_toc
+    # wrong number of offsets, and a track starting after the lead-out
+    assert_raise(MusicBrainz::Error) { MusicBrainz::DiscID.from_toc(1, 3, [95462, 150]) }
+    assert_raise(MusicBrainz::Error) { MusicBrainz::DiscID.from_toc(1, 2, [1000, 150, 2000]) }
+  end
+end
@@ -0,0 +1,86 @@
+#
+# Tests for MusicBrainz::IDMap and MusicBrainz::IDSet, in particular
+# lookups after deleting IDs and adding them back (the tables use open
+# addressing, so deletes have to keep the probe chains intact).
+#
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestIDMap < Test::Unit::TestCase
+  include MBTest
+
+  NIL_ID = '00000000-0000-0000-0000-000000000000'
+
+  #
+  # The i-th test ID.  IDs share most of their bytes, so plenty of them
+  # end up in the same probe chains.
+  #
+  def id(i)
+    '%08x-0000-4000-8000-%012x' % [i, i * 7]
+  end
+
+  def test_delete_reinsert
+    map = MusicBrainz::IDMap.new
+    n = 5000
+    n.times { |i| map[id(i)] = i }
+    assert_equal(n, map.size)
+
+    # delete every other ID, then check that the rest are still found
+    (0...n).step(2) { |i| assert_equal(i, map.delete(id(i))) }
+    assert_equal(n / 2, map.size)
+    n.times { |i| assert_equal((i % 2 == 0) ? nil : i, map[id(i)], id(i)) }
+    assert_nil(map.delete(id(0)))
+
+    # add them back with new values
+    (0...n).step(2) { |i| map[id(i)] = -i }
+    assert_equal(n, map.size)
+    n.times { |i| assert_equal((i % 2 == 0) ? -i : i, map[id(i)], id(i)) }
+
+    pairs = {}
+    map.each { |k, v| pairs[k.to_s] = v }
+    assert_equal(n, pairs.size)
+    assert_equal(-2, pairs[id(2)])
+  end
+
+  def test_nil_id
+    map = MusicBrainz::IDMap.new
+    map[NIL_ID] = 42
+    assert_equal(42, map[NIL_ID])
+    assert_equal(1, map.size)
+    assert_equal(42, map.delete(NIL_ID))
+    assert_nil(map[NIL_ID])
+    map[NIL_ID] = 7
+    assert_equal(7, map[MusicBrainz::MBID.new(NIL_ID)])
+  end
+
+  def test_set_delete_reinsert
+    set = MusicBrainz::IDSet.new
+    1000.times { |i| set << id(i) }
+    1000.times { |i| set.delete(id(i)) if i % 3 == 0 }
+    1000.times { |i| assert_equal(i % 3 != 0, set.include?(id(i)), id(i)) }
+    1000.times { |i| set << id(i) }
+    assert_equal(1000, set.size)
+    1000.times { |i| assert(set.include?(id(i)), id(i)) }
+  end
+
+  def test_save_load
+    map = MusicBrainz::IDMap.new
+    100.times { |i| map[id(i)] = i * i }
+    map.delete(id(50))
+    map[NIL_ID] = -1
+
+    with_tmpdir do |dir|
+      path = File.join(dir, 'map.ids')
+      map.save(path)
+      copy = MusicBrainz::IDMap.load(path)
+      assert_equal(map.size, copy.size)
+      100.times { |i| assert_equal((i == 50) ? nil : i * i, copy[id(i)]) }
+      assert_equal(-1, copy[NIL_ID])
+
+      # a set can't load a saved map, and a truncated file is an error
+      assert_raise(MusicBrainz::Error) { MusicBrainz::IDSet.load(path) }
+      write_file(path, File.open(path, 'rb') { |fh| fh.read(100) })
+      assert_raise(MusicBrainz::Error) { MusicBrainz::IDMap.load(path) }
+    end
+  end
+end
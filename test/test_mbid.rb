@@ -0,0 +1,46 @@
+#
+# Tests for parsing and formatting MusicBrainz::MBID.
+#
+
+require File.join(File.dirname(__FILE__), 'helper')
+
+class TestMBID < Test::Unit::TestCase
+  ID = 'c0b2500e-0cef-4130-869d-732b23ed9df5'
+  RAW = ['c0b2500e0cef4130869d732b23ed9df5'].pack('H*')
+
+  def test_parse
+    [ID, ID.upcase, ID.delete('-'),
+     "http://musicbrainz.org/mm-2.1/artist/#{ID}",
+     "http://musicbrainz.org/mm-2.1/album/#{ID.delete('-')}"].each do |str|
+      id = MusicBrainz::MBID.parse(str)
+      assert_not_nil(id, str)
+      assert_equal(ID, id.to_s, str)
+      assert_equal(RAW, id.raw, str)
+    end
+  end
+
+  def test_parse_invalid
+    ['', 'xyz', ID[0..-2], ID + '0', ID.sub(/5\z/, 'g'), ID.tr('-', '_')].each do |str|
+      assert_nil(MusicBrainz::MBID.parse(str), str)
+      assert(!MusicBrainz::MBID.valid?(str), str)
+      assert_raise(MusicBrainz::Error, str) { MusicBrainz::MBID.new(str) }
+    end
+  end
+
+  def test_raw
+    id = MusicBrainz::MBID.from_raw(RAW)
+    assert_equal(ID, id.to_s)
+    assert_equal(MusicBrainz::MBID.new(ID), id)
+  end
+
+  def test_hash_key
+    a, b = MusicBrainz::MBID.new(ID), MusicBrainz::MBID.new(ID.upcase)
+    assert(a.eql?(b))
+    assert_equal(a.hash, b.hash)
+    assert_equal(1, { a => 1, b => 2 }.size)
+  end
+
+  def test_to_url
+    assert_equal("http://musicbrainz.org/mm-2.1/album/#{ID}", MusicBrainz::MBID.new(ID).to_url('album'))
+  end
+end